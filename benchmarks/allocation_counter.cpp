@@ -0,0 +1,31 @@
+#include "pch.hpp"
+#include "allocation_counter.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	thread_local std::uint64_t allocationCount = 0;
+}
+
+std::uint64_t allocation_counter::allocations()
+{
+	return allocationCount;
+}
+
+// The other replaceable forms (arrays, sized and nothrow) forward to these two by default
+void* operator new(const std::size_t size)
+{
+	++allocationCount;
+
+	if (void* block = std::malloc(size != 0 ? size : 1))
+		return block;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept
+{
+	std::free(block);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+// The benchmark binary replaces the global operator new, so benchmarks can report heap allocations next to timings
+namespace allocation_counter
+{
+	// Allocations made by the calling thread so far
+	std::uint64_t allocations();
+}
@@ -0,0 +1,106 @@
+#include "pch.hpp"
+#include "benchmark_application.hpp"
+
+#include <benchmark/benchmark.h>
+#include <Poco/Process.h>
+
+#include "server/subsystems/negative_cache.hpp"
+#include "server/subsystems/offline_streaming.hpp"
+#include "server/subsystems/subtitle_override.hpp"
+#include "server/subsystems/video_list.hpp"
+
+using Poco::Logger;
+using Poco::Message;
+using Poco::Process;
+using Poco::JSON::Object;
+
+BenchmarkApplication::BenchmarkApplication() :
+	root_(std::filesystem::temp_directory_path() / std::format("quantumstreamer-bench-{}", Process::id()))
+{
+	episode_.id = EPISODE_ID;
+	episode_.fragment_count = EPISODE_FRAGMENTS;
+	episode_.caption_tracks = {CAPTION_TRACK};
+	episode_.payload_scale = 0.05; // keeps the library around 40 MB, fragments still span several pages
+
+	std::filesystem::create_directories(root_ / "episodes");
+	fixtures::writeEpisode(root_ / "episodes", episode_);
+}
+
+BenchmarkApplication::~BenchmarkApplication()
+{
+	std::error_code ec;
+	std::filesystem::remove_all(root_, ec);
+}
+
+BenchmarkApplication& BenchmarkApplication::get()
+{
+	return dynamic_cast<BenchmarkApplication&>(instance());
+}
+
+std::filesystem::path BenchmarkApplication::trackWithFragments(const std::size_t fragment_count) const
+{
+	auto path = root_ / "tracks" / std::format("video_{}.ismv", fragment_count);
+
+	if (!std::filesystem::exists(path))
+	{
+		std::filesystem::create_directories(path.parent_path());
+		fixtures::writeTrack(path, 1, fragment_count, episode_.fragment_duration, 16);
+	}
+
+	return path;
+}
+
+std::filesystem::path BenchmarkApplication::srtWithCues(const std::size_t cue_count) const
+{
+	auto path = root_ / "srt" / std::format("{}_{}.srt", CAPTION_TRACK, cue_count);
+
+	if (!std::filesystem::exists(path))
+	{
+		std::filesystem::create_directories(path.parent_path());
+		fixtures::writeSrt(path, cue_count / 2, 2, episode_.fragment_duration);
+	}
+
+	return path;
+}
+
+void BenchmarkApplication::writeVideoList() const
+{
+	Object::Ptr videoList = new Object;
+	videoList->set(EPISODE_ID, std::format("http://127.0.0.1:1/{}/manifest", EPISODE_ID));
+
+	std::ostringstream oss;
+	Poco::JSON::Stringifier::stringify(videoList, oss);
+
+	std::string videoListStr = oss.str();
+	VideoList::applyCipher(videoListStr.data(), videoListStr.size());
+
+	std::ofstream outFile(root_ / "videoList.rmdj", std::ios::binary | std::ios::trunc);
+	outFile.write(videoListStr.data(), static_cast<std::streamsize>(videoListStr.size()));
+}
+
+void BenchmarkApplication::initialize(Application& self)
+{
+	// Warnings from the subsystems would only disturb the measurements
+	Logger::root().setLevel(Message::PRIO_ERROR);
+
+	writeVideoList();
+
+	config().setString("Server.EpisodesPath", (root_ / "episodes").string());
+	config().setString("Server.VideoListPath", (root_ / "videoList.rmdj").string());
+	config().setBool("VideoList.PatchFile", false);
+	config().setString("Subtitles.TemplatePath", (root_ / "caption_templates").string());
+
+	addSubsystem(new NegativeCache);
+	addSubsystem(new VideoList);
+	addSubsystem(new OfflineStreaming);
+	addSubsystem(new SubtitleOverride);
+
+	Application::initialize(self);
+}
+
+int BenchmarkApplication::main(const std::vector<std::string>& /*args*/)
+{
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return EXIT_OK;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fixture_writer.hpp"
+
+// Hosts the serving subsystems over a synthetic episode library generated at startup, benchmarks run from main()
+class BenchmarkApplication final : public Poco::Util::Application
+{
+public:
+	static constexpr auto EPISODE_ID = "BENCH-EP1";
+	static constexpr auto CAPTION_TRACK = "enus_captions";
+	static constexpr std::size_t EPISODE_FRAGMENTS = 600;
+
+	BenchmarkApplication();
+	~BenchmarkApplication() override;
+
+	static BenchmarkApplication& get();
+
+	[[nodiscard]] const std::filesystem::path& root() const { return root_; }
+	[[nodiscard]] std::filesystem::path trackWithFragments(std::size_t fragment_count) const;
+	[[nodiscard]] std::filesystem::path srtWithCues(std::size_t cue_count) const;
+
+	[[nodiscard]] const fixtures::EpisodeSpec& episode() const { return episode_; }
+
+protected:
+	void initialize(Application& self) override;
+	int main(const std::vector<std::string>& args) override;
+
+private:
+	std::filesystem::path root_;
+	fixtures::EpisodeSpec episode_;
+
+	void writeVideoList() const;
+};
@@ -0,0 +1,29 @@
+#include "pch.hpp"
+#include "benchmark_application.hpp"
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+
+int main(int argc, char** argv)
+{
+	// Emit JSON next to the console report unless told otherwise, so runs can be compared with Google Benchmark's compare.py
+	std::vector args(argv, argv + argc);
+	std::string outArg = "--benchmark_out=quantumstreamer-benchmarks.json";
+	std::string outFormatArg = "--benchmark_out_format=json";
+
+	if (std::ranges::none_of(args, [](const char* arg) { return std::string_view(arg).starts_with("--benchmark_out="); }))
+	{
+		args.push_back(outArg.data());
+		args.push_back(outFormatArg.data());
+	}
+
+	int count = static_cast<int>(args.size());
+	benchmark::Initialize(&count, args.data());
+
+	if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+		return 1;
+
+	BenchmarkApplication app;
+	app.init(1, argv);
+	return app.run();
+}
@@ -0,0 +1,343 @@
+#include "pch.hpp"
+#include "benchmark_application.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include "allocation_counter.hpp"
+#include "server/event/buffered_exchange.hpp"
+#include "server/fragment_io.hpp"
+#include "server/handler_factory.hpp"
+#include "server/handlers/fragment.hpp"
+#include "server/subsystems/offline_streaming.hpp"
+#include "server/subsystems/subtitle_override.hpp"
+#include "server/subsystems/video_list.hpp"
+
+#include <array>
+
+using Poco::Net::HTTPRequest;
+using Poco::Net::HTTPServerParams;
+using Poco::Net::SocketAddress;
+using Poco::Util::Application;
+
+namespace
+{
+	std::string startTimeOf(const std::size_t fragment)
+	{
+		return std::to_string(fragment * BenchmarkApplication::get().episode().fragment_duration);
+	}
+
+	std::string bitrateOf(const benchmark::State& state)
+	{
+		const auto& bitrates = BenchmarkApplication::get().episode().video_bitrates;
+		return std::to_string(bitrates[static_cast<std::size_t>(state.range(0)) % bitrates.size()]);
+	}
+
+	void BM_RouteManifest(benchmark::State& state)
+	{
+		const std::string uri = std::format("/{}/manifest", BenchmarkApplication::EPISODE_ID);
+
+		for (auto _ : state)
+		{
+			const std::unique_ptr<BaseHandler> handler(RequestHandlerFactory::route(HTTPRequest::HTTP_GET, uri));
+			benchmark::DoNotOptimize(handler.get());
+		}
+	}
+
+	void BM_RouteFragment(benchmark::State& state)
+	{
+		const std::string uri = std::format("/{}/QualityLevels(1200000)/Fragments(video=1220000000)",
+		                                    BenchmarkApplication::EPISODE_ID);
+
+		for (auto _ : state)
+		{
+			const std::unique_ptr<BaseHandler> handler(RequestHandlerFactory::route(HTTPRequest::HTTP_GET, uri));
+			benchmark::DoNotOptimize(handler.get());
+		}
+	}
+
+	void BM_RouteNotFound(benchmark::State& state)
+	{
+		const std::string uri = "/favicon.ico";
+
+		for (auto _ : state)
+		{
+			const std::unique_ptr<BaseHandler> handler(RequestHandlerFactory::route(HTTPRequest::HTTP_GET, uri));
+			benchmark::DoNotOptimize(handler.get());
+		}
+	}
+
+	void BM_PreloadTrack(benchmark::State& state)
+	{
+		const auto fragmentCount = static_cast<std::size_t>(state.range(0));
+		const std::string path = BenchmarkApplication::get().trackWithFragments(fragmentCount).string();
+
+		const OfflineStreaming& offlineStreaming = Application::instance().getSubsystem<OfflineStreaming>();
+
+		for (auto _ : state)
+		{
+			auto [success, track] = offlineStreaming.preloadTrack(path);
+			benchmark::DoNotOptimize(success);
+			benchmark::DoNotOptimize(track);
+		}
+
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+
+	void BM_GetLocalFragment(benchmark::State& state)
+	{
+		OfflineStreaming& offlineStreaming = Application::instance().getSubsystem<OfflineStreaming>();
+
+		const std::string bitrate = bitrateOf(state);
+		std::vector<std::string> startTimes;
+
+		for (std::size_t i = 0; i < BenchmarkApplication::EPISODE_FRAGMENTS; ++i)
+			startTimes.push_back(startTimeOf(i));
+
+		std::size_t fragment = 0;
+		std::int64_t bytes = 0;
+
+		for (auto _ : state)
+		{
+			std::string data = offlineStreaming.getLocalFragment(BenchmarkApplication::EPISODE_ID, "video", bitrate,
+			                                                     startTimes[fragment]);
+			bytes += static_cast<std::int64_t>(data.size());
+			benchmark::DoNotOptimize(data);
+
+			fragment = (fragment + 1) % startTimes.size();
+		}
+
+		state.SetBytesProcessed(bytes);
+	}
+
+	// Whole video fragments read concurrently through a fragment I/O backend, range 0 = blocking, 1 = io_uring. The
+	// synthetic library sits in the page cache, so this shows the cost per read and how well concurrent reads are
+	// batched, not what a cold NVMe drive would do.
+	void BM_ReadFragments(benchmark::State& state)
+	{
+		static const std::vector<OfflineStreaming::FragmentLocation> locations = []
+		{
+			OfflineStreaming& offlineStreaming = Application::instance().getSubsystem<OfflineStreaming>();
+			std::vector<OfflineStreaming::FragmentLocation> result;
+
+			for (const unsigned int bitrate : BenchmarkApplication::get().episode().video_bitrates)
+				for (std::size_t i = 0; i < BenchmarkApplication::EPISODE_FRAGMENTS; ++i)
+					if (OfflineStreaming::FragmentLocation location; offlineStreaming.findLocalFragment(
+						BenchmarkApplication::EPISODE_ID, "video", std::to_string(bitrate), startTimeOf(i), location))
+						result.push_back(location);
+
+			return result;
+		}();
+
+		static const auto backends = []
+		{
+			std::array<std::unique_ptr<FragmentIo>, 2> result;
+			result[0] = FragmentIo::create(FragmentIo::Backend::BLOCKING);
+
+			try
+			{
+				result[1] = FragmentIo::create(FragmentIo::Backend::IO_URING);
+			}
+			catch (const Poco::Exception&)
+			{
+			}
+
+			return result;
+		}();
+
+		FragmentIo* fragmentIo = backends[static_cast<std::size_t>(state.range(0))].get();
+
+		if (!fragmentIo || locations.empty())
+		{
+			state.SkipWithError(fragmentIo ? "No local fragments in the synthetic library" : "io_uring is unavailable");
+			return;
+		}
+
+		std::vector<char> buffer;
+		std::size_t fragment = static_cast<std::size_t>(state.thread_index()) * 7919;
+		std::int64_t bytes = 0;
+
+		for (auto _ : state)
+		{
+			const OfflineStreaming::FragmentLocation& location = locations[fragment++ % locations.size()];
+			buffer.resize(location.size);
+
+			if (!fragmentIo->read(*location.source_path, location.moof_offset, buffer.size(), buffer.data()))
+			{
+				state.SkipWithError("Short read");
+				return;
+			}
+
+			bytes += static_cast<std::int64_t>(buffer.size());
+		}
+
+		state.SetBytesProcessed(bytes);
+	}
+
+	void BM_ProcessSubtitleData(benchmark::State& state)
+	{
+		OfflineStreaming& offlineStreaming = Application::instance().getSubsystem<OfflineStreaming>();
+
+		const std::string startTime = startTimeOf(42);
+		const std::string fragmentData = offlineStreaming.getLocalFragment(
+			BenchmarkApplication::EPISODE_ID, BenchmarkApplication::CAPTION_TRACK, "1000", startTime);
+
+		if (fragmentData.empty())
+		{
+			state.SkipWithError("Caption fragment missing from the synthetic library");
+			return;
+		}
+
+		const RequestTarget target = RequestTarget::fragment(BenchmarkApplication::EPISODE_ID, "1000",
+		                                                     BenchmarkApplication::CAPTION_TRACK, startTime);
+
+		for (auto _ : state)
+		{
+			// One handler per request, the rewritten fragment stays in its arena until it's destroyed
+			FragmentRequestHandler handler(target);
+			std::pmr::string data = handler.processSubtitleData(fragmentData);
+			benchmark::DoNotOptimize(data);
+		}
+
+		state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(fragmentData.size()));
+	}
+
+	// Routing and handling a request for a stored fragment, as the event engine's workers do it. The media body stays
+	// in the file (it would be sent from there), captions are read and rewritten. Range 0 = media, 1 = captions.
+	void BM_ServeLocalFragment(benchmark::State& state)
+	{
+		const bool captions = state.range(0) == 1;
+		const std::string uri = captions
+			                        ? std::format("/{}/QualityLevels(1000)/Fragments({}={})",
+			                                      BenchmarkApplication::EPISODE_ID,
+			                                      BenchmarkApplication::CAPTION_TRACK, startTimeOf(42))
+			                        : std::format("/{}/QualityLevels({})/Fragments(video={})",
+			                                      BenchmarkApplication::EPISODE_ID, bitrateOf(state),
+			                                      startTimeOf(42));
+
+		std::istringstream head(std::format("GET {} HTTP/1.1\r\nHost: localhost\r\n\r\n", uri));
+		BufferedServerResponse unusedResponse;
+		BufferedServerRequest request(head, unusedResponse, SocketAddress(), SocketAddress(), new HTTPServerParams);
+
+		std::uint64_t allocations = 0;
+
+		for (auto _ : state)
+		{
+			BufferedServerResponse response;
+			const std::uint64_t before = allocation_counter::allocations();
+
+			{
+				const std::unique_ptr<BaseHandler> handler(RequestHandlerFactory::route(request.getMethod(), uri));
+				handler->handleRequest(request, response);
+			}
+
+			allocations += allocation_counter::allocations() - before;
+
+			if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_OK)
+			{
+				state.SkipWithError("Fragment missing from the synthetic library");
+				return;
+			}
+		}
+
+		// Including Poco's response headers, which the handler can't avoid
+		state.counters["allocs_per_request"] = benchmark::Counter(static_cast<double>(allocations),
+		                                                          benchmark::Counter::kAvgIterations);
+	}
+
+	void BM_OverrideSubtitles(benchmark::State& state)
+	{
+		SubtitleOverride& subtitleOverride = Application::instance().getSubsystem<SubtitleOverride>();
+
+		const std::string document = fixtures::makeCaptionDocument(static_cast<std::size_t>(state.range(0)));
+		const std::string startTime = startTimeOf(42);
+
+		for (auto _ : state)
+		{
+			std::string data = document;
+			std::string result = subtitleOverride.overrideSubtitles(BenchmarkApplication::EPISODE_ID,
+			                                                        BenchmarkApplication::CAPTION_TRACK, data,
+			                                                        startTime);
+			benchmark::DoNotOptimize(result);
+		}
+	}
+
+	// Building a caption fragment of the overridden track from its template instead of fetching the original
+	void BM_SynthesizeCaptionFragment(benchmark::State& state)
+	{
+		const Application& app = Application::instance();
+		SubtitleOverride& subtitleOverride = app.getSubsystem<SubtitleOverride>();
+
+		OfflineStreaming& offlineStreaming = app.getSubsystem<OfflineStreaming>();
+		const std::string templateFragment = offlineStreaming.getLocalFragment(
+			BenchmarkApplication::EPISODE_ID, BenchmarkApplication::CAPTION_TRACK, "1000", startTimeOf(0));
+
+		const SymbolTable::Symbol episode = SymbolTable::episodes().find(BenchmarkApplication::EPISODE_ID);
+		const SymbolTable::Symbol track = SymbolTable::tracks().find(BenchmarkApplication::CAPTION_TRACK);
+		subtitleOverride.rememberTemplate(episode, track, templateFragment);
+		subtitleOverride.rememberClientManifest(
+			episode, offlineStreaming.getLocalClientManifest(BenchmarkApplication::EPISODE_ID));
+
+		const std::string startTime = startTimeOf(42);
+
+		for (auto _ : state)
+		{
+			std::pmr::string data = subtitleOverride.synthesizeFragment(episode, track, startTime,
+			                                                            std::pmr::get_default_resource());
+
+			if (data.empty())
+			{
+				state.SkipWithError("No caption template or override in the synthetic library");
+				return;
+			}
+
+			benchmark::DoNotOptimize(data);
+		}
+	}
+
+	void BM_ParseSrtOverride(benchmark::State& state)
+	{
+		SubtitleOverride& subtitleOverride = Application::instance().getSubsystem<SubtitleOverride>();
+
+		const auto cueCount = static_cast<std::size_t>(state.range(0));
+		const std::string path = BenchmarkApplication::get().srtWithCues(cueCount).string();
+		const std::string fileName = std::string(BenchmarkApplication::CAPTION_TRACK) + ".srt";
+
+		for (auto _ : state)
+		{
+			std::map<std::string, SubtitleOverride::SrtTrack> overrides;
+			subtitleOverride.parseSrtOverride(path, fileName, BenchmarkApplication::EPISODE_ID, overrides);
+			benchmark::DoNotOptimize(overrides);
+		}
+
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+	}
+
+	void BM_RmdjDecode(benchmark::State& state)
+	{
+		std::string data(static_cast<std::size_t>(state.range(0)), '\0');
+
+		for (std::size_t i = 0; i < data.size(); ++i)
+			data[i] = static_cast<char>(i * 31);
+
+		for (auto _ : state)
+		{
+			VideoList::applyCipher(data.data(), data.size());
+			benchmark::ClobberMemory();
+		}
+
+		state.SetBytesProcessed(state.iterations() * state.range(0));
+	}
+}
+
+BENCHMARK(BM_RouteManifest);
+BENCHMARK(BM_RouteFragment);
+BENCHMARK(BM_RouteNotFound);
+BENCHMARK(BM_PreloadTrack)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_GetLocalFragment)->DenseRange(0, 2)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ReadFragments)->Arg(0)->Arg(1)->ThreadRange(1, 32)->UseRealTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ProcessSubtitleData)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ServeLocalFragment)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_OverrideSubtitles)->Arg(2)->Arg(16)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_SynthesizeCaptionFragment)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ParseSrtOverride)->Arg(100)->Arg(5000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_RmdjDecode)->Arg(4 << 10)->Arg(256 << 10);
@@ -10,25 +10,36 @@ static auto VERSION = "1.2.0";
 #define FLAGS_TO_SKIP 3
 #define REMOTE_TIMEOUT 20 // seconds (Game seems to use 20 seconds till it tries to retry)
 
-#define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
-
 // Standard C++ Header Files
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <format>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
 // Windows Header Files
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 #include <tchar.h>
 #include <windows.h>
+#endif
 
 // Poco Header Files
 #include <Poco/AutoPtr.h>
+#include <Poco/Clock.h>
 #include <Poco/ConsoleChannel.h>
 #include <Poco/DirectoryIterator.h>
+#include <Poco/Event.h>
 #include <Poco/Exception.h>
 #include <Poco/File.h>
 #include <Poco/FileChannel.h>
@@ -36,10 +47,14 @@ static auto VERSION = "1.2.0";
 #include <Poco/Logger.h>
 #include <Poco/Message.h>
 #include <Poco/PatternFormatter.h>
+#include <Poco/SharedMemory.h>
 #include <Poco/SplitterChannel.h>
 #include <Poco/StreamCopier.h>
+#include <Poco/String.h>
+#include <Poco/Thread.h>
 #include <Poco/ThreadPool.h>
 #include <Poco/Timespan.h>
+#include <Poco/Timestamp.h>
 #include <Poco/URI.h>
 #include <Poco/DOM/DOMParser.h>
 #include <Poco/DOM/DOMWriter.h>
@@ -52,6 +67,7 @@ static auto VERSION = "1.2.0";
 #include <Poco/JSON/Array.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
+#include <Poco/JSON/Stringifier.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPMessage.h>
 #include <Poco/Net/HTTPRequest.h>
@@ -66,4 +82,7 @@ static auto VERSION = "1.2.0";
 #include <Poco/SAX/InputSource.h>
 #include <Poco/XML/XMLWriter.h>
 #include <Poco/Util/Application.h>
+#include <Poco/Util/HelpFormatter.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
 #include <Poco/Util/ServerApplication.h>
@@ -9,6 +9,7 @@
 
 // add headers that you want to pre-compile here
 #include "framework.hpp"
+#include "server/request_trace.hpp"
 #include "server/base_handler.hpp"
 
 #endif //PCH_H
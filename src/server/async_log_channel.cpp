@@ -0,0 +1,198 @@
+#include "pch.hpp"
+#include "async_log_channel.hpp"
+
+#include <Poco/String.h>
+
+using Poco::Channel;
+using Poco::Message;
+
+AsyncLogChannel::AsyncLogChannel(Channel::Ptr channel, const std::size_t capacity, const OverflowPolicy policy) :
+	channel_(std::move(channel)),
+	policy_(policy)
+{
+	std::size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	slots_ = std::make_unique<Slot[]>(size);
+	mask_ = size - 1;
+
+	for (std::size_t i = 0; i < size; ++i)
+		slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+AsyncLogChannel::~AsyncLogChannel()
+{
+	try
+	{
+		close();
+	}
+	catch (...)
+	{
+		poco_unexpected();
+	}
+}
+
+AsyncLogChannel::OverflowPolicy AsyncLogChannel::parseOverflowPolicy(const std::string& value)
+{
+	if (Poco::icompare(value, "block") == 0)
+		return OverflowPolicy::BLOCK;
+
+	return OverflowPolicy::DROP;
+}
+
+void AsyncLogChannel::open()
+{
+	if (running_.exchange(true))
+		return;
+
+	channel_->open();
+	writer_ = std::thread(&AsyncLogChannel::run, this);
+}
+
+void AsyncLogChannel::close()
+{
+	if (!running_.exchange(false))
+		return;
+
+	wake_event_.set();
+
+	if (writer_.joinable())
+		writer_.join();
+
+	// Producers that saw the channel running may still be pushing, their messages would be left in the queue
+	while (producers_.load() > 0)
+		std::this_thread::yield();
+
+	// Anything logged while the writer was shutting down
+	drain();
+	channel_->close();
+}
+
+void AsyncLogChannel::log(const Message& msg)
+{
+	// Counted before running_ is checked (both sequentially consistent), so close() either sees this producer or the
+	// producer sees the channel closing
+	producers_.fetch_add(1);
+
+	if (!running_.load())
+	{
+		producers_.fetch_sub(1, std::memory_order_release);
+
+		// Not started yet (or already stopped), write through
+		channel_->log(msg);
+		return;
+	}
+
+	while (!tryPush(msg))
+	{
+		if (policy_ == OverflowPolicy::DROP)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			producers_.fetch_sub(1, std::memory_order_release);
+			return;
+		}
+
+		// Nobody drains the queue anymore once it's closing
+		if (!running_.load(std::memory_order_acquire))
+		{
+			producers_.fetch_sub(1, std::memory_order_release);
+			channel_->log(msg);
+			return;
+		}
+
+		wake_event_.set();
+		std::this_thread::yield();
+	}
+
+	producers_.fetch_sub(1, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (writer_sleeping_.load(std::memory_order_relaxed))
+		wake_event_.set();
+}
+
+bool AsyncLogChannel::tryPush(const Message& msg)
+{
+	std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		Slot& slot = slots_[pos & mask_];
+		const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+		if (const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos); diff == 0)
+		{
+			if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot.message = msg;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false; // full
+		else
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+	}
+}
+
+bool AsyncLogChannel::tryPop(Message& msg)
+{
+	std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		Slot& slot = slots_[pos & mask_];
+		const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+		if (const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1); diff == 0)
+		{
+			if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				msg = std::move(slot.message);
+				slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false; // empty
+		else
+			pos = dequeue_pos_.load(std::memory_order_relaxed);
+	}
+}
+
+void AsyncLogChannel::drain()
+{
+	Message msg;
+
+	while (tryPop(msg))
+		channel_->log(msg);
+
+	if (const std::uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed); dropped > 0)
+	{
+		channel_->log(Message("Core", std::format("Log queue overflowed, {} messages were dropped", dropped),
+		                      Message::PRIO_WARNING));
+	}
+}
+
+void AsyncLogChannel::run()
+{
+	while (running_.load(std::memory_order_acquire))
+	{
+		drain();
+
+		writer_sleeping_.store(true);
+
+		// Re-check after announcing we're going to sleep, a producer may have pushed in between
+		if (Message msg; tryPop(msg))
+		{
+			writer_sleeping_.store(false, std::memory_order_relaxed);
+			channel_->log(msg);
+			continue;
+		}
+
+		wake_event_.tryWait(100);
+		writer_sleeping_.store(false, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Hands log messages to a background writer through a bounded lock-free queue, so handler threads
+// never wait on the formatter, console or rotating log file.
+class AsyncLogChannel final : public Poco::Channel
+{
+public:
+	enum class OverflowPolicy
+	{
+		DROP, // discard the new message and report how many were lost once the writer catches up
+		BLOCK // spin until the writer frees a slot, or write through once the channel is closing
+	};
+
+	AsyncLogChannel(Poco::Channel::Ptr channel, std::size_t capacity, OverflowPolicy policy);
+
+	void open() override;
+	void close() override;
+	void log(const Poco::Message& msg) override;
+
+	static OverflowPolicy parseOverflowPolicy(const std::string& value);
+
+protected:
+	~AsyncLogChannel() override;
+
+private:
+	struct Slot
+	{
+		std::atomic<std::size_t> sequence;
+		Poco::Message message;
+	};
+
+	Poco::Channel::Ptr channel_;
+	OverflowPolicy policy_;
+
+	// Bounded MPMC ring buffer (Vyukov), capacity is rounded up to a power of two
+	std::unique_ptr<Slot[]> slots_;
+	std::size_t mask_;
+	alignas(64) std::atomic<std::size_t> enqueue_pos_ = 0;
+	alignas(64) std::atomic<std::size_t> dequeue_pos_ = 0;
+
+	std::atomic<std::uint64_t> dropped_ = 0;
+	std::atomic<bool> writer_sleeping_ = false;
+	std::atomic<bool> running_ = false;
+	std::atomic<unsigned int> producers_ = 0; // in log() past the running_ check, close() waits for them
+	Poco::Event wake_event_;
+	std::thread writer_;
+
+	bool tryPush(const Poco::Message& msg);
+	bool tryPop(Poco::Message& msg);
+	void run();
+	void drain();
+};
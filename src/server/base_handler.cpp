@@ -1,24 +1,403 @@
 #include "pch.hpp"
 #include "base_handler.hpp"
 
+#include "file_transmission.hpp"
+#include "event/buffered_exchange.hpp"
+#include "subsystems/request_scheduling.hpp"
+
+#include <Poco/Net/HTTPServerRequestImpl.h>
+#include <utility>
+
+namespace
+{
+	// Freed handlers by size (one list per handler class), reused by the next request on the same thread. A handler
+	// is freed on the worker that created it, unless its deferred response is completed after the worker returned.
+	class HandlerPool
+	{
+	public:
+		static constexpr std::size_t MAX_SIZES = 8;
+		static constexpr std::size_t MAX_FREE = 4; // per size, a worker only handles one request at a time
+
+		HandlerPool() = default;
+		HandlerPool(const HandlerPool&) = delete;
+		HandlerPool& operator=(const HandlerPool&) = delete;
+
+		~HandlerPool()
+		{
+			for (FreeList& list : lists_)
+			{
+				while (list.head)
+					::operator delete(std::exchange(list.head, list.head->next), list.size);
+			}
+		}
+
+		void* allocate(const std::size_t size)
+		{
+			if (FreeList* list = find(size); list && list->head)
+			{
+				--list->count;
+				return std::exchange(list->head, list->head->next);
+			}
+
+			return ::operator new(size);
+		}
+
+		void deallocate(void* block, const std::size_t size)
+		{
+			if (FreeList* list = find(size); list && list->count < MAX_FREE)
+			{
+				list->head = ::new(block) FreeBlock{list->head};
+				++list->count;
+				return;
+			}
+
+			::operator delete(block, size);
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		struct FreeList
+		{
+			std::size_t size = 0; // 0 while unused
+			FreeBlock* head = nullptr;
+			std::size_t count = 0;
+		};
+
+		std::array<FreeList, MAX_SIZES> lists_{};
+
+		FreeList* find(const std::size_t size)
+		{
+			for (FreeList& list : lists_)
+			{
+				if (list.size == size)
+					return &list;
+
+				if (list.size == 0)
+				{
+					list.size = size;
+					return &list;
+				}
+			}
+
+			return nullptr;
+		}
+	};
+
+	thread_local HandlerPool handlerPool;
+}
+
+void* BaseHandler::operator new(const std::size_t size)
+{
+	return handlerPool.allocate(size);
+}
+
+void BaseHandler::operator delete(void* block, const std::size_t size)
+{
+	handlerPool.deallocate(block, size);
+}
+
 void BaseHandler::handleRequest(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response)
 {
 	// let derived class do its work
 	handleWithLogging(request, response);
 
+	// deferred responses are logged once they are completed
+	if (const auto* buffered = dynamic_cast<BufferedServerResponse*>(&response); buffered && buffered->deferred())
+		return;
+
+	logResponse(request, response);
+}
+
+bool BaseHandler::deferResponse(Poco::Net::HTTPServerResponse& response)
+{
+	auto* buffered = dynamic_cast<BufferedServerResponse*>(&response);
+	return buffered && buffered->defer();
+}
+
+void BaseHandler::completeDeferred(const Poco::Net::HTTPServerRequest& request,
+                                   Poco::Net::HTTPServerResponse& response)
+{
+	logResponse(request, response);
+	dynamic_cast<BufferedServerResponse&>(response).complete();
+}
+
+void BaseHandler::completeDeferred(const Poco::Net::HTTPServerRequest& request,
+                                   Poco::Net::HTTPServerResponse& response, const std::function<void()>& send)
+{
+	if (runDeferred(request, response, send))
+		completeDeferred(request, response);
+}
+
+void BaseHandler::continueUpstream(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+                                   std::function<bool()> fetch)
+{
+	if (!deferResponse(response))
+	{
+		fetch();
+		return;
+	}
+
+	auto task = [this, &request, &response, fetch = std::move(fetch)]
+	{
+		bool fetching = false;
+
+		if (runDeferred(request, response, [&] { fetching = fetch(); }) && !fetching)
+			completeDeferred(request, response);
+	};
+
+	if (Poco::Util::Application::instance().getSubsystem<RequestScheduling>().continueUpstream(request, task))
+		return;
+
+	response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+	response.setContentLength(0);
+	response.send();
+	completeDeferred(request, response);
+}
+
+bool BaseHandler::runDeferred(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+                              const std::function<void()>& work)
+{
+	static Poco::Logger& logger = Poco::Logger::get("Network");
+
+	std::string error;
+
+	try
+	{
+		work();
+	}
+	catch (Poco::Exception& ex)
+	{
+		error = ex.displayText();
+	}
+	catch (std::exception& ex)
+	{
+		error = ex.what();
+	}
+	catch (...)
+	{
+		error = "unknown exception";
+	}
+
+	if (error.empty())
+		return true;
+
+	logger.error("Failed to send the deferred response for %s (%s)", request.getURI(), error);
+
+	if (!response.sent())
+	{
+		response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_BAD_GATEWAY);
+		response.setContentLength(0);
+		response.send();
+	}
+
+	completeDeferred(request, response);
+	return false;
+}
+
+void BaseHandler::logResponse(const Poco::Net::HTTPServerRequest& request,
+                              const Poco::Net::HTTPServerResponse& response)
+{
 	// after response is finished, log status and content length
-	Poco::Logger& logger = Poco::Logger::get("Network");
-
-	const auto contentLength = response.getContentLength();
-	std::string contentLengthStr = (contentLength >= 0)
-		                               ? std::to_string(contentLength)
-		                               : "-";
-
-	logger.debug("%s - \"%s %s %s\" %d %s",
-	             request.clientAddress().toString(),
-	             request.getMethod(),
-	             request.getURI(),
-	             request.getVersion(),
-	             static_cast<int>(response.getStatus()),
-	             contentLengthStr);
+	static Poco::Logger& logger = Poco::Logger::get("Network");
+
+	// Formatting the client address and content length isn't free, skip it unless someone's going to read it
+	if (logger.debug())
+	{
+		const auto contentLength = response.getContentLength();
+		std::string contentLengthStr = (contentLength >= 0)
+			                               ? std::to_string(contentLength)
+			                               : "-";
+
+		logger.debug("%s - \"%s %s %s\" %d %s",
+		             request.clientAddress().toString(),
+		             request.getMethod(),
+		             request.getURI(),
+		             request.getVersion(),
+		             static_cast<int>(response.getStatus()),
+		             contentLengthStr);
+	}
+
+	trace_.finish(static_cast<int>(response.getStatus()));
+
+	// Episodes are indexed in the background, so this is how long the game waited for the server at startup
+	static std::atomic<bool> firstResponse = true;
+
+	if (firstResponse.exchange(false, std::memory_order_relaxed))
+		Poco::Logger::get("Core").information(
+			"First request served %s ms after startup",
+			std::to_string(Poco::Util::Application::instance().uptime().totalMilliseconds()));
+}
+
+BaseHandler::RangeRequest BaseHandler::parseRange(const Poco::Net::HTTPServerRequest& request,
+                                                  const unsigned long long total_size, const std::string& entity_tag,
+                                                  ByteRange& range)
+{
+	const std::string rangeHeader = request.get("Range", "");
+
+	if (rangeHeader.empty())
+		return RangeRequest::NONE;
+
+	// If-Range with a stale (or weak, or date) validator means the client's partial copy is useless
+	if (request.has("If-Range") && (entity_tag.empty() || request.get("If-Range") != entity_tag))
+		return RangeRequest::NONE;
+
+	constexpr std::string_view unit = "bytes=";
+
+	if (rangeHeader.size() <= unit.size() || Poco::icompare(rangeHeader.substr(0, unit.size()), unit.data()) != 0)
+		return RangeRequest::NONE;
+
+	std::string_view spec(rangeHeader);
+	spec.remove_prefix(unit.size());
+
+	while (!spec.empty() && spec.front() == ' ')
+		spec.remove_prefix(1);
+
+	while (!spec.empty() && spec.back() == ' ')
+		spec.remove_suffix(1);
+
+	const auto dash = spec.find('-');
+
+	if (dash == std::string_view::npos || spec.find(',') != std::string_view::npos)
+		return RangeRequest::NONE;
+
+	const auto parseNumber = [](const std::string_view text, unsigned long long& value)
+	{
+		const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+		return ec == std::errc() && end == text.data() + text.size();
+	};
+
+	const std::string_view firstStr = spec.substr(0, dash);
+	const std::string_view lastStr = spec.substr(dash + 1);
+
+	if (firstStr.empty())
+	{
+		// Suffix range, the last N bytes
+		unsigned long long suffixLength;
+
+		if (!parseNumber(lastStr, suffixLength))
+			return RangeRequest::NONE;
+
+		if (suffixLength == 0 || total_size == 0)
+			return RangeRequest::UNSATISFIABLE;
+
+		range.first = total_size > suffixLength ? total_size - suffixLength : 0;
+		range.last = total_size - 1;
+		return RangeRequest::SATISFIABLE;
+	}
+
+	unsigned long long first;
+	unsigned long long last = total_size > 0 ? total_size - 1 : 0;
+
+	if (!parseNumber(firstStr, first) || (!lastStr.empty() && !parseNumber(lastStr, last)))
+		return RangeRequest::NONE;
+
+	if (!lastStr.empty() && last < first)
+		return RangeRequest::NONE;
+
+	if (first >= total_size)
+		return RangeRequest::UNSATISFIABLE;
+
+	range.first = first;
+	range.last = std::min(last, total_size - 1);
+	return RangeRequest::SATISFIABLE;
+}
+
+std::string BaseHandler::contentEntityTag(const std::string_view body)
+{
+	// FNV-1a, stable across runs so clients can resume after a restart
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (const char c : body)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ULL;
+	}
+
+	return std::format("\"{:x}-{:x}\"", body.size(), hash);
+}
+
+void BaseHandler::sendBody(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+                           const std::string_view body, const std::string& entity_tag)
+{
+	ByteRange range{};
+
+	switch (parseRange(request, body.size(), entity_tag, range))
+	{
+	case RangeRequest::SATISFIABLE:
+		sendPartialContent(response, body.substr(range.first, range.length()), range, body.size(), entity_tag);
+		return;
+	case RangeRequest::UNSATISFIABLE:
+		sendRangeNotSatisfiable(response, body.size());
+		return;
+	case RangeRequest::NONE:
+		break;
+	}
+
+	response.set("Accept-Ranges", "bytes");
+
+	if (!entity_tag.empty())
+		response.set("ETag", entity_tag);
+
+	response.setContentLength(static_cast<long long>(body.size()));
+
+	const auto phase = trace().phase("socket_write");
+	std::ostream& responseBody = response.send();
+	responseBody.write(body.data(), static_cast<long long>(body.size()));
+}
+
+void BaseHandler::sendPartialContent(Poco::Net::HTTPServerResponse& response, const std::string_view data,
+                                     const ByteRange& range, const unsigned long long total_size,
+                                     const std::string& entity_tag)
+{
+	response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_PARTIAL_CONTENT);
+	response.set("Accept-Ranges", "bytes");
+	response.set("Content-Range", std::format("bytes {}-{}/{}", range.first, range.last, total_size));
+
+	if (!entity_tag.empty())
+		response.set("ETag", entity_tag);
+
+	response.setContentLength(static_cast<long long>(data.size()));
+
+	const auto phase = trace().phase("socket_write");
+	std::ostream& responseBody = response.send();
+	responseBody.write(data.data(), static_cast<long long>(data.size()));
+}
+
+void BaseHandler::sendRangeNotSatisfiable(Poco::Net::HTTPServerResponse& response, const unsigned long long total_size)
+{
+	response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_REQUESTED_RANGE_NOT_SATISFIABLE);
+	response.set("Content-Range", std::format("bytes */{}", total_size));
+	response.setContentLength(0);
+	response.send();
+}
+
+void BaseHandler::sendFileRange(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+                                const std::string& path, const unsigned long long offset,
+                                const unsigned long long length)
+{
+	const auto phase = trace().phase("socket_write");
+
+	// The event loop sends it once the head is out, without blocking
+	if (auto* buffered = dynamic_cast<BufferedServerResponse*>(&response))
+	{
+		buffered->sendFileRange(path, offset, length);
+		return;
+	}
+
+	// Opened before the head goes out, so a missing file can still be answered with a fallback
+	FileTransmission file(path, offset, length);
+
+	response.setContentLength64(static_cast<Poco::Int64>(length));
+	response.send().flush();
+
+	if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_HEAD)
+		return;
+
+	// Poco's response stream would copy the body once more, the connection's blocking socket takes it directly
+	Poco::Net::StreamSocket& socket = dynamic_cast<Poco::Net::HTTPServerRequestImpl&>(request).socket();
+	file.sendTo(socket);
 }
@@ -1,10 +1,92 @@
 #pragma once
 
+#include "request_arena.hpp"
+
+#include <functional>
+
 class BaseHandler : public Poco::Net::HTTPRequestHandler
 {
 public:
 	void handleRequest(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response) override;
 
+	void attachTrace(RequestTrace trace) { trace_ = std::move(trace); }
+
+	// Handlers are recycled per thread instead of going back to the heap after every request, see HandlerPool
+	static void* operator new(std::size_t size);
+	static void operator delete(void* block, std::size_t size);
+
+	// Inclusive byte range, as in "Range: bytes=first-last"
+	struct ByteRange
+	{
+		unsigned long long first;
+		unsigned long long last;
+
+		[[nodiscard]] unsigned long long length() const { return last - first + 1; }
+	};
+
+	enum class RangeRequest
+	{
+		NONE, // no (usable) Range header or If-Range didn't match, send the whole body
+		SATISFIABLE,
+		UNSATISFIABLE
+	};
+
+	// Only single ranges are supported, multipart/byteranges requests get the whole body which RFC 9110 allows
+	static RangeRequest parseRange(const Poco::Net::HTTPServerRequest& request, unsigned long long total_size,
+	                               const std::string& entity_tag, ByteRange& range);
+
+	// Strong validator for a body generated in memory
+	static std::string contentEntityTag(std::string_view body);
+
 protected:
 	virtual void handleWithLogging(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response) = 0;
+
+	[[nodiscard]] RequestTrace& trace() { return trace_; }
+
+	// For buffers that are only needed until the response is sent
+	[[nodiscard]] std::pmr::memory_resource* arena() { return arena_.resource(); }
+
+	// Sends body with status 200, or the requested part of it with 206/416
+	void sendBody(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	              std::string_view body, const std::string& entity_tag);
+
+	// Sends a part that was read on its own, without materializing the whole body
+	void sendPartialContent(Poco::Net::HTTPServerResponse& response, std::string_view data, const ByteRange& range,
+	                        unsigned long long total_size, const std::string& entity_tag);
+
+	static void sendRangeNotSatisfiable(Poco::Net::HTTPServerResponse& response, unsigned long long total_size);
+
+	// Sends length bytes of the file at offset as the body, status and headers have to be set already. The kernel
+	// copies them from the page cache to the socket (see FileTransmission), throws Poco::OpenFileException before
+	// anything was sent if the file can't be opened.
+	void sendFileRange(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                   const std::string& path, unsigned long long offset, unsigned long long length);
+
+	// On the event engine a handler may return before its response is ready and finish it later, on any thread,
+	// with completeDeferred(). Returns false if the server needs the response before the handler returns.
+	static bool deferResponse(Poco::Net::HTTPServerResponse& response);
+
+	// Logs the deferred response and hands it to the server, the handler may be destroyed before this returns
+	void completeDeferred(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response);
+
+	// Runs send and completes the deferred response whatever happens, if send throws before the response went out
+	// it's answered with 502 (deferred responses carry upstream data)
+	void completeDeferred(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                      const std::function<void()>& send);
+
+	// For requests with nothing local to serve: on the event engine fetch runs on the upstream executor, so misses
+	// don't hold up local playback, otherwise right away. fetch returns true if it completes the response itself
+	// later; a request the upstream executor doesn't admit is answered with 503.
+	void continueUpstream(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                      std::function<bool()> fetch);
+
+private:
+	RequestTrace trace_;
+	RequestArena arena_;
+
+	void logResponse(const Poco::Net::HTTPServerRequest& request, const Poco::Net::HTTPServerResponse& response);
+
+	// Runs work for a deferred response, returns false if it threw and the response was completed with 502
+	bool runDeferred(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                 const std::function<void()>& work);
 };
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <bit>
+#include <concepts>
+#include <cstdint>
+
+// Smooth Streaming boxes store every integer big-endian, these replace the MSVC-only _byteswap_* intrinsics
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T byteSwap(T value)
+{
+	if constexpr (sizeof(T) == 1)
+		return value;
+#if defined(_MSC_VER) && !defined(__clang__)
+	else if constexpr (sizeof(T) == 2)
+		return static_cast<T>(_byteswap_ushort(static_cast<unsigned short>(value)));
+	else if constexpr (sizeof(T) == 4)
+		return static_cast<T>(_byteswap_ulong(static_cast<unsigned long>(value)));
+	else
+		return static_cast<T>(_byteswap_uint64(static_cast<unsigned long long>(value)));
+#else
+	else if constexpr (sizeof(T) == 2)
+		return static_cast<T>(__builtin_bswap16(static_cast<std::uint16_t>(value)));
+	else if constexpr (sizeof(T) == 4)
+		return static_cast<T>(__builtin_bswap32(static_cast<std::uint32_t>(value)));
+	else
+		return static_cast<T>(__builtin_bswap64(static_cast<std::uint64_t>(value)));
+#endif
+}
+
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T fromBigEndian(const T value)
+{
+	if constexpr (std::endian::native == std::endian::big)
+		return value;
+	else
+		return byteSwap(value);
+}
+
+template <std::unsigned_integral T>
+[[nodiscard]] constexpr T toBigEndian(const T value)
+{
+	return fromBigEndian(value);
+}
@@ -0,0 +1,191 @@
+#include "pch.hpp"
+#include "caption_template.hpp"
+
+#include "byte_order.hpp"
+
+using Poco::DataFormatException;
+
+namespace
+{
+	// Smooth Streaming's tfxd box, the absolute time and duration of the fragment
+	constexpr std::string_view TFXD_UUID = "\x6D\x1D\x9B\x05\x42\xD5\x44\xE6\x80\xE2\x14\x1D\xAF\xF7\x57\xB2";
+
+	constexpr unsigned int TRUN_DATA_OFFSET = 0x1;
+	constexpr unsigned int TRUN_FIRST_SAMPLE_FLAGS = 0x4;
+	constexpr unsigned int TRUN_SAMPLE_DURATION = 0x100;
+	constexpr unsigned int TRUN_SAMPLE_SIZE = 0x200;
+
+	unsigned int readUInt32(const std::string_view data, const std::size_t offset)
+	{
+		unsigned int value;
+		memcpy(&value, data.data() + offset, sizeof(value));
+		return fromBigEndian(value);
+	}
+
+	// Size of the box at offset, 0 if it doesn't end before end
+	std::size_t boxSize(const std::string_view data, const std::size_t offset, const std::size_t end)
+	{
+		if (end - offset < 8)
+			return 0;
+
+		const std::size_t size = readUInt32(data, offset);
+		return size < 8 || size > end - offset ? 0 : size;
+	}
+}
+
+CaptionTemplate::CaptionTemplate(std::string fragment) : fragment_(std::move(fragment))
+{
+	const std::string_view data = fragment_;
+
+	moof_size_ = boxSize(data, 0, data.size());
+
+	if (moof_size_ == 0 || data.substr(4, 4) != BLOCK_MOOF)
+		throw DataFormatException("Caption fragment doesn't start with a moof box");
+
+	const std::size_t mdatSize = boxSize(data, moof_size_, data.size());
+
+	if (mdatSize == 0 || data.substr(moof_size_ + 4, 4) != BLOCK_MDAT)
+		throw DataFormatException("Caption fragment has no mdat box after its moof");
+
+	for (std::size_t offset = 8; offset < moof_size_;)
+	{
+		const std::size_t size = boxSize(data, offset, moof_size_);
+
+		if (size == 0)
+			throw DataFormatException("Malformed box in the moof of a caption fragment");
+
+		if (data.substr(offset + 4, 4) == "traf")
+			parseTraf(offset + 8, offset + size);
+
+		offset += size;
+	}
+
+	fragment_.resize(moof_size_ + mdatSize);
+}
+
+std::string_view CaptionTemplate::document() const
+{
+	return std::string_view(fragment_).substr(moof_size_ + 8);
+}
+
+std::pmr::string CaptionTemplate::build(const unsigned long long start_time, const unsigned long long duration,
+                                        const unsigned int track_id, const std::string_view document,
+                                        std::pmr::memory_resource* memory) const
+{
+	std::pmr::string data(memory);
+	data.reserve(moof_size_ + 8 + document.size());
+	data.append(fragment_.data(), moof_size_);
+
+	write(data, track_id_, track_id);
+	write(data, fragment_time_, start_time);
+	write(data, fragment_duration_, duration);
+	write(data, decode_time_, start_time);
+	write(data, sample_duration_, duration);
+	write(data, sample_size_, document.size());
+
+	const unsigned int mdatSizeBe = toBigEndian(static_cast<unsigned int>(document.size() + 8));
+	data.append(reinterpret_cast<const char*>(&mdatSizeBe), sizeof(mdatSizeBe));
+	data.append(BLOCK_MDAT);
+	data.append(document);
+
+	return data;
+}
+
+void CaptionTemplate::parseTraf(const std::size_t begin, const std::size_t end)
+{
+	const std::string_view data = fragment_;
+
+	for (std::size_t offset = begin; offset < end;)
+	{
+		const std::size_t size = boxSize(data, offset, end);
+
+		if (size == 0)
+			throw DataFormatException("Malformed box in the traf of a caption fragment");
+
+		const std::string_view type = data.substr(offset + 4, 4);
+		const std::size_t boxEnd = offset + size;
+
+		// Full boxes, version 1 has 64 bit times
+		if (type == "tfhd" && size >= 16)
+			track_id_ = {offset + 12, 4};
+		else if (type == "tfdt" && size >= 16)
+		{
+			const std::size_t fieldSize = data[offset + 8] == 1 ? 8 : 4;
+
+			if (offset + 12 + fieldSize <= boxEnd)
+				decode_time_ = {offset + 12, fieldSize};
+		}
+		else if (type == "uuid" && size >= 28 && data.substr(offset + 8, TFXD_UUID.size()) == TFXD_UUID)
+		{
+			const std::size_t fieldSize = data[offset + 24] == 1 ? 8 : 4;
+
+			if (offset + 28 + 2 * fieldSize <= boxEnd)
+			{
+				fragment_time_ = {offset + 28, fieldSize};
+				fragment_duration_ = {offset + 28 + fieldSize, fieldSize};
+			}
+		}
+		else if (type == "trun" && size >= 16 && readUInt32(data, offset + 12) == 1)
+		{
+			// A single sample, the TTML document
+			const unsigned int flags = readUInt32(data, offset + 8) & 0xFFFFFF;
+			std::size_t field = offset + 16;
+
+			if (flags & TRUN_DATA_OFFSET)
+				field += 4;
+
+			if (flags & TRUN_FIRST_SAMPLE_FLAGS)
+				field += 4;
+
+			if (flags & TRUN_SAMPLE_DURATION && field + 4 <= boxEnd)
+			{
+				sample_duration_ = {field, 4};
+				field += 4;
+			}
+
+			if (flags & TRUN_SAMPLE_SIZE && field + 4 <= boxEnd)
+				sample_size_ = {field, 4};
+		}
+
+		offset = boxEnd;
+	}
+}
+
+unsigned int CaptionTemplate::readTrackId(const std::string_view fragment)
+{
+	const std::size_t moofSize = boxSize(fragment, 0, fragment.size());
+
+	if (moofSize == 0 || fragment.substr(4, 4) != BLOCK_MOOF)
+		return 0;
+
+	for (std::size_t offset = 8; offset < moofSize;)
+	{
+		const std::size_t size = boxSize(fragment, offset, moofSize);
+
+		if (size == 0)
+			return 0;
+
+		for (std::size_t child = offset + 8; fragment.substr(offset + 4, 4) == "traf" && child < offset + size;)
+		{
+			const std::size_t childSize = boxSize(fragment, child, offset + size);
+
+			if (childSize == 0)
+				return 0;
+
+			if (fragment.substr(child + 4, 4) == "tfhd" && childSize >= 16)
+				return readUInt32(fragment, child + 12);
+
+			child += childSize;
+		}
+
+		offset += size;
+	}
+
+	return 0;
+}
+
+void CaptionTemplate::write(std::pmr::string& data, const Field& field, const unsigned long long value)
+{
+	for (std::size_t i = 0; i < field.size; ++i)
+		data[field.offset + i] = static_cast<char>(value >> (field.size - 1 - i) * 8);
+}
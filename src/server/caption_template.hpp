@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory_resource>
+#include <string_view>
+
+// A caption fragment of a track (moof, then an mdat holding a TTML document) that other fragments of the track are
+// built from. The moof is reused as is apart from the fields that depend on the fragment: the tfhd track ID, the tfxd
+// and tfdt times and the duration and size of the trun sample. Fields the template doesn't have are left out, like the
+// CDN would.
+class CaptionTemplate final
+{
+public:
+	// Throws Poco::DataFormatException if the fragment isn't a moof followed by an mdat
+	explicit CaptionTemplate(std::string fragment);
+
+	[[nodiscard]] const std::string& fragment() const { return fragment_; }
+
+	// The TTML document of the template
+	[[nodiscard]] std::string_view document() const;
+
+	// The template's moof moved to start_time, followed by an mdat holding document
+	[[nodiscard]] std::pmr::string build(unsigned long long start_time, unsigned long long duration,
+	                                     unsigned int track_id, std::string_view document,
+	                                     std::pmr::memory_resource* memory) const;
+
+	// The tfhd track ID of a caption fragment, 0 if it has none or isn't a moof
+	static unsigned int readTrackId(std::string_view fragment);
+
+private:
+	// A big-endian integer of 4 or 8 bytes in the moof
+	struct Field
+	{
+		std::size_t offset = 0;
+		std::size_t size = 0; // 0 if the moof doesn't have it
+	};
+
+	std::string fragment_;
+	std::size_t moof_size_ = 0;
+
+	Field track_id_; // tfhd
+	Field fragment_time_; // tfxd
+	Field fragment_duration_; // tfxd
+	Field decode_time_; // tfdt
+	Field sample_duration_; // trun
+	Field sample_size_; // trun
+
+	void parseTraf(std::size_t begin, std::size_t end);
+	static void write(std::pmr::string& data, const Field& field, unsigned long long value);
+};
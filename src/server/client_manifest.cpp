@@ -0,0 +1,458 @@
+#include "pch.hpp"
+#include "client_manifest.hpp"
+
+#include "byte_order.hpp"
+
+#include <algorithm>
+
+#include <Poco/SAX/AttributesImpl.h>
+
+using Poco::XML::AttributesImpl;
+using Poco::XML::Element;
+using Poco::XML::Node;
+using Poco::XML::XMLWriter;
+
+namespace
+{
+	// Only the last chunk of a stream has no next one to take its duration from, one chunk alone gets this
+	constexpr unsigned long long DEFAULT_CHUNK_DURATION = 20000000;
+
+	// Manifests may come from the CDN, r (repeat) counts beyond this are cut off
+	constexpr std::size_t MAX_CHUNKS = 1 << 16;
+
+	// Offsets into the payload of a visual or audio sample entry (ISO/IEC 14496-12)
+	constexpr std::size_t SAMPLE_ENTRY_SIZE = 8;
+	constexpr std::size_t VISUAL_WIDTH = SAMPLE_ENTRY_SIZE + 16;
+	constexpr std::size_t VISUAL_CHILDREN = SAMPLE_ENTRY_SIZE + 70;
+	constexpr std::size_t AUDIO_CHANNELS = SAMPLE_ENTRY_SIZE + 8;
+	constexpr std::size_t AUDIO_SAMPLE_RATE = SAMPLE_ENTRY_SIZE + 16;
+	constexpr std::size_t AUDIO_CHILDREN = SAMPLE_ENTRY_SIZE + 20;
+
+	constexpr unsigned char ES_DESCRIPTOR = 0x03;
+	constexpr unsigned char DECODER_CONFIG_DESCRIPTOR = 0x04;
+	constexpr unsigned char DECODER_SPECIFIC_INFO = 0x05;
+
+	template <std::unsigned_integral T>
+	T readInteger(const std::string_view data, const std::size_t offset)
+	{
+		T value;
+		memcpy(&value, data.data() + offset, sizeof(value));
+		return fromBigEndian(value);
+	}
+
+	// Narrows [begin, end) to the payload of the first child box of the given type, false if there's none
+	bool findBox(const std::string_view data, const std::string_view type, std::size_t& begin, std::size_t& end)
+	{
+		for (std::size_t offset = begin; end - offset >= 8;)
+		{
+			std::size_t size = readInteger<std::uint32_t>(data, offset);
+			std::size_t header = 8;
+
+			if (size == 0)
+				size = end - offset;
+			else if (size == 1 && end - offset >= 16)
+			{
+				size = static_cast<std::size_t>(readInteger<std::uint64_t>(data, offset + 8));
+				header = 16;
+			}
+
+			if (size < header || size > end - offset)
+				return false;
+
+			if (data.substr(offset + 4, 4) == type)
+			{
+				begin = offset + header;
+				end = offset + size;
+				return true;
+			}
+
+			offset += size;
+		}
+
+		return false;
+	}
+
+	std::string toHex(const std::string_view bytes)
+	{
+		static constexpr char DIGITS[] = "0123456789ABCDEF";
+
+		std::string hex;
+		hex.reserve(bytes.size() * 2);
+
+		for (const char byte : bytes)
+		{
+			hex += DIGITS[static_cast<unsigned char>(byte) >> 4];
+			hex += DIGITS[static_cast<unsigned char>(byte) & 0xF];
+		}
+
+		return hex;
+	}
+
+	// H.264 parameter sets of an avcC box, each prefixed with a start code
+	std::string avcCodecPrivateData(const std::string_view box)
+	{
+		std::string data;
+		std::size_t offset = 5;
+
+		// SPS count in the low 5 bits, then the PPS count
+		for (const unsigned int mask : {0x1Fu, 0xFFu})
+		{
+			if (offset >= box.size())
+				return data;
+
+			const unsigned int count = static_cast<unsigned char>(box[offset++]) & mask;
+
+			for (unsigned int i = 0; i < count && offset + 2 <= box.size(); ++i)
+			{
+				const std::size_t length = readInteger<std::uint16_t>(box, offset);
+
+				if (offset + 2 + length > box.size())
+					return data;
+
+				data += "00000001" + toHex(box.substr(offset + 2, length));
+				offset += 2 + length;
+			}
+		}
+
+		return data;
+	}
+
+	// MPEG-4 descriptor header: a tag and a length of up to 4 bytes, 7 bits each
+	bool readDescriptor(const std::string_view data, std::size_t& offset, unsigned char& tag, std::size_t& length)
+	{
+		if (offset >= data.size())
+			return false;
+
+		tag = static_cast<unsigned char>(data[offset++]);
+		length = 0;
+
+		for (int i = 0; i < 4 && offset < data.size(); ++i)
+		{
+			const auto byte = static_cast<unsigned char>(data[offset++]);
+			length = length << 7 | (byte & 0x7F);
+
+			if (!(byte & 0x80))
+				return length <= data.size() - offset;
+		}
+
+		return false;
+	}
+
+	// The AudioSpecificConfig in an esds box
+	std::string esdsCodecPrivateData(const std::string_view box)
+	{
+		std::size_t offset = 4; // version and flags
+		unsigned char tag;
+		std::size_t length;
+
+		if (!readDescriptor(box, offset, tag, length) || tag != ES_DESCRIPTOR || length < 3)
+			return "";
+
+		const auto flags = static_cast<unsigned char>(box[offset + 2]);
+		offset += 3;
+
+		if (flags & 0x80) // stream dependence
+			offset += 2;
+
+		if (flags & 0x40 && offset < box.size()) // URL
+			offset += 1 + static_cast<unsigned char>(box[offset]);
+
+		if (flags & 0x20) // OCR stream
+			offset += 2;
+
+		if (!readDescriptor(box, offset, tag, length) || tag != DECODER_CONFIG_DESCRIPTOR || length < 13)
+			return "";
+
+		offset += 13;
+
+		if (!readDescriptor(box, offset, tag, length) || tag != DECODER_SPECIFIC_INFO)
+			return "";
+
+		return toHex(box.substr(offset, length));
+	}
+
+	std::string defaultFourCc(const std::string& type)
+	{
+		if (type == "video")
+			return "H264";
+
+		return type == "audio" ? "AACL" : "TTML";
+	}
+
+	int typeOrder(const std::string& type)
+	{
+		if (type == "video")
+			return 0;
+
+		return type == "audio" ? 1 : 2;
+	}
+
+	void addAttribute(AttributesImpl& attributes, const std::string& name, const std::string& value)
+	{
+		attributes.addAttribute("", "", name, "CDATA", value);
+	}
+
+	void addAttribute(AttributesImpl& attributes, const std::string& name, const unsigned long long value)
+	{
+		addAttribute(attributes, name, std::to_string(value));
+	}
+}
+
+ClientManifestBuilder::SampleDescription ClientManifestBuilder::parseSampleDescription(const std::string_view header)
+{
+	SampleDescription description;
+	std::size_t begin = 0;
+	std::size_t end = header.size();
+
+	for (const std::string_view type : {"moov", "trak", "mdia", "minf", "stbl", "stsd"})
+	{
+		if (!findBox(header, type, begin, end))
+			return description;
+	}
+
+	// Version, flags and the entry count, then the first entry
+	if (end - begin < 16)
+		return description;
+
+	begin += 8;
+	const std::size_t stsdEnd = end;
+
+	const std::string_view format = header.substr(begin + 4, 4);
+	const std::size_t entryEnd = std::min<std::size_t>(begin + readInteger<std::uint32_t>(header, begin), stsdEnd);
+	const std::string_view entry = header.substr(begin + 8, entryEnd > begin + 8 ? entryEnd - begin - 8 : 0);
+
+	description.four_cc = Poco::toUpper(std::string(format));
+
+	if (format == "avc1" || format == "avc3")
+	{
+		description.four_cc = "H264";
+
+		if (entry.size() < VISUAL_CHILDREN)
+			return description;
+
+		description.width = readInteger<std::uint16_t>(entry, VISUAL_WIDTH);
+		description.height = readInteger<std::uint16_t>(entry, VISUAL_WIDTH + 2);
+
+		if (std::size_t boxBegin = VISUAL_CHILDREN, boxEnd = entry.size(); findBox(entry, "avcC", boxBegin, boxEnd))
+			description.codec_private_data = avcCodecPrivateData(entry.substr(boxBegin, boxEnd - boxBegin));
+	}
+	else if (format == "mp4a")
+	{
+		description.four_cc = "AACL";
+
+		if (entry.size() < AUDIO_CHILDREN)
+			return description;
+
+		description.channels = readInteger<std::uint16_t>(entry, AUDIO_CHANNELS);
+		description.bits_per_sample = readInteger<std::uint16_t>(entry, AUDIO_CHANNELS + 2);
+		description.sampling_rate = readInteger<std::uint32_t>(entry, AUDIO_SAMPLE_RATE) >> 16; // 16.16 fixed point
+
+		if (std::size_t boxBegin = AUDIO_CHILDREN, boxEnd = entry.size(); findBox(entry, "esds", boxBegin, boxEnd))
+			description.codec_private_data = esdsCodecPrivateData(entry.substr(boxBegin, boxEnd - boxBegin));
+	}
+	else if (format == "stpp" || format == "dfxp")
+		description.four_cc = "TTML";
+
+	return description;
+}
+
+void ClientManifestBuilder::addQualityLevel(const std::string& type, const std::string& name,
+                                            const unsigned long long bitrate, const SampleDescription& description,
+                                            const std::vector<unsigned long long>& start_times)
+{
+	auto stream = std::ranges::find(streams_, name, &Stream::name);
+
+	if (stream == streams_.end())
+	{
+		stream = streams_.emplace(streams_.end());
+		stream->type = type;
+		stream->name = name;
+	}
+
+	stream->quality_levels.push_back({bitrate, description});
+	stream->start_times.insert(start_times.begin(), start_times.end());
+}
+
+std::string ClientManifestBuilder::build() const
+{
+	// Video first, then audio and text, in the order of the server manifest within each
+	std::vector<const Stream*> streams;
+
+	for (const Stream& stream : streams_)
+	{
+		if (!stream.start_times.empty())
+			streams.push_back(&stream);
+	}
+
+	std::ranges::stable_sort(streams, {}, [](const Stream* stream) { return typeOrder(stream->type); });
+
+	// Each chunk lasts until the next one starts
+	std::vector<std::vector<unsigned long long>> durations;
+	unsigned long long duration = 0;
+
+	for (const Stream* stream : streams)
+	{
+		std::vector<unsigned long long>& chunks = durations.emplace_back();
+
+		for (auto it = stream->start_times.begin(); std::next(it) != stream->start_times.end(); ++it)
+			chunks.push_back(*std::next(it) - *it);
+
+		chunks.push_back(chunks.empty() ? DEFAULT_CHUNK_DURATION : chunks.back());
+		duration = std::max(duration, *stream->start_times.rbegin() + chunks.back());
+	}
+
+	std::ostringstream output;
+	XMLWriter writer(output, XMLWriter::WRITE_XML_DECLARATION | XMLWriter::PRETTY_PRINT);
+	writer.startDocument();
+
+	AttributesImpl mediaAttributes;
+	addAttribute(mediaAttributes, "MajorVersion", 2);
+	addAttribute(mediaAttributes, "MinorVersion", 2);
+	addAttribute(mediaAttributes, "TimeScale", 10000000);
+	addAttribute(mediaAttributes, "Duration", duration);
+	writer.startElement("", "", "SmoothStreamingMedia", mediaAttributes);
+
+	for (std::size_t i = 0; i < streams.size(); ++i)
+	{
+		const Stream& stream = *streams[i];
+
+		std::vector<QualityLevel> qualityLevels = stream.quality_levels;
+		std::ranges::sort(qualityLevels, {}, &QualityLevel::bitrate);
+
+		AttributesImpl streamAttributes;
+		addAttribute(streamAttributes, "Type", stream.type);
+		addAttribute(streamAttributes, "Name", stream.name);
+
+		if (stream.type == "text")
+			addAttribute(streamAttributes, "Subtype",
+			             stream.name.find("_captions") != std::string::npos ? "CAPT" : "SUBT");
+
+		addAttribute(streamAttributes, "Chunks", stream.start_times.size());
+		addAttribute(streamAttributes, "QualityLevels", qualityLevels.size());
+		addAttribute(streamAttributes, "Url", "QualityLevels({bitrate})/Fragments(" + stream.name + "={start time})");
+
+		if (stream.type == "video")
+		{
+			const auto widest = std::ranges::max(qualityLevels, {}, [](const QualityLevel& level)
+			{
+				return level.description.width * level.description.height;
+			});
+
+			if (widest.description.width > 0)
+			{
+				addAttribute(streamAttributes, "MaxWidth", widest.description.width);
+				addAttribute(streamAttributes, "MaxHeight", widest.description.height);
+				addAttribute(streamAttributes, "DisplayWidth", widest.description.width);
+				addAttribute(streamAttributes, "DisplayHeight", widest.description.height);
+			}
+		}
+
+		writer.startElement("", "", "StreamIndex", streamAttributes);
+
+		for (std::size_t index = 0; index < qualityLevels.size(); ++index)
+		{
+			const auto& [bitrate, description] = qualityLevels[index];
+
+			AttributesImpl levelAttributes;
+			addAttribute(levelAttributes, "Index", index);
+			addAttribute(levelAttributes, "Bitrate", bitrate);
+			addAttribute(levelAttributes, "FourCC",
+			             description.four_cc.empty() ? defaultFourCc(stream.type) : description.four_cc);
+
+			if (description.width > 0)
+			{
+				addAttribute(levelAttributes, "MaxWidth", description.width);
+				addAttribute(levelAttributes, "MaxHeight", description.height);
+			}
+
+			if (description.sampling_rate > 0)
+			{
+				addAttribute(levelAttributes, "SamplingRate", description.sampling_rate);
+				addAttribute(levelAttributes, "Channels", description.channels);
+				addAttribute(levelAttributes, "BitsPerSample", description.bits_per_sample);
+				addAttribute(levelAttributes, "PacketSize", description.channels * description.bits_per_sample / 8);
+				addAttribute(levelAttributes, "AudioTag", description.four_cc == "AACL" ? 255 : 0);
+			}
+
+			addAttribute(levelAttributes, "CodecPrivateData", description.codec_private_data);
+			writer.emptyElement("", "", "QualityLevel", levelAttributes);
+		}
+
+		// Only the first chunk needs its start time, the others follow on
+		std::size_t chunk = 0;
+
+		for (const unsigned long long startTime : stream.start_times)
+		{
+			AttributesImpl chunkAttributes;
+
+			if (chunk == 0)
+				addAttribute(chunkAttributes, "t", startTime);
+
+			addAttribute(chunkAttributes, "d", durations[i][chunk++]);
+			writer.emptyElement("", "", "c", chunkAttributes);
+		}
+
+		writer.endElement("", "", "StreamIndex");
+	}
+
+	writer.endElement("", "", "SmoothStreamingMedia");
+	writer.endDocument();
+
+	return output.str();
+}
+
+std::string streamIndexTrackName(const Element* stream_index)
+{
+	const std::string url = stream_index->getAttribute("Url");
+	const auto begin = url.find("Fragments(");
+	const auto end = url.find('=', begin);
+
+	if (begin == std::string::npos || end == std::string::npos)
+		return stream_index->getAttribute("Name");
+
+	return url.substr(begin + 10, end - begin - 10);
+}
+
+std::vector<std::pair<unsigned long long, unsigned long long>> streamIndexChunks(const Element* stream_index)
+{
+	// number is left as it is unless the whole value is one
+	const auto parse = [](const std::string& value, unsigned long long& number)
+	{
+		unsigned long long parsed;
+		const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+
+		if (value.empty() || ec != std::errc() || end != value.data() + value.size())
+			return;
+
+		number = parsed;
+	};
+
+	std::vector<std::pair<unsigned long long, unsigned long long>> chunks;
+	unsigned long long time = 0;
+
+	for (const Node* child = stream_index->firstChild(); child && chunks.size() < MAX_CHUNKS;
+	     child = child->nextSibling())
+	{
+		if (child->nodeType() != Node::ELEMENT_NODE || child->nodeName() != "c")
+			continue;
+
+		const auto* chunk = dynamic_cast<const Element*>(child);
+		unsigned long long duration = 0;
+		unsigned long long repeat = 1;
+
+		parse(chunk->getAttribute("t"), time);
+		parse(chunk->getAttribute("d"), duration);
+		parse(chunk->getAttribute("r"), repeat);
+
+		if (!chunks.empty() && chunks.back().second == 0 && time > chunks.back().first)
+			chunks.back().second = time - chunks.back().first;
+
+		for (unsigned long long i = 0; i < std::max(repeat, 1ull) && chunks.size() < MAX_CHUNKS; ++i)
+		{
+			chunks.emplace_back(time, duration);
+			time += duration;
+		}
+	}
+
+	return chunks;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <set>
+#include <string_view>
+
+// Builds a Smooth Streaming client manifest (.ismc) for an episode whose own one is missing, from what indexing knows:
+// the quality levels of the server manifest, the chunks of the fragment indexes and the codec details of the track
+// files' moov boxes. Times are in 100ns ticks like everywhere else.
+class ClientManifestBuilder final
+{
+public:
+	// The first sample description of a track file (moov/trak/mdia/minf/stbl/stsd)
+	struct SampleDescription
+	{
+		std::string four_cc; // empty if the file has no moov, the stream type's usual one is listed then
+		std::string codec_private_data; // hex, as the client manifest lists it
+		unsigned int width = 0;
+		unsigned int height = 0;
+		unsigned int sampling_rate = 0;
+		unsigned int channels = 0;
+		unsigned int bits_per_sample = 0;
+	};
+
+	// header is the start of a track file, up to its first fragment
+	static SampleDescription parseSampleDescription(std::string_view header);
+
+	// type is video, audio or text. Quality levels of a stream may have different fragments, the stream's chunks are
+	// all of their start times.
+	void addQualityLevel(const std::string& type, const std::string& name, unsigned long long bitrate,
+	                     const SampleDescription& description, const std::vector<unsigned long long>& start_times);
+
+	[[nodiscard]] bool empty() const { return streams_.empty(); }
+	[[nodiscard]] std::string build() const;
+
+private:
+	struct QualityLevel
+	{
+		unsigned long long bitrate;
+		SampleDescription description;
+	};
+
+	struct Stream
+	{
+		std::string type;
+		std::string name;
+		std::vector<QualityLevel> quality_levels;
+		std::set<unsigned long long> start_times;
+	};
+
+	std::vector<Stream> streams_;
+};
+
+// Track name from a StreamIndex Url template, e.g. "QualityLevels({bitrate})/Fragments(audio_eng={start time})"
+std::string streamIndexTrackName(const Poco::XML::Element* stream_index);
+
+// (start time, duration) of every chunk of a StreamIndex in order; a chunk without a duration lasts until the next one
+// starts, the last one then gets 0
+std::vector<std::pair<unsigned long long, unsigned long long>> streamIndexChunks(
+	const Poco::XML::Element* stream_index);
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace coroutine_detail
+{
+	template <typename T>
+	struct PromiseResult
+	{
+		std::optional<T> value;
+
+		template <typename U>
+		void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+
+		T take() { return std::move(*value); }
+	};
+
+	template <>
+	struct PromiseResult<void>
+	{
+		void return_void()
+		{
+		}
+
+		void take()
+		{
+		}
+	};
+}
+
+// Lazily started coroutine producing a T. co_await runs it and resumes the awaiting coroutine once it finished
+// (exceptions are rethrown there), start() runs it detached and the frame frees itself when it's done.
+template <typename T = void>
+class Task
+{
+public:
+	struct promise_type : coroutine_detail::PromiseResult<T>
+	{
+		std::coroutine_handle<> continuation;
+		std::exception_ptr exception;
+		bool detached = false;
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		struct FinalAwaiter
+		{
+			[[nodiscard]] bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				promise_type& promise = handle.promise();
+
+				if (promise.detached)
+				{
+					// Nobody is going to look at the result, detached coroutines have to handle their own errors
+					if (promise.exception)
+						std::terminate();
+
+					handle.destroy();
+					return std::noop_coroutine();
+				}
+
+				return promise.continuation ? promise.continuation : std::noop_coroutine();
+			}
+
+			void await_resume() const noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {}))
+	{
+	}
+
+	Task& operator=(Task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (handle_)
+				handle_.destroy();
+
+			handle_ = std::exchange(other.handle_, {});
+		}
+
+		return *this;
+	}
+
+	~Task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	auto operator co_await() && noexcept
+	{
+		struct Awaiter
+		{
+			std::coroutine_handle<promise_type> handle;
+
+			[[nodiscard]] bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(const std::coroutine_handle<> awaiting) noexcept
+			{
+				handle.promise().continuation = awaiting;
+				return handle;
+			}
+
+			T await_resume()
+			{
+				if (handle.promise().exception)
+					std::rethrow_exception(handle.promise().exception);
+
+				return handle.promise().take();
+			}
+		};
+
+		return Awaiter{handle_};
+	}
+
+	// Runs until the first suspension point, the coroutine owns itself from here on
+	void start() &&
+	{
+		const auto handle = std::exchange(handle_, {});
+		handle.promise().detached = true;
+		handle.resume();
+	}
+
+private:
+	explicit Task(const std::coroutine_handle<promise_type> handle) : handle_(handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle_;
+};
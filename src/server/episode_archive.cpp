@@ -0,0 +1,257 @@
+#include "pch.hpp"
+#include "episode_archive.hpp"
+
+#include "byte_order.hpp"
+
+using Poco::DataFormatException;
+using Poco::File;
+using Poco::Path;
+using Poco::SharedMemory;
+
+namespace
+{
+	constexpr std::string_view MAGIC = "QSPK";
+	constexpr std::size_t HEADER_SIZE = 64;
+
+	unsigned long long alignToPage(const unsigned long long offset)
+	{
+		return (offset + EpisodeArchive::PAGE_SIZE - 1) / EpisodeArchive::PAGE_SIZE * EpisodeArchive::PAGE_SIZE;
+	}
+
+	class Reader
+	{
+	public:
+		explicit Reader(const std::string_view data) : data_(data)
+		{
+		}
+
+		template <std::unsigned_integral T>
+		T read()
+		{
+			T value;
+			memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+			return fromBigEndian(value);
+		}
+
+		std::string readString()
+		{
+			const auto length = read<unsigned short>();
+			return std::string(take(length));
+		}
+
+		std::string_view take(const std::size_t size)
+		{
+			if (size > data_.size() - position_)
+				throw DataFormatException("Truncated episode archive");
+
+			const std::string_view result = data_.substr(position_, size);
+			position_ += size;
+			return result;
+		}
+
+	private:
+		std::string_view data_;
+		std::size_t position_ = 0;
+	};
+
+	class Writer
+	{
+	public:
+		template <std::unsigned_integral T>
+		void write(const T value)
+		{
+			const T valueBe = toBigEndian(value);
+			data_.append(reinterpret_cast<const char*>(&valueBe), sizeof(valueBe));
+		}
+
+		void writeString(const std::string& value)
+		{
+			write(static_cast<unsigned short>(value.size()));
+			data_.append(value);
+		}
+
+		void writeBytes(const std::string_view value)
+		{
+			data_.append(value);
+		}
+
+		[[nodiscard]] const std::string& data() const { return data_; }
+
+	private:
+		std::string data_;
+	};
+
+	std::string serializeIndex(const std::vector<EpisodeArchive::TrackSource>& tracks,
+	                           const std::vector<unsigned long long>& data_offsets,
+	                           const std::vector<unsigned long long>& data_sizes)
+	{
+		Writer writer;
+
+		for (std::size_t i = 0; i < tracks.size(); ++i)
+		{
+			writer.writeString(tracks[i].name);
+			writer.writeString(tracks[i].bitrate);
+			writer.write(data_offsets[i]);
+			writer.write(data_sizes[i]);
+			writer.write(static_cast<unsigned int>(tracks[i].fragments.size()));
+
+			for (const auto& [startTime, offset, size] : tracks[i].fragments)
+			{
+				writer.write(startTime);
+				writer.write(offset);
+				writer.write(size);
+			}
+		}
+
+		return writer.data();
+	}
+}
+
+EpisodeArchive::EpisodeArchive(const Path& path) :
+	path_(path),
+	last_modified_(File(path).getLastModified()),
+	mapping_(File(path), SharedMemory::AM_READ)
+{
+	const std::string_view archive(mapping_.begin(), mapping_.end() - mapping_.begin());
+	Reader header(archive);
+
+	if (header.take(MAGIC.size()) != MAGIC)
+		throw DataFormatException("Not an episode archive", path.toString());
+
+	if (const auto version = header.read<unsigned int>(); version != VERSION)
+		throw DataFormatException("Unsupported episode archive version " + std::to_string(version), path.toString());
+
+	header.read<unsigned int>(); // page size, only matters to the writer
+
+	const auto trackCount = header.read<unsigned int>();
+	const auto clientManifestOffset = header.read<unsigned long long>();
+	const auto clientManifestSize = header.read<unsigned long long>();
+	const auto serverManifestOffset = header.read<unsigned long long>();
+	const auto serverManifestSize = header.read<unsigned long long>();
+	const auto indexOffset = header.read<unsigned long long>();
+	const auto indexSize = header.read<unsigned long long>();
+
+	client_manifest_ = bytes(clientManifestOffset, clientManifestSize);
+	server_manifest_ = bytes(serverManifestOffset, serverManifestSize);
+
+	const std::string_view indexData = bytes(indexOffset, indexSize);
+
+	if (indexData.size() != indexSize)
+		throw DataFormatException("Episode archive index is out of bounds", path.toString());
+
+	Reader index(indexData);
+	tracks_.reserve(trackCount);
+
+	for (unsigned int i = 0; i < trackCount; ++i)
+	{
+		Track track;
+		track.name = index.readString();
+		track.bitrate = index.readString();
+		track.data_offset = index.read<unsigned long long>();
+		track.data_size = index.read<unsigned long long>();
+
+		if (bytes(track.data_offset, track.data_size).size() != track.data_size)
+			throw DataFormatException("Episode archive track data is out of bounds", path.toString());
+
+		const auto fragmentCount = index.read<unsigned int>();
+		track.fragments.reserve(fragmentCount);
+
+		for (unsigned int j = 0; j < fragmentCount; ++j)
+		{
+			Fragment fragment{};
+			fragment.start_time = index.read<unsigned long long>();
+			fragment.offset = index.read<unsigned long long>();
+			fragment.size = index.read<unsigned long long>();
+
+			if (fragment.offset > track.data_size || fragment.size > track.data_size - fragment.offset)
+				throw DataFormatException("Episode archive fragment is out of bounds", path.toString());
+
+			track.fragments.push_back(fragment);
+		}
+
+		tracks_.push_back(std::move(track));
+	}
+}
+
+std::string_view EpisodeArchive::bytes(const unsigned long long offset, const unsigned long long size) const
+{
+	const auto archiveSize = static_cast<unsigned long long>(mapping_.end() - mapping_.begin());
+
+	if (offset > archiveSize || size > archiveSize - offset)
+		return {};
+
+	return {mapping_.begin() + offset, static_cast<std::size_t>(size)};
+}
+
+void EpisodeArchive::write(const Path& path, const std::string& server_manifest, const std::string& client_manifest,
+                           const std::vector<TrackSource>& tracks)
+{
+	const unsigned long long clientManifestOffset = HEADER_SIZE;
+	const unsigned long long serverManifestOffset = clientManifestOffset + client_manifest.size();
+	const unsigned long long indexOffset = serverManifestOffset + server_manifest.size();
+
+	std::vector<unsigned long long> dataSizes;
+
+	for (const auto& track : tracks)
+		dataSizes.push_back(File(track.source_file).getSize());
+
+	// The index has a fixed size for given tracks, so it can be laid out before the data offsets are known
+	std::vector<unsigned long long> dataOffsets(tracks.size(), 0);
+	const unsigned long long indexSize = serializeIndex(tracks, dataOffsets, dataSizes).size();
+
+	unsigned long long offset = indexOffset + indexSize;
+
+	for (std::size_t i = 0; i < tracks.size(); ++i)
+	{
+		dataOffsets[i] = alignToPage(offset);
+		offset = dataOffsets[i] + dataSizes[i];
+	}
+
+	Writer header;
+	header.writeBytes(MAGIC);
+	header.write(VERSION);
+	header.write(PAGE_SIZE);
+	header.write(static_cast<unsigned int>(tracks.size()));
+	header.write(clientManifestOffset);
+	header.write(static_cast<unsigned long long>(client_manifest.size()));
+	header.write(serverManifestOffset);
+	header.write(static_cast<unsigned long long>(server_manifest.size()));
+	header.write(indexOffset);
+	header.write(indexSize);
+
+	std::string headerData = header.data();
+	headerData.resize(HEADER_SIZE, '\0');
+
+	const Path temporaryPath(path.toString() + ".tmp");
+	std::ofstream archive(temporaryPath.toString(), std::ios::binary | std::ios::trunc);
+
+	if (!archive)
+		throw Poco::CreateFileException(temporaryPath.toString());
+
+	archive << headerData << client_manifest << server_manifest << serializeIndex(tracks, dataOffsets, dataSizes);
+
+	std::vector<char> buffer(1024 * 1024);
+
+	for (std::size_t i = 0; i < tracks.size(); ++i)
+	{
+		archive << std::string(dataOffsets[i] - static_cast<unsigned long long>(archive.tellp()), '\0');
+
+		std::ifstream trackStream(tracks[i].source_file.toString(), std::ios::binary);
+
+		if (!trackStream)
+			throw Poco::OpenFileException(tracks[i].source_file.toString());
+
+		while (trackStream)
+		{
+			trackStream.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+			archive.write(buffer.data(), trackStream.gcount());
+		}
+	}
+
+	archive.close();
+
+	if (!archive)
+		throw Poco::WriteFileException(temporaryPath.toString());
+
+	File(temporaryPath).renameTo(path.toString());
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Packed episode (.qsp): both manifests, a prebuilt fragment index and every track in one page-aligned file.
+//
+// All integers are big-endian, like the boxes they describe.
+//
+//   header (64 bytes)  "QSPK", version, page size, track count, offset/size of client manifest,
+//                      server manifest and index
+//   manifests
+//   index              per track: name, bitrate, data offset/size, fragment count,
+//                      then (start time, offset within track data, moof + mdat size) per fragment
+//   track data         each original track file, starting on a page boundary
+class EpisodeArchive
+{
+public:
+	static constexpr auto EXTENSION = "qsp";
+	static constexpr unsigned int VERSION = 1;
+	static constexpr unsigned int PAGE_SIZE = 4096;
+
+	struct Fragment
+	{
+		unsigned long long start_time;
+		unsigned long long offset; // within the track data
+		unsigned long long size;
+	};
+
+	struct Track
+	{
+		std::string name;
+		std::string bitrate;
+		unsigned long long data_offset;
+		unsigned long long data_size;
+		std::vector<Fragment> fragments;
+	};
+
+	// What the packer needs to know about a track stored as a separate file
+	struct TrackSource
+	{
+		std::string name;
+		std::string bitrate;
+		Poco::Path source_file;
+		std::vector<Fragment> fragments;
+	};
+
+	// Maps the archive read-only and parses the header and index, throws Poco::DataFormatException if it's invalid
+	explicit EpisodeArchive(const Poco::Path& path);
+
+	[[nodiscard]] const Poco::Path& path() const { return path_; }
+	[[nodiscard]] const Poco::Timestamp& lastModified() const { return last_modified_; }
+	[[nodiscard]] const std::vector<Track>& tracks() const { return tracks_; }
+
+	[[nodiscard]] std::string_view clientManifest() const { return client_manifest_; }
+	[[nodiscard]] std::string_view serverManifest() const { return server_manifest_; }
+
+	// Bytes at an absolute archive offset, empty if the range is outside the archive
+	[[nodiscard]] std::string_view bytes(unsigned long long offset, unsigned long long size) const;
+
+	static void write(const Poco::Path& path, const std::string& server_manifest, const std::string& client_manifest,
+	                  const std::vector<TrackSource>& tracks);
+
+private:
+	Poco::Path path_;
+	Poco::Timestamp last_modified_;
+	Poco::SharedMemory mapping_;
+	std::string_view client_manifest_;
+	std::string_view server_manifest_;
+	std::vector<Track> tracks_;
+};
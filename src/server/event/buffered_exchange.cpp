@@ -0,0 +1,117 @@
+#include "pch.hpp"
+#include "buffered_exchange.hpp"
+
+using Poco::Net::HTTPServerParams;
+using Poco::Net::HTTPServerResponse;
+using Poco::Net::SocketAddress;
+
+BufferedServerRequest::BufferedServerRequest(std::istream& head, BufferedServerResponse& response,
+                                             SocketAddress client_address, SocketAddress server_address,
+                                             HTTPServerParams::Ptr params) :
+	response_(response),
+	client_address_(std::move(client_address)),
+	server_address_(std::move(server_address)),
+	params_(std::move(params))
+{
+	read(head);
+	response_.setVersion(getVersion());
+}
+
+HTTPServerResponse& BufferedServerRequest::response() const
+{
+	return response_;
+}
+
+void BufferedServerResponse::sendContinue()
+{
+	// The whole request body is buffered before the handler runs, nobody is waiting for 100 Continue
+}
+
+std::ostream& BufferedServerResponse::send()
+{
+	poco_assert(!sent_);
+
+	sent_ = true;
+	return body_;
+}
+
+void BufferedServerResponse::sendFile(const std::string& path, const std::string& media_type)
+{
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file)
+		throw Poco::OpenFileException(path);
+
+	setContentType(media_type);
+	send() << file.rdbuf();
+}
+
+void BufferedServerResponse::sendBuffer(const void* buffer, const std::size_t length)
+{
+	setContentLength(static_cast<std::streamsize>(length));
+	send().write(static_cast<const char*>(buffer), static_cast<std::streamsize>(length));
+}
+
+void BufferedServerResponse::sendFileRange(const std::string& path, const unsigned long long offset,
+                                           const unsigned long long length)
+{
+	file_body_ = std::make_unique<FileTransmission>(path, offset, length);
+	send();
+}
+
+void BufferedServerResponse::redirect(const std::string& uri, const HTTPStatus status)
+{
+	setContentLength(0);
+	set("Location", uri);
+	setStatusAndReason(status);
+	send();
+}
+
+void BufferedServerResponse::requireAuthentication(const std::string& realm)
+{
+	setContentLength(0);
+	set("WWW-Authenticate", "Basic realm=\"" + realm + "\"");
+	setStatusAndReason(HTTP_UNAUTHORIZED);
+	send();
+}
+
+std::string BufferedServerResponse::serialize(const bool keep_alive, const bool head_only)
+{
+	const std::string body = std::move(body_).str();
+
+	// Handlers that forward upstream headers may have copied the CDN's framing, ours is always a plain body
+	erase("Transfer-Encoding");
+	const unsigned long long contentLength = file_body_ ? file_body_->remaining() : body.size();
+	setContentLength(static_cast<std::streamsize>(contentLength));
+	setKeepAlive(keep_alive);
+
+	std::ostringstream head;
+	write(head);
+
+	std::string message = std::move(head).str();
+
+	if (head_only)
+		file_body_.reset();
+	else
+		message.append(body);
+
+	return message;
+}
+
+bool BufferedServerResponse::defer()
+{
+	if (!completion_handler_)
+		return false;
+
+	deferred_ = true;
+	return true;
+}
+
+void BufferedServerResponse::complete()
+{
+	poco_assert(deferred_);
+
+	// Moved out first, this response may already be gone by the time the handler returns
+	const auto handler = std::exchange(completion_handler_, {});
+	handler();
+}
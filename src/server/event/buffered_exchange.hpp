@@ -0,0 +1,72 @@
+#pragma once
+
+#include "../file_transmission.hpp"
+
+class BufferedServerResponse;
+
+// Request parsed by the event loop, handed to the regular request handlers on a worker thread
+class BufferedServerRequest final : public Poco::Net::HTTPServerRequest
+{
+public:
+	// head holds the request line and headers, throws Poco::Net::MessageException if they are malformed
+	BufferedServerRequest(std::istream& head, BufferedServerResponse& response,
+	                      Poco::Net::SocketAddress client_address, Poco::Net::SocketAddress server_address,
+	                      Poco::Net::HTTPServerParams::Ptr params);
+
+	void setBody(std::string body) { body_.str(std::move(body)); }
+
+	std::istream& stream() override { return body_; }
+	[[nodiscard]] const Poco::Net::SocketAddress& clientAddress() const override { return client_address_; }
+	[[nodiscard]] const Poco::Net::SocketAddress& serverAddress() const override { return server_address_; }
+	[[nodiscard]] const Poco::Net::HTTPServerParams& serverParams() const override { return *params_; }
+	[[nodiscard]] Poco::Net::HTTPServerResponse& response() const override;
+	[[nodiscard]] bool secure() const override { return false; }
+
+private:
+	std::istringstream body_;
+	BufferedServerResponse& response_;
+	Poco::Net::SocketAddress client_address_;
+	Poco::Net::SocketAddress server_address_;
+	Poco::Net::HTTPServerParams::Ptr params_;
+};
+
+// Collects status, headers and body in memory, the event loop writes them out without blocking
+class BufferedServerResponse final : public Poco::Net::HTTPServerResponse
+{
+public:
+	BufferedServerResponse() = default;
+
+	void sendContinue() override;
+	std::ostream& send() override;
+	void sendFile(const std::string& path, const std::string& media_type) override;
+	void sendBuffer(const void* buffer, std::size_t length) override;
+	void redirect(const std::string& uri, HTTPStatus status) override;
+	void requireAuthentication(const std::string& realm) override;
+	[[nodiscard]] bool sent() const override { return sent_; }
+
+	// The body is length bytes of the file at offset, the event loop sends them straight from the file after the head
+	void sendFileRange(const std::string& path, unsigned long long offset, unsigned long long length);
+
+	// Status line, headers and (unless head_only) body, ready to go on the wire
+	[[nodiscard]] std::string serialize(bool keep_alive, bool head_only);
+
+	// Rest of the body after serialize(), if it's a file range
+	[[nodiscard]] std::unique_ptr<FileTransmission> takeFileBody() { return std::move(file_body_); }
+
+	// Set by the server before the handler runs, lets the handler finish the response after it returned
+	void setCompletionHandler(std::function<void()> handler) { completion_handler_ = std::move(handler); }
+
+	// The handler finishes the response later on another thread, false if the server doesn't support that
+	bool defer();
+	[[nodiscard]] bool deferred() const { return deferred_; }
+
+	// Hands a deferred response back to the server, which may destroy the request, response and handler right away
+	void complete();
+
+private:
+	std::ostringstream body_;
+	std::unique_ptr<FileTransmission> file_body_;
+	bool sent_ = false;
+	bool deferred_ = false;
+	std::function<void()> completion_handler_;
+};
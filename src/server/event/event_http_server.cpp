@@ -0,0 +1,674 @@
+#include "pch.hpp"
+#include "event_http_server.hpp"
+
+#include "buffered_exchange.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <ranges>
+
+#include <Poco/Net/PollSet.h>
+#include <Poco/Net/StreamSocket.h>
+
+using Poco::AutoPtr;
+using Poco::Logger;
+using Poco::Thread;
+using Poco::Timespan;
+using Poco::Timestamp;
+using Poco::Net::HTTPRequest;
+using Poco::Net::HTTPRequestHandler;
+using Poco::Net::HTTPRequestHandlerFactory;
+using Poco::Net::HTTPResponse;
+using Poco::Net::HTTPServerParams;
+using Poco::Net::PollSet;
+using Poco::Net::ServerSocket;
+using Poco::Net::Socket;
+using Poco::Net::SocketAddress;
+using Poco::Net::StreamSocket;
+
+namespace
+{
+	constexpr std::size_t READ_BUFFER_SIZE = 64 * 1024;
+	constexpr std::size_t MAX_HEAD_SIZE = 16 * 1024;
+	constexpr std::size_t MAX_BODY_SIZE = 1024 * 1024;
+	constexpr long POLL_INTERVAL_MS = 1000;
+
+	std::string emptyResponse(const HTTPResponse::HTTPStatus status)
+	{
+		HTTPResponse response(status);
+		response.setContentLength(0);
+		response.setKeepAlive(false);
+
+		std::ostringstream message;
+		response.write(message);
+		return message.str();
+	}
+}
+
+struct EventHttpServer::Connection
+{
+	explicit Connection(const StreamSocket& stream_socket) : socket(stream_socket)
+	{
+	}
+
+	StreamSocket socket;
+	SocketAddress client_address;
+	SocketAddress server_address;
+
+	std::string input;
+	std::string output;
+	std::size_t output_offset = 0;
+	std::unique_ptr<FileTransmission> file_output; // sent after output
+
+	bool busy = false; // the current request is being handled
+	bool polling_write = false;
+	bool close_after_write = false;
+	bool closed = false;
+	int requests_served = 0;
+	Timestamp last_activity;
+};
+
+class EventHttpServer::Exchange final : public Poco::RefCountedObject
+{
+public:
+	Exchange(std::shared_ptr<EventLoop> event_loop, std::shared_ptr<Connection> request_connection) :
+		loop(std::move(event_loop)),
+		connection(std::move(request_connection))
+	{
+	}
+
+	// Shared, a deferred response may be completed after the server is gone
+	std::shared_ptr<EventLoop> loop;
+	std::shared_ptr<Connection> connection;
+	BufferedServerResponse response;
+	std::unique_ptr<BufferedServerRequest> request;
+	std::unique_ptr<HTTPRequestHandler> handler;
+	std::atomic<int> handler_users = 2; // the worker running it and the completion, whichever finishes last frees it
+	bool keep_alive = false;
+	bool head_only = false;
+	bool failed = false;
+};
+
+class EventHttpServer::EventLoop final : public Poco::Runnable, public std::enable_shared_from_this<EventLoop>
+{
+public:
+	EventLoop(EventHttpServer& server, const bool accepts) : server_(server), accepts_(accepts)
+	{
+		read_buffer_.resize(READ_BUFFER_SIZE);
+	}
+
+	void start()
+	{
+		running_ = true;
+
+		if (accepts_)
+			poll_set_.add(server_.socket_, PollSet::POLL_READ);
+
+		thread_.start(*this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard lock(pending_mutex_);
+			running_ = false;
+		}
+
+		poll_set_.wakeUp();
+		thread_.join();
+	}
+
+	// Thread-safe, the connection is registered by the loop's own thread
+	void adopt(const StreamSocket& socket)
+	{
+		{
+			std::lock_guard lock(pending_mutex_);
+			adopted_.push_back(socket);
+		}
+
+		poll_set_.wakeUp();
+	}
+
+	// Thread-safe, called once a response is ready, the loop releases the request when it picks the response up.
+	// Responses completed after the loop stopped are dropped.
+	void complete(AutoPtr<Exchange> request, std::string data, std::unique_ptr<FileTransmission> file,
+	              const bool close)
+	{
+		{
+			std::lock_guard lock(pending_mutex_);
+
+			if (running_)
+				completed_.push_back({std::move(request), std::move(data), std::move(file), close});
+		}
+
+		poll_set_.wakeUp();
+	}
+
+	void run() override
+	{
+		static Logger& logger = Logger::get("Network");
+
+		while (running_)
+		{
+			PollSet::SocketModeMap ready;
+
+			try
+			{
+				ready = poll_set_.poll(Timespan(POLL_INTERVAL_MS * 1000));
+			}
+			catch (Poco::Exception& ex)
+			{
+				logger.error("Event loop poll failed (%s)", ex.displayText());
+				continue;
+			}
+
+			processPending();
+
+			for (const auto& [socket, mode] : ready)
+			{
+				if (accepts_ && socket == server_.socket_)
+				{
+					acceptConnection();
+					continue;
+				}
+
+				const auto it = connections_.find(socket);
+				if (it == connections_.end())
+					continue;
+
+				const std::shared_ptr<Connection> connection = it->second;
+
+				if (mode & PollSet::POLL_ERROR)
+				{
+					close(connection);
+					continue;
+				}
+
+				if (mode & PollSet::POLL_READ)
+					receive(connection);
+
+				if (mode & PollSet::POLL_WRITE && !connection->closed)
+					flush(connection);
+			}
+
+			closeIdle();
+		}
+
+		while (!connections_.empty())
+			close(connections_.begin()->second);
+
+		// Completions hold their loop through the request, don't let them keep each other alive
+		std::vector<Completion> completed;
+
+		{
+			std::lock_guard lock(pending_mutex_);
+			completed.swap(completed_);
+		}
+	}
+
+private:
+	struct Completion
+	{
+		AutoPtr<Exchange> request;
+		std::string data;
+		std::unique_ptr<FileTransmission> file;
+		bool close;
+	};
+
+	EventHttpServer& server_;
+	bool accepts_;
+	PollSet poll_set_;
+	Thread thread_;
+	std::atomic<bool> running_ = false;
+	std::vector<char> read_buffer_;
+	Timestamp last_idle_check_;
+
+	std::mutex pending_mutex_;
+	std::vector<StreamSocket> adopted_;
+	std::vector<Completion> completed_;
+
+	std::map<Socket, std::shared_ptr<Connection>> connections_;
+
+	void acceptConnection() const
+	{
+		try
+		{
+			// The listening socket is level-triggered, one accept per wake-up keeps it from ever blocking
+			server_.nextLoop().adopt(server_.socket_.acceptConnection());
+		}
+		catch (Poco::Exception& ex)
+		{
+			Logger::get("Network").warning("Failed to accept connection (%s)", ex.displayText());
+		}
+	}
+
+	void processPending()
+	{
+		std::vector<StreamSocket> adopted;
+		std::vector<Completion> completed;
+
+		{
+			std::lock_guard lock(pending_mutex_);
+			adopted.swap(adopted_);
+			completed.swap(completed_);
+		}
+
+		for (auto& socket : adopted)
+		{
+			try
+			{
+				socket.setBlocking(false);
+				socket.setNoDelay(true);
+
+				const auto connection = std::make_shared<Connection>(socket);
+				connection->client_address = socket.peerAddress();
+				connection->server_address = socket.address();
+
+				connections_[socket] = connection;
+				poll_set_.add(socket, PollSet::POLL_READ);
+			}
+			catch (Poco::Exception&)
+			{
+				// Peer went away before we got to it
+				socket.close();
+			}
+		}
+
+		for (auto& [request, data, file, close] : completed)
+		{
+			const std::shared_ptr<Connection>& connection = request->connection;
+
+			// The client may have disconnected while its request was being handled
+			if (connection->closed)
+				continue;
+
+			connection->busy = false;
+			connection->close_after_write = close;
+			++connection->requests_served;
+
+			if (connection->output.empty())
+				connection->output = std::move(data);
+			else
+				connection->output.append(data);
+
+			connection->file_output = std::move(file);
+
+			flush(connection);
+		}
+	}
+
+	void receive(const std::shared_ptr<Connection>& connection)
+	{
+		for (;;)
+		{
+			int received;
+
+			try
+			{
+				received = connection->socket.receiveBytes(read_buffer_.data(), static_cast<int>(read_buffer_.size()));
+			}
+			catch (Poco::Exception&)
+			{
+				close(connection);
+				return;
+			}
+
+			if (received == 0)
+			{
+				close(connection);
+				return;
+			}
+
+			// Would block, everything available has been read
+			if (received < 0)
+				break;
+
+			connection->input.append(read_buffer_.data(), received);
+
+			if (static_cast<std::size_t>(received) < read_buffer_.size())
+				break;
+		}
+
+		connection->last_activity.update();
+
+		if (connection->input.size() > MAX_HEAD_SIZE + MAX_BODY_SIZE)
+		{
+			close(connection);
+			return;
+		}
+
+		dispatchNext(connection);
+	}
+
+	// Starts the next buffered request, one at a time per connection so responses stay in order
+	void dispatchNext(const std::shared_ptr<Connection>& connection)
+	{
+		if (connection->busy || connection->close_after_write || !connection->output.empty() || connection->file_output)
+			return;
+
+		const auto headEnd = connection->input.find("\r\n\r\n");
+
+		if (headEnd == std::string::npos)
+		{
+			if (connection->input.size() > MAX_HEAD_SIZE)
+				reject(connection, HTTPResponse::HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+
+			return;
+		}
+
+		const AutoPtr exchange = new Exchange(shared_from_this(), connection);
+
+		try
+		{
+			std::istringstream head(connection->input.substr(0, headEnd + 4));
+			exchange->request = std::make_unique<BufferedServerRequest>(
+				head, exchange->response, connection->client_address, connection->server_address,
+				server_.params_);
+		}
+		catch (Poco::Exception&)
+		{
+			reject(connection, HTTPResponse::HTTP_BAD_REQUEST);
+			return;
+		}
+
+		BufferedServerRequest& request = *exchange->request;
+
+		if (request.getChunkedTransferEncoding())
+		{
+			reject(connection, HTTPResponse::HTTP_NOT_IMPLEMENTED);
+			return;
+		}
+
+		const auto contentLength = request.hasContentLength() ? request.getContentLength64() : 0;
+
+		if (contentLength < 0 || static_cast<std::size_t>(contentLength) > MAX_BODY_SIZE)
+		{
+			reject(connection, HTTPResponse::HTTP_REQUEST_ENTITY_TOO_LARGE);
+			return;
+		}
+
+		const std::size_t requestSize = headEnd + 4 + static_cast<std::size_t>(contentLength);
+
+		// Wait for the rest of the body
+		if (connection->input.size() < requestSize)
+			return;
+
+		request.setBody(connection->input.substr(headEnd + 4, static_cast<std::size_t>(contentLength)));
+		connection->input.erase(0, requestSize);
+
+		const int maxRequests = server_.params_->getMaxKeepAliveRequests();
+
+		exchange->keep_alive = running_ && server_.params_->getKeepAlive() && request.getKeepAlive() &&
+			(maxRequests <= 0 || connection->requests_served + 1 < maxRequests);
+		exchange->head_only = request.getMethod() == HTTPRequest::HTTP_HEAD;
+
+		connection->busy = true;
+
+		if (!server_.dispatch(exchange))
+		{
+			connection->busy = false;
+			reject(connection, HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+		}
+	}
+
+	void reject(const std::shared_ptr<Connection>& connection, const HTTPResponse::HTTPStatus status)
+	{
+		connection->input.clear();
+		connection->output = emptyResponse(status);
+		connection->close_after_write = true;
+		flush(connection);
+	}
+
+	// Writes as much as the socket takes, the rest goes out when the socket becomes writable again
+	void flush(const std::shared_ptr<Connection>& connection)
+	{
+		while (connection->output_offset < connection->output.size())
+		{
+			const std::size_t remaining = connection->output.size() - connection->output_offset;
+			int sent;
+
+			try
+			{
+				sent = connection->socket.sendBytes(connection->output.data() + connection->output_offset,
+				                                    static_cast<int>(std::min<std::size_t>(remaining, INT_MAX)));
+			}
+			catch (Poco::Exception&)
+			{
+				close(connection);
+				return;
+			}
+
+			if (sent < 0)
+			{
+				waitWritable(connection);
+				return;
+			}
+
+			connection->output_offset += static_cast<std::size_t>(sent);
+		}
+
+		// Fragments can be megabytes, don't keep that much memory around per idle connection
+		std::string().swap(connection->output);
+		connection->output_offset = 0;
+
+		// Local fragments go straight from the file after the head
+		while (connection->file_output && connection->file_output->remaining() > 0)
+		{
+			long long sent;
+
+			try
+			{
+				sent = connection->file_output->sendTo(connection->socket);
+			}
+			catch (Poco::Exception& ex)
+			{
+				Logger::get("Network").warning("Failed to send file range (%s)", ex.displayText());
+				close(connection);
+				return;
+			}
+
+			if (sent < 0)
+			{
+				waitWritable(connection);
+				return;
+			}
+		}
+
+		connection->file_output.reset();
+		connection->last_activity.update();
+
+		if (connection->close_after_write)
+		{
+			close(connection);
+			return;
+		}
+
+		if (connection->polling_write)
+		{
+			poll_set_.update(connection->socket, PollSet::POLL_READ);
+			connection->polling_write = false;
+		}
+
+		// A pipelined request may already be waiting in the input buffer
+		dispatchNext(connection);
+	}
+
+	void waitWritable(const std::shared_ptr<Connection>& connection)
+	{
+		if (connection->polling_write)
+			return;
+
+		poll_set_.update(connection->socket, PollSet::POLL_READ | PollSet::POLL_WRITE);
+		connection->polling_write = true;
+	}
+
+	void close(const std::shared_ptr<Connection>& connection)
+	{
+		if (connection->closed)
+			return;
+
+		connection->closed = true;
+		connections_.erase(connection->socket);
+
+		try
+		{
+			poll_set_.remove(connection->socket);
+			connection->socket.close();
+		}
+		catch (Poco::Exception&)
+		{
+			// Already gone
+		}
+	}
+
+	void closeIdle()
+	{
+		// Once a second is precise enough for timeouts measured in seconds
+		if (!last_idle_check_.isElapsed(POLL_INTERVAL_MS * 1000))
+			return;
+
+		last_idle_check_.update();
+
+		const Timestamp::TimeDiff timeout = server_.params_->getKeepAliveTimeout().totalMicroseconds();
+		std::vector<std::shared_ptr<Connection>> expired;
+
+		for (const auto& connection : connections_ | std::views::values)
+		{
+			if (!connection->busy && connection->last_activity.isElapsed(timeout))
+				expired.push_back(connection);
+		}
+
+		for (const auto& connection : expired)
+			close(connection);
+	}
+};
+
+EventHttpServer::EventHttpServer(HTTPRequestHandlerFactory::Ptr factory, const ServerSocket& socket,
+                                 HTTPServerParams::Ptr params, const int loop_threads, Dispatcher dispatcher) :
+	factory_(std::move(factory)),
+	socket_(socket),
+	params_(std::move(params)),
+	dispatcher_(std::move(dispatcher))
+{
+	for (int i = 0; i < std::max(1, loop_threads); ++i)
+		loops_.push_back(std::make_shared<EventLoop>(*this, i == 0));
+}
+
+EventHttpServer::~EventHttpServer()
+{
+	try
+	{
+		stop();
+	}
+	catch (...)
+	{
+		poco_unexpected();
+	}
+}
+
+void EventHttpServer::start()
+{
+	if (running_)
+		return;
+
+	running_ = true;
+
+	for (const auto& loop : loops_)
+		loop->start();
+}
+
+void EventHttpServer::stop()
+{
+	if (!running_)
+		return;
+
+	running_ = false;
+
+	// Handlers still queued or running complete into stopped loops, which drop their responses
+	for (const auto& loop : loops_)
+		loop->stop();
+}
+
+EventHttpServer::EventLoop& EventHttpServer::nextLoop()
+{
+	return *loops_[next_loop_.fetch_add(1, std::memory_order_relaxed) % loops_.size()];
+}
+
+bool EventHttpServer::dispatch(const AutoPtr<Exchange>& exchange) const
+{
+	// The task owns the factory too, it may run after the server is gone
+	return dispatcher_(*exchange->request, [factory = factory_, exchange](const HandlerCreator& create)
+	{
+		process(factory, *exchange, create);
+	});
+}
+
+void EventHttpServer::process(const HTTPRequestHandlerFactory::Ptr& factory, Exchange& exchange,
+                              const HandlerCreator& create)
+{
+	static Logger& logger = Logger::get("Network");
+
+	// Released by respond(), which runs on another thread when the handler defers its response
+	exchange.duplicate();
+	exchange.response.setCompletionHandler([&exchange] { respond(exchange); });
+
+	try
+	{
+		exchange.handler.reset(create ? create() : factory->createRequestHandler(*exchange.request));
+
+		if (exchange.handler)
+		{
+			exchange.handler->handleRequest(*exchange.request, exchange.response);
+		}
+		else
+		{
+			exchange.response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+			exchange.response.send();
+		}
+	}
+	catch (Poco::Exception& ex)
+	{
+		logger.error("Unhandled exception while handling %s (%s)", exchange.request->getURI(), ex.displayText());
+		exchange.failed = true;
+	}
+	catch (std::exception& ex)
+	{
+		logger.error("Unhandled exception while handling %s (%s)", exchange.request->getURI(),
+		             std::string(ex.what()));
+		exchange.failed = true;
+	}
+
+	// Read before letting go of the handler, the completion may already have run on another thread. The exchange
+	// itself stays alive until the task that runs this is gone.
+	const bool deferred = exchange.response.deferred();
+	releaseHandler(exchange);
+
+	// The handler completes it once its upstream fetch is done
+	if (deferred)
+		return;
+
+	respond(exchange);
+}
+
+void EventHttpServer::releaseHandler(Exchange& exchange)
+{
+	// Freed on a worker or upstream thread it goes back to that thread's handler pool rather than the event loop's
+	if (exchange.handler_users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		exchange.handler.reset();
+}
+
+void EventHttpServer::respond(Exchange& exchange)
+{
+	// A deferred response can be completed while the handler is still on the worker's stack
+	releaseHandler(exchange);
+
+	const bool keepAlive = exchange.keep_alive && !exchange.failed;
+	std::string data = exchange.failed
+		                   ? emptyResponse(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR)
+		                   : exchange.response.serialize(keepAlive, exchange.head_only);
+	std::unique_ptr<FileTransmission> file = exchange.failed ? nullptr : exchange.response.takeFileBody();
+
+	// Takes over the reference from process(), so this has to be the last use of exchange
+	const std::shared_ptr<EventLoop> loop = exchange.loop;
+	loop->complete(AutoPtr(&exchange), std::move(data), std::move(file), !keepAlive);
+}
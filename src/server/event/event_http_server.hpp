@@ -0,0 +1,52 @@
+#pragma once
+
+#include <functional>
+
+// Alternative to Poco::Net::HTTPServer with keep-alive connections multiplexed over a few event-loop threads
+// (Poco::Net::PollSet, epoll on Linux). Loops only parse requests and write responses without blocking,
+// the request handlers themselves run on the executors the dispatcher picks since they may still block on disk.
+class EventHttpServer
+{
+public:
+	// Creates the handler of a request on the thread that runs it
+	using HandlerCreator = std::function<Poco::Net::HTTPRequestHandler*()>;
+
+	// Queues task, which runs the handler of a parsed request, on an executor. Returning false answers 503. The task
+	// is given a creator for the handler (the dispatcher may already know where the request goes), or an empty one
+	// to create it with the factory.
+	using Dispatcher = std::function<bool(const Poco::Net::HTTPServerRequest& request,
+	                                      std::function<void(HandlerCreator create)> task)>;
+
+	EventHttpServer(Poco::Net::HTTPRequestHandlerFactory::Ptr factory, const Poco::Net::ServerSocket& socket,
+	                Poco::Net::HTTPServerParams::Ptr params, int loop_threads, Dispatcher dispatcher);
+	~EventHttpServer();
+
+	EventHttpServer(const EventHttpServer&) = delete;
+	EventHttpServer& operator=(const EventHttpServer&) = delete;
+
+	void start();
+	void stop();
+
+private:
+	struct Connection;
+	class EventLoop;
+	class Exchange;
+
+	Poco::Net::HTTPRequestHandlerFactory::Ptr factory_;
+	Poco::Net::ServerSocket socket_;
+	Poco::Net::HTTPServerParams::Ptr params_;
+
+	std::vector<std::shared_ptr<EventLoop>> loops_;
+	std::atomic<std::size_t> next_loop_ = 0;
+
+	Dispatcher dispatcher_;
+	bool running_ = false;
+
+	EventLoop& nextLoop();
+	bool dispatch(const Poco::AutoPtr<Exchange>& exchange) const;
+
+	static void process(const Poco::Net::HTTPRequestHandlerFactory::Ptr& factory, Exchange& exchange,
+	                    const HandlerCreator& create);
+	static void releaseHandler(Exchange& exchange);
+	static void respond(Exchange& exchange);
+};
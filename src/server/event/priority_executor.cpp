@@ -0,0 +1,124 @@
+#include "pch.hpp"
+#include "priority_executor.hpp"
+
+#include <algorithm>
+
+using Poco::Clock;
+using Poco::Logger;
+
+PriorityExecutor::PriorityExecutor(std::string name, const int threads, const std::size_t max_queued) :
+	name_(std::move(name)),
+	max_queued_(std::max<std::size_t>(1, max_queued))
+{
+	for (int i = 0; i < std::max(1, threads); ++i)
+		threads_.emplace_back(&PriorityExecutor::run, this);
+}
+
+PriorityExecutor::~PriorityExecutor()
+{
+	stop();
+}
+
+bool PriorityExecutor::submit(const Priority priority, std::function<void()> task)
+{
+	{
+		std::lock_guard lock(mutex_);
+
+		if (stopping_ || statistics_.queued >= admissionLimit(priority))
+		{
+			++statistics_.rejected;
+			return false;
+		}
+
+		queues_[static_cast<std::size_t>(priority)].push_back({std::move(task), Clock()});
+
+		++statistics_.submitted;
+		++statistics_.queued;
+		statistics_.peak_queued = std::max(statistics_.peak_queued, statistics_.queued);
+	}
+
+	available_.notify_one();
+	return true;
+}
+
+void PriorityExecutor::stop()
+{
+	// Dropped outside the lock, tasks may own arbitrary state
+	std::array<std::deque<QueuedTask>, static_cast<std::size_t>(Priority::COUNT)> dropped;
+
+	{
+		std::lock_guard lock(mutex_);
+
+		if (stopping_)
+			return;
+
+		stopping_ = true;
+		dropped.swap(queues_);
+		statistics_.queued = 0;
+	}
+
+	available_.notify_all();
+
+	for (auto& thread : threads_)
+		thread.join();
+}
+
+PriorityExecutor::Statistics PriorityExecutor::statistics() const
+{
+	std::lock_guard lock(mutex_);
+	return statistics_;
+}
+
+void PriorityExecutor::run()
+{
+	for (;;)
+	{
+		QueuedTask task;
+
+		{
+			std::unique_lock lock(mutex_);
+			available_.wait(lock, [this] { return stopping_ || statistics_.queued > 0; });
+
+			if (stopping_)
+				return;
+
+			auto& queue = *std::ranges::find_if(queues_, [](const auto& candidate) { return !candidate.empty(); });
+			task = std::move(queue.front());
+			queue.pop_front();
+
+			const Clock::ClockDiff wait = task.queued_at.elapsed();
+			--statistics_.queued;
+			statistics_.total_wait += wait;
+			statistics_.max_wait = std::max(statistics_.max_wait, wait);
+		}
+
+		try
+		{
+			task.run();
+		}
+		catch (Poco::Exception& ex)
+		{
+			Logger::get("Core").error("Unhandled exception in %s executor (%s)", name_, ex.displayText());
+		}
+		catch (std::exception& ex)
+		{
+			Logger::get("Core").error("Unhandled exception in %s executor (%s)", name_, std::string(ex.what()));
+		}
+
+		std::lock_guard lock(mutex_);
+		++statistics_.completed;
+	}
+}
+
+std::size_t PriorityExecutor::admissionLimit(const Priority priority) const
+{
+	switch (priority)
+	{
+	case Priority::HIGH:
+		return max_queued_;
+	case Priority::NORMAL:
+		return std::max<std::size_t>(1, max_queued_ * 3 / 4);
+	default:
+		return std::max<std::size_t>(1, max_queued_ / 2);
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+// Fixed pool of threads running queued tasks in priority order. Admission is priority-aware as well: lower
+// priorities may only fill part of the queue, so a backlog of them can't lock out more urgent work.
+class PriorityExecutor
+{
+public:
+	enum class Priority
+	{
+		HIGH, // admitted while the queue is not full
+		NORMAL, // admitted while the queue is less than 3/4 full
+		LOW, // admitted while the queue is less than half full
+		COUNT
+	};
+
+	struct Statistics
+	{
+		std::size_t queued = 0;
+		std::size_t peak_queued = 0;
+		unsigned long long submitted = 0;
+		unsigned long long rejected = 0;
+		unsigned long long completed = 0;
+		Poco::Clock::ClockDiff total_wait = 0; // time tasks spent queued, microseconds
+		Poco::Clock::ClockDiff max_wait = 0;
+	};
+
+	PriorityExecutor(std::string name, int threads, std::size_t max_queued);
+	~PriorityExecutor();
+
+	PriorityExecutor(const PriorityExecutor&) = delete;
+	PriorityExecutor& operator=(const PriorityExecutor&) = delete;
+
+	// Returns false if the task wasn't admitted, it's destroyed without running then
+	bool submit(Priority priority, std::function<void()> task);
+
+	// Waits for running tasks, queued ones are dropped
+	void stop();
+
+	[[nodiscard]] const std::string& name() const { return name_; }
+	[[nodiscard]] int threads() const { return static_cast<int>(threads_.size()); }
+	[[nodiscard]] std::size_t maxQueued() const { return max_queued_; }
+	[[nodiscard]] Statistics statistics() const;
+
+private:
+	struct QueuedTask
+	{
+		std::function<void()> run;
+		Poco::Clock queued_at;
+	};
+
+	std::string name_;
+	std::size_t max_queued_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable available_;
+	std::array<std::deque<QueuedTask>, static_cast<std::size_t>(Priority::COUNT)> queues_;
+	Statistics statistics_;
+	bool stopping_ = false;
+
+	std::vector<std::thread> threads_;
+
+	void run();
+	[[nodiscard]] std::size_t admissionLimit(Priority priority) const;
+};
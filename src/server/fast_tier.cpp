@@ -0,0 +1,323 @@
+#include "pch.hpp"
+#include "fast_tier.hpp"
+
+#include "fragment_io.hpp"
+
+#include <algorithm>
+#include <limits>
+
+using Poco::File;
+using Poco::Logger;
+using Poco::Path;
+using Poco::Timespan;
+using Poco::Timestamp;
+
+namespace
+{
+	const Timespan DECAY_INTERVAL(1 * Timespan::MINUTES);
+
+	// Readers pick the copy when they look up a fragment, they're long done with it by then
+	const Timespan EVICTION_GRACE(30 * Timespan::SECONDS);
+
+	bool isCurrentCopy(const std::string& path, const unsigned long long size, const Timestamp& source_modified)
+	{
+		const File file(path);
+		return file.exists() && file.getSize() == size && file.getLastModified() >= source_modified;
+	}
+
+	void removeFile(const std::string& path)
+	{
+		try
+		{
+			if (File file(path); file.exists())
+				file.remove();
+		}
+		catch (Poco::FileException&)
+		{
+			// Windows doesn't delete files that are still open, the next eviction pass retries
+		}
+	}
+}
+
+FastTier::FastTier(const Path& path, const unsigned long long budget, const unsigned int promote_after,
+                   FragmentIo& fragment_io) :
+	path_(path),
+	budget_(budget),
+	promote_after_(std::max(promote_after, 1u)),
+	fragment_io_(fragment_io)
+{
+	File(path_).createDirectories();
+	worker_ = std::thread([this] { run(); });
+}
+
+FastTier::~FastTier()
+{
+	{
+		std::lock_guard lock(queue_mutex_);
+		stopping_ = true;
+		queued_.notify_all();
+	}
+
+	worker_.join();
+}
+
+FastTier::Track* FastTier::add(const std::string& episode_id, const Path& source_file,
+                               const Timestamp& source_modified)
+{
+	Path copyPath(path_);
+	copyPath.pushDirectory(episode_id);
+	copyPath.setFileName(source_file.getFileName());
+
+	std::lock_guard lock(tracks_mutex_);
+	Track& track = tracks_.emplace_back();
+	track.source_path = source_file.toString();
+	track.path = copyPath.toString();
+	track.size = File(source_file).getSize();
+	track.source_modified = source_modified;
+
+	// Left by an earlier run, the worker takes it back if it still fits
+	if (isCurrentCopy(track.path, track.size, source_modified))
+	{
+		track.state = Track::State::QUEUED;
+
+		std::lock_guard queueLock(queue_mutex_);
+		queue_.push_back(&track);
+		queued_.notify_one();
+	}
+
+	return &track;
+}
+
+void FastTier::touch(Track& track)
+{
+	track.last_play.store(Timestamp().epochMicroseconds(), std::memory_order_relaxed);
+
+	if (track.plays.fetch_add(1, std::memory_order_relaxed) + 1 < promote_after_)
+		return;
+
+	// An evicted copy that's played again is taken back before it's deleted
+	Track::State state = track.state.load(std::memory_order_relaxed);
+
+	if ((state != Track::State::COLD && state != Track::State::EVICTING) ||
+		!track.state.compare_exchange_strong(state, Track::State::QUEUED))
+		return;
+
+	std::lock_guard lock(queue_mutex_);
+	queue_.push_back(&track);
+	queued_.notify_one();
+}
+
+FastTier::Statistics FastTier::statistics() const
+{
+	Statistics stats;
+	stats.budget = budget_;
+	stats.used = used_.load(std::memory_order_relaxed);
+	stats.hot_tracks = hot_tracks_.load(std::memory_order_relaxed);
+	stats.promotions = promotions_.load(std::memory_order_relaxed);
+	stats.evictions = evictions_.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void FastTier::run()
+{
+	Logger& logger = Logger::get("OfflineStreaming");
+	Timestamp lastDecay;
+
+	while (true)
+	{
+		Track* track = nullptr;
+
+		{
+			std::unique_lock lock(queue_mutex_);
+			queued_.wait_for(lock, std::chrono::seconds(1), [this] { return stopping_ || !queue_.empty(); });
+
+			if (stopping_)
+				return;
+
+			if (!queue_.empty())
+			{
+				track = queue_.front();
+				queue_.pop_front();
+			}
+		}
+
+		try
+		{
+			if (track)
+				promote(*track);
+
+			// A smaller budget than the copies of an earlier run take up
+			makeRoom(0, std::numeric_limits<Timestamp::TimeVal>::max());
+			deleteEvicted();
+
+			if (lastDecay.isElapsed(DECAY_INTERVAL.totalMicroseconds()))
+			{
+				decay();
+				lastDecay.update();
+			}
+		}
+		catch (Poco::Exception& ex)
+		{
+			logger.warning("Fast tier maintenance failed (%s)", ex.displayText());
+		}
+	}
+}
+
+void FastTier::promote(Track& track)
+{
+	Logger& logger = Logger::get("OfflineStreaming");
+
+	if (track.state != Track::State::QUEUED)
+		return;
+
+	// Evicted copies that are played again and copies left by an earlier run don't need copying
+	const bool evicted = std::ranges::find(hot_, &track) != hot_.end();
+	const bool onDisk = evicted || isCurrentCopy(track.path, track.size, track.source_modified);
+
+	// Only copies that were played less recently make room, otherwise the track has to wait for its next chance
+	if (!makeRoom(track.size, track.last_play.load(std::memory_order_relaxed)))
+	{
+		track.plays = 0;
+
+		if (!evicted && onDisk)
+			removeFile(track.path);
+
+		track.state = evicted ? Track::State::EVICTING : Track::State::COLD;
+		return;
+	}
+
+	used_ += track.size;
+
+	if (!onDisk && !copy(track))
+	{
+		used_ -= track.size;
+		track.plays = 0;
+		track.state = Track::State::COLD;
+		return;
+	}
+
+	if (!evicted)
+		hot_.push_back(&track);
+
+	track.state.store(Track::State::HOT, std::memory_order_release);
+	++hot_tracks_;
+	++promotions_;
+
+	logger.debug("Promoted %s to the fast tier (%s of %s MB used)", track.source_path,
+	             std::to_string(used_.load() >> 20), std::to_string(budget_ >> 20));
+}
+
+bool FastTier::copy(const Track& track)
+{
+	const std::string partPath = track.path + ".part";
+
+	try
+	{
+		File(Path(track.path).parent()).createDirectories();
+
+		std::ifstream source(track.source_path, std::ios::binary);
+		std::ofstream target(partPath, std::ios::binary | std::ios::trunc);
+		std::vector<char> buffer(COPY_CHUNK_SIZE);
+		unsigned long long copied = 0;
+
+		while (source && target && !stopping())
+		{
+			source.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+			target.write(buffer.data(), source.gcount());
+			copied += static_cast<unsigned long long>(source.gcount());
+		}
+
+		target.close();
+
+		if (copied != track.size || !target)
+		{
+			if (!stopping())
+				Logger::get("OfflineStreaming").warning("Failed to copy %s to the fast tier", track.source_path);
+
+			removeFile(partPath);
+			return false;
+		}
+
+		File(partPath).renameTo(track.path);
+		return true;
+	}
+	catch (Poco::Exception& ex)
+	{
+		Logger::get("OfflineStreaming").warning("Failed to copy %s to the fast tier (%s)", track.source_path,
+		                                        ex.displayText());
+		removeFile(partPath);
+		return false;
+	}
+}
+
+bool FastTier::makeRoom(const unsigned long long size, const Timestamp::TimeVal colder_than)
+{
+	if (size > budget_)
+		return false;
+
+	while (used_ + size > budget_)
+	{
+		Track* victim = nullptr;
+
+		for (Track* candidate : hot_)
+			if (candidate->state == Track::State::HOT && candidate->last_play < colder_than &&
+				(!victim || candidate->last_play < victim->last_play))
+				victim = candidate;
+
+		if (!victim)
+			return false;
+
+		evict(*victim);
+	}
+
+	return true;
+}
+
+void FastTier::evict(Track& track)
+{
+	// Not counted anymore, the disk holds a little more than the budget until the grace period is over
+	track.state = Track::State::EVICTING;
+	track.evicted.update();
+	used_ -= track.size;
+	--hot_tracks_;
+	++evictions_;
+}
+
+void FastTier::deleteEvicted()
+{
+	std::erase_if(hot_, [this](Track* track)
+	{
+		Track::State state = Track::State::EVICTING;
+
+		if (!track->evicted.isElapsed(EVICTION_GRACE.totalMicroseconds()) ||
+			!track->state.compare_exchange_strong(state, Track::State::COLD))
+			return false;
+
+		fragment_io_.close(track->path);
+		removeFile(track->path);
+
+		if (File(track->path).exists())
+		{
+			// Played again meanwhile it's still queued, otherwise deleting is retried
+			state = Track::State::COLD;
+			track->state.compare_exchange_strong(state, Track::State::EVICTING);
+			return false;
+		}
+
+		return true;
+	});
+}
+
+void FastTier::decay()
+{
+	std::lock_guard lock(tracks_mutex_);
+
+	for (Track& track : tracks_)
+		track.plays.store(track.plays.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+}
+
+bool FastTier::stopping()
+{
+	std::lock_guard lock(queue_mutex_);
+	return stopping_;
+}
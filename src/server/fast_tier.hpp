@@ -0,0 +1,101 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+
+class FragmentIo;
+
+// Copies of the most played track files on a small fast disk (Server.FastTierPath). Fragment lookups count as plays
+// of their track; a track played often enough is copied over on a background thread and read from there until it's
+// the least recently played one and its space is needed. Play counts halve every minute, so recent viewing weighs
+// the most. Copies survive restarts, a copy that's still up to date is picked up again when its track is indexed.
+class FastTier final
+{
+public:
+	// A track file of the library that may get a fast copy, owned by the tier so the index can keep a pointer
+	struct Track
+	{
+		enum class State
+		{
+			COLD,
+			QUEUED, // for copying
+			HOT,
+			EVICTING // no longer read from, deleted once reads that picked it earlier are surely done
+		};
+
+		std::string source_path;
+		std::string path; // of the fast copy
+		unsigned long long size = 0;
+		Poco::Timestamp source_modified;
+
+		std::atomic<State> state = State::COLD;
+		std::atomic<unsigned int> plays = 0;
+		std::atomic<Poco::Timestamp::TimeVal> last_play = 0;
+		Poco::Timestamp evicted; // worker only
+
+		// The fast copy while it can be read from, nullptr otherwise
+		[[nodiscard]] const std::string* copy() const
+		{
+			return state.load(std::memory_order_acquire) == State::HOT ? &path : nullptr;
+		}
+	};
+
+	struct Statistics
+	{
+		unsigned long long budget = 0;
+		unsigned long long used = 0;
+		std::size_t hot_tracks = 0;
+		unsigned long long promotions = 0;
+		unsigned long long evictions = 0;
+	};
+
+	// Starts the worker, budget is in bytes. Copies are read through fragment_io, which is told before one is deleted.
+	FastTier(const Poco::Path& path, unsigned long long budget, unsigned int promote_after, FragmentIo& fragment_io);
+	~FastTier();
+
+	FastTier(const FastTier&) = delete;
+	FastTier& operator=(const FastTier&) = delete;
+
+	[[nodiscard]] const Poco::Path& path() const { return path_; }
+
+	// Called while indexing, the copy would be <path>/<episode>/<file name>
+	Track* add(const std::string& episode_id, const Poco::Path& source_file, const Poco::Timestamp& source_modified);
+
+	// A fragment of the track was looked up
+	void touch(Track& track);
+
+	[[nodiscard]] Statistics statistics() const;
+
+private:
+	static constexpr std::size_t COPY_CHUNK_SIZE = 1 << 20;
+
+	Poco::Path path_;
+	unsigned long long budget_;
+	unsigned int promote_after_;
+	FragmentIo& fragment_io_;
+
+	std::mutex tracks_mutex_;
+	std::deque<Track> tracks_;
+
+	std::mutex queue_mutex_;
+	std::condition_variable queued_;
+	std::deque<Track*> queue_;
+	bool stopping_ = false;
+	std::thread worker_;
+
+	// Worker only, apart from the atomics read by statistics()
+	std::vector<Track*> hot_; // HOT and EVICTING
+	std::atomic<unsigned long long> used_ = 0; // of the budget, evicted copies are no longer counted
+	std::atomic<std::size_t> hot_tracks_ = 0;
+	std::atomic<unsigned long long> promotions_ = 0;
+	std::atomic<unsigned long long> evictions_ = 0;
+
+	void run();
+	void promote(Track& track);
+	bool copy(const Track& track);
+	bool makeRoom(unsigned long long size, Poco::Timestamp::TimeVal colder_than);
+	void evict(Track& track);
+	void deleteEvicted();
+	void decay();
+	[[nodiscard]] bool stopping();
+};
@@ -0,0 +1,169 @@
+#include "pch.hpp"
+#include "file_transmission.hpp"
+
+#include <Poco/Net/StreamSocket.h>
+#include <climits>
+
+#ifdef _WIN32
+#include <Poco/UnicodeConverter.h>
+#include <mswsock.h>
+#pragma comment(lib, "mswsock.lib")
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+using Poco::IOException;
+using Poco::OpenFileException;
+using Poco::ReadFileException;
+using Poco::Net::StreamSocket;
+
+FileTransmission::FileTransmission(const std::string& path, const unsigned long long offset,
+                                   const unsigned long long length) :
+	offset_(offset),
+	remaining_(length)
+{
+#ifdef _WIN32
+	std::wstring widePath;
+	Poco::UnicodeConverter::toUTF16(path, widePath);
+
+	file_ = CreateFileW(widePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+	                    FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (file_ == INVALID_HANDLE_VALUE)
+		throw OpenFileException(path);
+#else
+	// Unlike send(), sendfile() has no MSG_NOSIGNAL, a client hanging up mid-range must not kill the server
+	static const bool ignoreSigPipe = (std::signal(SIGPIPE, SIG_IGN), true);
+	static_cast<void>(ignoreSigPipe);
+
+	file_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (file_ < 0)
+		throw OpenFileException(path);
+#endif
+}
+
+FileTransmission::~FileTransmission()
+{
+#ifdef _WIN32
+	CloseHandle(file_);
+#else
+	::close(file_);
+#endif
+}
+
+long long FileTransmission::sendTo(StreamSocket& socket)
+{
+	long long total = 0;
+
+#if defined(__linux__)
+	while (remaining_ > 0)
+	{
+		auto offset = static_cast<off_t>(offset_);
+		const ssize_t sent = ::sendfile(socket.impl()->sockfd(), file_, &offset,
+		                                static_cast<std::size_t>(std::min<unsigned long long>(remaining_, INT_MAX)));
+
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return total > 0 ? total : -1;
+
+			throw IOException("sendfile() failed", errno);
+		}
+
+		// The file got shorter than the index says
+		if (sent == 0)
+			throw ReadFileException("File ended before the range did");
+
+		offset_ += static_cast<unsigned long long>(sent);
+		remaining_ -= static_cast<unsigned long long>(sent);
+		total += sent;
+	}
+#elif defined(_WIN32)
+	if (!socket.getBlocking())
+		return sendChunk(socket);
+
+	while (remaining_ > 0)
+	{
+		// TransmitFile sends from the current file position and at most 2 GB - 1 per call
+		const auto count = static_cast<DWORD>(std::min<unsigned long long>(remaining_, INT_MAX - 1));
+
+		LARGE_INTEGER position;
+		position.QuadPart = static_cast<LONGLONG>(offset_);
+
+		if (!SetFilePointerEx(file_, position, nullptr, FILE_BEGIN))
+			throw ReadFileException("SetFilePointerEx() failed", static_cast<int>(GetLastError()));
+
+		if (!TransmitFile(socket.impl()->sockfd(), file_, count, 0, nullptr, nullptr, 0))
+			throw IOException("TransmitFile() failed", WSAGetLastError());
+
+		offset_ += count;
+		remaining_ -= count;
+		total += count;
+	}
+#else
+	return sendChunk(socket);
+#endif
+
+	return total;
+}
+
+long long FileTransmission::sendChunk(StreamSocket& socket)
+{
+	long long total = 0;
+
+	while (remaining_ > 0)
+	{
+		if (chunk_offset_ == chunk_.size())
+		{
+			chunk_.resize(static_cast<std::size_t>(std::min<unsigned long long>(remaining_, CHUNK_SIZE)));
+			chunk_.resize(read(chunk_.data(), chunk_.size()));
+			chunk_offset_ = 0;
+		}
+
+		const int sent = socket.sendBytes(chunk_.data() + chunk_offset_,
+		                                  static_cast<int>(chunk_.size() - chunk_offset_));
+
+		if (sent < 0)
+			return total > 0 ? total : -1;
+
+		chunk_offset_ += static_cast<std::size_t>(sent);
+		offset_ += static_cast<unsigned long long>(sent);
+		remaining_ -= static_cast<unsigned long long>(sent);
+		total += sent;
+	}
+
+	return total;
+}
+
+std::size_t FileTransmission::read(char* buffer, const std::size_t length)
+{
+	// The chunk is sent before the next one is read, so offset_ is where this one starts
+#ifdef _WIN32
+	OVERLAPPED position{};
+	position.Offset = static_cast<DWORD>(offset_);
+	position.OffsetHigh = static_cast<DWORD>(offset_ >> 32);
+
+	DWORD bytesRead = 0;
+
+	if (!ReadFile(file_, buffer, static_cast<DWORD>(length), &bytesRead, &position) || bytesRead == 0)
+		throw ReadFileException("File ended before the range did");
+#else
+	const ssize_t bytesRead = ::pread(file_, buffer, length, static_cast<off_t>(offset_));
+
+	if (bytesRead <= 0)
+		throw ReadFileException("File ended before the range did");
+#endif
+
+	return static_cast<std::size_t>(bytesRead);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Sends a byte range of a file to a socket without copying it through user space: sendfile() on Linux,
+// TransmitFile() on Windows. TransmitFile can't report partial progress, so non-blocking sockets on Windows (and
+// other platforms) get the range read and sent chunk by chunk instead.
+class FileTransmission
+{
+public:
+	// Throws Poco::OpenFileException if the file can't be opened
+	FileTransmission(const std::string& path, unsigned long long offset, unsigned long long length);
+	~FileTransmission();
+
+	FileTransmission(const FileTransmission&) = delete;
+	FileTransmission& operator=(const FileTransmission&) = delete;
+
+	// Sends as much as the socket takes (everything on a blocking socket), returns the number of bytes sent or -1 if
+	// the socket would block. Throws Poco::IOException if the file or the connection fails mid-range.
+	long long sendTo(Poco::Net::StreamSocket& socket);
+
+	[[nodiscard]] unsigned long long remaining() const { return remaining_; }
+
+private:
+	static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+#ifdef _WIN32
+	HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+	int file_ = -1;
+#endif
+	unsigned long long offset_;
+	unsigned long long remaining_;
+
+	// Chunked fallback, read from the file but not sent yet
+	std::string chunk_;
+	std::size_t chunk_offset_ = 0;
+
+	long long sendChunk(Poco::Net::StreamSocket& socket);
+	std::size_t read(char* buffer, std::size_t length);
+};
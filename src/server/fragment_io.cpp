@@ -0,0 +1,368 @@
+#include "pch.hpp"
+#include "fragment_io.hpp"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#ifdef QUANTUMSTREAMER_HAS_IO_URING
+#include <cerrno>
+#include <condition_variable>
+#include <fcntl.h>
+#include <liburing.h>
+#include <ranges>
+#include <unistd.h>
+#endif
+
+using Poco::NotImplementedException;
+using Poco::SystemException;
+
+namespace
+{
+	// A std::ifstream per call, the way fragments have always been read
+	class BlockingFragmentIo final : public FragmentIo
+	{
+	public:
+		using FragmentIo::read;
+
+		[[nodiscard]] Backend backend() const override { return Backend::BLOCKING; }
+
+		bool read(const std::string& path, const std::span<Read> reads) override
+		{
+			std::ifstream stream(path, std::ios::binary);
+
+			if (!stream)
+				return false;
+
+			std::vector<char> scratch;
+
+			for (Read& read : reads)
+			{
+				char* buffer = read.buffer;
+
+				if (!buffer)
+				{
+					scratch.resize(read.length);
+					buffer = scratch.data();
+				}
+
+				stream.clear();
+				stream.seekg(static_cast<std::streamoff>(read.offset));
+				stream.read(buffer, static_cast<std::streamsize>(read.length));
+				read.result = stream.bad() ? -1 : static_cast<long long>(stream.gcount());
+			}
+
+			return true;
+		}
+	};
+
+#ifdef QUANTUMSTREAMER_HAS_IO_URING
+	class UringFragmentIo final : public FragmentIo
+	{
+	public:
+		using FragmentIo::read;
+
+		UringFragmentIo()
+		{
+			if (const int error = io_uring_queue_init(QUEUE_DEPTH, &ring_, 0); error < 0)
+				throw SystemException(std::string("io_uring_queue_init: ") + std::strerror(-error), -error);
+
+			// Warmup reads only need somewhere to land, they can all share one registered buffer
+			prefetch_buffer_.resize(PREFETCH_CHUNK_SIZE);
+			const iovec buffer{prefetch_buffer_.data(), prefetch_buffer_.size()};
+
+			if (const int error = io_uring_register_buffers(&ring_, &buffer, 1); error < 0)
+			{
+				io_uring_queue_exit(&ring_);
+				throw SystemException(std::string("io_uring_register_buffers: ") + std::strerror(-error), -error);
+			}
+
+			reaper_ = std::thread([this] { reap(); });
+		}
+
+		~UringFragmentIo() override
+		{
+			// Nobody is reading anymore, a completion without an operation tells the reaper to stop
+			io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, nullptr);
+			io_uring_submit(&ring_);
+
+			reaper_.join();
+			io_uring_queue_exit(&ring_);
+
+			for (const int file : files_ | std::views::values)
+				::close(file);
+		}
+
+		[[nodiscard]] Backend backend() const override { return Backend::IO_URING; }
+
+		void close(const std::string& path) override
+		{
+			std::lock_guard lock(files_mutex_);
+
+			if (const auto it = files_.find(path); it != files_.end())
+			{
+				::close(it->second);
+				files_.erase(it);
+			}
+		}
+
+		bool read(const std::string& path, const std::span<Read> reads) override
+		{
+			const auto [file, cached] = open(path);
+
+			if (file < 0)
+				return false;
+
+			// In rounds of up to MAX_BATCH ranges, so the operations can live on the stack
+			for (std::size_t first = 0; first < reads.size(); first += MAX_BATCH)
+			{
+				const std::span<Read> round = reads.subspan(first, std::min(MAX_BATCH, reads.size() - first));
+				std::array<Operation, MAX_BATCH> operations;
+				Batch batch;
+				batch.remaining = round.size();
+
+				for (std::size_t i = 0; i < round.size(); ++i)
+					operations[i] = {file, &round[i], &batch};
+
+				enqueue(operations.data(), round.size());
+
+				std::unique_lock lock(batch.mutex);
+				batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+			}
+
+			if (!cached)
+				::close(file);
+
+			return true;
+		}
+
+	private:
+		static constexpr unsigned int QUEUE_DEPTH = 256;
+		static constexpr std::size_t MAX_BATCH = 16;
+		static constexpr std::size_t MAX_OPEN_FILES = 256; // beyond that, files are opened and closed per read
+
+		// The ranges of one round of a read() call, the caller waits until the reaper completed all of them
+		struct Batch
+		{
+			std::mutex mutex;
+			std::condition_variable done;
+			std::size_t remaining = 0;
+		};
+
+		struct Operation
+		{
+			int file = -1;
+			Read* read = nullptr;
+			Batch* batch = nullptr;
+			Operation* next = nullptr; // queued for the next submission
+		};
+
+		io_uring ring_{};
+		std::vector<char> prefetch_buffer_;
+		std::thread reaper_;
+
+		std::mutex queue_mutex_;
+		Operation* queue_head_ = nullptr;
+		Operation* queue_tail_ = nullptr;
+		bool submitting_ = false; // only the submitting thread touches the submission queue
+
+		// Submitting thread only: no-ops a failed submission left in the queue, they go out ahead of the next reads
+		std::size_t stale_entries_ = 0;
+		Operation discarded_; // user data of those no-ops, the reaper ignores their completions
+
+		std::mutex files_mutex_;
+		std::map<std::string, int> files_;
+
+		std::pair<int, bool> open(const std::string& path)
+		{
+			std::lock_guard lock(files_mutex_);
+
+			if (const auto it = files_.find(path); it != files_.end())
+				return {it->second, true};
+
+			const int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (file < 0 || files_.size() >= MAX_OPEN_FILES)
+				return {file, false};
+
+			files_.emplace(path, file);
+			return {file, true};
+		}
+
+		// Reads queued while another thread submits go out with its next round, so under load one io_uring_enter()
+		// carries the reads of many requests
+		void enqueue(Operation* operations, const std::size_t count)
+		{
+			std::unique_lock lock(queue_mutex_);
+
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				(queue_tail_ ? queue_tail_->next : queue_head_) = &operations[i];
+				queue_tail_ = &operations[i];
+			}
+
+			if (submitting_)
+				return;
+
+			submitting_ = true;
+
+			while (queue_head_)
+			{
+				Operation* queued = std::exchange(queue_head_, nullptr);
+				queue_tail_ = nullptr;
+
+				lock.unlock();
+				submit(queued);
+				lock.lock();
+			}
+
+			submitting_ = false;
+		}
+
+		void submit(Operation* operation)
+		{
+			// The reads prepared for the next io_uring_submit(), there can't be more than the queue holds
+			std::array<std::pair<io_uring_sqe*, Operation*>, QUEUE_DEPTH> prepared;
+			std::size_t count = 0;
+
+			while (operation)
+			{
+				// Read before the operation is submitted, its owner may return as soon as it completes
+				Operation* next = operation->next;
+				io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+
+				if (!sqe && flush(prepared.data(), count))
+					sqe = io_uring_get_sqe(&ring_);
+
+				if (!sqe)
+				{
+					complete(*operation, -1);
+					operation = next;
+					continue;
+				}
+
+				if (const Read& read = *operation->read; read.buffer)
+					io_uring_prep_read(sqe, operation->file, read.buffer, static_cast<unsigned int>(read.length),
+					                   read.offset);
+				else
+					io_uring_prep_read_fixed(sqe, operation->file, prefetch_buffer_.data(),
+					                         static_cast<unsigned int>(std::min(read.length, prefetch_buffer_.size())),
+					                         read.offset, 0);
+
+				io_uring_sqe_set_data(sqe, operation);
+				prepared[count++] = {sqe, operation};
+				operation = next;
+			}
+
+			flush(prepared.data(), count);
+		}
+
+		// Submits the prepared reads and resets count. If the kernel refuses them, they are turned into no-ops and
+		// completed as failed, so their callers fall back instead of waiting for reads that never went out.
+		bool flush(const std::pair<io_uring_sqe*, Operation*>* prepared, std::size_t& count)
+		{
+			// The kernel takes the queue in order, stale no-ops first
+			const std::size_t total = stale_entries_ + std::exchange(count, 0);
+			std::size_t submitted = 0;
+
+			while (submitted < total)
+			{
+				const int result = io_uring_submit(&ring_);
+
+				if (result > 0)
+				{
+					submitted += static_cast<std::size_t>(result);
+					continue;
+				}
+
+				// Busy while the completion queue is backed up (the reaper is draining it), or interrupted
+				if (result == 0 || result == -EBUSY || result == -EAGAIN || result == -EINTR)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				Poco::Logger::get("Core").error("io_uring_submit failed (%s), reads fall back",
+				                                std::string(std::strerror(-result)));
+
+				// The entries are still in the queue and may go out with a later submission, by then their
+				// buffers may be gone
+				for (std::size_t i = submitted > stale_entries_ ? submitted - stale_entries_ : 0;
+				     i < total - stale_entries_; ++i)
+				{
+					io_uring_prep_nop(prepared[i].first);
+					io_uring_sqe_set_data(prepared[i].first, &discarded_);
+					complete(*prepared[i].second, -1);
+				}
+
+				stale_entries_ = total - submitted;
+				return false;
+			}
+
+			stale_entries_ = 0;
+			return true;
+		}
+
+		void reap()
+		{
+			while (true)
+			{
+				io_uring_cqe* cqe;
+
+				if (io_uring_wait_cqe(&ring_, &cqe) < 0)
+					continue;
+
+				auto* operation = static_cast<Operation*>(io_uring_cqe_get_data(cqe));
+				const int result = cqe->res;
+				io_uring_cqe_seen(&ring_, cqe);
+
+				if (!operation)
+					return;
+
+				if (operation != &discarded_)
+					complete(*operation, result < 0 ? -1 : result);
+			}
+		}
+
+		static void complete(const Operation& operation, const long long result)
+		{
+			operation.read->result = result;
+
+			Batch& batch = *operation.batch;
+			std::lock_guard lock(batch.mutex);
+
+			if (--batch.remaining == 0)
+				batch.done.notify_one();
+		}
+	};
+#endif
+}
+
+bool FragmentIo::read(const std::string& path, const unsigned long long offset, const std::size_t length,
+                      char* buffer)
+{
+	Read range{offset, length, buffer};
+	return read(path, std::span(&range, 1)) && range.result == static_cast<long long>(length);
+}
+
+std::unique_ptr<FragmentIo> FragmentIo::create(const Backend backend)
+{
+	if (backend == Backend::BLOCKING)
+		return std::make_unique<BlockingFragmentIo>();
+
+#ifdef QUANTUMSTREAMER_HAS_IO_URING
+	return std::make_unique<UringFragmentIo>();
+#else
+	throw NotImplementedException("This build has no io_uring support");
+#endif
+}
+
+FragmentIo::Backend FragmentIo::parseBackend(const std::string& value)
+{
+	if (Poco::icompare(value, "io_uring") == 0)
+		return Backend::IO_URING;
+
+	return Backend::BLOCKING;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <span>
+
+// Reads byte ranges of track files for OfflineStreaming. The blocking backend reads on the calling thread, one
+// syscall chain per range. The io_uring backend (Linux builds with liburing) queues the ranges of every concurrent
+// request and warmup on one ring, whoever finds the ring idle submits everything queued so far in one go.
+class FragmentIo
+{
+public:
+	enum class Backend
+	{
+		BLOCKING,
+		IO_URING
+	};
+
+	struct Read
+	{
+		unsigned long long offset;
+		std::size_t length;
+		char* buffer; // nullptr only brings the range into the page cache, at most PREFETCH_CHUNK_SIZE bytes
+		long long result = 0; // bytes read (less at the end of the file), -1 if the read failed
+	};
+
+	static constexpr std::size_t PREFETCH_CHUNK_SIZE = 256 << 10;
+
+	FragmentIo() = default;
+	virtual ~FragmentIo() = default;
+
+	FragmentIo(const FragmentIo&) = delete;
+	FragmentIo& operator=(const FragmentIo&) = delete;
+
+	[[nodiscard]] virtual Backend backend() const = 0;
+
+	// Reads all ranges of the file and returns once every one of them is done, false if the file can't be opened
+	virtual bool read(const std::string& path, std::span<Read> reads) = 0;
+
+	// Single range, true if all of it was read
+	bool read(const std::string& path, unsigned long long offset, std::size_t length, char* buffer);
+
+	// Closes the file if the backend keeps it open, before it's deleted; no reads of it may be in flight
+	virtual void close(const std::string& path) { (void)path; }
+
+	// Throws Poco::NotImplementedException if this build has no io_uring support, Poco::SystemException if the kernel
+	// refuses it (too old, or blocked by a seccomp profile)
+	static std::unique_ptr<FragmentIo> create(Backend backend);
+
+	static Backend parseBackend(const std::string& value);
+};
@@ -4,38 +4,77 @@
 #include "handlers/fragment.hpp"
 #include "handlers/manifest.hpp"
 #include "handlers/error.hpp"
+#include "handlers/status.hpp"
+#include "subsystems/request_tracing.hpp"
+
+#include <algorithm>
 
 using Poco::Logger;
 using Poco::Net::HTTPRequest;
 using Poco::Net::HTTPRequestHandler;
 using Poco::Net::HTTPResponse;
 using Poco::Net::HTTPServerRequest;
+using Poco::Util::Application;
+
+namespace
+{
+	bool consumePrefix(std::string_view& text, const std::string_view prefix)
+	{
+		if (!text.starts_with(prefix))
+			return false;
+
+		text.remove_prefix(prefix.size());
+		return true;
+	}
+
+	bool isNumber(const std::string_view text)
+	{
+		return !text.empty() && std::ranges::all_of(text, [](const char c) { return c >= '0' && c <= '9'; });
+	}
+}
 
 HTTPRequestHandler* RequestHandlerFactory::createRequestHandler(const HTTPServerRequest& request)
 {
-	if (request.getMethod() == HTTPRequest::HTTP_GET)
+	return createRequestHandler(request, RequestTarget::parse(request.getURI()));
+}
+
+BaseHandler* RequestHandlerFactory::createRequestHandler(const HTTPServerRequest& request, RequestTarget target)
+{
+	static RequestTracing& tracing = Application::instance().getSubsystem<RequestTracing>();
+
+	RequestTrace trace = tracing.begin(request.getURI());
+	BaseHandler* handler;
+
 	{
-		const std::string& uri = request.getURI();
+		const auto phase = trace.phase("route");
+		handler = route(request.getMethod(), std::move(target));
+	}
 
-		const std::regex manifestUrlPattern(R"(^/([^/]+)/manifest$)");
-		const std::regex fragmentUrlPattern(R"(^/([^/]+)/QualityLevels\((\d+)\)/Fragments\(([^=]+)=(\d+)\)$)");
+	handler->attachTrace(std::move(trace));
+	return handler;
+}
 
-		std::smatch match;
+BaseHandler* RequestHandlerFactory::route(const std::string& method, const std::string& uri)
+{
+	return route(method, RequestTarget::parse(uri));
+}
 
-		if (std::regex_match(uri, match, manifestUrlPattern))
-		{
-			const std::string episodeId = match[1].str();
-			return new ManifestRequestHandler(episodeId);
-		}
+BaseHandler* RequestHandlerFactory::route(const std::string& method, RequestTarget target)
+{
+	if (method == HTTPRequest::HTTP_GET)
+	{
+		target.resolveSymbols();
 
-		if (std::regex_match(uri, match, fragmentUrlPattern))
+		switch (target.kind)
 		{
-			std::string episodeId = match[1].str();
-			std::string qualityLevel = match[2].str();
-			std::string fragmentType = match[3].str();
-			std::string startTime = match[4].str();
-
-			return new FragmentRequestHandler(episodeId, qualityLevel, fragmentType, startTime);
+		case RequestTarget::Kind::MANIFEST:
+			return new ManifestRequestHandler(std::move(target));
+		case RequestTarget::Kind::FRAGMENT:
+			return new FragmentRequestHandler(std::move(target));
+		case RequestTarget::Kind::STATUS:
+			return new StatusRequestHandler();
+		case RequestTarget::Kind::OTHER:
+			break;
 		}
 
 		return new ErrorHandler(HTTPResponse::HTTP_NOT_FOUND);
@@ -43,3 +82,98 @@ HTTPRequestHandler* RequestHandlerFactory::createRequestHandler(const HTTPServer
 
 	return new ErrorHandler(HTTPResponse::HTTP_NOT_IMPLEMENTED);
 }
+
+RequestTarget RequestTarget::parse(const std::string& uri)
+{
+	// Matched by hand, std::regex allocates its match state on every request. The grammar is
+	//   /{episode id}/manifest
+	//   /{episode id}/QualityLevels({digits})/Fragments({type}={digits})
+	// where the episode id has no '/' and the type no '='.
+	RequestTarget target;
+
+	if (uri == "/status")
+	{
+		target.kind = Kind::STATUS;
+		return target;
+	}
+
+	std::string_view rest(uri);
+
+	if (!consumePrefix(rest, "/"))
+		return target;
+
+	const auto slash = rest.find('/');
+
+	if (slash == 0 || slash == std::string_view::npos)
+		return target;
+
+	const std::string_view episodeId = rest.substr(0, slash);
+	rest.remove_prefix(slash + 1);
+
+	if (rest == "manifest")
+	{
+		target.kind = Kind::MANIFEST;
+		target.episode_id = episodeId;
+		return target;
+	}
+
+	if (!consumePrefix(rest, "QualityLevels("))
+		return target;
+
+	const auto bitrateEnd = rest.find(')');
+
+	if (bitrateEnd == std::string_view::npos)
+		return target;
+
+	const std::string_view bitrate = rest.substr(0, bitrateEnd);
+	rest.remove_prefix(bitrateEnd + 1);
+
+	if (!isNumber(bitrate) || !consumePrefix(rest, "/Fragments(") || !rest.ends_with(')'))
+		return target;
+
+	rest.remove_suffix(1);
+	const auto equals = rest.find('=');
+
+	if (equals == 0 || equals == std::string_view::npos || !isNumber(rest.substr(equals + 1)))
+		return target;
+
+	target.kind = Kind::FRAGMENT;
+	target.episode_id = episodeId;
+	target.bitrate = bitrate;
+	target.type = rest.substr(0, equals);
+	target.start_time = rest.substr(equals + 1);
+	return target;
+}
+
+RequestTarget RequestTarget::manifest(std::string episode_id)
+{
+	RequestTarget target;
+	target.kind = Kind::MANIFEST;
+	target.episode_id = std::move(episode_id);
+	target.resolveSymbols();
+	return target;
+}
+
+RequestTarget RequestTarget::fragment(std::string episode_id, std::string bitrate, std::string type,
+                                      std::string start_time)
+{
+	RequestTarget target;
+	target.kind = Kind::FRAGMENT;
+	target.episode_id = std::move(episode_id);
+	target.bitrate = std::move(bitrate);
+	target.type = std::move(type);
+	target.start_time = std::move(start_time);
+	target.resolveSymbols();
+	return target;
+}
+
+void RequestTarget::resolveSymbols()
+{
+	episode_symbol = SymbolTable::episodes().find(episode_id);
+
+	if (kind != Kind::FRAGMENT)
+		return;
+
+	track_symbol = SymbolTable::tracks().find(type);
+	bitrate_symbol = SymbolTable::bitrates().find(bitrate);
+}
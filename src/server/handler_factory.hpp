@@ -1,7 +1,50 @@
 #pragma once
 
+#include "symbol_table.hpp"
+
+class BaseHandler;
+
+// What a game request URI asks for, shared by routing and request scheduling
+struct RequestTarget
+{
+	enum class Kind
+	{
+		MANIFEST,
+		FRAGMENT,
+		STATUS,
+		OTHER
+	};
+
+	Kind kind = Kind::OTHER;
+	std::string episode_id;
+	std::string bitrate; // fragments only
+	std::string type;
+	std::string start_time;
+
+	// Resolved by the router, subsystems index their data with these (NONE if nothing was ever indexed under the name)
+	SymbolTable::Symbol episode_symbol = SymbolTable::NONE;
+	SymbolTable::Symbol track_symbol = SymbolTable::NONE;
+	SymbolTable::Symbol bitrate_symbol = SymbolTable::NONE;
+
+	// Again once the episode is indexed, its tracks and bitrates may not have had symbols before
+	void resolveSymbols();
+
+	// Only looks at the URI, so it's cheap enough for the event loop; symbols are resolved by the router
+	static RequestTarget parse(const std::string& uri);
+
+	static RequestTarget manifest(std::string episode_id);
+	static RequestTarget fragment(std::string episode_id, std::string bitrate, std::string type,
+	                              std::string start_time);
+};
+
 class RequestHandlerFactory final : public Poco::Net::HTTPRequestHandlerFactory
 {
 public:
 	Poco::Net::HTTPRequestHandler* createRequestHandler(const Poco::Net::HTTPServerRequest& request) override;
+
+	// For a request whose target was parsed already (request scheduling does on the event engine)
+	static BaseHandler* createRequestHandler(const Poco::Net::HTTPServerRequest& request, RequestTarget target);
+
+	static BaseHandler* route(const std::string& method, const std::string& uri);
+	static BaseHandler* route(const std::string& method, RequestTarget target);
 };
@@ -1,202 +1,415 @@
 #include "pch.hpp"
 #include "fragment.hpp"
 
+#include "../byte_order.hpp"
+#include "../subsystems/negative_cache.hpp"
 #include "../subsystems/offline_streaming.hpp"
+#include "../subsystems/request_scheduling.hpp"
 #include "../subsystems/subtitle_override.hpp"
+#include "../subsystems/upstream_client.hpp"
 #include "../subsystems/video_list.hpp"
 
 using Poco::Logger;
-using Poco::StreamCopier;
 using Poco::Timespan;
 using Poco::URI;
-using Poco::Net::HTTPClientSession;
-using Poco::Net::HTTPMessage;
-using Poco::Net::HTTPRequest;
 using Poco::Net::HTTPResponse;
+using Poco::Net::NameValueCollection;
 using Poco::Net::HTTPServerResponse;
 using Poco::Net::HTTPServerRequest;
 using Poco::Util::Application;
 
-FragmentRequestHandler::FragmentRequestHandler(std::string episode_id, std::string bitrate, std::string type,
-                                               std::string start_time) :
-	episode_id_(std::move(episode_id)),
-	bitrate_(std::move(bitrate)),
-	type_(std::move(type)),
-	start_time_(std::move(start_time))
+namespace
 {
-	is_text_stream_ = type_.find("_captions") != std::string::npos;
+	// Stable for as long as the track file isn't replaced
+	std::string localEntityTag(const OfflineStreaming::FragmentLocation& location)
+	{
+		return std::format("\"{:x}-{:x}-{:x}\"", location.last_modified.epochMicroseconds(), location.moof_offset,
+		                   location.size);
+	}
+}
+
+FragmentRequestHandler::FragmentRequestHandler(RequestTarget target) : target_(std::move(target))
+{
+	is_text_stream_ = target_.type.find("_captions") != std::string::npos;
 }
 
 void FragmentRequestHandler::handleWithLogging(HTTPServerRequest& request, HTTPServerResponse& response)
 {
-	Logger& logger = Logger::get("Network");
+	static Logger& logger = Logger::get("Network");
 
 	Application& app = Application::instance();
+
+	// The player keeps retrying fragments it can't get, answer those the way the last attempt ended
+	if (const auto status = app.getSubsystem<NegativeCache>().find(request.getURI()))
+	{
+		response.setStatusAndReason(*status);
+		response.send();
+		return;
+	}
+
 	VideoList& videoList = app.getSubsystem<VideoList>();
+	bool isListed;
 
-	std::string fragmentUrl = videoList.getFragmentUrl(episode_id_, bitrate_, type_, start_time_);
+	{
+		const auto phase = trace().phase("lookup");
+		isListed = videoList.hasEpisode(target_.episode_symbol);
+	}
 
-	if (fragmentUrl.empty())
+	if (!isListed)
 	{
-		response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
-		response.send();
+		sendNotFound(request, response);
 		return;
 	}
 
 	OfflineStreaming& offlineStreaming = app.getSubsystem<OfflineStreaming>();
-	std::string localFragment = offlineStreaming.getLocalFragment(episode_id_, type_, bitrate_, start_time_);
+	OfflineStreaming::FragmentLocation location{};
+	std::pmr::string localFragment(arena());
+	bool isIndexed;
 
-	if (localFragment.empty())
+	if (!offlineStreaming.preloaded())
 	{
-		if (app.config().getBool("Server.OfflineMode", false))
+		const auto phase = trace().phase("episode_index");
+		offlineStreaming.ensureEpisode(target_.episode_id);
+		target_.resolveSymbols();
+	}
+
+	{
+		const auto phase = trace().phase("index_lookup");
+		isIndexed = offlineStreaming.findLocalFragment(target_, location);
+	}
+
+	if (isIndexed)
+		offlineStreaming.countPlay(location);
+
+	// Media fragments are served as stored, the kernel can send them (or the requested part) straight from the file
+	static const bool fileTransmission = app.config().getBool("Server.FileTransmission", true);
+
+	if (isIndexed && !is_text_stream_ && fileTransmission && transmitLocalFragment(request, response, location))
+		return;
+
+	if (ByteRange range{}; isIndexed && !is_text_stream_ &&
+		parseRange(request, location.size, localEntityTag(location), range) == RangeRequest::SATISFIABLE)
+	{
+		// Media fragments are served as stored, so the range can be read straight from the track file
+		std::pmr::string part(arena());
+
 		{
-			logger.warning("Offline mode is enabled, but the requested fragment is not available locally: %s",
-			               episode_id_);
+			const auto phase = trace().phase("disk_read");
+			part = offlineStreaming.readLocalFragmentRange(location, target_.start_time, range.first,
+			                                               range.length(), arena());
+		}
 
-			response.setStatusAndReason(HTTPResponse::HTTP_NOT_ACCEPTABLE);
-			response.send();
+		if (!part.empty())
+		{
+			sendPartialContent(response, part, range, location.size, localEntityTag(location));
 			return;
 		}
+	}
 
-		// Call the fragment URL keeping all headers, query parameters, and body intact
-		// The only thing we need to change is the Host header to the fragment URL's host
+	if (isIndexed)
+	{
+		const auto phase = trace().phase("disk_read");
+		localFragment = offlineStreaming.readLocalFragment(location, target_.start_time, arena());
+	}
 
-		// Parse fragment URL to extract the host
-		URI uri(fragmentUrl);
-		const std::string& fragmentHost = uri.getHost();
+	// Overridden captions only need the original fragment's moof, the track's template has one
+	if (localFragment.empty() && is_text_stream_)
+	{
+		{
+			const auto phase = trace().phase("subtitle_synthesis");
+			localFragment = app.getSubsystem<SubtitleOverride>().synthesizeFragment(
+				target_.episode_symbol, target_.track_symbol, target_.start_time, arena());
+		}
 
-		try
+		if (!localFragment.empty())
 		{
-			logger.trace("Fetching fragment from remote server (%s)...", fragmentUrl);
-			HTTPRequest fragmentRequest(HTTPRequest::HTTP_GET, fragmentUrl, HTTPMessage::HTTP_1_1);
+			sendBody(request, response, localFragment, contentEntityTag(localFragment));
+			return;
+		}
+	}
 
-			// Copy headers from the original request to the fragment request
-			for (const auto& [key, value] : request)
+	if (localFragment.empty())
+	{
+		// Media fragments continue on the upstream executor, captions stay on the subtitle one
+		if (is_text_stream_)
+			fetchUpstream(request, response);
+		else
+			continueUpstream(request, response, [this, &request, &response]
 			{
-				if (key != "Host")
-				{
-					// Skip Host header, we'll set it later
-					fragmentRequest.set(key, value);
-				}
-			}
+				return fetchUpstream(request, response);
+			});
+	}
+	else
+	{
+		if (logger.trace())
+			logger.trace("Serving local fragment for episode %s, bitrate %s, type %s, start time %s...",
+			             target_.episode_id, target_.bitrate, target_.type, target_.start_time);
 
-			// Set the Host header to the fragment URL's host
-			fragmentRequest.set("Host", fragmentHost);
+		if (is_text_stream_)
+		{
+			const auto phase = trace().phase("subtitle_rewrite");
+			localFragment = processSubtitleData(localFragment);
+		}
 
-			// Send the request to the fragment URL
-			HTTPClientSession session(uri.getHost(), uri.getPort());
+		sendBody(request, response, localFragment,
+		         is_text_stream_ ? contentEntityTag(localFragment) : localEntityTag(location));
+	}
+}
 
-			// Set a timeout for the request
-			session.setTimeout(Timespan(REMOTE_TIMEOUT, 0));
+bool FragmentRequestHandler::fetchUpstream(HTTPServerRequest& request, HTTPServerResponse& response)
+{
+	static Logger& logger = Logger::get("Network");
 
-			// Send the request and get the response
-			session.sendRequest(fragmentRequest);
+	Application& app = Application::instance();
 
-			HTTPResponse fragmentResponse;
-			std::istream& fragmentResponseStream = session.receiveResponse(fragmentResponse);
+	if (app.config().getBool("Server.OfflineMode", false))
+	{
+		logger.warning("Offline mode is enabled, but the requested fragment is not available locally: %s",
+		               target_.episode_id);
 
-			std::ostringstream buffer;
-			StreamCopier::copyStream(fragmentResponseStream, buffer);
-			std::string bodyStr = buffer.str();
+		app.getSubsystem<NegativeCache>().remember(request.getURI(), HTTPResponse::HTTP_NOT_ACCEPTABLE);
+		response.setStatusAndReason(HTTPResponse::HTTP_NOT_ACCEPTABLE);
+		response.send();
+		return false;
+	}
 
-			if (is_text_stream_)
-				bodyStr = processSubtitleData(bodyStr);
+	// Only built for fragments that aren't stored locally
+	const std::string fragmentUrl = app.getSubsystem<VideoList>().getFragmentUrl(target_);
 
-			auto responseStatus = fragmentResponse.getStatus();
+	if (fragmentUrl.empty())
+	{
+		sendNotFound(request, response);
+		return false;
+	}
 
-			if (responseStatus != HTTPResponse::HTTP_OK)
-			{
-				logger.error("Failed to fetch fragment! Remote server returned %s status code.",
-				             std::to_string(responseStatus));
-				logger.trace(bodyStr);
-			}
+	// Call the fragment URL keeping all headers intact
+	// The only thing we need to change is the Host header, the upstream client sets it from the URL
+	NameValueCollection headers;
 
-			response.setStatusAndReason(responseStatus);
+	for (const auto& [key, value] : request)
+	{
+		// Ranges are applied to the complete (possibly rewritten) fragment once it's here
+		if (key != "Host" && key != "Range" && key != "If-Range")
+			headers.add(key, value);
+	}
 
-			for (const auto& [key, value] : fragmentResponse)
-				response.set(key, value);
+	if (logger.trace())
+		logger.trace("Fetching fragment from remote server (%s)...", fragmentUrl);
 
-			response.setContentLength(static_cast<long long>(bodyStr.size()));
+	UpstreamClient& upstreamClient = app.getSubsystem<UpstreamClient>();
+	const URI uri(fragmentUrl);
+	const Timespan timeout(REMOTE_TIMEOUT, 0);
 
-			std::ostream& responseBody = response.send();
-			responseBody.write(bodyStr.data(), static_cast<long long>(bodyStr.size()));
-		}
-		catch (Poco::Exception& ex)
+	// On the event engine the worker moves on while the fragment is in flight
+	if (deferResponse(response))
+	{
+		upstreamClient.fetch(uri, headers, timeout, [this, &request, &response](UpstreamClient::Result result)
 		{
-			logger.error(
-				"An exception occurred while fetching media fragment from the remote server! [episode_id: %s, bitrate: %s, type: %s, start_time: %s] (%s)",
-				episode_id_,
-				bitrate_,
-				type_,
-				start_time_,
-				ex.displayText());
-			response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
-			response.send();
-		}
+			auto send = [this, &request, &response, result = std::move(result)]() mutable
+			{
+				completeDeferred(request, response, [&]
+				{
+					sendUpstreamFragment(request, response, std::move(result));
+				});
+			};
+
+			// The caption rewrite is too slow for the upstream client's thread, everything else is a copy
+			if (is_text_stream_ && Application::instance().getSubsystem<RequestScheduling>().submit(
+				RequestScheduling::RequestClass::SUBTITLE, PriorityExecutor::Priority::NORMAL, send))
+				return;
+
+			send();
+		});
+		return true;
 	}
-	else
+
+	sendUpstreamFragment(request, response, upstreamClient.fetch(uri, headers, timeout));
+	return false;
+}
+
+bool FragmentRequestHandler::transmitLocalFragment(HTTPServerRequest& request, HTTPServerResponse& response,
+                                                   const OfflineStreaming::FragmentLocation& location)
+{
+	OfflineStreaming& offlineStreaming = Application::instance().getSubsystem<OfflineStreaming>();
+
+	// The kernel sends the extent as it is, so it has to be exactly moof + mdat; anything else goes through the
+	// buffered path, which looks at the boxes
 	{
-		logger.trace("Serving local fragment for episode %s, bitrate %s, type %s, start time %s...",
-		             episode_id_, bitrate_, type_, start_time_);
+		const auto phase = trace().phase("disk_read");
 
-		if (is_text_stream_)
-			localFragment = processSubtitleData(localFragment);
+		if (!offlineStreaming.checkLocalFragment(location))
+			return false;
+	}
 
-		response.setContentLength(static_cast<long long>(localFragment.size()));
+	const std::string entityTag = localEntityTag(location);
+	ByteRange range{0, location.size - 1};
 
-		std::ostream& responseBody = response.send();
-		responseBody.write(localFragment.data(), static_cast<long long>(localFragment.size()));
+	switch (parseRange(request, location.size, entityTag, range))
+	{
+	case RangeRequest::SATISFIABLE:
+		response.setStatusAndReason(HTTPResponse::HTTP_PARTIAL_CONTENT);
+		response.set("Content-Range", std::format("bytes {}-{}/{}", range.first, range.last, location.size));
+		break;
+	case RangeRequest::UNSATISFIABLE:
+		sendRangeNotSatisfiable(response, location.size);
+		return true;
+	case RangeRequest::NONE:
+		break;
+	}
+
+	response.set("Accept-Ranges", "bytes");
+	response.set("ETag", entityTag);
+
+	try
+	{
+		// The kernel reads the file, it still counts against the root
+		StorageRoots::Read rootRead(offlineStreaming.storageRoots(), location.root);
+
+		sendFileRange(request, response, *location.source_path, location.moof_offset + range.first, range.length());
+		rootRead.add(range.length());
+		return true;
+	}
+	catch (Poco::OpenFileException& ex)
+	{
+		// Nothing was sent yet, the buffered path reports it and goes upstream
+		Logger::get("Network").warning("Failed to open %s for sending (%s)", *location.source_path, ex.displayText());
+
+		response.setStatusAndReason(HTTPResponse::HTTP_OK);
+		response.erase("Content-Range");
+		return false;
 	}
 }
 
+void FragmentRequestHandler::sendNotFound(const HTTPServerRequest& request, HTTPServerResponse& response)
+{
+	Application::instance().getSubsystem<NegativeCache>().remember(request.getURI(), HTTPResponse::HTTP_NOT_FOUND);
+	response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+	response.send();
+}
 
-std::string FragmentRequestHandler::processSubtitleData(const std::string& data) const
+void FragmentRequestHandler::sendUpstreamFragment(const HTTPServerRequest& request, HTTPServerResponse& response,
+                                                  UpstreamClient::Result result)
 {
-	const auto bytesData = new char[data.size()];
-	memcpy(bytesData, data.data(), data.size());
+	static Logger& logger = Logger::get("Network");
 
-	unsigned int moofSize;
-	memcpy(&moofSize, bytesData, sizeof(moofSize));
-	moofSize = _byteswap_ulong(moofSize);
+	if (result.connect_duration > 0)
+	{
+		trace().record("upstream_connect", result.begin, result.connect_duration);
+		trace().record("upstream_transfer", result.begin + result.connect_duration, result.transfer_duration);
+	}
 
-	const auto moofBlock = new char[moofSize];
-	memcpy(moofBlock, bytesData, moofSize);
+	NegativeCache& negativeCache = Application::instance().getSubsystem<NegativeCache>();
 
-	unsigned int mdatSize;
-	memcpy(&mdatSize, bytesData + moofSize, sizeof(mdatSize));
-	mdatSize = _byteswap_ulong(mdatSize);
+	if (result.outcome != UpstreamClient::Result::Outcome::OK)
+	{
+		// Cancelled only when shutting down, that says nothing about the fragment
+		if (result.outcome != UpstreamClient::Result::Outcome::CANCELLED)
+			negativeCache.remember(request.getURI(), result.status);
+
+		logger.error(
+			"Failed to fetch media fragment from the remote server! [episode_id: %s, bitrate: %s, type: %s, start_time: %s] (%s)",
+			target_.episode_id,
+			target_.bitrate,
+			target_.type,
+			target_.start_time,
+			result.error);
+		response.setStatusAndReason(result.status);
+		response.send();
+		return;
+	}
 
-	auto mdatBlock = new char[mdatSize];
-	memcpy(mdatBlock, bytesData + moofSize, mdatSize);
+	std::string_view body = result.body;
+	std::pmr::string rewrittenBody(arena());
+	const auto responseStatus = result.status;
 
-	delete[] bytesData;
+	if (responseStatus != HTTPResponse::HTTP_OK)
+	{
+		negativeCache.remember(request.getURI(), responseStatus);
+		logger.error("Failed to fetch fragment! Remote server returned %s status code.",
+		             std::to_string(responseStatus));
+
+		if (logger.trace())
+			logger.trace(result.body);
+	}
+	else if (is_text_stream_)
+	{
+		const auto phase = trace().phase("subtitle_rewrite");
+		rewrittenBody = processSubtitleData(body);
+		body = rewrittenBody;
+	}
+
+	response.setStatusAndReason(responseStatus);
+
+	for (const auto& [key, value] : result.headers)
+		response.set(key, value);
+
+	if (responseStatus == HTTPResponse::HTTP_OK)
+	{
+		// Caption fragments were rewritten, so the upstream validator no longer describes the body
+		const std::string entityTag = !is_text_stream_ && result.headers.has("ETag")
+			                              ? result.headers.get("ETag")
+			                              : contentEntityTag(body);
+
+		sendBody(request, response, body, entityTag);
+		return;
+	}
+
+	response.setContentLength(static_cast<long long>(body.size()));
+
+	const auto phase = trace().phase("socket_write");
+	std::ostream& responseBody = response.send();
+	responseBody.write(body.data(), static_cast<long long>(body.size()));
+}
 
-	// Skip 8 bytes and read it as string
-	std::string subtitleData(mdatBlock + 8, mdatSize - 8);
+std::pmr::string FragmentRequestHandler::processSubtitleData(const std::string_view data)
+{
+	// moof, then an mdat holding the TTML document after its 8 byte box header
+	unsigned int moofSize = 0;
+	unsigned int mdatSize = 0;
+
+	if (data.size() >= 8)
+	{
+		memcpy(&moofSize, data.data(), sizeof(moofSize));
+		moofSize = fromBigEndian(moofSize);
+	}
+
+	if (moofSize >= 8 && data.size() >= 8 && moofSize <= data.size() - 8)
+	{
+		memcpy(&mdatSize, data.data() + moofSize, sizeof(mdatSize));
+		mdatSize = fromBigEndian(mdatSize);
+	}
+
+	// Upstream bodies aren't trusted, one that isn't a moof and an mdat is passed through as it came
+	if (mdatSize < 8 || mdatSize > data.size() - moofSize)
+	{
+		Logger::get("Network").warning("Caption fragment for %s isn't a moof followed by an mdat, sent unchanged",
+		                               target_.episode_id);
+		return std::pmr::string(data, arena());
+	}
+
+	const std::string_view subtitleData = data.substr(moofSize + 8, mdatSize - 8);
 
 	const Application& app = Application::instance();
 	SubtitleOverride& subtitleOverride = app.getSubsystem<SubtitleOverride>();
 
+	// The fragments of an overridden track that aren't local are built from the first one seen
+	subtitleOverride.rememberTemplate(target_.episode_symbol, target_.track_symbol,
+	                                  data.substr(0, moofSize + mdatSize));
+
 	const std::string newSubtitleData = subtitleOverride.overrideSubtitles(
-		episode_id_, type_, subtitleData,
-		start_time_);
+		target_.episode_symbol, target_.track_symbol, subtitleData, target_.start_time);
 
 	mdatSize = static_cast<unsigned int>(newSubtitleData.size() + 8);
 
-	// delete original mdat
-	delete[] mdatBlock;
-	mdatBlock = new char[mdatSize];
-
 	// Write mdatSize in big-endian
-	const unsigned int mdatSizeBe = _byteswap_ulong(mdatSize);
-	memcpy(mdatBlock, &mdatSizeBe, sizeof(mdatSizeBe));
-	memcpy(mdatBlock + 4, BLOCK_MDAT, strlen(BLOCK_MDAT));
-	memcpy(mdatBlock + 8, newSubtitleData.c_str(), newSubtitleData.size());
-
-	std::string newData = std::string(moofBlock, moofSize) + std::string(mdatBlock, mdatSize);
-
-	delete[] moofBlock;
-	delete[] mdatBlock;
+	const unsigned int mdatSizeBe = toBigEndian(mdatSize);
+
+	std::pmr::string newData(arena());
+	newData.reserve(static_cast<std::size_t>(moofSize) + mdatSize);
+	newData.append(data.substr(0, moofSize));
+	newData.append(reinterpret_cast<const char*>(&mdatSizeBe), sizeof(mdatSizeBe));
+	newData.append(BLOCK_MDAT);
+	newData.append(newSubtitleData);
 
 	return newData;
 }
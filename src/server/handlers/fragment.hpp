@@ -1,19 +1,28 @@
 #pragma once
 
+#include "../handler_factory.hpp"
+#include "../subsystems/offline_streaming.hpp"
+#include "../subsystems/upstream_client.hpp"
+
 class FragmentRequestHandler final : public BaseHandler
 {
 public:
-	explicit FragmentRequestHandler(std::string episode_id, std::string bitrate, std::string type,
-	                                std::string start_time);
+	explicit FragmentRequestHandler(RequestTarget target);
 	void handleWithLogging(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response) override;
 
+	// The rewritten fragment lives in the handler's arena
+	[[nodiscard]] std::pmr::string processSubtitleData(std::string_view data);
+
 private:
-	std::string episode_id_;
-	std::string bitrate_;
-	std::string type_;
-	std::string start_time_;
+	RequestTarget target_; // symbols are resolved by the router
 	std::string text_lang_code_;
 	bool is_text_stream_;
 
-	[[nodiscard]] std::string processSubtitleData(const std::string& data) const;
+	bool transmitLocalFragment(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                           const OfflineStreaming::FragmentLocation& location);
+	// Answers from the CDN, returns true if the response was deferred until the fragment is here
+	bool fetchUpstream(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response);
+	static void sendNotFound(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response);
+	void sendUpstreamFragment(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                          UpstreamClient::Result result);
 };
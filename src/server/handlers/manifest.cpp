@@ -1,128 +1,200 @@
 #include "pch.hpp"
 #include "manifest.hpp"
 
+#include "../subsystems/negative_cache.hpp"
 #include "../subsystems/offline_streaming.hpp"
+#include "../subsystems/subtitle_override.hpp"
+#include "../subsystems/upstream_client.hpp"
 #include "../subsystems/video_list.hpp"
 
 using Poco::Logger;
-using Poco::StreamCopier;
 using Poco::Timespan;
 using Poco::URI;
-using Poco::Net::HTTPClientSession;
-using Poco::Net::HTTPMessage;
-using Poco::Net::HTTPRequest;
 using Poco::Net::HTTPResponse;
+using Poco::Net::NameValueCollection;
 using Poco::Net::HTTPServerResponse;
 using Poco::Net::HTTPServerRequest;
 using Poco::Util::Application;
 
-ManifestRequestHandler::ManifestRequestHandler(std::string episode_id) : episode_id_(std::move(episode_id))
+ManifestRequestHandler::ManifestRequestHandler(RequestTarget target) : target_(std::move(target))
 {
 }
 
 void ManifestRequestHandler::handleWithLogging(HTTPServerRequest& request, HTTPServerResponse& response)
 {
-	Logger& logger = Logger::get("Network");
+	static Logger& logger = Logger::get("Network");
 
 	Application& app = Application::instance();
+
+	// Dead episodes are retried by the player, answer those the way the last attempt ended
+	if (const auto status = app.getSubsystem<NegativeCache>().find(request.getURI()))
+	{
+		response.setStatusAndReason(*status);
+		response.send();
+		return;
+	}
+
 	VideoList& videoList = app.getSubsystem<VideoList>();
+	std::string manifestUrl;
 
-	std::string manifestUrl = videoList.getManifestUrl(episode_id_);
+	{
+		const auto phase = trace().phase("lookup");
+		manifestUrl = videoList.getManifestUrl(target_.episode_symbol);
+	}
 
 	if (manifestUrl.empty())
 	{
+		app.getSubsystem<NegativeCache>().remember(request.getURI(), HTTPResponse::HTTP_NOT_FOUND);
 		response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
 		response.send();
 		return;
 	}
 
 	OfflineStreaming& offlineStreaming = app.getSubsystem<OfflineStreaming>();
+	std::string localManifest;
 
-	if (std::string localManifest = offlineStreaming.getLocalClientManifest(episode_id_); localManifest.empty())
+	// Still starting up, the player usually asks for the manifest of an episode before anything else
+	if (!offlineStreaming.preloaded())
 	{
-		if (app.config().getBool("Server.OfflineMode", false))
-		{
-			logger.warning("Offline mode is enabled, but the requested client manifest is not available locally: %s",
-			               episode_id_);
-
-			response.setStatusAndReason(HTTPResponse::HTTP_NOT_ACCEPTABLE);
-			response.send();
-			return;
-		}
+		const auto phase = trace().phase("episode_index");
+		offlineStreaming.ensureEpisode(target_.episode_id);
+	}
 
-		// Call the manifest URL keeping all headers, query parameters, and body intact
-		// The only thing we need to change is the Host header to the manifest URL's host
+	// The opening fragments are next, at whichever bitrate the player picks
+	offlineStreaming.warmEpisode(target_.episode_id);
 
-		// Parse manifest URL to extract the host
-		URI uri(manifestUrl);
-		const std::string& manifestHost = uri.getHost();
+	{
+		const auto phase = trace().phase("disk_read");
+		localManifest = offlineStreaming.getLocalClientManifest(target_.episode_id);
+	}
 
-		try
+	if (localManifest.empty())
+	{
+		continueUpstream(request, response, [this, &request, &response, manifestUrl = std::move(manifestUrl)]
 		{
-			logger.trace("Fetching client manifest from remote server (%s)...", manifestUrl);
-			HTTPRequest manifestRequest(HTTPRequest::HTTP_GET, manifestUrl, HTTPMessage::HTTP_1_1);
+			return fetchUpstream(request, response, manifestUrl);
+		});
+	}
+	else
+	{
+		if (logger.trace())
+			logger.trace("Serving local client manifest for episode %s...", target_.episode_id);
 
-			// Copy headers from the original request to the manifest request
-			for (const auto& [key, value] : request)
-			{
-				if (key != "Host")
-				{
-					// Skip Host header, we'll set it later
-					manifestRequest.set(key, value);
-				}
-			}
+		app.getSubsystem<SubtitleOverride>().rememberClientManifest(target_.episode_symbol, localManifest);
+		sendBody(request, response, localManifest, contentEntityTag(localManifest));
+	}
+}
 
-			// Set the Host header to the manifest URL's host
-			manifestRequest.set("Host", manifestHost);
+bool ManifestRequestHandler::fetchUpstream(HTTPServerRequest& request, HTTPServerResponse& response,
+                                           const std::string& manifest_url)
+{
+	static Logger& logger = Logger::get("Network");
 
-			// Send the request to the manifest URL
-			HTTPClientSession session(uri.getHost(), uri.getPort());
+	Application& app = Application::instance();
 
-			// Set a timeout for the request
-			session.setTimeout(Timespan(REMOTE_TIMEOUT, 0));
+	if (app.config().getBool("Server.OfflineMode", false))
+	{
+		logger.warning("Offline mode is enabled, but the requested client manifest is not available locally: %s",
+		               target_.episode_id);
 
-			// Send the request and get the response
-			session.sendRequest(manifestRequest);
+		app.getSubsystem<NegativeCache>().remember(request.getURI(), HTTPResponse::HTTP_NOT_ACCEPTABLE);
+		response.setStatusAndReason(HTTPResponse::HTTP_NOT_ACCEPTABLE);
+		response.send();
+		return false;
+	}
 
-			HTTPResponse manifestResponse;
-			std::istream& manifestResponseStream = session.receiveResponse(manifestResponse);
+	// Call the manifest URL keeping all headers intact
+	// The only thing we need to change is the Host header, the upstream client sets it from the URL
+	NameValueCollection headers;
 
-			std::ostringstream buffer;
-			StreamCopier::copyStream(manifestResponseStream, buffer);
-			std::string bodyStr = buffer.str();
+	for (const auto& [key, value] : request)
+	{
+		// Ranges are applied to the complete manifest once it's here
+		if (key != "Host" && key != "Range" && key != "If-Range")
+			headers.add(key, value);
+	}
 
-			auto responseStatus = manifestResponse.getStatus();
+	if (logger.trace())
+		logger.trace("Fetching client manifest from remote server (%s)...", manifest_url);
 
-			if (responseStatus != HTTPResponse::HTTP_OK)
+	UpstreamClient& upstreamClient = app.getSubsystem<UpstreamClient>();
+	const URI uri(manifest_url);
+	const Timespan timeout(REMOTE_TIMEOUT, 0);
+
+	// On the event engine the worker moves on while the manifest is in flight
+	if (deferResponse(response))
+	{
+		upstreamClient.fetch(uri, headers, timeout, [this, &request, &response](UpstreamClient::Result result)
+		{
+			completeDeferred(request, response, [&]
 			{
-				logger.error("Failed to fetch client manifest! Remote server returned %s status code.",
-				             std::to_string(responseStatus));
-				logger.trace("Remote server response: %s", bodyStr);
-			}
+				sendUpstreamManifest(request, response, std::move(result));
+			});
+		});
+		return true;
+	}
 
-			response.setStatusAndReason(responseStatus);
+	sendUpstreamManifest(request, response, upstreamClient.fetch(uri, headers, timeout));
+	return false;
+}
 
-			for (const auto& [key, value] : manifestResponse)
-				response.set(key, value);
+void ManifestRequestHandler::sendUpstreamManifest(const HTTPServerRequest& request, HTTPServerResponse& response,
+                                                  UpstreamClient::Result result)
+{
+	static Logger& logger = Logger::get("Network");
 
-			std::ostream& responseBody = response.send();
-			responseBody.write(bodyStr.data(), static_cast<long long>(bodyStr.size()));
-		}
-		catch (Poco::Exception& ex)
-		{
-			logger.error(
-				"An exception occurred while fetching client manifest from the remote server! [episode_id: %s] (%s)",
-				episode_id_, ex.displayText());
-			response.setStatusAndReason(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
-			response.send();
-		}
+	if (result.connect_duration > 0)
+	{
+		trace().record("upstream_connect", result.begin, result.connect_duration);
+		trace().record("upstream_transfer", result.begin + result.connect_duration, result.transfer_duration);
 	}
-	else
+
+	NegativeCache& negativeCache = Application::instance().getSubsystem<NegativeCache>();
+
+	if (result.outcome != UpstreamClient::Result::Outcome::OK)
+	{
+		// Cancelled only when shutting down, that says nothing about the manifest
+		if (result.outcome != UpstreamClient::Result::Outcome::CANCELLED)
+			negativeCache.remember(request.getURI(), result.status);
+
+		logger.error("Failed to fetch client manifest from the remote server! [episode_id: %s] (%s)",
+		             target_.episode_id, result.error);
+		response.setStatusAndReason(result.status);
+		response.send();
+		return;
+	}
+
+	const std::string& bodyStr = result.body;
+	const auto responseStatus = result.status;
+
+	if (responseStatus != HTTPResponse::HTTP_OK)
 	{
-		logger.trace("Serving local client manifest for episode %s...", episode_id_);
-		response.setContentLength(static_cast<long long>(localManifest.size()));
+		negativeCache.remember(request.getURI(), responseStatus);
+		logger.error("Failed to fetch client manifest! Remote server returned %s status code.",
+		             std::to_string(responseStatus));
 
-		std::ostream& responseBody = response.send();
-		responseBody.write(localManifest.data(), static_cast<long long>(localManifest.size()));
+		if (logger.trace())
+			logger.trace("Remote server response: %s", bodyStr);
 	}
+
+	response.setStatusAndReason(responseStatus);
+
+	for (const auto& [key, value] : result.headers)
+		response.set(key, value);
+
+	if (responseStatus == HTTPResponse::HTTP_OK)
+	{
+		// Overridden captions that are synthesized are timed by the chunks the player was given
+		Application::instance().getSubsystem<SubtitleOverride>().rememberClientManifest(target_.episode_symbol,
+		                                                                                 bodyStr);
+		sendBody(request, response, bodyStr,
+		         result.headers.has("ETag") ? result.headers.get("ETag") : contentEntityTag(bodyStr));
+		return;
+	}
+
+	response.setContentLength(static_cast<long long>(bodyStr.size()));
+
+	const auto phase = trace().phase("socket_write");
+	std::ostream& responseBody = response.send();
+	responseBody.write(bodyStr.data(), static_cast<long long>(bodyStr.size()));
 }
@@ -1,11 +1,20 @@
 #pragma once
 
+#include "../handler_factory.hpp"
+#include "../subsystems/upstream_client.hpp"
+
 class ManifestRequestHandler final : public BaseHandler
 {
 public:
-	explicit ManifestRequestHandler(std::string episode_id);
+	explicit ManifestRequestHandler(RequestTarget target);
 	void handleWithLogging(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response) override;
 
 private:
-	std::string episode_id_;
+	RequestTarget target_;
+
+	// Answers from the CDN, returns true if the response was deferred until the manifest is here
+	bool fetchUpstream(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                   const std::string& manifest_url);
+	void sendUpstreamManifest(const Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response,
+	                          UpstreamClient::Result result);
 };
@@ -0,0 +1,91 @@
+#include "pch.hpp"
+#include "status.hpp"
+
+#include "../subsystems/negative_cache.hpp"
+#include "../subsystems/offline_streaming.hpp"
+#include "../subsystems/request_scheduling.hpp"
+#include "../subsystems/upstream_client.hpp"
+
+using Poco::JSON::Array;
+using Poco::JSON::Object;
+using Poco::JSON::Stringifier;
+using Poco::Net::HTTPServerRequest;
+using Poco::Net::HTTPServerResponse;
+using Poco::Util::Application;
+
+void StatusRequestHandler::handleWithLogging(HTTPServerRequest& request, HTTPServerResponse& response)
+{
+	Application& app = Application::instance();
+
+	Object::Ptr status = new Object;
+	status->set("engine", Poco::toLower(app.config().getString("Server.Engine", "poco")));
+	status->set("preloading", !app.getSubsystem<OfflineStreaming>().preloaded());
+	status->set("uptime_ms", app.uptime().totalMilliseconds());
+	status->set("executors", app.getSubsystem<RequestScheduling>().statistics());
+	const UpstreamClient& upstreamClient = app.getSubsystem<UpstreamClient>();
+	const UpstreamClient::Statistics upstreamStats = upstreamClient.statistics();
+
+	Object::Ptr upstream = new Object;
+	upstream->set("in_flight", upstreamClient.inFlight());
+	upstream->set("fetches", upstreamStats.fetches);
+	upstream->set("hedges", upstreamStats.hedges);
+	upstream->set("hedge_wins", upstreamStats.hedge_wins);
+	upstream->set("retries", upstreamStats.retries);
+	upstream->set("throttled", upstreamStats.throttled);
+	upstream->set("hedge_delay_ms", upstreamStats.hedge_delay.totalMilliseconds());
+	status->set("upstream", upstream);
+
+	const NegativeCache& negativeCache = app.getSubsystem<NegativeCache>();
+
+	Object::Ptr negative = new Object;
+	negative->set("entries", negativeCache.size());
+	negative->set("hits", negativeCache.hits());
+	status->set("negative_cache", negative);
+
+	// Averages are over the uptime, the counters give current rates between two requests
+	const StorageRoots& storageRoots = app.getSubsystem<OfflineStreaming>().storageRoots();
+	const auto uptime = static_cast<double>(std::max<Poco::Timespan::TimeDiff>(app.uptime().totalMicroseconds(), 1));
+
+	Array::Ptr storage = new Array;
+
+	for (std::size_t root = 0; root < storageRoots.size(); ++root)
+	{
+		const StorageRoots::Statistics stats = storageRoots.statistics(root);
+
+		Object::Ptr entry = new Object;
+		entry->set("path", storageRoots.path(root).toString());
+		entry->set("tracks", stats.tracks);
+		entry->set("reads", stats.reads);
+		entry->set("bytes", stats.bytes);
+		entry->set("in_flight", stats.in_flight);
+		entry->set("peak_in_flight", stats.peak_in_flight);
+		entry->set("avg_queue_depth", static_cast<double>(stats.read_time) / uptime);
+		entry->set("avg_mb_per_s", static_cast<double>(stats.bytes) / uptime);
+		storage->add(entry);
+	}
+
+	status->set("storage", storage);
+
+	if (const FastTier* fastTier = app.getSubsystem<OfflineStreaming>().fastTier())
+	{
+		const FastTier::Statistics stats = fastTier->statistics();
+
+		Object::Ptr tier = new Object;
+		tier->set("path", fastTier->path().toString());
+		tier->set("budget", stats.budget);
+		tier->set("used", stats.used);
+		tier->set("hot_tracks", stats.hot_tracks);
+		tier->set("promotions", stats.promotions);
+		tier->set("evictions", stats.evictions);
+		status->set("fast_tier", tier);
+	}
+
+	std::ostringstream body;
+	Stringifier::stringify(status, body, 2);
+	const std::string bodyStr = body.str();
+
+	response.setContentType("application/json");
+	response.set("Cache-Control", "no-store");
+	response.setContentLength(static_cast<long long>(bodyStr.size()));
+	response.send() << bodyStr;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Executor and upstream statistics as JSON, for watching the server under load
+class StatusRequestHandler final : public BaseHandler
+{
+public:
+	void handleWithLogging(Poco::Net::HTTPServerRequest& request, Poco::Net::HTTPServerResponse& response) override;
+};
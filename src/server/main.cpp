@@ -2,11 +2,17 @@
 #include "main.hpp"
 
 #include "handler_factory.hpp"
+#include "event/event_http_server.hpp"
+#include "subsystems/negative_cache.hpp"
 #include "subsystems/offline_streaming.hpp"
+#include "subsystems/request_scheduling.hpp"
+#include "subsystems/request_tracing.hpp"
 #include "subsystems/subtitle_override.hpp"
+#include "subsystems/upstream_client.hpp"
 #include "subsystems/video_list.hpp"
 
 using Poco::AutoPtr;
+using Poco::Channel;
 using Poco::ConsoleChannel;
 using Poco::FileChannel;
 using Poco::FormattingChannel;
@@ -15,14 +21,20 @@ using Poco::Message;
 using Poco::PatternFormatter;
 using Poco::SplitterChannel;
 using Poco::ThreadPool;
+using Poco::Timespan;
 using Poco::Net::HTTPServer;
 using Poco::Net::HTTPServerParams;
 using Poco::Net::ServerSocket;
 using Poco::Util::Application;
+using Poco::Util::HelpFormatter;
+using Poco::Util::Option;
+using Poco::Util::OptionCallback;
+using Poco::Util::OptionSet;
 
 void QuantumStreamer::initialize(Application& self)
 {
-	loadConfiguration();
+	// Files given with --config were loaded while processing options and take precedence
+	loadConfiguration(PRIO_DEFAULT + 1);
 	setupLogger();
 
 	self.logger().notice("Quantum Streamer %s by Marek Grzyb (@GrzybDev)",
@@ -35,11 +47,24 @@ void QuantumStreamer::initialize(Application& self)
 	addSubsystem(new VideoList);
 	addSubsystem(new OfflineStreaming);
 	addSubsystem(new SubtitleOverride);
+	addSubsystem(new RequestTracing);
+	addSubsystem(new UpstreamClient);
+	addSubsystem(new RequestScheduling);
+	addSubsystem(new NegativeCache);
 
 	ServerApplication::initialize(self);
 }
 
-void QuantumStreamer::setupLogger() const
+void QuantumStreamer::uninitialize()
+{
+	ServerApplication::uninitialize();
+
+	// Flush whatever is still queued before the process goes away
+	if (async_log_channel_)
+		async_log_channel_->close();
+}
+
+void QuantumStreamer::setupLogger()
 {
 	const bool showConsole = config().getBool("Logger.ShowConsole", false);
 	const bool saveToLogFile = config().getBool("Logger.SaveToLogFile", false);
@@ -70,21 +95,36 @@ void QuantumStreamer::setupLogger() const
 	// Create a FormattingChannel that wraps ConsoleChannel
 	const AutoPtr pFormattingChannel = new FormattingChannel(pFormatter, pSplitterChannel);
 
+	// Formatting and writing happens on a background thread, loggers only enqueue the message
+	Channel::Ptr pLoggerChannel = pFormattingChannel;
+
+	if (config().getBool("Logger.Async", true))
+	{
+		const auto queueSize = config().getUInt("Logger.AsyncQueueSize", 8192);
+		const auto overflowPolicy = AsyncLogChannel::parseOverflowPolicy(
+			config().getString("Logger.AsyncOverflowPolicy", "drop"));
+
+		async_log_channel_ = new AsyncLogChannel(pFormattingChannel, queueSize, overflowPolicy);
+		async_log_channel_->open();
+		pLoggerChannel = async_log_channel_;
+	}
+
 	const int logLevelCore = config().getInt("Logger.LogLevel_Core", Message::PRIO_INFORMATION);
 	const int logLevelNetwork = config().getInt("Logger.LogLevel_Network", Message::PRIO_INFORMATION);
 	const int logLevelVideoList = config().getInt("Logger.LogLevel_VideoList", Message::PRIO_INFORMATION);
 	const int logLevelOfflineStreaming = config().getInt("Logger.LogLevel_OfflineStreaming", Message::PRIO_INFORMATION);
 	const int logLevelSubtitleOverride = config().getInt("Logger.LogLevel_SubtitleOverride", Message::PRIO_INFORMATION);
 
-	Logger::create("Core", pFormattingChannel, logLevelCore);
-	Logger::create("Network", pFormattingChannel, logLevelNetwork);
-	Logger::create("VideoList", pFormattingChannel, logLevelVideoList);
-	Logger::create("OfflineStreaming", pFormattingChannel, logLevelOfflineStreaming);
-	Logger::create("SubtitleOverride", pFormattingChannel, logLevelSubtitleOverride);
+	Logger::create("Core", pLoggerChannel, logLevelCore);
+	Logger::create("Network", pLoggerChannel, logLevelNetwork);
+	Logger::create("VideoList", pLoggerChannel, logLevelVideoList);
+	Logger::create("OfflineStreaming", pLoggerChannel, logLevelOfflineStreaming);
+	Logger::create("SubtitleOverride", pLoggerChannel, logLevelSubtitleOverride);
 }
 
 void QuantumStreamer::setupConsole()
 {
+#ifdef _WIN32
 	// Create a console for Debug output
 	AllocConsole();
 
@@ -117,10 +157,49 @@ void QuantumStreamer::setupConsole()
 	std::wclog.clear();
 	std::wcerr.clear();
 	std::wcin.clear();
+#endif
+}
+
+void QuantumStreamer::defineOptions(OptionSet& options)
+{
+	ServerApplication::defineOptions(options);
+
+	options.addOption(
+		Option("help", "h", "Display help information on command line arguments.")
+		.required(false)
+		.repeatable(false)
+		.callback(OptionCallback<QuantumStreamer>(this, &QuantumStreamer::handleHelp)));
+
+	options.addOption(
+		Option("config", "c", "Load configuration from a file (in addition to QuantumStreamer.properties/.ini/.xml).")
+		.required(false)
+		.repeatable(true)
+		.argument("file")
+		.callback(OptionCallback<QuantumStreamer>(this, &QuantumStreamer::handleConfig)));
+}
+
+void QuantumStreamer::handleHelp(const std::string& /*name*/, const std::string& /*value*/)
+{
+	HelpFormatter helpFormatter(options());
+	helpFormatter.setCommand(commandName());
+	helpFormatter.setUsage("[options]");
+	helpFormatter.setHeader("Serves Quantum Break live action episodes from local storage.");
+	helpFormatter.format(std::cout);
+
+	help_requested_ = true;
+	stopOptionsProcessing();
+}
+
+void QuantumStreamer::handleConfig(const std::string& /*name*/, const std::string& value)
+{
+	loadConfiguration(value);
 }
 
 int QuantumStreamer::main(const std::vector<std::string>& args)
 {
+	if (help_requested_)
+		return EXIT_OK;
+
 	Logger& logger = Logger::get("Core");
 	logger.debug("Initializing Quantum Streamer...");
 
@@ -137,13 +216,30 @@ int QuantumStreamer::main(const std::vector<std::string>& args)
 	const int maxThreads = config().getInt("Server.MaxThreads", static_cast<int>(n));
 	ThreadPool::defaultPool().addCapacity(maxThreads);
 
+	const std::string engine = Poco::toLower(config().getString("Server.Engine", "poco"));
+	const bool eventEngine = engine == "event";
+
+	if (!eventEngine && engine != "poco")
+		logger.warning("Unknown server engine \"%s\", falling back to poco.", engine);
+
 	const auto pParams = new HTTPServerParams;
-	pParams->setKeepAlive(false);
 	pParams->setMaxQueued(maxQueued);
 	pParams->setMaxThreads(maxThreads);
 	logger.debug("Max Queued: %d", maxQueued);
 	logger.debug("Max Threads: %d", maxThreads);
 
+	// Keep-alive is only worth it when idle connections don't each hold a thread
+	if (eventEngine)
+	{
+		pParams->setKeepAlive(true);
+		pParams->setKeepAliveTimeout(Timespan(config().getInt("Server.KeepAliveTimeout", 15), 0));
+		pParams->setMaxKeepAliveRequests(0);
+	}
+	else
+	{
+		pParams->setKeepAlive(false);
+	}
+
 	// set up the server socket
 	const unsigned short port = static_cast<unsigned short>(config().getInt("Server.Port", 0));
 	const ServerSocket svs(port);
@@ -152,21 +248,40 @@ int QuantumStreamer::main(const std::vector<std::string>& args)
 	{
 		VideoList& videoList = instance().getSubsystem<VideoList>();
 		videoList.patch(svs.address().port());
-
-		OfflineStreaming& offlineStreaming = instance().getSubsystem<OfflineStreaming>();
-		offlineStreaming.preload();
-
-		SubtitleOverride& subtitleOverride = instance().getSubsystem<SubtitleOverride>();
-		subtitleOverride.load();
 	}
 
+	// The server starts accepting right away, requests for episodes the preloader hasn't reached yet index them first
+	OfflineStreaming& offlineStreaming = instance().getSubsystem<OfflineStreaming>();
+	offlineStreaming.startPreload();
+
 	// create the HTTP server instance
-	HTTPServer srv(new RequestHandlerFactory(), svs, pParams);
+	std::unique_ptr<HTTPServer> srv;
+	std::unique_ptr<EventHttpServer> eventSrv;
 
-	// start the server
-	srv.start();
+	if (eventEngine)
+	{
+		const int loopThreads = config().getInt("Server.EventLoopThreads", 2);
+		RequestScheduling& scheduling = instance().getSubsystem<RequestScheduling>();
+
+		eventSrv = std::make_unique<EventHttpServer>(
+			new RequestHandlerFactory(), svs, pParams, loopThreads,
+			[&scheduling](const Poco::Net::HTTPServerRequest& request,
+			              std::function<void(EventHttpServer::HandlerCreator create)> task)
+			{
+				return scheduling.dispatch(request, std::move(task));
+			});
+		eventSrv->start();
+
+		logger.debug("Event Loop Threads: %d", loopThreads);
+	}
+	else
+	{
+		srv = std::make_unique<HTTPServer>(new RequestHandlerFactory(), svs, pParams);
+		srv->start();
+	}
 
-	logger.information("Started HTTP Server (Listening at port %d)", static_cast<int>(svs.address().port()));
+	logger.information("Started HTTP Server (Listening at port %d, %s engine)", static_cast<int>(svs.address().port()),
+	                   eventEngine ? std::string("event") : std::string("poco"));
 
 	// wait for termination signal
 	waitForTerminationRequest();
@@ -174,6 +289,12 @@ int QuantumStreamer::main(const std::vector<std::string>& args)
 	logger.information("Stopping HTTP Server...");
 
 	// stop the server
-	srv.stop();
+	if (eventSrv)
+		eventSrv->stop();
+	else
+		srv->stop();
+
+	offlineStreaming.stopPreload();
+
 	return EXIT_OK;
 }
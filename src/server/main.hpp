@@ -1,13 +1,23 @@
 #pragma once
 
+#include "async_log_channel.hpp"
+
 class QuantumStreamer final : public Poco::Util::ServerApplication
 {
 protected:
 	void initialize(Application& self) override;
+	void uninitialize() override;
 
+	void defineOptions(Poco::Util::OptionSet& options) override;
 	int main(const std::vector<std::string>& args) override;
 
 private:
-	void setupLogger() const;
+	Poco::AutoPtr<AsyncLogChannel> async_log_channel_;
+	bool help_requested_ = false;
+
+	void handleHelp(const std::string& name, const std::string& value);
+	void handleConfig(const std::string& name, const std::string& value);
+
+	void setupLogger();
 	static void setupConsole();
 };
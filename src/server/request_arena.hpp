@@ -0,0 +1,28 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+// Memory for the transient strings and buffers of one request. Allocations are bumped out of a block the arena owns
+// and only freed all together, when the handler that owns the arena is done. Handlers are pooled together with their
+// arena, so a request whose buffers fit in the block doesn't touch the heap; bigger ones (buffered media fragments)
+// get extra blocks from the global heap for the rest of the request.
+class RequestArena final
+{
+public:
+	static constexpr std::size_t BLOCK_SIZE = 8 * 1024;
+
+	RequestArena() : resource_(block_.data(), block_.size())
+	{
+	}
+
+	RequestArena(const RequestArena&) = delete;
+	RequestArena& operator=(const RequestArena&) = delete;
+
+	[[nodiscard]] std::pmr::memory_resource* resource() { return &resource_; }
+
+private:
+	alignas(std::max_align_t) std::array<std::byte, BLOCK_SIZE> block_;
+	std::pmr::monotonic_buffer_resource resource_;
+};
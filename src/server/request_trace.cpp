@@ -0,0 +1,28 @@
+#include "pch.hpp"
+#include "request_trace.hpp"
+
+#include "subsystems/request_tracing.hpp"
+
+using Poco::Clock;
+using Poco::Thread;
+
+RequestTrace::RequestTrace(RequestTracing* sink, std::string target) :
+	sink_(sink),
+	target_(std::move(target)),
+	begin_(Clock().microseconds())
+{
+	phases_.reserve(8);
+}
+
+void RequestTrace::finish(const int status)
+{
+	if (!sink_)
+		return;
+
+	duration_ = Clock().microseconds() - begin_;
+	thread_id_ = static_cast<long>(Thread::currentOsTid());
+	status_ = status;
+
+	sink_->submit(*this);
+	sink_ = nullptr;
+}
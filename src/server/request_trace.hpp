@@ -0,0 +1,72 @@
+#pragma once
+
+class RequestTracing;
+
+class RequestTrace
+{
+public:
+	struct PhaseRecord
+	{
+		const char* name;
+		Poco::Clock::ClockVal begin;
+		Poco::Clock::ClockDiff duration;
+	};
+
+	class Phase
+	{
+	public:
+		Phase(RequestTrace* trace, const char* name) : trace_(trace), name_(name)
+		{
+			if (trace_)
+				begin_ = Poco::Clock().microseconds();
+		}
+
+		~Phase()
+		{
+			if (trace_)
+				trace_->phases_.push_back({name_, begin_, Poco::Clock().microseconds() - begin_});
+		}
+
+		Phase(const Phase&) = delete;
+		Phase& operator=(const Phase&) = delete;
+
+	private:
+		RequestTrace* trace_;
+		const char* name_;
+		Poco::Clock::ClockVal begin_ = 0;
+	};
+
+	// Unsampled trace, every phase is a no-op
+	RequestTrace() = default;
+	RequestTrace(RequestTracing* sink, std::string target);
+
+	[[nodiscard]] bool sampled() const { return sink_ != nullptr; }
+
+	// Usage: const auto phase = trace.phase("disk_read");
+	[[nodiscard]] Phase phase(const char* name) { return {sink_ ? this : nullptr, name}; }
+
+	// For phases timed elsewhere, e.g. on the upstream client's thread
+	void record(const char* name, const Poco::Clock::ClockVal begin, const Poco::Clock::ClockDiff duration)
+	{
+		if (sink_)
+			phases_.push_back({name, begin, duration});
+	}
+
+	void finish(int status);
+
+	[[nodiscard]] const std::string& target() const { return target_; }
+	[[nodiscard]] Poco::Clock::ClockVal begin() const { return begin_; }
+	[[nodiscard]] Poco::Clock::ClockDiff duration() const { return duration_; }
+	[[nodiscard]] long threadId() const { return thread_id_; }
+	[[nodiscard]] int status() const { return status_; }
+	[[nodiscard]] const std::vector<PhaseRecord>& phases() const { return phases_; }
+
+private:
+	RequestTracing* sink_ = nullptr;
+	std::string target_;
+	Poco::Clock::ClockVal begin_ = 0;
+	Poco::Clock::ClockDiff duration_ = 0;
+	long thread_id_ = 0;
+	int status_ = 0;
+	std::vector<PhaseRecord> phases_;
+};
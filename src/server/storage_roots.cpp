@@ -0,0 +1,76 @@
+#include "pch.hpp"
+#include "storage_roots.hpp"
+
+#include <Poco/StringTokenizer.h>
+
+using Poco::Path;
+using Poco::StringTokenizer;
+
+StorageRoots::Read::Read(StorageRoots& roots, const std::size_t root) : roots_(roots), root_(root)
+{
+	Root& counted = roots_.roots_[root_];
+	const unsigned int inFlight = counted.in_flight.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	unsigned int peak = counted.peak_in_flight.load(std::memory_order_relaxed);
+	while (peak < inFlight && !counted.peak_in_flight.compare_exchange_weak(peak, inFlight, std::memory_order_relaxed))
+	{
+	}
+}
+
+StorageRoots::Read::~Read()
+{
+	Root& counted = roots_.roots_[root_];
+	counted.reads.fetch_add(1, std::memory_order_relaxed);
+	counted.bytes.fetch_add(bytes_, std::memory_order_relaxed);
+	counted.read_time.fetch_add(static_cast<unsigned long long>(start_.elapsed()), std::memory_order_relaxed);
+	counted.in_flight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+StorageRoots::StorageRoots(const std::vector<Path>& paths)
+{
+	for (const Path& path : paths)
+		roots_.emplace_back().path = path;
+}
+
+std::vector<Path> StorageRoots::fromConfig(const Poco::Util::AbstractConfiguration& config)
+{
+	std::vector<Path> paths;
+
+	for (const std::string& path : StringTokenizer(config.getString("Server.EpisodesPath", "./videos/episodes"), ";",
+	                                               StringTokenizer::TOK_TRIM | StringTokenizer::TOK_IGNORE_EMPTY))
+		paths.push_back(Path(path).makeDirectory());
+
+	if (paths.empty())
+		paths.push_back(Path("./videos/episodes/"));
+
+	return paths;
+}
+
+const Path& StorageRoots::path(const std::size_t root) const
+{
+	return roots_[root].path;
+}
+
+unsigned int StorageRoots::inFlight(const std::size_t root) const
+{
+	return roots_[root].in_flight.load(std::memory_order_relaxed);
+}
+
+void StorageRoots::addTrack(const std::size_t root)
+{
+	roots_[root].tracks.fetch_add(1, std::memory_order_relaxed);
+}
+
+StorageRoots::Statistics StorageRoots::statistics(const std::size_t root) const
+{
+	const Root& counted = roots_[root];
+
+	Statistics stats;
+	stats.tracks = counted.tracks.load(std::memory_order_relaxed);
+	stats.reads = counted.reads.load(std::memory_order_relaxed);
+	stats.bytes = counted.bytes.load(std::memory_order_relaxed);
+	stats.read_time = counted.read_time.load(std::memory_order_relaxed);
+	stats.in_flight = counted.in_flight.load(std::memory_order_relaxed);
+	stats.peak_in_flight = counted.peak_in_flight.load(std::memory_order_relaxed);
+	return stats;
+}
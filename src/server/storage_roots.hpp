@@ -0,0 +1,66 @@
+#pragma once
+
+#include <deque>
+
+// The directories episodes are stored in. Server.EpisodesPath lists them separated by ';', ideally one per disk: an
+// episode's track files may be spread over all of them and OfflineStreaming merges them into one index. Reads are
+// counted per root, so the status page shows how busy each disk is and where another one would help.
+class StorageRoots final
+{
+public:
+	struct Statistics
+	{
+		unsigned long long tracks = 0; // indexed on the root, copies included
+		unsigned long long reads = 0;
+		unsigned long long bytes = 0;
+		unsigned long long read_time = 0; // in microseconds, summed over concurrent reads
+		unsigned int in_flight = 0;
+		unsigned int peak_in_flight = 0;
+	};
+
+	// Counts a read against its root while it's alive
+	class Read
+	{
+	public:
+		Read(StorageRoots& roots, std::size_t root);
+		~Read();
+
+		Read(const Read&) = delete;
+		Read& operator=(const Read&) = delete;
+
+		void add(const unsigned long long bytes) { bytes_ += bytes; }
+
+	private:
+		StorageRoots& roots_;
+		std::size_t root_;
+		Poco::Clock start_;
+		unsigned long long bytes_ = 0;
+	};
+
+	explicit StorageRoots(const std::vector<Poco::Path>& paths);
+
+	// Server.EpisodesPath, in the configured order (earlier roots win duplicates)
+	static std::vector<Poco::Path> fromConfig(const Poco::Util::AbstractConfiguration& config);
+
+	[[nodiscard]] std::size_t size() const { return roots_.size(); }
+	[[nodiscard]] const Poco::Path& path(std::size_t root) const;
+	[[nodiscard]] unsigned int inFlight(std::size_t root) const;
+
+	void addTrack(std::size_t root);
+
+	[[nodiscard]] Statistics statistics(std::size_t root) const;
+
+private:
+	struct Root
+	{
+		Poco::Path path;
+		std::atomic<unsigned long long> tracks = 0;
+		std::atomic<unsigned long long> reads = 0;
+		std::atomic<unsigned long long> bytes = 0;
+		std::atomic<unsigned long long> read_time = 0;
+		std::atomic<unsigned int> in_flight = 0;
+		std::atomic<unsigned int> peak_in_flight = 0;
+	};
+
+	std::deque<Root> roots_;
+};
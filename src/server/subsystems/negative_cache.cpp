@@ -0,0 +1,99 @@
+#include "pch.hpp"
+#include "negative_cache.hpp"
+
+using Poco::Logger;
+using Poco::Timespan;
+using Poco::Timestamp;
+using Poco::Net::HTTPResponse;
+using Poco::Util::Application;
+
+const char* NegativeCache::name() const
+{
+	return "NegativeCache";
+}
+
+void NegativeCache::initialize(Application& app)
+{
+	not_found_ttl_ = Timespan(app.config().getInt("NegativeCache.NotFoundTTL", 10), 0);
+	failure_ttl_ = Timespan(app.config().getInt("NegativeCache.FailureTTL", 3), 0);
+}
+
+void NegativeCache::uninitialize()
+{
+	std::lock_guard lock(mutex_);
+	entries_.clear();
+}
+
+std::optional<HTTPResponse::HTTPStatus> NegativeCache::find(const std::string& key)
+{
+	if (not_found_ttl_ <= 0 && failure_ttl_ <= 0)
+		return std::nullopt;
+
+	std::lock_guard lock(mutex_);
+
+	const auto it = entries_.find(key);
+	if (it == entries_.end() || it->second.expires.isElapsed(0))
+		return std::nullopt;
+
+	++it->second.hits;
+	hits_.fetch_add(1, std::memory_order_relaxed);
+	return it->second.status;
+}
+
+void NegativeCache::remember(const std::string& key, const HTTPResponse::HTTPStatus status)
+{
+	static Logger& logger = Logger::get("Network");
+
+	const Timespan timeToLive = ttl(status);
+	if (timeToLive <= 0)
+		return;
+
+	Entry entry{status, Timestamp() + timeToLive.totalMicroseconds()};
+	unsigned long long suppressed = 0;
+
+	{
+		std::lock_guard lock(mutex_);
+
+		if (entries_.size() >= MAX_ENTRIES)
+			std::erase_if(entries_, [](const auto& item) { return item.second.expires.isElapsed(0); });
+
+		if (const auto it = entries_.find(key); it != entries_.end())
+		{
+			suppressed = it->second.hits;
+			it->second = entry;
+		}
+		else if (entries_.size() < MAX_ENTRIES)
+		{
+			entries_.emplace(key, entry);
+		}
+	}
+
+	// The failure itself was just logged by the handler, this accounts for the ones it didn't see
+	if (suppressed > 0 && logger.information())
+		logger.information("%s failed again, %s requests for it were answered from the negative cache meanwhile", key,
+		                   std::to_string(suppressed));
+}
+
+std::size_t NegativeCache::size() const
+{
+	std::lock_guard lock(mutex_);
+	return entries_.size();
+}
+
+Timespan NegativeCache::ttl(const HTTPResponse::HTTPStatus status) const
+{
+	switch (status)
+	{
+	case HTTPResponse::HTTP_NOT_FOUND:
+	case HTTPResponse::HTTP_NOT_ACCEPTABLE:
+	case HTTPResponse::HTTP_GONE:
+		return not_found_ttl_;
+	case HTTPResponse::HTTP_INTERNAL_SERVER_ERROR:
+	case HTTPResponse::HTTP_BAD_GATEWAY:
+	case HTTPResponse::HTTP_SERVICE_UNAVAILABLE:
+	case HTTPResponse::HTTP_GATEWAY_TIMEOUT:
+		return failure_ttl_;
+	default:
+		return {};
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <optional>
+#include <unordered_map>
+
+// Remembers requests that recently failed for a few seconds (unknown episodes, fragments missing in offline mode,
+// 404s and failures from the CDN), so the player's retries are answered without repeating the lookups and fetches.
+// Only the first failure per entry is logged.
+class NegativeCache final : public Poco::Util::Subsystem
+{
+public:
+	[[nodiscard]] const char* name() const override;
+
+	// Status the request was answered with recently, if it's still cached
+	std::optional<Poco::Net::HTTPResponse::HTTPStatus> find(const std::string& key);
+
+	// Caches not-found statuses (404, 406, 410) and server-side failures (500, 502-504), ignores everything else
+	void remember(const std::string& key, Poco::Net::HTTPResponse::HTTPStatus status);
+
+	[[nodiscard]] std::size_t size() const;
+	[[nodiscard]] unsigned long long hits() const { return hits_.load(std::memory_order_relaxed); }
+
+protected:
+	void initialize(Poco::Util::Application& app) override;
+	void uninitialize() override;
+
+private:
+	struct Entry
+	{
+		Poco::Net::HTTPResponse::HTTPStatus status;
+		Poco::Timestamp expires;
+		unsigned long long hits = 0;
+	};
+
+	static constexpr std::size_t MAX_ENTRIES = 4096;
+
+	Poco::Timespan not_found_ttl_;
+	Poco::Timespan failure_ttl_;
+
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, Entry> entries_;
+	std::atomic<unsigned long long> hits_ = 0;
+
+	[[nodiscard]] Poco::Timespan ttl(Poco::Net::HTTPResponse::HTTPStatus status) const;
+};
@@ -1,20 +1,91 @@
 #include "pch.hpp"
 #include "offline_streaming.hpp"
 
+#include "subtitle_override.hpp"
 #include "video_list.hpp"
 
+#include "../byte_order.hpp"
+#include "../client_manifest.hpp"
+#include "../episode_archive.hpp"
+#include "../handler_factory.hpp"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <ranges>
+
 using Poco::AutoPtr;
+using Poco::Clock;
 using Poco::DirectoryIterator;
 using Poco::File;
 using Poco::Logger;
 using Poco::Path;
+using Poco::Timespan;
 using Poco::Util::Application;
 using Poco::XML::DOMParser;
+using Poco::XML::DOMWriter;
 using Poco::XML::Document;
 using Poco::XML::Element;
 using Poco::XML::InputSource;
 using Poco::XML::Node;
 using Poco::XML::NodeList;
+using Poco::XML::XMLWriter;
+
+namespace
+{
+	// Indexing is mostly parsing (manifests, tfra boxes, SubRip overrides), a few threads go a long way
+	constexpr unsigned int MAX_PRELOAD_THREADS = 4;
+
+	// The page cache most likely still holds an episode warmed up this recently
+	const Timespan WARMUP_INTERVAL(5 * Timespan::MINUTES);
+	constexpr std::size_t WARMUP_BATCH = 16; // chunks of FragmentIo::PREFETCH_CHUNK_SIZE per read
+
+	// The moov in front of the first fragment of a track file only holds its sample descriptions
+	constexpr unsigned long long MAX_TRACK_HEADER = 1 << 20;
+
+	// Bitrates and start times
+	bool parseNumber(const std::string& value, unsigned long long& number)
+	{
+		const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+		return ec == std::errc() && end == value.data() + value.size();
+	}
+
+	// moof + mdat size of the fragment starting at moof_offset, 0 if the boxes aren't there
+	unsigned long long readFragmentSize(std::istream& stream, const unsigned long long moof_offset)
+	{
+		char header[8];
+		unsigned long long size = 0;
+
+		for (const char* expectedMagic : {BLOCK_MOOF, BLOCK_MDAT})
+		{
+			stream.clear();
+			stream.seekg(static_cast<long long>(moof_offset + size));
+			stream.read(header, sizeof(header));
+
+			if (!stream || std::string_view(header + 4, 4) != expectedMagic)
+				return 0;
+
+			unsigned int boxSize;
+			memcpy(&boxSize, header, sizeof(boxSize));
+			size += fromBigEndian(boxSize);
+		}
+
+		return size;
+	}
+
+	// tfra traf/trun/sample numbers are 1-4 byte big-endian integers
+	unsigned long long readVariableSizeNumber(std::istream& stream, const int size)
+	{
+		unsigned char bytes[4] = {};
+		stream.read(reinterpret_cast<char*>(bytes), size);
+
+		unsigned long long value = 0;
+		for (int i = 0; i < size; ++i)
+			value = value << 8 | bytes[i];
+
+		return value;
+	}
+}
 
 const char* OfflineStreaming::name() const
 {
@@ -23,12 +94,75 @@ const char* OfflineStreaming::name() const
 
 void OfflineStreaming::initialize(Application& app)
 {
-	if (!app.config().getBool("VideoList.PatchFile", true))
-		preload();
+	bitrate_substitution_ = parseBitrateSubstitution(app.config().getString("Server.BitrateSubstitution", "none"));
+	synthesize_client_manifests_ = app.config().getBool("Server.SynthesizeClientManifest", false);
+
+	const FragmentIo::Backend backend = FragmentIo::parseBackend(app.config().getString("Server.FragmentIO", "blocking"));
+
+	try
+	{
+		fragment_io_ = FragmentIo::create(backend);
+	}
+	catch (const Poco::Exception& e)
+	{
+		Logger::get(name()).warning("Can't use io_uring for fragment reads, falling back to blocking reads: %s",
+		                            e.displayText());
+		fragment_io_ = FragmentIo::create(FragmentIo::Backend::BLOCKING);
+	}
+
+	std::vector<Path> roots = StorageRoots::fromConfig(app.config());
+	library_roots_ = roots.size();
+
+	// Hot tracks are copied to the fast tier, which is read from like another root
+	if (const std::string fastTierPath = app.config().getString("Server.FastTierPath", ""); !fastTierPath.empty())
+	{
+		const Poco::Int64 sizeMb = std::max(app.config().getInt64("Server.FastTierSize", 16384), Poco::Int64(0));
+		const int promoteAfter = std::max(app.config().getInt("Server.FastTierPromoteAfter", 30), 1);
+
+		try
+		{
+			fast_tier_ = std::make_unique<FastTier>(Path(fastTierPath).makeDirectory(),
+			                                        static_cast<unsigned long long>(sizeMb) << 20,
+			                                        static_cast<unsigned int>(promoteAfter), *fragment_io_);
+			roots.push_back(fast_tier_->path());
+		}
+		catch (const Poco::Exception& e)
+		{
+			Logger::get(name()).warning("Can't use the fast tier in %s: %s", fastTierPath, e.displayText());
+		}
+	}
+
+	storage_roots_ = std::make_unique<StorageRoots>(roots);
+
+	// Fragment start times are in 100ns ticks
+	warmup_window_ = static_cast<unsigned long long>(std::max(app.config().getInt("Server.WarmupSeconds", 10), 0)) *
+		10000000;
 }
 
 void OfflineStreaming::uninitialize()
 {
+	stopPreload();
+	stopWarmer();
+	fast_tier_.reset();
+	fragment_io_.reset();
+
+	Logger& logger = Logger::get(name());
+
+	for (std::size_t root = 0; root < storage_roots_->size(); ++root)
+	{
+		const StorageRoots::Statistics stats = storage_roots_->statistics(root);
+		logger.debug("Storage root %s: %s tracks, %s reads, %s bytes, peak queue depth %u",
+		             storage_roots_->path(root).toString(), std::to_string(stats.tracks), std::to_string(stats.reads),
+		             std::to_string(stats.bytes), stats.peak_in_flight);
+	}
+
+	{
+		std::lock_guard lock(client_manifests_mutex_);
+		client_manifests_.clear();
+	}
+
+	std::unique_lock lock(streams_mutex_);
+	streams_by_symbol_.clear();
 	streams_.clear();
 }
 
@@ -39,65 +173,539 @@ void OfflineStreaming::preload()
 	Logger& logger = Logger::get(name());
 	logger.information("Initializing offline playback subsystem...");
 
-	std::string episodesPath = app.config().getString("Server.EpisodesPath", "./videos/episodes");
+	const Clock start;
 	VideoList& videoList = app.getSubsystem<VideoList>();
 
-	// Check if the episodes path exists
-	for (auto episodes = videoList.getEpisodeList(); const auto& episode : episodes)
+	const auto episodes = videoList.getEpisodeList();
+	std::atomic<std::size_t> next = 0;
+
+	const auto indexEpisodes = [&]
+	{
+		for (auto i = next++; i < episodes.size() && !stopping_; i = next++)
+			ensureEpisode(episodes[i]);
+	};
+
+	const unsigned int threadCount = std::clamp(std::thread::hardware_concurrency(), 1u, MAX_PRELOAD_THREADS);
+	std::vector<std::thread> indexers;
+
+	for (unsigned int i = 1; i < threadCount; ++i)
+		indexers.emplace_back(indexEpisodes);
+
+	indexEpisodes();
+
+	for (auto& indexer : indexers)
+		indexer.join();
+
+	if (stopping_)
+		return;
+
+	preloaded_.store(true, std::memory_order_release);
+
+	std::size_t episodeCount;
+
+	{
+		std::shared_lock lock(streams_mutex_);
+		episodeCount = streams_.size();
+	}
+
+	logger.information("%s episodes are ready to offline playback! (indexed in %s ms)", std::to_string(episodeCount),
+	                   std::to_string(start.elapsed() / 1000));
+}
+
+void OfflineStreaming::startPreload()
+{
+	if (preloader_.joinable())
+		return;
+
+	preloader_ = std::thread([this]
+	{
+		try
+		{
+			preload();
+		}
+		catch (Poco::Exception& ex)
+		{
+			Logger::get(name()).error("Preloading episodes failed, they are indexed on first request (%s)",
+			                          ex.displayText());
+		}
+	});
+}
+
+void OfflineStreaming::stopPreload()
+{
+	stopping_ = true;
+
+	if (preloader_.joinable())
+		preloader_.join();
+}
+
+void OfflineStreaming::ensureEpisode(const std::string& episode_id)
+{
+	// Everything is indexed once the preloader is done, no need to take the lock anymore
+	if (preloaded())
+		return;
+
+	std::unique_lock lock(index_mutex_);
+	IndexState& state = index_states_[episode_id];
+
+	if (state == IndexState::PENDING)
+	{
+		state = IndexState::INDEXING;
+		lock.unlock();
+
+		try
+		{
+			indexEpisode(episode_id);
+		}
+		catch (Poco::Exception& ex)
+		{
+			// Nothing local then, requests for it go upstream
+			Logger::get(name()).error("Failed to index episode %s (%s)", episode_id, ex.displayText());
+		}
+		catch (std::exception& ex)
+		{
+			Logger::get(name()).error("Failed to index episode %s (%s)", episode_id, std::string(ex.what()));
+		}
+
+		lock.lock();
+		index_states_[episode_id] = IndexState::INDEXED;
+		index_changed_.notify_all();
+		return;
+	}
+
+	// Another thread is indexing it, a request or the preloader
+	index_changed_.wait(lock, [&] { return index_states_[episode_id] == IndexState::INDEXED; });
+}
+
+void OfflineStreaming::warmEpisode(const std::string& episode_id)
+{
+	if (warmup_window_ == 0)
+		return;
+
+	std::lock_guard lock(warmup_mutex_);
+
+	if (warmer_stopping_)
+		return;
+
+	const auto warmedUp = warmed_up_.find(episode_id);
+	if (warmedUp != warmed_up_.end() && !warmedUp->second.isElapsed(WARMUP_INTERVAL.totalMicroseconds()))
+		return;
+
+	// A manifest request per episode is plenty, anything beyond a short queue is a client going through the list
+	if (warmup_queue_.size() >= MAX_WARMUP_QUEUE ||
+		std::ranges::find(warmup_queue_, episode_id) != warmup_queue_.end())
+		return;
+
+	warmup_queue_.push_back(episode_id);
+
+	// Started on demand, tools using this subsystem never need it
+	if (!warmer_.joinable())
+		warmer_ = std::thread([this] { runWarmer(); });
+
+	warmup_queued_.notify_one();
+}
+
+void OfflineStreaming::runWarmer()
+{
+	Logger& logger = Logger::get(name());
+
+	while (true)
 	{
-		Path episodePath(episodesPath);
-		episodePath.append(episode);
-		File episodeDir(episodePath);
+		std::string episodeId;
+
+		{
+			std::unique_lock lock(warmup_mutex_);
+			warmup_queued_.wait(lock, [this] { return warmer_stopping_ || !warmup_queue_.empty(); });
 
-		if (!(episodeDir.exists() && episodeDir.isDirectory()))
+			if (warmer_stopping_)
+				return;
+
+			episodeId = std::move(warmup_queue_.front());
+			warmup_queue_.pop_front();
+			warmed_up_[episodeId].update();
+		}
+
+		try
+		{
+			warmUp(episodeId);
+		}
+		catch (Poco::Exception& ex)
+		{
+			logger.warning("Failed to warm up episode %s (%s)", episodeId, ex.displayText());
+		}
+	}
+}
+
+void OfflineStreaming::stopWarmer()
+{
+	{
+		std::lock_guard lock(warmup_mutex_);
+		warmer_stopping_ = true;
+		warmup_queued_.notify_all();
+	}
+
+	if (warmer_.joinable())
+		warmer_.join();
+}
+
+void OfflineStreaming::warmUp(const std::string& episode_id) const
+{
+	Logger& logger = Logger::get(name());
+
+	const SmoothStream* stream = findStream(episode_id);
+	if (!stream)
+		return;
+
+	const Clock start;
+	unsigned long long bytes = 0;
+
+	for (const auto& media : stream->media_map | std::views::values)
+	{
+		if (warmer_stopping_)
+			return;
+
+		bytes += warmUpTrack(*stream, media);
+	}
+
+	logger.debug("Warmed up %s tracks of episode %s (%s KB in %s ms)", std::to_string(stream->media_map.size()),
+	             episode_id, std::to_string(bytes >> 10), std::to_string(start.elapsed() / 1000));
+}
+
+unsigned long long OfflineStreaming::warmUpTrack(const SmoothStream& stream, const SmoothMedia& media) const
+{
+	const auto& fragments = media.track.fragments;
+	if (fragments.empty())
+		return 0;
+
+	// Fragments are keyed by their start time as a string, so the earliest ones aren't necessarily first
+	unsigned long long firstStart = std::numeric_limits<unsigned long long>::max();
+	for (const auto& startTime : fragments | std::views::keys)
+		if (unsigned long long value; parseNumber(startTime, value))
+			firstStart = std::min(firstStart, value);
+
+	// The opening fragments are next to each other in the track, one contiguous range covers them
+	unsigned long long begin = std::numeric_limits<unsigned long long>::max(), end = 0;
+	for (const auto& [startTime, fragment] : fragments)
+	{
+		if (unsigned long long value; !parseNumber(startTime, value) || value - firstStart >= warmup_window_)
 			continue;
 
-		// Find all *.ism files in the episode directory
-		for (DirectoryIterator it(episodeDir), end; it != end; ++it)
+		begin = std::min(begin, fragment.moof_offset);
+		end = std::max(end, fragment.moof_offset + fragment.size);
+	}
+
+	if (begin >= end)
+		return 0;
+
+	std::size_t root;
+	const std::string& path = selectCopy(media, root);
+	StorageRoots::Read rootRead(*storage_roots_, root);
+
+	if (stream.archive)
+	{
+		// Touching a byte per page faults the range in
+		const std::string_view range = stream.archive->bytes(begin, end - begin);
+		volatile char page = 0;
+
+		for (std::size_t offset = 0; offset < range.size(); offset += EpisodeArchive::PAGE_SIZE)
+			page = range[offset];
+
+		rootRead.add(range.size());
+		return range.size();
+	}
+
+	// The chunks only need to reach the page cache, a batch of them goes out in one read
+	std::array<FragmentIo::Read, WARMUP_BATCH> reads;
+	unsigned long long offset = begin, bytes = 0;
+
+	while (offset < end && !warmer_stopping_)
+	{
+		std::size_t count = 0;
+
+		for (; count < reads.size() && offset < end; ++count)
 		{
-			if (Path(it.name()).getExtension() != "ism")
-				continue;
+			const auto chunk = static_cast<std::size_t>(
+				std::min<unsigned long long>(end - offset, FragmentIo::PREFETCH_CHUNK_SIZE));
+			reads[count] = {offset, chunk, nullptr};
+			offset += chunk;
+		}
+
+		if (!fragment_io_->read(path, std::span(reads.data(), count)))
+			break;
 
-			std::ifstream fileStream(it.path().toString());
-			if (!fileStream)
+		for (const FragmentIo::Read& read : std::span(reads.data(), count))
+		{
+			if (read.result > 0)
 			{
-				logger.error("Failed to open server manifest file (%s) for episode %s", it.name(), episode);
-				continue;
+				bytes += static_cast<unsigned long long>(read.result);
+				rootRead.add(static_cast<unsigned long long>(read.result));
 			}
 
-			std::string manifestContent((std::istreambuf_iterator<char>(fileStream)), {});
-			std::istringstream manifestStream(manifestContent);
-			InputSource manifestSource(manifestStream);
-			DOMParser parser;
-			AutoPtr doc(parser.parse(&manifestSource));
+			if (read.result != static_cast<long long>(read.length))
+				return bytes;
+		}
+	}
 
-			SmoothStream stream;
-			Node* metaNode = doc->getNodeByPath("//head/meta[@name='clientManifestRelativePath']");
-			if (!metaNode || metaNode->nodeType() != Node::ELEMENT_NODE)
+	return bytes;
+}
+
+void OfflineStreaming::indexEpisode(const std::string& episode_id)
+{
+	Application& app = Application::instance();
+
+	// Caption overrides belong to the episode's readiness too, caption fragments are rewritten with them
+	app.getSubsystem<SubtitleOverride>().loadEpisode(episode_id);
+
+	// A packed archive replaces the episode directories, the first root that has one wins
+	for (std::size_t root = 0; root < library_roots_; ++root)
+	{
+		Path archivePath(storage_roots_->path(root));
+		archivePath.setFileName(episode_id + "." + EpisodeArchive::EXTENSION);
+
+		if (File(archivePath).exists() && loadEpisodeArchive(episode_id, archivePath, root))
+			return;
+	}
+
+	// Otherwise the episode directories of all roots make up the episode
+	std::vector<Path> episodePaths;
+	bool found = false;
+
+	for (std::size_t root = 0; root < library_roots_; ++root)
+	{
+		Path& episodePath = episodePaths.emplace_back(storage_roots_->path(root));
+		episodePath.append(episode_id);
+
+		if (File episodeDir(episodePath); episodeDir.exists() && episodeDir.isDirectory())
+			found = true;
+	}
+
+	if (!found)
+		return;
+
+	if (SmoothStream stream; loadEpisodeDirectory(episode_id, episodePaths, stream))
+		addStream(episode_id, std::move(stream));
+}
+
+void OfflineStreaming::addStream(const std::string& episode_id, SmoothStream stream)
+{
+	const SymbolTable::Symbol episode = SymbolTable::episodes().intern(episode_id);
+
+	std::unique_lock lock(streams_mutex_);
+	SmoothStream& added = streams_[episode_id] = std::move(stream);
+
+	// Requests look up media by symbol, the names are only needed for substitution and manifest filtering
+	for (auto& media : added.media_map | std::views::values)
+	{
+		symbolSlot(symbolSlot(added.media_by_symbol, media.track_symbol), media.bitrate_symbol) = &media;
+
+		if (fast_tier_ && !added.archive)
+			media.fast_copy = fast_tier_->add(episode_id, media.source_file, media.last_modified);
+
+		storage_roots_->addTrack(media.root);
+		for (const std::size_t root : media.copies | std::views::keys)
+			storage_roots_->addTrack(root);
+	}
+
+	symbolSlot(streams_by_symbol_, episode) = &added;
+}
+
+const OfflineStreaming::SmoothStream* OfflineStreaming::findStream(const std::string& episode_id) const
+{
+	std::shared_lock lock(streams_mutex_);
+	const auto it = streams_.find(episode_id);
+	return it != streams_.end() ? &it->second : nullptr;
+}
+
+const OfflineStreaming::SmoothStream* OfflineStreaming::findStream(const SymbolTable::Symbol episode) const
+{
+	std::shared_lock lock(streams_mutex_);
+	return symbolAt(streams_by_symbol_, episode);
+}
+
+bool OfflineStreaming::loadEpisodeDirectory(const std::string& episode_id, const std::vector<Path>& episode_paths,
+                                            SmoothStream& stream, std::string* server_manifest) const
+{
+	for (const Path& episodePath : episode_paths)
+	{
+		if (File episodeDir(episodePath); !(episodeDir.exists() && episodeDir.isDirectory()))
+			continue;
+
+		if (loadServerManifest(episode_id, episodePath, episode_paths, stream, server_manifest))
+			return true;
+	}
+
+	return false;
+}
+
+bool OfflineStreaming::loadServerManifest(const std::string& episode_id, const Path& episode_path,
+                                          const std::vector<Path>& episode_paths, SmoothStream& stream,
+                                          std::string* server_manifest) const
+{
+	Logger& logger = Logger::get(name());
+
+	bool loaded = false;
+
+	// Find all *.ism files in the episode directory
+	for (DirectoryIterator it(episode_path), end; it != end; ++it)
+	{
+		if (Path(it.name()).getExtension() != "ism")
+			continue;
+
+		std::ifstream fileStream(it.path().toString());
+		if (!fileStream)
+		{
+			logger.error("Failed to open server manifest file (%s) for episode %s", it.name(), episode_id);
+			continue;
+		}
+
+		std::string manifestContent((std::istreambuf_iterator<char>(fileStream)), {});
+		std::istringstream manifestStream(manifestContent);
+		InputSource manifestSource(manifestStream);
+		DOMParser parser;
+		AutoPtr doc(parser.parse(&manifestSource));
+
+		SmoothStream episodeStream;
+		Node* metaNode = doc->getNodeByPath("//head/meta[@name='clientManifestRelativePath']");
+		if (!metaNode || metaNode->nodeType() != Node::ELEMENT_NODE)
+		{
+			logger.warning("Server manifest file (%s) missing clientManifestRelativePath, skipping.", it.name());
+			continue;
+		}
+
+		auto* metaElem = dynamic_cast<Element*>(metaNode);
+		Path clientManifestPath = episode_path;
+		clientManifestPath.append(metaElem->getAttribute("content"));
+		episodeStream.client_manifest_relative_path = clientManifestPath;
+
+		processMediaNodes("video", doc, episode_id, episode_paths, episodeStream);
+		processMediaNodes("audio", doc, episode_id, episode_paths, episodeStream);
+		processMediaNodes("textstream", doc, episode_id, episode_paths, episodeStream);
+
+		stream = episodeStream;
+		loaded = true;
+
+		if (server_manifest)
+			*server_manifest = manifestContent;
+	}
+
+	return loaded;
+}
+
+bool OfflineStreaming::loadEpisodeArchive(const std::string& episode_id, const Path& archive_path,
+                                          const std::size_t root)
+{
+	Logger& logger = Logger::get(name());
+
+	try
+	{
+		SmoothStream stream;
+		stream.archive = std::make_shared<EpisodeArchive>(archive_path);
+		stream.client_manifest_relative_path = archive_path;
+
+		for (const auto& [trackName, bitrate, dataOffset, dataSize, fragments] : stream.archive->tracks())
+		{
+			const std::string mediaKey = trackName + "_" + bitrate;
+
+			SmoothMedia media;
+			media.source_file = archive_path;
+			media.source_path = archive_path.toString();
+			media.root = root;
+			media.last_modified = stream.archive->lastModified();
+			media.system_bitrate = bitrate;
+			media.track_symbol = SymbolTable::tracks().intern(trackName);
+			media.bitrate_symbol = SymbolTable::bitrates().intern(bitrate);
+
+			for (const auto& [startTime, offset, size] : fragments)
 			{
-				logger.warning("Server manifest file (%s) missing clientManifestRelativePath, skipping.", it.name());
-				continue;
+				SmoothFragment fragment{};
+				fragment.moof_offset = dataOffset + offset;
+				fragment.size = size;
+				media.track.fragments[std::to_string(startTime)] = fragment;
 			}
 
-			auto* metaElem = dynamic_cast<Element*>(metaNode);
-			Path clientManifestPath = episodePath;
-			clientManifestPath.append(metaElem->getAttribute("content"));
-			stream.client_manifest_relative_path = clientManifestPath;
+			stream.media_map[mediaKey] = media;
 
-			processMediaNodes("video", doc, episode, episodePath.toString(), stream);
-			processMediaNodes("audio", doc, episode, episodePath.toString(), stream);
-			processMediaNodes("textstream", doc, episode, episodePath.toString(), stream);
+			if (unsigned long long numericBitrate; parseNumber(bitrate, numericBitrate))
+				stream.track_bitrates[trackName][numericBitrate] = mediaKey;
+		}
 
-			streams_[episode] = stream;
+		logger.debug("Loaded episode %s from archive %s (%s tracks)", episode_id, archive_path.toString(),
+		             std::to_string(stream.media_map.size()));
+
+		addStream(episode_id, std::move(stream));
+		return true;
+	}
+	catch (Poco::Exception& ex)
+	{
+		logger.error("Failed to load episode archive %s, falling back to the episode directory (%s)",
+		             archive_path.toString(), ex.displayText());
+		return false;
+	}
+}
+
+bool OfflineStreaming::packEpisode(const std::string& episode_id, const Path& episode_path,
+                                   const Path& archive_path) const
+{
+	Logger& logger = Logger::get(name());
+
+	SmoothStream stream;
+	std::string serverManifest;
+
+	if (!loadEpisodeDirectory(episode_id, {episode_path}, stream, &serverManifest))
+	{
+		logger.error("No server manifest found for episode %s in %s", episode_id, episode_path.toString());
+		return false;
+	}
+
+	std::ifstream clientManifestStream(stream.client_manifest_relative_path.toString(), std::ios::binary);
+
+	if (!clientManifestStream)
+	{
+		logger.error("Failed to open client manifest file %s", stream.client_manifest_relative_path.toString());
+		return false;
+	}
+
+	const std::string clientManifest((std::istreambuf_iterator<char>(clientManifestStream)), {});
+
+	std::vector<EpisodeArchive::TrackSource> tracks;
+
+	for (const auto& [mediaKey, media] : stream.media_map)
+	{
+		EpisodeArchive::TrackSource track;
+		track.name = mediaKey.substr(0, mediaKey.size() - media.system_bitrate.size() - 1);
+		track.bitrate = media.system_bitrate;
+		track.source_file = media.source_file;
+
+		std::ifstream trackStream(media.source_file.toString(), std::ios::binary);
+
+		for (const auto& [startTime, fragment] : media.track.fragments)
+		{
+			// Store the exact moof + mdat extent so the server never has to look at box headers
+			const unsigned long long size = readFragmentSize(trackStream, fragment.moof_offset);
+
+			if (size == 0)
+			{
+				logger.warning("Skipping unreadable fragment at start time %s in track %s", startTime,
+				               media.source_file.toString());
+				continue;
+			}
+
+			track.fragments.push_back({std::stoull(startTime), fragment.moof_offset, size});
 		}
+
+		std::ranges::sort(track.fragments, {}, &EpisodeArchive::Fragment::start_time);
+		tracks.push_back(std::move(track));
 	}
 
-	logger.information("%s episodes are ready to offline playback!",
-	                   std::to_string(streams_.size()));
+	EpisodeArchive::write(archive_path, serverManifest, clientManifest, tracks);
+
+	logger.information("Packed episode %s (%s tracks) into %s", episode_id, std::to_string(tracks.size()),
+	                   archive_path.toString());
+	return true;
 }
 
 void OfflineStreaming::processMediaNodes(const std::string& tag_name, Document* doc, const std::string& episode_id,
-                                         const std::string& episode_path, SmoothStream& stream) const
+                                         const std::vector<Path>& episode_paths, SmoothStream& stream) const
 {
 	Logger& logger = Logger::get(name());
 
@@ -122,24 +730,58 @@ void OfflineStreaming::processMediaNodes(const std::string& tag_name, Document*
 			}
 		}
 
-		Path fullPath = episode_path;
-		fullPath.append(src);
-		if (!fullPath.isFile())
-			continue;
-
 		std::string mediaKey = trackName + "_" + bitrate;
 
 		SmoothMedia media;
-		media.source_file = fullPath;
-		media.system_bitrate = bitrate;
+		bool preloaded = false;
 
-		if (auto [success, track] = preloadTrack(fullPath.toString()); success)
+		// The track file may be on any root, the first one found is indexed and identical copies on later roots
+		// share the reads
+		for (std::size_t root = 0; root < episode_paths.size(); ++root)
 		{
-			media.track = track;
-			stream.media_map[mediaKey] = media;
-			logger.debug("Preloaded %s track '%s' for episode %s from %s with bitrate %s", tag_name, trackName,
-			             episode_id, fullPath.toString(), bitrate);
+			Path fullPath = episode_paths[root];
+			fullPath.append(src);
+			if (!fullPath.isFile() || !File(fullPath).exists())
+				continue;
+
+			auto [success, track] = preloadTrack(fullPath.toString());
+
+			if (!success)
+				continue;
+
+			if (preloaded)
+			{
+				if (track.fragments == media.track.fragments)
+					media.copies.emplace_back(root, fullPath.toString());
+				else
+					logger.warning("Track %s doesn't match %s, only the first one is used", fullPath.toString(),
+					               media.source_path);
+
+				continue;
+			}
+
+			media.source_file = fullPath;
+			media.source_path = fullPath.toString();
+			media.root = root;
+			media.last_modified = File(fullPath).getLastModified();
+			media.system_bitrate = bitrate;
+			media.stream_type = tag_name == "textstream" ? "text" : tag_name;
+			media.track_symbol = SymbolTable::tracks().intern(trackName);
+			media.bitrate_symbol = SymbolTable::bitrates().intern(bitrate);
+			media.track = std::move(track);
+			preloaded = true;
 		}
+
+		if (!preloaded)
+			continue;
+
+		logger.debug("Preloaded %s track '%s' for episode %s from %s with bitrate %s (%z copies)", tag_name, trackName,
+		             episode_id, media.source_path, bitrate, media.copies.size());
+
+		stream.media_map[mediaKey] = std::move(media);
+
+		if (unsigned long long numericBitrate; parseNumber(bitrate, numericBitrate))
+			stream.track_bitrates[trackName][numericBitrate] = mediaKey;
 	}
 }
 
@@ -161,17 +803,18 @@ std::pair<bool, OfflineStreaming::SmoothTrack> OfflineStreaming::preloadTrack(co
 
 	// Read mfro box
 	trackStream.seekg(-4, std::ios::end);
+	const unsigned long long mfroEnd = static_cast<unsigned long long>(trackStream.tellg()) + 4;
 
 	unsigned int mfroSize;
 	trackStream.read(reinterpret_cast<char*>(&mfroSize), sizeof(mfroSize));
-	mfroSize = _byteswap_ulong(mfroSize);
+	mfroSize = fromBigEndian(mfroSize);
 
 	trackStream.seekg(-static_cast<int>(mfroSize), std::ios::end);
 
 	// Read mfra box
 	unsigned int mfraBlockSize;
 	trackStream.read(reinterpret_cast<char*>(&mfraBlockSize), sizeof(mfraBlockSize));
-	mfraBlockSize = _byteswap_ulong(mfraBlockSize);
+	mfraBlockSize = fromBigEndian(mfraBlockSize);
 
 	if (mfraBlockSize != mfroSize)
 	{
@@ -198,7 +841,7 @@ std::pair<bool, OfflineStreaming::SmoothTrack> OfflineStreaming::preloadTrack(co
 	// Read tfra box
 	unsigned int tfraSize;
 	trackStream.read(reinterpret_cast<char*>(&tfraSize), sizeof(tfraSize));
-	tfraSize = _byteswap_ulong(tfraSize);
+	tfraSize = fromBigEndian(tfraSize);
 
 	std::string tfraExpectedMagic = BLOCK_TFRA;
 	std::string tfraMagic(tfraExpectedMagic.length(), '\0');
@@ -221,17 +864,18 @@ std::pair<bool, OfflineStreaming::SmoothTrack> OfflineStreaming::preloadTrack(co
 
 	unsigned int trackId;
 	trackStream.read(reinterpret_cast<char*>(&trackId), sizeof(trackId));
-	track.track_id = _byteswap_ulong(trackId);
+	track.track_id = fromBigEndian(trackId);
 
-	int temp;
+	unsigned int temp;
 	trackStream.read(reinterpret_cast<char*>(&temp), sizeof(temp));
+	temp = fromBigEndian(temp);
 	track.length_size_of_traf_num = ((temp & 0x3F) >> 4) + 1;
 	track.length_size_of_trun_num = ((temp & 0xC) >> 2) + 1;
 	track.length_size_of_sample_num = (temp & 0x3) + 1;
 
 	unsigned int numberOfEntries;
 	trackStream.read(reinterpret_cast<char*>(&numberOfEntries), sizeof(numberOfEntries));
-	numberOfEntries = _byteswap_ulong(numberOfEntries);
+	numberOfEntries = fromBigEndian(numberOfEntries);
 
 	std::map<std::string, SmoothFragment> fragments;
 
@@ -245,36 +889,53 @@ std::pair<bool, OfflineStreaming::SmoothTrack> OfflineStreaming::preloadTrack(co
 		{
 			unsigned long long time;
 			trackStream.read(reinterpret_cast<char*>(&time), sizeof(time));
-			startTime = _byteswap_uint64(time);
+			startTime = fromBigEndian(time);
 
 			unsigned long long moofOffset;
 			trackStream.read(reinterpret_cast<char*>(&moofOffset), sizeof(moofOffset));
-			fragment.moof_offset = _byteswap_uint64(moofOffset);
+			fragment.moof_offset = fromBigEndian(moofOffset);
 		}
 		else
 		{
 			unsigned int time;
 			trackStream.read(reinterpret_cast<char*>(&time), sizeof(time));
-			startTime = _byteswap_ulong(time);
+			startTime = fromBigEndian(time);
 
 			unsigned int moofOffset;
 			trackStream.read(reinterpret_cast<char*>(&moofOffset), sizeof(moofOffset));
-			fragment.moof_offset = _byteswap_ulong(moofOffset);
+			fragment.moof_offset = fromBigEndian(moofOffset);
 		}
 
-		unsigned long long trafNumber;
-		trackStream.read(reinterpret_cast<char*>(&trafNumber), track.length_size_of_traf_num);
-		fragment.traf_number = _byteswap_uint64(trafNumber);
+		fragment.traf_number = readVariableSizeNumber(trackStream, track.length_size_of_traf_num);
+		fragment.trun_number = readVariableSizeNumber(trackStream, track.length_size_of_trun_num);
+		fragment.sample_number = readVariableSizeNumber(trackStream, track.length_size_of_sample_num);
+
+		fragments[std::to_string(startTime)] = fragment;
+	}
+
+	// The exact moof + mdat extent from the box headers, boxes between fragments aren't part of them. Several entries
+	// may point at one moof, its headers are only read once. Fragments whose boxes don't check out keep size 0 and
+	// are served from a full read that looks at the boxes again.
+	std::vector<SmoothFragment*> byOffset;
+	byOffset.reserve(fragments.size());
 
-		unsigned long long trunNumber;
-		trackStream.read(reinterpret_cast<char*>(&trunNumber), track.length_size_of_trun_num);
-		fragment.trun_number = _byteswap_uint64(trunNumber);
+	for (auto& fragment : fragments | std::views::values)
+		byOffset.push_back(&fragment);
 
-		unsigned long long sampleNumber;
-		trackStream.read(reinterpret_cast<char*>(&sampleNumber), track.length_size_of_sample_num);
-		fragment.sample_number = _byteswap_uint64(sampleNumber);
+	std::ranges::sort(byOffset, {}, &SmoothFragment::moof_offset);
 
-		fragments[std::to_string(startTime)] = fragment;
+	const unsigned long long mfraOffset = mfroEnd - mfroSize;
+
+	for (std::size_t i = 0; i < byOffset.size(); ++i)
+	{
+		if (i > 0 && byOffset[i]->moof_offset == byOffset[i - 1]->moof_offset)
+		{
+			byOffset[i]->size = byOffset[i - 1]->size;
+			continue;
+		}
+
+		const unsigned long long size = readFragmentSize(trackStream, byOffset[i]->moof_offset);
+		byOffset[i]->size = byOffset[i]->moof_offset + size <= mfraOffset ? size : 0;
 	}
 
 	track.fragments = fragments;
@@ -286,16 +947,35 @@ std::pair<bool, OfflineStreaming::SmoothTrack> OfflineStreaming::preloadTrack(co
 
 std::string OfflineStreaming::getLocalClientManifest(const std::string& episode_id)
 {
-	if (!streams_.contains(episode_id))
+	const SmoothStream* streamPtr = findStream(episode_id);
+	if (!streamPtr)
 		return "";
 
 	Logger& logger = Logger::get(name());
+	const SmoothStream& stream = *streamPtr;
+
+	if (stream.archive)
+	{
+		const std::string manifest(stream.archive->clientManifest());
 
-	Path clientManifestRelativePath = streams_[episode_id].client_manifest_relative_path;
+		if (bitrate_substitution_ != BitrateSubstitution::NONE)
+			return filterClientManifest(stream, manifest);
+
+		return manifest;
+	}
+
+	Path clientManifestRelativePath = stream.client_manifest_relative_path;
 	std::ifstream clientManifestStream(clientManifestRelativePath.toString());
 
 	if (!clientManifestStream)
 	{
+		// Only lists the quality levels stored locally, there's nothing to filter
+		if (synthesize_client_manifests_)
+		{
+			if (std::string manifest = synthesizeClientManifest(episode_id, stream); !manifest.empty())
+				return manifest;
+		}
+
 		logger.warning(
 			"Failed to open client manifest file %s, the file was there while initializing, but it probably got deleted. Will need to fetch client manifest from server.",
 			clientManifestRelativePath);
@@ -309,6 +989,10 @@ std::string OfflineStreaming::getLocalClientManifest(const std::string& episode_
 
 	clientManifestStream.close();
 
+	// Substituted fragments only stay consistent if the player never picks a quality level we can't serve
+	if (bitrate_substitution_ != BitrateSubstitution::NONE)
+		return filterClientManifest(stream, buffer.str());
+
 	return buffer.str();
 }
 
@@ -316,92 +1000,469 @@ std::string OfflineStreaming::getLocalFragment(const std::string& episode_id, co
                                                const std::string& bitrate,
                                                const std::string& start_time)
 {
-	if (!streams_.contains(episode_id))
+	FragmentLocation location;
+
+	if (!findLocalFragment(episode_id, track_name, bitrate, start_time, location))
 		return {};
 
-	Logger& logger = Logger::get(name());
+	return readLocalFragment(location, start_time);
+}
 
-	auto& [clientManifestRelativePath, mediaMap] = streams_[episode_id];
-	std::string mediaKey = track_name + "_" + bitrate;
+bool OfflineStreaming::findLocalFragment(const std::string& episode_id, const std::string& track_name,
+                                         const std::string& bitrate, const std::string& start_time,
+                                         FragmentLocation& location)
+{
+	return findLocalFragment(RequestTarget::fragment(episode_id, bitrate, track_name, start_time), location);
+}
 
-	if (!mediaMap.contains(mediaKey))
-		return {};
+bool OfflineStreaming::findLocalFragment(const RequestTarget& target, FragmentLocation& location)
+{
+	const SmoothStream* streamPtr = findStream(target.episode_symbol);
+	if (!streamPtr)
+		return false;
+
+	const SmoothStream& stream = *streamPtr;
+	const SmoothMedia* media = nullptr;
+
+	if (const SmoothMedia* exact = symbolAt(symbolAt(stream.media_by_symbol, target.track_symbol),
+	                                        target.bitrate_symbol);
+		exact && exact->track.fragments.contains(target.start_time))
+		media = exact;
+	else if (bitrate_substitution_ != BitrateSubstitution::NONE)
+		media = findSubstitute(stream, target.type, target.bitrate, target.start_time);
+
+	if (!media)
+		return false;
+
+	const auto fragmentIt = media->track.fragments.find(target.start_time);
+
+	location.archive = stream.archive.get();
+	location.source_path = &selectCopy(*media, location.root);
+	location.last_modified = media->last_modified;
+	location.moof_offset = fragmentIt->second.moof_offset;
+	location.size = fragmentIt->second.size;
+	location.fast_copy = media->fast_copy;
+	return true;
+}
 
-	SmoothMedia media = mediaMap[mediaKey];
-	SmoothTrack track = media.track;
+void OfflineStreaming::countPlay(const FragmentLocation& location) const
+{
+	if (location.fast_copy)
+		fast_tier_->touch(*location.fast_copy);
+}
 
-	if (!track.fragments.contains(start_time))
-		return {};
+const std::string& OfflineStreaming::selectCopy(const SmoothMedia& media, std::size_t& root) const
+{
+	if (media.fast_copy)
+	{
+		if (const std::string* path = media.fast_copy->copy())
+		{
+			root = library_roots_;
+			return *path;
+		}
+	}
+
+	root = media.root;
 
-	SmoothFragment fragment = track.fragments[start_time];
+	if (media.copies.empty())
+		return media.source_path;
 
-	std::ifstream fragmentStream(media.source_file.toString(), std::ios::binary);
+	// Tracks start looking at different copies, so the ones a player fetches together are read from different roots
+	// even while nothing else is going on; a busier root than another copy's is passed over
+	const std::size_t count = media.copies.size() + 1;
+	const std::size_t first = (media.track_symbol + media.bitrate_symbol) % count;
+	const std::string* path = nullptr;
+	unsigned int fewest = std::numeric_limits<unsigned int>::max();
 
-	if (!fragmentStream)
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const std::size_t copy = (first + i) % count;
+		const std::size_t copyRoot = copy == 0 ? media.root : media.copies[copy - 1].first;
+
+		if (const unsigned int inFlight = storage_roots_->inFlight(copyRoot); inFlight < fewest)
+		{
+			fewest = inFlight;
+			root = copyRoot;
+			path = copy == 0 ? &media.source_path : &media.copies[copy - 1].second;
+		}
+	}
+
+	return *path;
+}
+
+template <typename String>
+void OfflineStreaming::readFragment(const FragmentLocation& location, const std::string& start_time,
+                                    String& data) const
+{
+	Logger& logger = Logger::get(name());
+	StorageRoots::Read rootRead(*storage_roots_, location.root);
+
+	if (location.archive)
+	{
+		const std::string_view fragment = location.archive->bytes(location.moof_offset, location.size);
+
+		if (fragment.size() < 8 || fragment.substr(4, 4) != BLOCK_MOOF)
+		{
+			logger.warning("Invalid fragment at start time %s in archive %s. Will need to fetch that fragment from server.",
+			               start_time, *location.source_path);
+			return;
+		}
+
+		data.assign(fragment);
+		rootRead.add(data.size());
+		return;
+	}
+
+	// The index extent is exactly moof + mdat unless indexing couldn't check it, so one read normally gets the
+	// fragment; the box headers decide
+	data.clear();
+	data.resize(location.size);
+	FragmentIo::Read read{location.moof_offset, data.size(), data.data()};
+
+	if (!fragment_io_->read(*location.source_path, std::span(&read, 1)))
 	{
 		logger.warning(
 			"Failed to open track file %s, the file was there while initializing, but it probably got deleted. Will need to fetch client manifest from server.",
-			media.source_file.toString());
-		fragmentStream.close();
+			*location.source_path);
 
-		return {};
+		data.clear();
+		return;
 	}
 
-	fragmentStream.seekg(static_cast<long long>(fragment.moof_offset));
+	// Whatever the boxes need beyond the extent (or past a short read) is read after the fact
+	std::size_t available = read.result > 0 ? static_cast<std::size_t>(read.result) : 0;
+	const auto ensure = [&](const std::size_t length)
+	{
+		if (length <= available)
+			return true;
 
-	unsigned int moofSize;
-	fragmentStream.read(reinterpret_cast<char*>(&moofSize), sizeof(moofSize));
-	moofSize = _byteswap_ulong(moofSize);
+		data.resize(length);
 
-	std::string moofExpectedMagic = BLOCK_MOOF;
-	std::string moofMagic(moofExpectedMagic.length(), '\0');
-	fragmentStream.read(moofMagic.data(), moofExpectedMagic.length());
+		if (!fragment_io_->read(*location.source_path, location.moof_offset + available, length - available,
+		                        data.data() + available))
+			return false;
 
-	if (moofMagic != moofExpectedMagic)
+		available = length;
+		return true;
+	};
+
+	const auto boxSize = [&data](const std::size_t offset)
+	{
+		unsigned int size;
+		memcpy(&size, data.data() + offset, sizeof(size));
+		return static_cast<std::size_t>(fromBigEndian(size));
+	};
+
+	if (const std::string_view moofMagic = ensure(8) ? std::string_view(data.data() + 4, 4) : std::string_view();
+		moofMagic != BLOCK_MOOF)
 	{
 		logger.warning(
 			"Invalid moof magic in fragment at start time %s in track %s, expected: %s, got %s. Will need to fetch that fragment from server.",
-			start_time, media.source_file.toString(), moofExpectedMagic, moofMagic);
-		fragmentStream.close();
+			start_time, *location.source_path, std::string(BLOCK_MOOF), std::string(moofMagic));
 
-		return {};
+		data.clear();
+		return;
+	}
+
+	const std::size_t moofSize = boxSize(0);
+
+	if (const std::string_view mdatMagic =
+			ensure(moofSize + 8) ? std::string_view(data.data() + moofSize + 4, 4) : std::string_view();
+		mdatMagic != BLOCK_MDAT)
+	{
+		logger.warning(
+			"Invalid mdat magic in fragment at start time %s in track %s, expected: %s, got %s. Will need to fetch that fragment from server.",
+			start_time, *location.source_path, std::string(BLOCK_MDAT), std::string(mdatMagic));
+
+		data.clear();
+		return;
+	}
+
+	const std::size_t size = moofSize + boxSize(moofSize);
+
+	if (!ensure(size))
+	{
+		data.clear();
+		return;
+	}
+
+	data.resize(size);
+	rootRead.add(data.size());
+}
+
+std::string OfflineStreaming::readLocalFragment(const FragmentLocation& location, const std::string& start_time) const
+{
+	std::string data;
+	readFragment(location, start_time, data);
+	return data;
+}
+
+std::pmr::string OfflineStreaming::readLocalFragment(const FragmentLocation& location, const std::string& start_time,
+                                                     std::pmr::memory_resource* memory) const
+{
+	std::pmr::string data(memory);
+	readFragment(location, start_time, data);
+	return data;
+}
+
+bool OfflineStreaming::checkLocalFragment(const FragmentLocation& location) const
+{
+	if (location.size == 0)
+		return false;
+
+	// Archives are written from checked extents and never change
+	if (location.archive)
+		return true;
+
+	char header[8];
+	unsigned long long offset = location.moof_offset;
+
+	for (const char* expectedMagic : {BLOCK_MOOF, BLOCK_MDAT})
+	{
+		if (!fragment_io_->read(*location.source_path, offset, sizeof(header), header) ||
+			std::string_view(header + 4, 4) != expectedMagic)
+			return false;
+
+		unsigned int boxSize;
+		memcpy(&boxSize, header, sizeof(boxSize));
+		offset += fromBigEndian(boxSize);
+	}
+
+	if (offset - location.moof_offset != location.size)
+	{
+		Logger::get(name()).debug("Fragment at offset %s in track %s doesn't match its index extent",
+		                          std::to_string(location.moof_offset), *location.source_path);
+		return false;
+	}
+
+	return true;
+}
+
+std::pmr::string OfflineStreaming::readLocalFragmentRange(const FragmentLocation& location,
+                                                          const std::string& start_time,
+                                                          const unsigned long long offset,
+                                                          const unsigned long long length,
+                                                          std::pmr::memory_resource* memory) const
+{
+	Logger& logger = Logger::get(name());
+
+	if (offset + length > location.size)
+		return std::pmr::string(memory);
+
+	StorageRoots::Read rootRead(*storage_roots_, location.root);
+
+	if (location.archive)
+	{
+		rootRead.add(length);
+		return std::pmr::string(location.archive->bytes(location.moof_offset + offset, length), memory);
 	}
 
-	std::string fragmentData;
+	// The moof header goes out together with the requested bytes, the mdat header behind it confirms the index extent
+	// before the bytes are trusted
+	char header[8];
+	std::pmr::string data(length, '\0', memory);
+	std::array<FragmentIo::Read, 2> reads{{
+		{location.moof_offset, sizeof(header), header},
+		{location.moof_offset + offset, data.size(), data.data()}
+	}};
 
-	fragmentStream.seekg(-8, std::ios::cur);
+	if (!fragment_io_->read(*location.source_path, reads) || reads[0].result != sizeof(header) ||
+		reads[1].result != static_cast<long long>(data.size()) || std::string_view(header + 4, 4) != BLOCK_MOOF)
+		return std::pmr::string(memory);
 
-	auto moof = new char[moofSize];
-	fragmentStream.read(moof, moofSize);
-	fragmentData.append(moof, moofSize);
-	delete[] moof;
+	unsigned int moofSize;
+	memcpy(&moofSize, header, sizeof(moofSize));
+	moofSize = fromBigEndian(moofSize);
+
+	if (!fragment_io_->read(*location.source_path, location.moof_offset + moofSize, sizeof(header), header))
+		return std::pmr::string(memory);
 
 	unsigned int mdatSize;
-	fragmentStream.read(reinterpret_cast<char*>(&mdatSize), 4);
-	mdatSize = _byteswap_ulong(mdatSize);
+	memcpy(&mdatSize, header, sizeof(mdatSize));
+	mdatSize = fromBigEndian(mdatSize);
 
-	std::string mdatExpectedMagic = BLOCK_MDAT;
-	std::string mdatMagic(mdatExpectedMagic.length(), '\0');
-	fragmentStream.read(mdatMagic.data(), mdatExpectedMagic.length());
+	if (std::string_view(header + 4, 4) != BLOCK_MDAT ||
+		static_cast<unsigned long long>(moofSize) + mdatSize != location.size)
+	{
+		logger.debug("Fragment at start time %s in track %s doesn't match its index extent, serving ranges from a full read.",
+		             start_time, *location.source_path);
+		return std::pmr::string(memory);
+	}
 
-	if (mdatMagic != mdatExpectedMagic)
+	rootRead.add(length);
+	return data;
+}
+
+OfflineStreaming::BitrateSubstitution OfflineStreaming::parseBitrateSubstitution(const std::string& value)
+{
+	if (Poco::icompare(value, "lower") == 0)
+		return BitrateSubstitution::LOWER;
+
+	if (Poco::icompare(value, "nearest") == 0)
+		return BitrateSubstitution::NEAREST;
+
+	return BitrateSubstitution::NONE;
+}
+
+const OfflineStreaming::SmoothMedia* OfflineStreaming::findSubstitute(const SmoothStream& stream,
+                                                                      const std::string& track_name,
+                                                                      const std::string& bitrate,
+                                                                      const std::string& start_time) const
+{
+	static Logger& logger = Logger::get(name());
+
+	const auto bitratesIt = stream.track_bitrates.find(track_name);
+	unsigned long long requested;
+
+	if (bitratesIt == stream.track_bitrates.end() || !parseNumber(bitrate, requested))
+		return nullptr;
+
+	const auto hasFragment = [&](const std::string& media_key) -> const SmoothMedia*
 	{
-		logger.warning(
-			"Invalid mdat magic in fragment at start time %s in track %s, expected: %s, got %s. Will need to fetch that fragment from server.",
-			start_time, media.source_file, mdatExpectedMagic, mdatMagic);
-		fragmentStream.close();
+		const SmoothMedia& media = stream.media_map.at(media_key);
+		return media.track.fragments.contains(start_time) ? &media : nullptr;
+	};
 
-		return "";
+	const auto& bitrates = bitratesIt->second;
+	const SmoothMedia* substitute = nullptr;
+
+	// Walk outwards from the requested bitrate, a partially downloaded track may lack this start time
+	auto higher = bitrates.upper_bound(requested);
+	auto lower = std::make_reverse_iterator(bitrates.lower_bound(requested));
+
+	while (!substitute && (lower != bitrates.rend() || higher != bitrates.end()))
+	{
+		const bool canGoHigher = bitrate_substitution_ == BitrateSubstitution::NEAREST && higher != bitrates.end();
+		const bool takeLower = lower != bitrates.rend() &&
+			(!canGoHigher || requested - lower->first <= higher->first - requested);
+
+		if (takeLower)
+			substitute = hasFragment((lower++)->second);
+		else if (canGoHigher)
+			substitute = hasFragment((higher++)->second);
+		else
+			break;
 	}
 
-	fragmentStream.seekg(-8, std::ios::cur);
+	if (substitute && logger.debug())
+		logger.debug("Substituting bitrate %s with %s for track %s at start time %s", bitrate,
+		             substitute->system_bitrate, track_name, start_time);
+
+	return substitute;
+}
+
+std::string OfflineStreaming::synthesizeClientManifest(const std::string& episode_id, const SmoothStream& stream)
+{
+	{
+		std::lock_guard lock(client_manifests_mutex_);
 
-	auto mdat = new char[mdatSize];
-	fragmentStream.read(mdat, mdatSize);
-	fragmentData.append(mdat, mdatSize);
+		if (const auto it = client_manifests_.find(episode_id); it != client_manifests_.end())
+			return it->second;
+	}
 
-	delete[] mdat;
-	fragmentStream.close();
+	Logger& logger = Logger::get(name());
+	ClientManifestBuilder builder;
+
+	for (const auto& [trackName, bitrates] : stream.track_bitrates)
+	{
+		for (const auto& [bitrate, mediaKey] : bitrates)
+		{
+			const SmoothMedia& media = stream.media_map.at(mediaKey);
+			std::vector<unsigned long long> startTimes;
+			unsigned long long firstMoof = MAX_TRACK_HEADER;
+
+			for (const auto& [startTime, fragment] : media.track.fragments)
+			{
+				if (unsigned long long time; parseNumber(startTime, time))
+					startTimes.push_back(time);
+
+				firstMoof = std::min(firstMoof, fragment.moof_offset);
+			}
 
-	return fragmentData;
+			// Codec details come from the moov in front of the first fragment, if the file has one
+			std::string header(static_cast<std::size_t>(firstMoof), '\0');
+
+			{
+				StorageRoots::Read rootRead(*storage_roots_, media.root);
+
+				if (!fragment_io_->read(media.source_path, 0, header.size(), header.data()))
+					header.clear();
+
+				rootRead.add(header.size());
+			}
+
+			builder.addQualityLevel(media.stream_type, trackName, bitrate,
+			                        ClientManifestBuilder::parseSampleDescription(header), startTimes);
+		}
+	}
+
+	if (builder.empty())
+		return "";
+
+	std::string manifest = builder.build();
+
+	logger.information("Built a client manifest for episode %s from its server manifest and track indexes",
+	                   episode_id);
+
+	std::lock_guard lock(client_manifests_mutex_);
+	return client_manifests_.try_emplace(episode_id, std::move(manifest)).first->second;
+}
+
+std::string OfflineStreaming::filterClientManifest(const SmoothStream& stream, const std::string& manifest) const
+{
+	Logger& logger = Logger::get(name());
+
+	try
+	{
+		DOMParser parser;
+		const AutoPtr doc = parser.parseString(manifest);
+		const AutoPtr streamIndexes = doc->getElementsByTagName("StreamIndex");
+
+		for (unsigned long i = 0; i < streamIndexes->length(); ++i)
+		{
+			auto* streamIndex = dynamic_cast<Element*>(streamIndexes->item(i));
+			const auto bitratesIt = stream.track_bitrates.find(streamIndexTrackName(streamIndex));
+
+			// Nothing of this track is local, leave it to upstream
+			if (bitratesIt == stream.track_bitrates.end())
+				continue;
+
+			std::vector<Element*> qualityLevels;
+
+			for (Node* child = streamIndex->firstChild(); child; child = child->nextSibling())
+			{
+				if (child->nodeType() == Node::ELEMENT_NODE && child->nodeName() == "QualityLevel")
+					qualityLevels.push_back(dynamic_cast<Element*>(child));
+			}
+
+			int index = 0;
+
+			for (Element* qualityLevel : qualityLevels)
+			{
+				if (unsigned long long bitrate; parseNumber(qualityLevel->getAttribute("Bitrate"), bitrate) &&
+					!bitratesIt->second.contains(bitrate))
+				{
+					streamIndex->removeChild(qualityLevel);
+					continue;
+				}
+
+				qualityLevel->setAttribute("Index", std::to_string(index++));
+			}
+
+			streamIndex->setAttribute("QualityLevels", std::to_string(index));
+		}
+
+		DOMWriter writer;
+		writer.setOptions(XMLWriter::WRITE_XML_DECLARATION);
+
+		std::ostringstream outputStream;
+		writer.writeNode(outputStream, doc);
+
+		return outputStream.str();
+	}
+	catch (Poco::Exception& ex)
+	{
+		logger.warning("Failed to filter client manifest, serving it unchanged (%s)", ex.displayText());
+		return manifest;
+	}
 }
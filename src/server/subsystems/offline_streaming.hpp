@@ -1,28 +1,48 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <shared_mutex>
+
+#include "../fast_tier.hpp"
+#include "../fragment_io.hpp"
+#include "../storage_roots.hpp"
+#include "../symbol_table.hpp"
+
+class EpisodeArchive;
+struct RequestTarget;
+
 class OfflineStreaming final : public Poco::Util::Subsystem
 {
 public:
-	[[nodiscard]] const char* name() const override;
-
-	std::string getLocalClientManifest(const std::string& episode_id);
-	std::string getLocalFragment(const std::string& episode_id, const std::string& track_name,
-	                             const std::string& bitrate,
-	                             const std::string& start_time);
-
-	void preload();
+	// What to serve when the requested bitrate of a track isn't stored locally
+	enum class BitrateSubstitution
+	{
+		NONE, // go upstream
+		LOWER, // closest lower local bitrate
+		NEAREST // closest local bitrate in either direction, lower wins a tie
+	};
 
-protected:
-	void initialize(Poco::Util::Application& app) override;
-	void uninitialize() override;
+	struct FragmentLocation
+	{
+		const EpisodeArchive* archive = nullptr; // moof_offset is relative to the archive if set
+		const std::string* source_path = nullptr; // owned by the index, streams are only ever added
+		std::size_t root = 0; // storage root of source_path
+		FastTier::Track* fast_copy = nullptr; // the track's, if there's a fast tier
+		Poco::Timestamp last_modified;
+		unsigned long long moof_offset;
+		unsigned long long size; // moof + mdat as checked when indexing, 0 if the boxes didn't check out
+	};
 
-private:
 	struct SmoothFragment
 	{
 		unsigned long long moof_offset;
+		unsigned long long size;
 		unsigned long long traf_number;
 		unsigned long long trun_number;
 		unsigned long long sample_number;
+
+		bool operator==(const SmoothFragment&) const = default;
 	};
 
 	struct SmoothTrack
@@ -35,10 +55,82 @@ private:
 		std::map<std::string, SmoothFragment> fragments;
 	};
 
+	[[nodiscard]] const char* name() const override;
+
+	std::string getLocalClientManifest(const std::string& episode_id);
+	[[nodiscard]] bool hasEpisode(const std::string& episode_id) const { return findStream(episode_id) != nullptr; }
+	std::string getLocalFragment(const std::string& episode_id, const std::string& track_name,
+	                             const std::string& bitrate,
+	                             const std::string& start_time);
+
+	bool findLocalFragment(const std::string& episode_id, const std::string& track_name, const std::string& bitrate,
+	                       const std::string& start_time, FragmentLocation& location);
+	bool findLocalFragment(const RequestTarget& target, FragmentLocation& location);
+
+	// Counts the request towards copying the fragment's track to the fast tier
+	void countPlay(const FragmentLocation& location) const;
+	std::string readLocalFragment(const FragmentLocation& location, const std::string& start_time) const;
+
+	// Same, into memory from the given resource (a request's arena)
+	std::pmr::string readLocalFragment(const FragmentLocation& location, const std::string& start_time,
+	                                   std::pmr::memory_resource* memory) const;
+
+	// Whether the fragment on disk still is exactly its index extent, moof then mdat, before it's sent without being
+	// read (file transmission); false means it has to go through readLocalFragment
+	[[nodiscard]] bool checkLocalFragment(const FragmentLocation& location) const;
+
+	// Reads length bytes starting at offset within the fragment, returns an empty string if the fragment on disk
+	// doesn't match its index extent (the caller should fall back to readLocalFragment)
+	std::pmr::string readLocalFragmentRange(const FragmentLocation& location, const std::string& start_time,
+	                                        unsigned long long offset, unsigned long long length,
+	                                        std::pmr::memory_resource* memory) const;
+
+	// Indexes every episode of the video list with a few threads, preload() blocks until it's done, startPreload()
+	// runs it in the background so the server can start accepting right away
+	void preload();
+	void startPreload();
+	void stopPreload(); // the preloader stops after the episodes it's indexing
+
+	// Requests call this before looking up an episode: indexes it right away if the preloader hasn't got to it yet,
+	// or waits for the preloader if it's indexing it at the moment
+	void ensureEpisode(const std::string& episode_id);
+
+	[[nodiscard]] bool preloaded() const { return preloaded_.load(std::memory_order_acquire); }
+
+	// Queues reading the opening seconds of every local track of the episode into the page cache on a background
+	// thread, so the first fragments are served from memory at whatever bitrate the player starts with
+	void warmEpisode(const std::string& episode_id);
+
+	// Packs an episode directory into a single archive (see EpisodeArchive) that preload() picks up instead
+	bool packEpisode(const std::string& episode_id, const Poco::Path& episode_path,
+	                 const Poco::Path& archive_path) const;
+
+	// Where episodes are stored, with their read statistics; the fast tier (if any) is the last root
+	[[nodiscard]] StorageRoots& storageRoots() const { return *storage_roots_; }
+	[[nodiscard]] FastTier* fastTier() const { return fast_tier_.get(); } // nullptr if there's none
+
+	// Reads the fragment index (mfra/tfra) from the end of a track file
+	[[nodiscard]] std::pair<bool, SmoothTrack> preloadTrack(const std::string& path) const;
+
+	static BitrateSubstitution parseBitrateSubstitution(const std::string& value);
+
+protected:
+	void initialize(Poco::Util::Application& app) override;
+	void uninitialize() override;
+
+private:
 	struct SmoothMedia
 	{
 		Poco::Path source_file;
+		std::string source_path; // source_file.toString(), so requests don't have to build it
+		std::size_t root = 0; // storage root of source_file
+		std::vector<std::pair<std::size_t, std::string>> copies; // the same track file on other roots (root, path)
+		FastTier::Track* fast_copy = nullptr; // track files outside archives, if there's a fast tier
+		Poco::Timestamp last_modified;
 		std::string system_bitrate;
+		std::string stream_type; // video, audio or text, as the client manifest calls it
+		SymbolTable::Symbol track_symbol = SymbolTable::NONE;
+		SymbolTable::Symbol bitrate_symbol = SymbolTable::NONE;
 		SmoothTrack track;
 	};
 
@@ -46,11 +138,80 @@ private:
 	{
 		Poco::Path client_manifest_relative_path;
 		std::map<std::string, SmoothMedia> media_map;
+		std::map<std::string, std::map<unsigned long long, std::string>> track_bitrates; // track -> bitrate -> media key
+		std::vector<std::vector<const SmoothMedia*>> media_by_symbol; // [track symbol][bitrate symbol]
+		std::shared_ptr<EpisodeArchive> archive;
 	};
 
+	enum class IndexState
+	{
+		PENDING,
+		INDEXING,
+		INDEXED // whether or not there was anything local
+	};
+
+	// Streams are only ever added, so pointers into the map stay valid without holding the lock
 	std::map<std::string, SmoothStream> streams_;
+	std::vector<const SmoothStream*> streams_by_symbol_; // by episode symbol
+	mutable std::shared_mutex streams_mutex_;
+	BitrateSubstitution bitrate_substitution_ = BitrateSubstitution::NONE;
+	std::unique_ptr<FragmentIo> fragment_io_; // track files outside archives are read through it
+	std::unique_ptr<StorageRoots> storage_roots_;
+	std::size_t library_roots_ = 0; // the roots before the fast tier
+	std::unique_ptr<FastTier> fast_tier_;
+
+	bool synthesize_client_manifests_ = false;
+	std::mutex client_manifests_mutex_;
+	std::map<std::string, std::string> client_manifests_; // synthesized ones, by episode
+
+	std::mutex index_mutex_;
+	std::condition_variable index_changed_;
+	std::map<std::string, IndexState> index_states_;
+
+	std::thread preloader_;
+	std::atomic<bool> preloaded_ = false;
+	std::atomic<bool> stopping_ = false;
+
+	static constexpr std::size_t MAX_WARMUP_QUEUE = 8;
+
+	unsigned long long warmup_window_ = 0; // in 100ns ticks, 0 disables warmups
+	std::mutex warmup_mutex_;
+	std::condition_variable warmup_queued_;
+	std::deque<std::string> warmup_queue_;
+	std::map<std::string, Poco::Timestamp> warmed_up_; // when each episode was last warmed up
+	std::thread warmer_;
+	std::atomic<bool> warmer_stopping_ = false;
+
+	[[nodiscard]] const SmoothStream* findStream(const std::string& episode_id) const;
+	[[nodiscard]] const SmoothStream* findStream(SymbolTable::Symbol episode) const;
+	void indexEpisode(const std::string& episode_id);
+	void addStream(const std::string& episode_id, SmoothStream stream);
+
+	void runWarmer();
+	void stopWarmer();
+	void warmUp(const std::string& episode_id) const;
+	unsigned long long warmUpTrack(const SmoothStream& stream, const SmoothMedia& media) const;
+
+	// One episode path per storage root, the server manifest comes from the first one that has it
+	bool loadEpisodeDirectory(const std::string& episode_id, const std::vector<Poco::Path>& episode_paths,
+	                          SmoothStream& stream, std::string* server_manifest = nullptr) const;
+	bool loadServerManifest(const std::string& episode_id, const Poco::Path& episode_path,
+	                        const std::vector<Poco::Path>& episode_paths, SmoothStream& stream,
+	                        std::string* server_manifest) const;
+	bool loadEpisodeArchive(const std::string& episode_id, const Poco::Path& archive_path, std::size_t root);
+
+	// The copy of the track to read next, and its root
+	const std::string& selectCopy(const SmoothMedia& media, std::size_t& root) const;
+
+	template <typename String>
+	void readFragment(const FragmentLocation& location, const std::string& start_time, String& data) const;
+
+	[[nodiscard]] const SmoothMedia* findSubstitute(const SmoothStream& stream, const std::string& track_name,
+	                                                const std::string& bitrate, const std::string& start_time) const;
+	// From the server manifest and the track files, for an episode without its .ismc
+	[[nodiscard]] std::string synthesizeClientManifest(const std::string& episode_id, const SmoothStream& stream);
+	[[nodiscard]] std::string filterClientManifest(const SmoothStream& stream, const std::string& manifest) const;
 
 	void processMediaNodes(const std::string& tag_name, Poco::XML::Document* doc, const std::string& episode_id,
-	                       const std::string& episode_path, SmoothStream& stream) const;
-	[[nodiscard]] std::pair<bool, SmoothTrack> preloadTrack(const std::string& path) const;
+	                       const std::vector<Poco::Path>& episode_paths, SmoothStream& stream) const;
 };
@@ -0,0 +1,173 @@
+#include "pch.hpp"
+#include "request_scheduling.hpp"
+
+#include "../handler_factory.hpp"
+
+using Poco::Logger;
+using Poco::JSON::Object;
+using Poco::Net::HTTPServerRequest;
+using Poco::Util::Application;
+
+using Priority = PriorityExecutor::Priority;
+
+namespace
+{
+	// Speculative requests announce themselves with Sec-Purpose (or the older Purpose) header
+	bool isPrefetch(const HTTPServerRequest& request)
+	{
+		for (const char* header : {"Sec-Purpose", "Purpose"})
+		{
+			if (request.has(header) && Poco::toLower(request.get(header)).find("prefetch") != std::string::npos)
+				return true;
+		}
+
+		return false;
+	}
+}
+
+const char* RequestScheduling::name() const
+{
+	return "RequestScheduling";
+}
+
+void RequestScheduling::initialize(Application& app)
+{
+	// The poco engine schedules connections itself, one thread each
+	if (Poco::toLower(app.config().getString("Server.Engine", "poco")) != "event")
+		return;
+
+	Logger& logger = Logger::get("Core");
+
+	const unsigned int hardwareThreads = std::thread::hardware_concurrency();
+	const int maxThreads = app.config().getInt("Server.MaxThreads", hardwareThreads > 0
+		                                                                 ? static_cast<int>(hardwareThreads)
+		                                                                 : 2);
+	const auto maxQueued = static_cast<std::size_t>(app.config().getInt(
+		"Scheduling.MaxQueued", app.config().getInt("Server.MaxQueued", 100)));
+
+	const std::array threads = {
+		app.config().getInt("Scheduling.LocalThreads", maxThreads),
+		app.config().getInt("Scheduling.UpstreamThreads", 2),
+		app.config().getInt("Scheduling.SubtitleThreads", 2)
+	};
+
+	for (std::size_t i = 0; i < executors_.size(); ++i)
+	{
+		const auto requestClass = static_cast<RequestClass>(i);
+		executors_[i] = std::make_unique<PriorityExecutor>(className(requestClass), threads[i], maxQueued);
+
+		logger.debug("%s executor: %d threads, %z queued", std::string(className(requestClass)),
+		             executors_[i]->threads(), maxQueued);
+	}
+}
+
+void RequestScheduling::uninitialize()
+{
+	Logger& logger = Logger::get("Core");
+
+	for (auto& executor : executors_)
+	{
+		if (!executor)
+			continue;
+
+		executor->stop();
+
+		if (logger.debug())
+		{
+			const PriorityExecutor::Statistics stats = executor->statistics();
+			logger.debug("%s executor: %s completed, %s rejected, peak queue %z, max wait %sus", executor->name(),
+			             std::to_string(stats.completed), std::to_string(stats.rejected), stats.peak_queued,
+			             std::to_string(stats.max_wait));
+		}
+
+		executor.reset();
+	}
+}
+
+bool RequestScheduling::dispatch(const HTTPServerRequest& request,
+                                 std::function<void(EventHttpServer::HandlerCreator create)> task)
+{
+	RequestTarget target = RequestTarget::parse(request.getURI());
+	RequestClass requestClass;
+	Priority priority;
+	classify(request, target, requestClass, priority);
+
+	// The request lives in the exchange the server's task holds on to
+	return submit(requestClass, priority, [&request, target = std::move(target), task = std::move(task)]() mutable
+	{
+		task([&] { return RequestHandlerFactory::createRequestHandler(request, std::move(target)); });
+	});
+}
+
+bool RequestScheduling::continueUpstream(const HTTPServerRequest& request, std::function<void()> task)
+{
+	return submit(RequestClass::UPSTREAM, isPrefetch(request) ? Priority::LOW : Priority::HIGH, std::move(task));
+}
+
+bool RequestScheduling::submit(const RequestClass request_class, const Priority priority, std::function<void()> task)
+{
+	const auto& executor = executors_[static_cast<std::size_t>(request_class)];
+	return executor && executor->submit(priority, std::move(task));
+}
+
+Object::Ptr RequestScheduling::statistics() const
+{
+	Object::Ptr classes = new Object;
+
+	for (const auto& executor : executors_)
+	{
+		if (!executor)
+			continue;
+
+		const PriorityExecutor::Statistics stats = executor->statistics();
+		const unsigned long long dequeued = stats.submitted - stats.queued;
+
+		Object::Ptr entry = new Object;
+		entry->set("threads", executor->threads());
+		entry->set("max_queued", executor->maxQueued());
+		entry->set("queued", stats.queued);
+		entry->set("peak_queued", stats.peak_queued);
+		entry->set("submitted", stats.submitted);
+		entry->set("rejected", stats.rejected);
+		entry->set("completed", stats.completed);
+		entry->set("avg_wait_ms", dequeued > 0 ? static_cast<double>(stats.total_wait) / dequeued / 1000.0 : 0.0);
+		entry->set("max_wait_ms", static_cast<double>(stats.max_wait) / 1000.0);
+
+		classes->set(executor->name(), entry);
+	}
+
+	return classes;
+}
+
+const char* RequestScheduling::className(const RequestClass request_class)
+{
+	switch (request_class)
+	{
+	case RequestClass::LOCAL:
+		return "local";
+	case RequestClass::UPSTREAM:
+		return "upstream";
+	case RequestClass::SUBTITLE:
+		return "subtitle";
+	default:
+		return "unknown";
+	}
+}
+
+void RequestScheduling::classify(const HTTPServerRequest& request, const RequestTarget& target,
+                                 RequestClass& request_class, Priority& priority)
+{
+	// The player stalls without manifests, video and audio, it copes with late captions and prefetches
+	priority = isPrefetch(request) ? Priority::LOW : Priority::HIGH;
+	request_class = RequestClass::LOCAL;
+
+	// Runs on the event loop, so nothing that takes a lock: manifests and media start out as local (their handler
+	// indexes the episode first if needed, which is disk work as well) and continue upstream if they aren't
+	if (target.kind == RequestTarget::Kind::FRAGMENT && target.type.find("_captions") != std::string::npos)
+	{
+		request_class = RequestClass::SUBTITLE;
+
+		if (priority == Priority::HIGH)
+			priority = Priority::NORMAL;
+	}
+}
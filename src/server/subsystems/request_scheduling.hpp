@@ -0,0 +1,52 @@
+#pragma once
+
+#include "../event/event_http_server.hpp"
+#include "../event/priority_executor.hpp"
+
+struct RequestTarget;
+
+// Runs requests of the event engine on separate executors per class of work, so a burst of upstream misses or
+// caption rewrites can't hold up locally stored video and audio. Requests are classified on the event loop by their
+// URI alone; whether something is stored locally is up to the handler, which hands misses over to the upstream
+// executor (see continueUpstream).
+class RequestScheduling final : public Poco::Util::Subsystem
+{
+public:
+	enum class RequestClass
+	{
+		LOCAL, // manifests and media fragments stored locally, disk or page cache bound
+		UPSTREAM, // manifests and media fragments fetched from the CDN
+		SUBTITLE, // caption fragments, CPU bound because of the subtitle rewrite
+		COUNT
+	};
+
+	[[nodiscard]] const char* name() const override;
+
+	// Classifies the request and queues task on its executor, returns false if it wasn't admitted. The task creates
+	// the handler from the target parsed here.
+	bool dispatch(const Poco::Net::HTTPServerRequest& request,
+	              std::function<void(EventHttpServer::HandlerCreator create)> task);
+
+	// Continues a request that found nothing local on the upstream executor, with the priority it was dispatched
+	// with. Returns false if it wasn't admitted or the executors aren't running (poco engine).
+	bool continueUpstream(const Poco::Net::HTTPServerRequest& request, std::function<void()> task);
+
+	// Work continuing outside the request's executor, e.g. rewriting an upstream caption fragment once it's here.
+	// Returns false if the task wasn't admitted or the executors aren't running (poco engine).
+	bool submit(RequestClass request_class, PriorityExecutor::Priority priority, std::function<void()> task);
+
+	// Queue depth, wait time and throughput per class
+	[[nodiscard]] Poco::JSON::Object::Ptr statistics() const;
+
+	static const char* className(RequestClass request_class);
+
+protected:
+	void initialize(Poco::Util::Application& app) override;
+	void uninitialize() override;
+
+private:
+	std::array<std::unique_ptr<PriorityExecutor>, static_cast<std::size_t>(RequestClass::COUNT)> executors_;
+
+	static void classify(const Poco::Net::HTTPServerRequest& request, const RequestTarget& target,
+	                     RequestClass& request_class, PriorityExecutor::Priority& priority);
+};
@@ -0,0 +1,122 @@
+#include "pch.hpp"
+#include "request_tracing.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using Poco::Logger;
+using Poco::JSON::Object;
+using Poco::JSON::Stringifier;
+using Poco::Util::Application;
+
+const char* RequestTracing::name() const
+{
+	return "RequestTracing";
+}
+
+void RequestTracing::initialize(Application& app)
+{
+	Logger& logger = Logger::get("Core");
+
+	const double sampleRate = app.config().getDouble("Tracing.SampleRate", 0.0);
+
+	if (sampleRate <= 0.0)
+	{
+		sample_interval_ = 0;
+		return;
+	}
+
+	sample_interval_ = static_cast<unsigned int>(std::max(1.0, std::round(1.0 / std::min(sampleRate, 1.0))));
+
+	if (const std::string traceFile = app.config().getString("Tracing.TraceFile", ""); !traceFile.empty())
+	{
+		trace_file_.open(traceFile, std::ios::trunc);
+
+		if (!trace_file_)
+			logger.error("Failed to open trace file %s, sampled requests will be logged instead.", traceFile);
+		else
+			trace_file_ << "[\n";
+	}
+
+	logger.information("Request tracing enabled (1 in %s requests)", std::to_string(sample_interval_));
+}
+
+void RequestTracing::uninitialize()
+{
+	sample_interval_ = 0;
+
+	std::lock_guard lock(trace_file_mutex_);
+
+	if (trace_file_.is_open())
+	{
+		trace_file_ << "\n]\n";
+		trace_file_.close();
+	}
+}
+
+void RequestTracing::submit(const RequestTrace& trace)
+{
+	if (trace_file_.is_open())
+		writeTraceEvents(trace);
+	else
+		logTrace(trace);
+}
+
+void RequestTracing::writeTraceEvents(const RequestTrace& trace)
+{
+	// Chrome trace-event format, one complete ("X") event for the request and one per phase
+	std::ostringstream events;
+
+	const auto writeEvent = [&](const std::string& eventName, const char* category,
+	                            const Poco::Clock::ClockVal begin, const Poco::Clock::ClockDiff duration)
+	{
+		Object::Ptr event = new Object;
+		event->set("name", eventName);
+		event->set("cat", std::string(category));
+		event->set("ph", std::string("X"));
+		event->set("ts", begin);
+		event->set("dur", duration);
+		event->set("pid", 1);
+		event->set("tid", trace.threadId());
+
+		Object::Ptr args = new Object;
+		args->set("target", trace.target());
+		args->set("status", trace.status());
+		event->set("args", args);
+
+		if (events.tellp() > 0)
+			events << ",\n";
+
+		Stringifier::stringify(event, events);
+	};
+
+	writeEvent(trace.target(), "request", trace.begin(), trace.duration());
+
+	for (const auto& [phaseName, begin, duration] : trace.phases())
+		writeEvent(phaseName, "phase", begin, duration);
+
+	std::lock_guard lock(trace_file_mutex_);
+
+	if (!first_event_)
+		trace_file_ << ",\n";
+
+	first_event_ = false;
+	trace_file_ << events.str();
+	trace_file_.flush();
+}
+
+void RequestTracing::logTrace(const RequestTrace& trace)
+{
+	Logger& logger = Logger::get("Network");
+
+	if (!logger.information())
+		return;
+
+	std::string phases;
+
+	for (const auto& [phaseName, begin, duration] : trace.phases())
+		phases += std::format(" {}={}us", phaseName, duration);
+
+	logger.information("Trace \"%s\" %d total=%sus%s", trace.target(), trace.status(),
+	                   std::to_string(trace.duration()), phases);
+}
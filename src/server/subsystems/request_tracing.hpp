@@ -0,0 +1,33 @@
+#pragma once
+
+class RequestTracing final : public Poco::Util::Subsystem
+{
+public:
+	[[nodiscard]] const char* name() const override;
+
+	// Returns a sampled trace for every Nth request, or an inert one when tracing is disabled
+	[[nodiscard]] RequestTrace begin(const std::string& target)
+	{
+		if (sample_interval_ == 0 || request_counter_.fetch_add(1, std::memory_order_relaxed) % sample_interval_ != 0)
+			return {};
+
+		return {this, target};
+	}
+
+	void submit(const RequestTrace& trace);
+
+protected:
+	void initialize(Poco::Util::Application& app) override;
+	void uninitialize() override;
+
+private:
+	unsigned int sample_interval_ = 0;
+	std::atomic<unsigned int> request_counter_ = 0;
+
+	std::mutex trace_file_mutex_;
+	std::ofstream trace_file_;
+	bool first_event_ = true;
+
+	void writeTraceEvents(const RequestTrace& trace);
+	static void logTrace(const RequestTrace& trace);
+};
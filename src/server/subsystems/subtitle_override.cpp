@@ -1,16 +1,22 @@
 #include "pch.hpp"
 #include "subtitle_override.hpp"
 
-#include "video_list.hpp"
-#include <Poco/String.h>
+#include "../client_manifest.hpp"
+#include "../storage_roots.hpp"
+
 #include <algorithm>
 #include <cmath>
 
+#include <Poco/MemoryStream.h>
+
 using Poco::AutoPtr;
 using Poco::DirectoryIterator;
 using Poco::File;
 using Poco::Logger;
 using Poco::Path;
+using Poco::SharedMemory;
+using Poco::StreamCopier;
+using Poco::WriteFileException;
 using Poco::Util::Application;
 using Poco::XML::DOMWriter;
 using Poco::XML::Element;
@@ -20,6 +26,41 @@ using Poco::XML::Node;
 using Poco::XML::NodeList;
 using Poco::XML::XMLWriter;
 
+namespace
+{
+	constexpr long long TICKS_PER_SECOND = 10000000; // 100ns, the time scale of fragment start times
+	constexpr std::size_t FRACTION_DIGITS = 7; // finer than a tick is ignored
+	constexpr std::string_view UTF8_BOM = "\xEF\xBB\xBF";
+
+	bool isSpace(const char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+	}
+
+	std::string_view trim(std::string_view value)
+	{
+		while (!value.empty() && isSpace(value.front())) value.remove_prefix(1);
+		while (!value.empty() && isSpace(value.back())) value.remove_suffix(1);
+		return value;
+	}
+
+	// Returns the next line without its terminator and consumes it
+	std::string_view nextLine(std::string_view& data)
+	{
+		const auto end = data.find('\n');
+		const std::string_view line = data.substr(0, end);
+		data.remove_prefix(end == std::string_view::npos ? data.size() : end + 1);
+		return line;
+	}
+
+	// The whole value has to be a number, unlike std::stoi
+	bool parseNumber(const std::string_view value, long long& number)
+	{
+		const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+		return ec == std::errc() && end == value.data() + value.size() && !value.empty();
+	}
+}
+
 const char* SubtitleOverride::name() const
 {
 	return "SubtitleOverride";
@@ -27,38 +68,54 @@ const char* SubtitleOverride::name() const
 
 void SubtitleOverride::initialize(Application& app)
 {
-	if (!app.config().getBool("VideoList.PatchFile", true))
-		load();
+	Logger& logger = Logger::get(name());
+
+	// Read up front, overrides are loaded episode by episode while captions are already being served
+	closed_captioning_ = app.config().getBool("Subtitles.ClosedCaptioning", false);
+	music_notes_ = app.config().getBool("Subtitles.MusicNotes", true);
+	episode_roots_ = StorageRoots::fromConfig(app.config());
+
+	const std::string templatePath = app.config().getString("Subtitles.TemplatePath", "");
+	synthesize_ = !templatePath.empty();
+
+	if (synthesize_)
+		template_path_ = Path(templatePath).makeDirectory();
+
+	logger.information("Closed captioning is %s", std::string(closed_captioning_ ? "enabled" : "disabled"));
+	logger.information("Music notes are %s", std::string(music_notes_ ? "enabled" : "disabled"));
+
+	if (synthesize_)
+		logger.information("Overridden caption fragments are built from templates in %s", template_path_.toString());
 }
 
 void SubtitleOverride::uninitialize()
 {
+	{
+		std::unique_lock lock(templates_mutex_);
+		templates_.clear();
+		episode_captions_.clear();
+	}
+
+	std::unique_lock lock(overrides_mutex_);
+	tracks_by_symbol_.clear();
 	m_subtitle_overrides_.clear();
 }
 
-void SubtitleOverride::load()
+void SubtitleOverride::loadEpisode(const std::string& episode_id)
 {
-	const Application& app = Application::instance();
-
 	Logger& logger = Logger::get(name());
-	logger.debug("Loading subtitle overrides...");
 
-	closed_captioning_ = app.config().getBool("Subtitles.ClosedCaptioning", false);
-	music_notes_ = app.config().getBool("Subtitles.MusicNotes", true);
+	std::map<std::string, SrtTrack> overrides;
+	bool found = false;
 
-	logger.information("Closed captioning is %s", std::string(closed_captioning_ ? "enabled" : "disabled"));
-	logger.information("Music notes are %s", std::string(music_notes_ ? "enabled" : "disabled"));
-
-	const std::string episodesPath = app.config().getString("Server.EpisodesPath", "./videos/episodes");
-	VideoList& videoList = app.getSubsystem<VideoList>();
-
-	// Check if the episodes path exists
-	for (const auto episodes = videoList.getEpisodeList(); const auto& episodeId : episodes)
+	for (const Path& root : episode_roots_)
 	{
-		File episodeDir(episodesPath + "/" + episodeId);
+		// Check if the episode exists in this root
+		File episodeDir(Path(root, episode_id));
 		if (!(episodeDir.exists() && episodeDir.isDirectory())) continue;
 
-		std::map<std::string, std::vector<SrtSegment>> overrides;
+		found = true;
+		std::map<std::string, SrtTrack> rootOverrides;
 
 		for (DirectoryIterator it(episodeDir), end; it != end; ++it)
 		{
@@ -69,20 +126,32 @@ void SubtitleOverride::load()
 			if (fileName.find("_captions") == std::string::npos) continue;
 
 			if (extension == "srt")
-				parseSrtOverride(filePath.toString(), fileName, episodeId, overrides);
+				parseSrtOverride(filePath.toString(), fileName, episode_id, rootOverrides);
 		}
 
-		if (overrides.empty())
-		{
-			logger.warning("No subtitle overrides found for episode %s!", episodeId);
-			continue;
-		}
+		// Caption keys already overridden by an earlier root stay as they are
+		overrides.merge(rootOverrides);
+	}
 
-		m_subtitle_overrides_[episodeId] = std::move(overrides);
+	if (!found) return;
+
+	if (overrides.empty())
+	{
+		logger.warning("No subtitle overrides found for episode %s!", episode_id);
+		return;
 	}
 
-	logger.information("Successfully loaded caption overrides for %s episodes!",
-	                   std::to_string(m_subtitle_overrides_.size()));
+	const SymbolTable::Symbol episode = SymbolTable::episodes().intern(episode_id);
+
+	std::unique_lock lock(overrides_mutex_);
+
+	if (m_subtitle_overrides_.contains(episode_id))
+		return;
+
+	auto& tracks = symbolSlot(tracks_by_symbol_, episode);
+
+	for (const auto& [captionKey, track] : m_subtitle_overrides_[episode_id] = std::move(overrides))
+		symbolSlot(tracks, SymbolTable::tracks().intern(captionKey)) = &track;
 }
 
 std::string SubtitleOverride::extractCaptionKey(const std::string& file_name)
@@ -90,25 +159,40 @@ std::string SubtitleOverride::extractCaptionKey(const std::string& file_name)
 	return Path(file_name).getBaseName();
 }
 
-double SubtitleOverride::parseSrtTime(const std::string& time_str)
+bool SubtitleOverride::parseSrtTime(const std::string_view time, long long& ticks)
 {
-	// Format: HH:MM:SS,MMM
-	int h = 0, m = 0;
-	double s = 0.0;
+	// Format: HH:MM:SS,MMM (some files use a dot)
+	const auto firstColon = time.find(':');
+	if (firstColon == std::string_view::npos) return false;
 
-	auto firstColon = time_str.find(':');
-	auto secondColon = time_str.find(':', firstColon + 1);
+	const auto secondColon = time.find(':', firstColon + 1);
+	if (secondColon == std::string_view::npos) return false;
 
-	if (firstColon != std::string::npos && secondColon != std::string::npos)
-	{
-		h = std::stoi(time_str.substr(0, firstColon));
-		m = std::stoi(time_str.substr(firstColon + 1, secondColon - firstColon - 1));
-		std::string secStr = time_str.substr(secondColon + 1);
-		std::replace(secStr.begin(), secStr.end(), ',', '.');
-		s = std::stod(secStr);
-	}
+	const auto separator = time.find_first_of(",.", secondColon + 1);
+	const std::string_view seconds = time.substr(secondColon + 1, separator - secondColon - 1);
 
-	return h * 3600.0 + m * 60.0 + s;
+	long long h, m, s;
+	if (!parseNumber(time.substr(0, firstColon), h) ||
+		!parseNumber(time.substr(firstColon + 1, secondColon - firstColon - 1), m) || !parseNumber(seconds, s))
+		return false;
+
+	ticks = ((h * 60 + m) * 60 + s) * TICKS_PER_SECOND;
+
+	if (separator == std::string_view::npos)
+		return true;
+
+	// Usually milliseconds, scaled by the number of digits
+	const std::string_view fraction = time.substr(separator + 1, FRACTION_DIGITS);
+	long long value;
+	if (!parseNumber(fraction, value))
+		return false;
+
+	long long scale = TICKS_PER_SECOND;
+	for (std::size_t i = 0; i < fraction.size(); ++i)
+		scale /= 10;
+
+	ticks += value * scale;
+	return true;
 }
 
 double SubtitleOverride::parseTtmlTime(const std::string& time_str)
@@ -142,89 +226,392 @@ std::string SubtitleOverride::formatTtmlTime(double time_sec)
 }
 
 void SubtitleOverride::parseSrtOverride(const std::string& path, const std::string& file_name,
-                                        const std::string& episode_id,
-                                        std::map<std::string, std::vector<SrtSegment>>& overrides)
+                                        const std::string& episode_id, std::map<std::string, SrtTrack>& overrides)
 {
 	Logger& logger = Logger::get(name());
 
-	std::ifstream file(path);
-	if (!file)
+	SrtTrack track;
+
+	try
 	{
-		logger.error("Failed to open subtitle override file: %s", path);
+		// Mapping an empty file fails, there is nothing to parse in it anyway
+		if (const File file(path); file.getSize() > 0)
+		{
+			const SharedMemory mapping(file, SharedMemory::AM_READ);
+			parseSrt(std::string_view(mapping.begin(), mapping.end() - mapping.begin()), track);
+		}
+	}
+	catch (Poco::Exception& ex)
+	{
+		logger.error("Failed to open subtitle override file: %s (%s)", path, ex.displayText());
 		return;
 	}
 
-	std::vector<SrtSegment> segments;
-	std::string line;
+	const std::string captionKey = extractCaptionKey(file_name);
+
+	logger.debug("Loaded %s caption overrides for track %s in episode %s", std::to_string(track.segments.size()),
+	             captionKey, episode_id);
+
+	overrides[captionKey] = std::move(track);
+}
 
-	while (std::getline(file, line))
+void SubtitleOverride::parseSrt(std::string_view data, SrtTrack& track)
+{
+	if (data.starts_with(UTF8_BOM))
+		data.remove_prefix(UTF8_BOM.size());
+
+	// Cue text is never longer than the file, so the arena is allocated once
+	track.text_arena.reserve(data.size());
+
+	while (!data.empty())
 	{
-		Poco::trimInPlace(line);
-		if (line.empty()) continue;
+		// Cue number
+		if (trim(nextLine(data)).empty()) continue;
 
 		// The next line is the timestamps
-		std::string timeLine;
-		if (!std::getline(file, timeLine)) break;
-		Poco::trimInPlace(timeLine);
+		if (data.empty()) break;
+		const std::string_view timeLine = trim(nextLine(data));
 
-		auto arrowPos = timeLine.find(" --> ");
-		if (arrowPos == std::string::npos) continue;
+		const auto arrowPos = timeLine.find(" --> ");
+		if (arrowPos == std::string_view::npos) continue;
 
-		std::string beginTimeStr = timeLine.substr(0, arrowPos);
-		std::string endTimeStr = timeLine.substr(arrowPos + 5);
+		// Position hints may follow the end time
+		std::string_view endTime = timeLine.substr(arrowPos + 5);
+		endTime = endTime.substr(0, endTime.find(' '));
 
-		double beginTime = parseSrtTime(beginTimeStr);
-		double endTime = parseSrtTime(endTimeStr);
+		SrtSegment segment{};
+		const bool valid = parseSrtTime(trim(timeLine.substr(0, arrowPos)), segment.begin_ticks) &&
+			parseSrtTime(endTime, segment.end_ticks);
 
 		// The next lines are the text until an empty line
-		std::string text;
-		while (std::getline(file, line))
+		const std::size_t textBegin = track.text_arena.size();
+		while (!data.empty())
 		{
-			Poco::trimInPlace(line);
+			const std::string_view line = trim(nextLine(data));
 			if (line.empty()) break;
-			if (!text.empty()) text += "\n";
-			text += line;
+			if (track.text_arena.size() != textBegin) track.text_arena += '\n';
+			track.text_arena.append(line);
 		}
 
-		segments.push_back({beginTime, endTime, text});
-	}
+		if (!valid)
+		{
+			track.text_arena.resize(textBegin);
+			continue;
+		}
 
-	std::string captionKey = extractCaptionKey(file_name);
-	overrides[captionKey] = std::move(segments);
+		segment.text_offset = static_cast<std::uint32_t>(textBegin);
+		segment.text_length = static_cast<std::uint32_t>(track.text_arena.size() - textBegin);
+		track.segments.push_back(segment);
+	}
 
-	logger.debug("Loaded %s caption overrides for track %s in episode %s",
-	             std::to_string(overrides[captionKey].size()), captionKey, episode_id);
+	track.text_arena.shrink_to_fit();
 }
 
 std::string SubtitleOverride::overrideSubtitles(const std::string& episode_id, const std::string& track_name,
-                                                std::string& data_raw, const std::string& start_time)
+                                                const std::string_view data_raw, const std::string& start_time)
+{
+	return overrideSubtitles(SymbolTable::episodes().find(episode_id), SymbolTable::tracks().find(track_name), data_raw,
+	                         start_time);
+}
+
+std::string SubtitleOverride::overrideSubtitles(const SymbolTable::Symbol episode,
+                                                const SymbolTable::Symbol track_symbol, const std::string_view data_raw,
+                                                const std::string& start_time)
+{
+	const SrtTrack* track = findTrack(episode, track_symbol);
+
+	if (!track)
+		return std::string(data_raw);
+
+	long long frag_time = 0;
+	if (!start_time.empty())
+		frag_time = static_cast<long long>(std::stoull(start_time));
+
+	return rewriteDocument(*track, episode, track_symbol, data_raw, frag_time, 0);
+}
+
+std::pmr::string SubtitleOverride::synthesizeFragment(const SymbolTable::Symbol episode,
+                                                      const SymbolTable::Symbol track_symbol,
+                                                      const std::string& start_time,
+                                                      std::pmr::memory_resource* memory)
+{
+	const SrtTrack* track = synthesize_ ? findTrack(episode, track_symbol) : nullptr;
+	const std::shared_ptr<const CaptionTemplate> fragment = track ? findTemplate(track_symbol) : nullptr;
+
+	unsigned long long fragTime;
+	const auto [end, ec] = std::from_chars(start_time.data(), start_time.data() + start_time.size(), fragTime);
+
+	if (!fragment || ec != std::errc() || end != start_time.data() + start_time.size())
+		return std::pmr::string(memory);
+
+	// The template may be another episode's, the fragment is timed and labelled like the episode's own
+	const auto [duration, trackId] = findChunk(episode, track_symbol, fragTime);
+
+	if (duration == 0 || trackId == 0)
+		return std::pmr::string(memory);
+
+	try
+	{
+		const std::string document = rewriteDocument(*track, episode, track_symbol, fragment->document(),
+		                                             static_cast<long long>(fragTime),
+		                                             static_cast<long long>(duration));
+
+		return fragment->build(fragTime, duration, trackId, document, memory);
+	}
+	catch (Poco::Exception& ex)
+	{
+		// The CDN still has the fragment
+		Logger::get(name()).warning("Failed to build a caption fragment of track %s from its template (%s)",
+		                            SymbolTable::tracks().name(track_symbol), ex.displayText());
+		return std::pmr::string(memory);
+	}
+}
+
+void SubtitleOverride::rememberTemplate(const SymbolTable::Symbol episode, const SymbolTable::Symbol track_symbol,
+                                        const std::string_view fragment)
 {
+	if (!synthesize_ || track_symbol == SymbolTable::NONE)
+		return;
+
+	const unsigned int trackId = episode != SymbolTable::NONE ? CaptionTemplate::readTrackId(fragment) : 0;
+	bool hasTemplate;
+	bool trackIdKnown;
+
+	{
+		std::shared_lock lock(templates_mutex_);
+		hasTemplate = symbolAt(templates_, track_symbol).fragment != nullptr;
+		trackIdKnown = trackId == 0 ||
+			symbolAt(symbolAt(episode_captions_, episode).track_ids, track_symbol) == trackId;
+	}
+
+	// Fragments synthesized for the episode are given the ID its own fragments carry
+	if (!trackIdKnown)
+	{
+		std::unique_lock lock(templates_mutex_);
+		symbolSlot(symbolSlot(episode_captions_, episode).track_ids, track_symbol) = trackId;
+	}
+
+	if (hasTemplate)
+		return;
+
+	std::shared_ptr<const CaptionTemplate> captured;
+
+	try
+	{
+		captured = std::make_shared<const CaptionTemplate>(std::string(fragment));
+	}
+	catch (Poco::DataFormatException&)
+	{
+		return;
+	}
+
+	{
+		std::unique_lock lock(templates_mutex_);
+		TemplateSlot& slot = symbolSlot(templates_, track_symbol);
+
+		if (slot.fragment)
+			return;
+
+		slot.fragment = captured;
+	}
+
+	// Stored for later runs, which may be offline. A template that's already there (e.g. put there by hand) stays.
+	const Path path = templateFile(track_symbol);
+	const std::string partPath = path.toString() + ".part";
 	Logger& logger = Logger::get(name());
 
-	if (!m_subtitle_overrides_.contains(episode_id))
-		return data_raw;
+	try
+	{
+		if (File(path).exists())
+			return;
+
+		File(template_path_).createDirectories();
+
+		std::ofstream file(partPath, std::ios::binary | std::ios::trunc);
+		file.write(captured->fragment().data(), static_cast<std::streamsize>(captured->fragment().size()));
+		file.close();
+
+		if (!file)
+			throw WriteFileException(partPath);
+
+		File(partPath).renameTo(path.toString());
+		logger.information("Stored caption template %s", path.toString());
+	}
+	catch (Poco::Exception& ex)
+	{
+		logger.warning("Failed to store caption template %s (%s)", path.toString(), ex.displayText());
+	}
+}
+
+void SubtitleOverride::rememberClientManifest(const SymbolTable::Symbol episode, const std::string_view manifest)
+{
+	if (!synthesize_ || episode == SymbolTable::NONE)
+		return;
+
+	// Only overridden episodes are synthesized
+	{
+		std::shared_lock lock(overrides_mutex_);
+
+		if (std::ranges::none_of(symbolAt(tracks_by_symbol_, episode), [](const SrtTrack* track) { return track; }))
+			return;
+	}
+
+	const std::size_t hash = std::hash<std::string_view>()(manifest);
+	std::unique_lock lock(templates_mutex_);
+	EpisodeCaptions& captions = symbolSlot(episode_captions_, episode);
+
+	if (captions.manifest_hash == hash)
+		return;
+
+	// Parsed by the first fragment synthesized, this may be the upstream client's thread
+	captions.manifest_hash = hash;
+	captions.client_manifest = manifest;
+	captions.chunks.clear();
+}
+
+std::pair<unsigned long long, unsigned int> SubtitleOverride::findChunk(const SymbolTable::Symbol episode,
+                                                                       const SymbolTable::Symbol track_symbol,
+                                                                       const unsigned long long start_time)
+{
+	const auto find = [&](const EpisodeCaptions& captions) -> std::pair<unsigned long long, unsigned int>
+	{
+		const auto& chunks = symbolAt(captions.chunks, track_symbol);
+		const auto chunk = std::ranges::lower_bound(chunks, std::pair(start_time, 0ull));
+		const unsigned long long duration = chunk != chunks.end() && chunk->first == start_time ? chunk->second : 0;
+
+		return {duration, symbolAt(captions.track_ids, track_symbol)};
+	};
+
+	std::string manifest;
+
+	{
+		std::shared_lock lock(templates_mutex_);
+
+		if (const EpisodeCaptions& captions = symbolAt(episode_captions_, episode); captions.client_manifest.empty())
+			return find(captions);
+	}
+
+	{
+		std::unique_lock lock(templates_mutex_);
+		EpisodeCaptions& captions = symbolSlot(episode_captions_, episode);
+		manifest.swap(captions.client_manifest);
+
+		// Another fragment is parsing it
+		if (manifest.empty())
+			return find(captions);
+	}
+
+	std::vector<std::vector<std::pair<unsigned long long, unsigned long long>>> chunks;
+
+	try
+	{
+		DOMParser parser;
+		const AutoPtr doc = parser.parseString(manifest);
+		const AutoPtr streamIndexes = doc->getElementsByTagName("StreamIndex");
+
+		for (unsigned long i = 0; i < streamIndexes->length(); ++i)
+		{
+			const auto* streamIndex = dynamic_cast<Element*>(streamIndexes->item(i));
+
+			if (streamIndex->getAttribute("Type") != "text")
+				continue;
+
+			if (const SymbolTable::Symbol track = SymbolTable::tracks().find(streamIndexTrackName(streamIndex));
+				track != SymbolTable::NONE)
+			{
+				auto& trackChunks = symbolSlot(chunks, track);
+				trackChunks = streamIndexChunks(streamIndex);
+				std::ranges::sort(trackChunks);
+			}
+		}
+	}
+	catch (Poco::Exception& ex)
+	{
+		Logger::get(name()).warning("Failed to read the caption chunks of a client manifest, captions are fetched (%s)",
+		                            ex.displayText());
+	}
 
-	auto& episodeOverrides = m_subtitle_overrides_[episode_id];
+	std::unique_lock lock(templates_mutex_);
+	EpisodeCaptions& captions = symbolSlot(episode_captions_, episode);
 
-	if (!episodeOverrides.contains(track_name))
-		return data_raw;
+	// Unless a newer manifest came in meanwhile
+	if (captions.client_manifest.empty())
+		captions.chunks = std::move(chunks);
 
-	auto& segments = episodeOverrides[track_name];
+	return find(captions);
+}
+
+const SubtitleOverride::SrtTrack* SubtitleOverride::findTrack(const SymbolTable::Symbol episode,
+                                                              const SymbolTable::Symbol track_symbol) const
+{
+	std::shared_lock lock(overrides_mutex_);
+	return symbolAt(symbolAt(tracks_by_symbol_, episode), track_symbol);
+}
+
+std::shared_ptr<const CaptionTemplate> SubtitleOverride::findTemplate(const SymbolTable::Symbol track_symbol)
+{
+	{
+		std::shared_lock lock(templates_mutex_);
 
-	std::istringstream xmlStream(data_raw);
+		if (const TemplateSlot& slot = symbolAt(templates_, track_symbol); slot.looked_up)
+			return slot.fragment;
+	}
+
+	// Once per track, a template stored by an earlier run or put there by hand
+	std::shared_ptr<const CaptionTemplate> stored;
+	const Path path = templateFile(track_symbol);
+
+	try
+	{
+		if (File(path).exists())
+		{
+			std::ifstream file(path.toString(), std::ios::binary);
+			std::string data;
+			StreamCopier::copyToString(file, data);
+			stored = std::make_shared<const CaptionTemplate>(std::move(data));
+		}
+	}
+	catch (Poco::Exception& ex)
+	{
+		Logger::get(name()).warning("Ignoring caption template %s (%s)", path.toString(), ex.displayText());
+	}
+
+	std::unique_lock lock(templates_mutex_);
+	TemplateSlot& slot = symbolSlot(templates_, track_symbol);
+
+	if (!slot.looked_up)
+	{
+		slot.looked_up = true;
+
+		if (!slot.fragment)
+			slot.fragment = std::move(stored);
+	}
+
+	return slot.fragment;
+}
+
+Path SubtitleOverride::templateFile(const SymbolTable::Symbol track_symbol) const
+{
+	return Path(template_path_, SymbolTable::tracks().name(track_symbol) + ".frag");
+}
+
+std::string SubtitleOverride::rewriteDocument(const SrtTrack& track, const SymbolTable::Symbol episode,
+                                              const SymbolTable::Symbol track_symbol, const std::string_view document,
+                                              const long long frag_time, const long long fragment_duration) const
+{
+	Logger& logger = Logger::get(name());
+
+	// Parsed where it is, the caller's buffer isn't copied into a string stream
+	Poco::MemoryInputStream xmlStream(document.data(), document.size());
 	InputSource src(xmlStream);
 	DOMParser parser;
 	AutoPtr doc = parser.parse(&src);
 	NodeList* divList = doc->getElementsByTagName("div");
-	if (divList->length() == 0) return data_raw;
+	if (divList->length() == 0) return std::string(document);
 	auto firstDiv = dynamic_cast<Element*>(divList->item(0));
 
 	NodeList* pList = doc->getElementsByTagName("p");
 
-	double frag_time_sec = 0.0;
-	if (!start_time.empty())
-		frag_time_sec = std::stoull(start_time) / 10000000.0;
-
 	// Calculate maximum relative end time to estimate fragment duration
 	double max_rel_end = 0.0;
 	std::vector<Node*> nodesToRemove;
@@ -244,17 +631,19 @@ std::string SubtitleOverride::overrideSubtitles(const std::string& episode_id, c
 		node->release();
 	}
 
-	// Default duration is at least 2.5 seconds to ensure sufficient overlap window
-	double fragment_duration = std::max(max_rel_end, 2.5);
+	// Unless it's known, the duration is at least 2.5 seconds to ensure sufficient overlap window
+	const long long duration = fragment_duration > 0
+		                           ? fragment_duration
+		                           : static_cast<long long>(std::max(max_rel_end, 2.5) * TICKS_PER_SECOND);
 
 	int pId = 1;
-	for (const auto& seg : segments)
+	for (const auto& seg : track.segments)
 	{
 		// Check if the SRT segment overlaps with the current fragment
-		if (seg.end_time_sec > frag_time_sec && seg.begin_time_sec < frag_time_sec + fragment_duration)
+		if (seg.end_ticks > frag_time && seg.begin_ticks < frag_time + duration)
 		{
-			double rel_begin = std::max(0.0, seg.begin_time_sec - frag_time_sec);
-			double rel_end = seg.end_time_sec - frag_time_sec;
+			const double rel_begin = static_cast<double>(std::max(0LL, seg.begin_ticks - frag_time)) / TICKS_PER_SECOND;
+			const double rel_end = static_cast<double>(seg.end_ticks - frag_time) / TICKS_PER_SECOND;
 
 			AutoPtr p = doc->createElement("p");
 			p->setAttribute("xml:id", "p" + std::to_string(pId++));
@@ -265,7 +654,7 @@ std::string SubtitleOverride::overrideSubtitles(const std::string& episode_id, c
 			AutoPtr span = doc->createElement("span");
 			span->setAttribute("style", "textStyle");
 
-			std::string newText = seg.text;
+			std::string newText(track.text(seg));
 
 			if (!closed_captioning_)
 			{
@@ -288,7 +677,9 @@ std::string SubtitleOverride::overrideSubtitles(const std::string& episode_id, c
 
 			firstDiv->appendChild(p);
 
-			logger.trace("Episode: %s (%s), Subtitle Segment: p%d ('%s')", episode_id, track_name, pId - 1, newText);
+			if (logger.trace())
+				logger.trace("Episode: %s (%s), Subtitle Segment: p%d ('%s')", SymbolTable::episodes().name(episode),
+				             SymbolTable::tracks().name(track_symbol), pId - 1, newText);
 		}
 	}
 
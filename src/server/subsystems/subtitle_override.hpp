@@ -1,37 +1,117 @@
 #pragma once
 
+#include <memory_resource>
+#include <shared_mutex>
+#include <string_view>
+
+#include "../caption_template.hpp"
+#include "../symbol_table.hpp"
+
 class SubtitleOverride final : public Poco::Util::Subsystem
 {
 public:
+	// Cue times are in 100ns ticks like fragment start times, the text is a slice of the track's text arena
+	struct SrtSegment
+	{
+		long long begin_ticks;
+		long long end_ticks;
+		std::uint32_t text_offset;
+		std::uint32_t text_length;
+	};
+
+	// The cues of one override file, their text is stored back to back in a single buffer
+	struct SrtTrack
+	{
+		std::vector<SrtSegment> segments;
+		std::string text_arena;
+
+		[[nodiscard]] std::string_view text(const SrtSegment& segment) const
+		{
+			return std::string_view(text_arena).substr(segment.text_offset, segment.text_length);
+		}
+	};
+
 	[[nodiscard]] const char* name() const override;
 
-	std::string overrideSubtitles(const std::string& episode_id, const std::string& track_name, std::string& data_raw,
-	                              const std::string& start_time);
+	std::string overrideSubtitles(const std::string& episode_id, const std::string& track_name,
+	                              std::string_view data_raw, const std::string& start_time);
+	std::string overrideSubtitles(SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol,
+	                              std::string_view data_raw, const std::string& start_time);
+
+	// The caption fragment the CDN would serve with its cues replaced, built from the track's template without fetching
+	// anything. Empty if the track isn't overridden, no template of it is known yet, or the episode's own chunk of
+	// start_time or track ID isn't (the fragment is fetched then, which tells the track ID).
+	std::pmr::string synthesizeFragment(SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol,
+	                                    const std::string& start_time, std::pmr::memory_resource* memory);
+
+	// Keeps the first fragment seen of a caption track as its template, also in Subtitles.TemplatePath, and the
+	// episode's track ID from every one
+	void rememberTemplate(SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol, std::string_view fragment);
 
-	void load();
+	// The client manifest served for the episode, synthesized fragments are timed by its caption chunks
+	void rememberClientManifest(SymbolTable::Symbol episode, std::string_view manifest);
+
+	// Loads the SubRip overrides of a single episode (OfflineStreaming indexes them with the episode), safe to call
+	// while captions are being rewritten
+	void loadEpisode(const std::string& episode_id);
+
+	// Maps the file and parses it in place, the track is stored under its caption key
+	void parseSrtOverride(const std::string& path, const std::string& file_name, const std::string& episode_id,
+	                      std::map<std::string, SrtTrack>& overrides);
+
+	static void parseSrt(std::string_view data, SrtTrack& track);
 
 protected:
 	void initialize(Poco::Util::Application& app) override;
 	void uninitialize() override;
 
 private:
-	struct SrtSegment
+	// Episodes are only ever added, so their segments can be read without holding the lock
+	std::map<std::string, std::map<std::string, SrtTrack>> m_subtitle_overrides_;
+	std::vector<std::vector<const SrtTrack*>> tracks_by_symbol_; // [episode symbol][track symbol]
+	mutable std::shared_mutex overrides_mutex_;
+
+	std::vector<Poco::Path> episode_roots_; // storage roots, overrides in earlier ones win
+	bool closed_captioning_ = false;
+	bool music_notes_ = false;
+
+	struct TemplateSlot
+	{
+		std::shared_ptr<const CaptionTemplate> fragment;
+		bool looked_up = false; // in Subtitles.TemplatePath
+	};
+
+	// What synthesized fragments take from their own episode, templates may come from another one
+	struct EpisodeCaptions
 	{
-		double begin_time_sec;
-		double end_time_sec;
-		std::string text;
+		std::string client_manifest; // until its chunks are parsed, by the first synthesized fragment
+		std::size_t manifest_hash = 0; // of the last one remembered, the player asks for it every time
+		std::vector<std::vector<std::pair<unsigned long long, unsigned long long>>> chunks; // [track symbol]
+		std::vector<unsigned int> track_ids; // [track symbol], 0 until a fragment of the track is seen
 	};
 
-	std::map<std::string, std::map<std::string, std::vector<SrtSegment>>> m_subtitle_overrides_;
+	Poco::Path template_path_;
+	bool synthesize_ = false; // Subtitles.TemplatePath isn't empty
+	std::vector<TemplateSlot> templates_; // [track symbol]
+	std::vector<EpisodeCaptions> episode_captions_; // [episode symbol]
+	mutable std::shared_mutex templates_mutex_; // also guards episode_captions_
 
-	bool closed_captioning_ = false;
-	bool music_notes_ = false;
+	[[nodiscard]] const SrtTrack* findTrack(SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol) const;
+	std::shared_ptr<const CaptionTemplate> findTemplate(SymbolTable::Symbol track_symbol);
+	[[nodiscard]] Poco::Path templateFile(SymbolTable::Symbol track_symbol) const;
+
+	// Duration of the episode's chunk starting at start_time (0 if its client manifest doesn't list one) and the
+	// episode's track ID (0 until a fragment of the track is seen)
+	std::pair<unsigned long long, unsigned int> findChunk(SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol,
+	                                                      unsigned long long start_time);
+
+	// fragment_duration is in ticks, 0 estimates it from the cues of the document
+	std::string rewriteDocument(const SrtTrack& track, SymbolTable::Symbol episode, SymbolTable::Symbol track_symbol,
+	                            std::string_view document, long long frag_time, long long fragment_duration) const;
 
 	static std::string extractCaptionKey(const std::string& file_name);
 
-	void parseSrtOverride(const std::string& path, const std::string& file_name, const std::string& episode_id,
-	                      std::map<std::string, std::vector<SrtSegment>>& overrides);
-	static double parseSrtTime(const std::string& time_str);
+	static bool parseSrtTime(std::string_view time, long long& ticks);
 	static double parseTtmlTime(const std::string& time_str);
 	static std::string formatTtmlTime(double time_sec);
 };
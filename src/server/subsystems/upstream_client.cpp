@@ -0,0 +1,854 @@
+#include "pch.hpp"
+#include "upstream_client.hpp"
+
+#include <algorithm>
+#include <ranges>
+
+using Poco::Clock;
+using Poco::Logger;
+using Poco::Timespan;
+using Poco::Timestamp;
+using Poco::URI;
+using Poco::Net::HTTPMessage;
+using Poco::Net::HTTPRequest;
+using Poco::Net::HTTPResponse;
+using Poco::Net::NameValueCollection;
+using Poco::Net::PollSet;
+using Poco::Net::SocketAddress;
+using Poco::Net::StreamSocket;
+using Poco::Util::Application;
+
+namespace
+{
+	constexpr std::size_t READ_BUFFER_SIZE = 64 * 1024;
+	constexpr Timestamp::TimeDiff RESOLVE_CACHE_TIME = 60 * Timespan::SECONDS;
+	const Timespan MAX_POLL_INTERVAL(1, 0);
+
+	constexpr std::size_t MIN_HEDGE_SAMPLES = 20; // no hedging until the p95 means something
+	constexpr double MAX_BUDGET = 10; // burst of hedges and retries allowed after a quiet period
+
+	bool isHopByHop(const std::string& header)
+	{
+		return Poco::icompare(header, "Connection") == 0 || Poco::icompare(header, "Keep-Alive") == 0 ||
+			Poco::icompare(header, "Transfer-Encoding") == 0 || Poco::icompare(header, "Content-Length") == 0;
+	}
+
+	// Decodes the complete chunks in input from position on, returns true once the last chunk and trailers are in
+	bool decodeChunks(const std::string& input, std::size_t& position, std::string& body)
+	{
+		for (;;)
+		{
+			const auto lineEnd = input.find("\r\n", position);
+			if (lineEnd == std::string::npos)
+				return false;
+
+			std::size_t size;
+			const auto [end, ec] = std::from_chars(input.data() + position, input.data() + lineEnd, size, 16);
+
+			if (ec != std::errc() || (end != input.data() + lineEnd && *end != ';' && *end != ' '))
+				throw Poco::DataFormatException("Invalid chunk size in upstream response");
+
+			if (size == 0)
+				return input.find("\r\n\r\n", lineEnd) != std::string::npos;
+
+			if (input.size() < lineEnd + 2 + size + 2)
+				return false;
+
+			body.append(input, lineEnd + 2, size);
+			position = lineEnd + 2 + size + 2;
+		}
+	}
+
+	// Worth another try on a fresh connection, unlike 4xx answers or running out of time
+	bool isRetryable(const UpstreamClient::Result& result)
+	{
+		switch (result.outcome)
+		{
+		case UpstreamClient::Result::Outcome::OK:
+			return result.status == HTTPResponse::HTTP_INTERNAL_SERVER_ERROR ||
+				result.status == HTTPResponse::HTTP_BAD_GATEWAY ||
+				result.status == HTTPResponse::HTTP_SERVICE_UNAVAILABLE ||
+				result.status == HTTPResponse::HTTP_GATEWAY_TIMEOUT;
+		case UpstreamClient::Result::Outcome::FAILED:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	UpstreamClient::Result interrupted(const bool timed_out)
+	{
+		UpstreamClient::Result result;
+		result.outcome = timed_out ? UpstreamClient::Result::Outcome::TIMEOUT : UpstreamClient::Result::Outcome::CANCELLED;
+		result.status = timed_out ? HTTPResponse::HTTP_GATEWAY_TIMEOUT : HTTPResponse::HTTP_SERVICE_UNAVAILABLE;
+		result.error = timed_out ? "Timed out" : "Cancelled";
+		return result;
+	}
+}
+
+struct UpstreamClient::Fetch
+{
+	URI uri;
+	NameValueCollection headers;
+	SocketAddress address;
+	Timestamp deadline;
+	Callback callback;
+
+	std::atomic<bool> cancelled = false;
+	std::optional<Result> failure; // couldn't be started, the loop finishes it with this
+
+	// Event-loop thread only
+	std::vector<AttemptPtr> attempts;
+	int running = 0; // attempts still in flight
+	int retries = 0;
+	bool hedged = false;
+	bool done = false; // the callback has been called
+	std::optional<Timestamp> hedge_at; // the single attempt still has no headers by then
+	std::optional<Timestamp> retry_at; // backing off, no attempt running
+	Result last_failure;
+};
+
+// One request of a fetch on its own connection, the first, a hedge or a retry
+struct UpstreamClient::Attempt
+{
+	Fetch* fetch = nullptr; // kept alive by the attempt's coroutine
+	bool hedge = false;
+	Clock::ClockVal begin = 0;
+	Timestamp deadline; // header timeout until the headers are in, then the fetch's deadline
+	bool cancelled = false; // another attempt won
+
+	StreamSocket socket;
+	bool registered = false; // socket is in the poll set
+	std::coroutine_handle<> waiting; // suspended until the socket is ready, times out or is cancelled
+	Wake wake = Wake::READY;
+
+	[[nodiscard]] bool interrupted() const { return cancelled || fetch->cancelled; }
+};
+
+// Suspends the attempt until its socket is ready for mode, resumes with why it woke up
+class UpstreamClient::SocketWait
+{
+public:
+	SocketWait(UpstreamClient& client, Attempt& attempt, const int mode) :
+		client_(client),
+		attempt_(attempt),
+		mode_(mode)
+	{
+	}
+
+	[[nodiscard]] bool await_ready() const
+	{
+		if (attempt_.interrupted())
+		{
+			attempt_.wake = Wake::CANCELLED;
+			return true;
+		}
+
+		if (attempt_.deadline.isElapsed(0))
+		{
+			attempt_.wake = Wake::TIMEOUT;
+			return true;
+		}
+
+		return false;
+	}
+
+	void await_suspend(const std::coroutine_handle<> handle) const
+	{
+		if (attempt_.registered)
+		{
+			client_.poll_set_.update(attempt_.socket, mode_);
+		}
+		else
+		{
+			client_.poll_set_.add(attempt_.socket, mode_);
+			attempt_.registered = true;
+		}
+
+		attempt_.wake = Wake::READY;
+		attempt_.waiting = handle;
+		client_.waiting_[attempt_.socket] = &attempt_;
+	}
+
+	[[nodiscard]] Wake await_resume() const { return attempt_.wake; }
+
+private:
+	UpstreamClient& client_;
+	Attempt& attempt_;
+	int mode_;
+};
+
+UpstreamClient::UpstreamClient() : random_(std::random_device{}())
+{
+}
+
+UpstreamClient::~UpstreamClient()
+{
+	stop();
+}
+
+const char* UpstreamClient::name() const
+{
+	return "UpstreamClient";
+}
+
+void UpstreamClient::initialize(Application& app)
+{
+	Policy policy;
+	policy.hedging = app.config().getBool("Upstream.Hedging", policy.hedging);
+	policy.hedge_min_delay = Timespan(app.config().getInt("Upstream.HedgeMinDelay", 100) * Timespan::MILLISECONDS);
+	policy.budget = app.config().getDouble("Upstream.RetryBudget", policy.budget);
+	policy.retries = app.config().getInt("Upstream.Retries", policy.retries);
+	policy.retry_backoff = Timespan(app.config().getInt("Upstream.RetryBackoff", 250) * Timespan::MILLISECONDS);
+	policy.header_timeout = Timespan(app.config().getInt("Upstream.HeaderTimeout", 5), 0);
+	setPolicy(policy);
+
+	start();
+}
+
+void UpstreamClient::uninitialize()
+{
+	stop();
+}
+
+void UpstreamClient::start()
+{
+	if (running_.exchange(true))
+		return;
+
+	budget_ = MAX_BUDGET;
+
+	thread_ = std::thread(&UpstreamClient::run, this);
+}
+
+void UpstreamClient::stop()
+{
+	{
+		std::lock_guard lock(pending_mutex_);
+
+		if (!running_.exchange(false))
+			return;
+	}
+
+	poll_set_.wakeUp();
+	thread_.join();
+}
+
+UpstreamClient::FetchPtr UpstreamClient::fetch(const URI& uri, const NameValueCollection& headers,
+                                               const Timespan timeout, Callback callback)
+{
+	auto fetch = std::make_shared<Fetch>();
+	fetch->uri = uri;
+	fetch->headers = headers;
+	fetch->deadline += timeout.totalMicroseconds();
+	fetch->callback = std::move(callback);
+
+	try
+	{
+		// Resolved here, getaddrinfo has no non-blocking variant and the result is cached anyway
+		fetch->address = resolve(uri.getHost(), uri.getPort());
+	}
+	catch (Poco::Exception& ex)
+	{
+		// Still finished on the loop, callers may not be ready for the callback before fetch() returns
+		fetch->failure.emplace();
+		fetch->failure->error = ex.displayText();
+	}
+
+	{
+		// Checked under the lock, so the loop can't exit between the check and the push and leave this one behind
+		std::unique_lock lock(pending_mutex_);
+
+		// Only while shutting down, there's no loop left to finish it
+		if (!running_)
+		{
+			lock.unlock();
+			fetch->callback(interrupted(false));
+			return fetch;
+		}
+
+		++in_flight_;
+		pending_.push_back(fetch);
+	}
+
+	poll_set_.wakeUp();
+	return fetch;
+}
+
+UpstreamClient::Result UpstreamClient::fetch(const URI& uri, const NameValueCollection& headers,
+                                             const Timespan timeout)
+{
+	Poco::Event done;
+	Result result;
+
+	fetch(uri, headers, timeout, [&](Result completed)
+	{
+		result = std::move(completed);
+		done.set();
+	});
+
+	done.wait();
+	return result;
+}
+
+void UpstreamClient::cancel(const FetchPtr& fetch)
+{
+	if (!fetch || fetch->cancelled.exchange(true))
+		return;
+
+	poll_set_.wakeUp();
+}
+
+UpstreamClient::Statistics UpstreamClient::statistics() const
+{
+	Statistics statistics;
+	statistics.fetches = fetches_.load(std::memory_order_relaxed);
+	statistics.hedges = hedges_.load(std::memory_order_relaxed);
+	statistics.hedge_wins = hedge_wins_.load(std::memory_order_relaxed);
+	statistics.retries = retries_.load(std::memory_order_relaxed);
+	statistics.throttled = throttled_.load(std::memory_order_relaxed);
+	statistics.hedge_delay = Timespan(hedge_delay_.load(std::memory_order_relaxed));
+	return statistics;
+}
+
+void UpstreamClient::run()
+{
+	static Logger& logger = Logger::get("Network");
+
+	while (running_)
+	{
+		PollSet::SocketModeMap ready;
+
+		try
+		{
+			ready = poll_set_.poll(nextDeadline());
+		}
+		catch (Poco::Exception& ex)
+		{
+			logger.error("Upstream client poll failed (%s)", ex.displayText());
+		}
+
+		std::vector<FetchPtr> started;
+
+		{
+			std::lock_guard lock(pending_mutex_);
+			started.swap(pending_);
+		}
+
+		for (auto& fetch : started)
+		{
+			if (fetch->failure)
+			{
+				finish(*fetch, std::move(*fetch->failure));
+				continue;
+			}
+
+			++fetches_;
+			budget_ = std::min(MAX_BUDGET, budget_ + policy_.budget);
+			active_.push_back(fetch);
+			launch(fetch);
+		}
+
+		for (const auto& socket : ready | std::views::keys)
+		{
+			const auto it = waiting_.find(socket);
+			if (it == waiting_.end())
+				continue;
+
+			Attempt& attempt = *it->second;
+			waiting_.erase(it);
+
+			// Errors are picked up by the next socket call
+			attempt.wake = Wake::READY;
+			std::exchange(attempt.waiting, {}).resume();
+		}
+
+		wakeExpired();
+		schedule();
+	}
+
+	// Shutting down, every transfer still running completes as cancelled
+	std::vector<FetchPtr> abandoned;
+
+	{
+		std::lock_guard lock(pending_mutex_);
+		abandoned.swap(pending_);
+	}
+
+	for (const auto& fetch : abandoned)
+		finish(*fetch, interrupted(false));
+
+	while (!waiting_.empty())
+	{
+		Attempt& attempt = *waiting_.begin()->second;
+		waiting_.erase(waiting_.begin());
+
+		attempt.fetch->cancelled = true;
+		attempt.wake = Wake::CANCELLED;
+		std::exchange(attempt.waiting, {}).resume();
+	}
+
+	// Fetches backing off before a retry have no attempt that could complete them
+	for (const auto& fetch : active_)
+	{
+		if (!fetch->done)
+			finish(*fetch, interrupted(false));
+	}
+
+	active_.clear();
+}
+
+void UpstreamClient::wakeExpired()
+{
+	std::vector<Attempt*> expired;
+
+	for (Attempt* attempt : waiting_ | std::views::values)
+	{
+		if (attempt->interrupted() || attempt->deadline.isElapsed(0))
+			expired.push_back(attempt);
+	}
+
+	for (Attempt* attempt : expired)
+	{
+		waiting_.erase(attempt->socket);
+		attempt->wake = attempt->interrupted() ? Wake::CANCELLED : Wake::TIMEOUT;
+		std::exchange(attempt->waiting, {}).resume();
+	}
+}
+
+// Hedges and retries that are due, and fetches that ran out of time while backing off
+void UpstreamClient::schedule()
+{
+	static Logger& logger = Logger::get("Network");
+
+	for (const auto& fetch : active_)
+	{
+		if (fetch->done)
+			continue;
+
+		if (fetch->running == 0 && (fetch->cancelled || fetch->deadline.isElapsed(0)))
+		{
+			finish(*fetch, interrupted(!fetch->cancelled));
+			continue;
+		}
+
+		if (fetch->retry_at && fetch->retry_at->isElapsed(0))
+		{
+			fetch->retry_at.reset();
+			launch(fetch);
+		}
+
+		if (fetch->hedge_at && fetch->hedge_at->isElapsed(0))
+		{
+			fetch->hedge_at.reset();
+
+			if (!takeBudget())
+			{
+				++throttled_;
+				continue;
+			}
+
+			if (logger.debug())
+				logger.debug("Hedging %s, no response headers after %s ms", fetch->uri.toString(),
+				             std::to_string(hedge_delay_.load(std::memory_order_relaxed) / 1000));
+
+			++hedges_;
+			fetch->hedged = true;
+			launch(fetch, true);
+		}
+	}
+
+	std::erase_if(active_, [](const FetchPtr& fetch) { return fetch->done; });
+}
+
+Timespan UpstreamClient::nextDeadline() const
+{
+	Timespan interval = MAX_POLL_INTERVAL;
+	const Timestamp now;
+
+	const auto until = [&](const Timestamp& time)
+	{
+		interval = std::min(interval, Timespan(std::max<Timestamp::TimeDiff>(time - now, 0)));
+	};
+
+	for (const Attempt* attempt : waiting_ | std::views::values)
+	{
+		// Losers of a hedge and cancelled fetches are woken right away
+		if (attempt->interrupted())
+			return {};
+
+		until(attempt->deadline);
+	}
+
+	for (const auto& fetch : active_)
+	{
+		if (fetch->hedge_at)
+			until(*fetch->hedge_at);
+		if (fetch->retry_at)
+			until(*fetch->retry_at);
+		if (fetch->running == 0)
+			until(fetch->deadline);
+	}
+
+	return interval;
+}
+
+void UpstreamClient::launch(const FetchPtr& fetch, const bool hedge)
+{
+	const auto attempt = std::make_shared<Attempt>();
+	attempt->fetch = fetch.get();
+	attempt->hedge = hedge;
+	attempt->begin = Clock().microseconds();
+	attempt->deadline = std::min(fetch->deadline, Timestamp() + policy_.header_timeout.totalMicroseconds());
+
+	fetch->attempts.push_back(attempt);
+	++fetch->running;
+
+	// A single hedge per fetch, armed by whichever attempt runs alone
+	if (!fetch->hedged && fetch->running == 1)
+	{
+		if (const auto delay = hedgeDelay(); delay && Timestamp() + delay->totalMicroseconds() < fetch->deadline)
+			fetch->hedge_at = Timestamp() + delay->totalMicroseconds();
+	}
+
+	transfer(fetch, attempt).start();
+}
+
+Task<> UpstreamClient::transfer(const FetchPtr fetch, const AttemptPtr attempt)
+{
+	Result result;
+
+	try
+	{
+		result = co_await exchange(*attempt);
+	}
+	catch (Poco::Exception& ex)
+	{
+		result = {};
+		result.error = ex.displayText();
+	}
+	catch (std::exception& ex)
+	{
+		result = {};
+		result.error = ex.what();
+	}
+
+	result.begin = attempt->begin;
+	release(*attempt);
+	attemptFinished(*fetch, *attempt, std::move(result));
+}
+
+Task<UpstreamClient::Result> UpstreamClient::exchange(Attempt& attempt)
+{
+	const Fetch& fetch = *attempt.fetch;
+	const Clock start;
+
+	attempt.socket = StreamSocket(fetch.address.family());
+	attempt.socket.setBlocking(false);
+	attempt.socket.setNoDelay(true);
+	attempt.socket.connectNB(fetch.address);
+
+	if (const Wake wake = co_await wait(attempt, PollSet::POLL_WRITE); wake != Wake::READY)
+		co_return interrupted(wake == Wake::TIMEOUT);
+
+	if (const int error = attempt.socket.impl()->socketError(); error != 0)
+		throw Poco::Net::NetException(std::format("Connecting to {} failed", fetch.address.toString()), error);
+
+	const Clock::ClockDiff connectDuration = start.elapsed();
+
+	HTTPRequest request(HTTPRequest::HTTP_GET, fetch.uri.getPathEtc(), HTTPMessage::HTTP_1_1);
+
+	for (const auto& [key, value] : fetch.headers)
+	{
+		if (!isHopByHop(key))
+			request.set(key, value);
+	}
+
+	request.setHost(fetch.uri.getHost(), fetch.uri.getPort());
+	request.setKeepAlive(false);
+
+	std::ostringstream requestHead;
+	request.write(requestHead);
+	const std::string output = requestHead.str();
+
+	for (std::size_t sent = 0; sent < output.size();)
+	{
+		const int bytes = attempt.socket.sendBytes(output.data() + sent, static_cast<int>(output.size() - sent));
+
+		if (bytes < 0)
+		{
+			if (const Wake wake = co_await wait(attempt, PollSet::POLL_WRITE); wake != Wake::READY)
+				co_return interrupted(wake == Wake::TIMEOUT);
+
+			continue;
+		}
+
+		sent += static_cast<std::size_t>(bytes);
+	}
+
+	std::vector<char> buffer(READ_BUFFER_SIZE);
+	std::string input;
+
+	HTTPResponse response;
+	std::size_t bodyStart = std::string::npos;
+	bool chunked = false;
+	std::streamsize contentLength = HTTPMessage::UNKNOWN_CONTENT_LENGTH;
+	std::size_t chunkPosition = 0;
+
+	Result result;
+	bool complete = false;
+
+	while (!complete)
+	{
+		const int bytes = attempt.socket.receiveBytes(buffer.data(), static_cast<int>(buffer.size()));
+
+		if (bytes < 0)
+		{
+			if (const Wake wake = co_await wait(attempt, PollSet::POLL_READ); wake != Wake::READY)
+				co_return interrupted(wake == Wake::TIMEOUT);
+
+			continue;
+		}
+
+		if (bytes == 0)
+		{
+			// Without Content-Length or chunking the body ends with the connection
+			if (bodyStart != std::string::npos && !chunked && contentLength == HTTPMessage::UNKNOWN_CONTENT_LENGTH)
+			{
+				result.body = input.substr(bodyStart);
+				break;
+			}
+
+			throw Poco::Net::ConnectionResetException("Upstream closed the connection before the response was complete");
+		}
+
+		input.append(buffer.data(), static_cast<std::size_t>(bytes));
+
+		while (bodyStart == std::string::npos)
+		{
+			const auto headEnd = input.find("\r\n\r\n");
+			if (headEnd == std::string::npos)
+				break;
+
+			std::istringstream head(input.substr(0, headEnd + 4));
+			response.clear();
+			response.read(head);
+
+			// Interim responses are followed by the real one
+			if (response.getStatus() < HTTPResponse::HTTP_OK)
+			{
+				input.erase(0, headEnd + 4);
+				continue;
+			}
+
+			bodyStart = headEnd + 4;
+			chunkPosition = bodyStart;
+			headersReceived(attempt);
+			chunked = response.getChunkedTransferEncoding();
+			contentLength = response.getContentLength64();
+		}
+
+		if (bodyStart == std::string::npos)
+			continue;
+
+		if (response.getStatus() == HTTPResponse::HTTP_NO_CONTENT ||
+			response.getStatus() == HTTPResponse::HTTP_NOT_MODIFIED)
+		{
+			break;
+		}
+
+		if (chunked)
+		{
+			complete = decodeChunks(input, chunkPosition, result.body);
+		}
+		else if (contentLength != HTTPMessage::UNKNOWN_CONTENT_LENGTH &&
+			input.size() - bodyStart >= static_cast<std::size_t>(contentLength))
+		{
+			result.body = input.substr(bodyStart, static_cast<std::size_t>(contentLength));
+			complete = true;
+		}
+	}
+
+	result.outcome = Result::Outcome::OK;
+	result.status = response.getStatus();
+	result.connect_duration = connectDuration;
+	result.transfer_duration = start.elapsed() - connectDuration;
+
+	for (const auto& [key, value] : response)
+	{
+		if (!isHopByHop(key))
+			result.headers.add(key, value);
+	}
+
+	co_return result;
+}
+
+UpstreamClient::SocketWait UpstreamClient::wait(Attempt& attempt, const int mode)
+{
+	return {*this, attempt, mode};
+}
+
+void UpstreamClient::headersReceived(Attempt& attempt)
+{
+	Fetch& fetch = *attempt.fetch;
+
+	attempt.deadline = fetch.deadline; // the body may take as long as the fetch allows
+
+	// Hedging only helps while nothing answered, a slow body is bandwidth bound
+	fetch.hedge_at.reset();
+
+	header_latencies_[latency_count_++ % LATENCY_SAMPLES] = Clock().microseconds() - attempt.begin;
+}
+
+void UpstreamClient::attemptFinished(Fetch& fetch, const Attempt& attempt, Result result)
+{
+	static Logger& logger = Logger::get("Network");
+
+	--fetch.running;
+
+	// Lost a hedge
+	if (fetch.done)
+		return;
+
+	// A header timeout gets another try, the fetch's own deadline doesn't
+	const bool headerTimeout = result.outcome == Result::Outcome::TIMEOUT && !fetch.deadline.isElapsed(0) &&
+		!attempt.interrupted();
+
+	if (!headerTimeout && !isRetryable(result))
+	{
+		if (attempt.hedge && result.outcome == Result::Outcome::OK)
+			++hedge_wins_;
+
+		finish(fetch, std::move(result));
+		return;
+	}
+
+	fetch.last_failure = std::move(result);
+
+	// The hedge may still make it
+	if (fetch.running > 0)
+		return;
+
+	fetch.hedge_at.reset();
+
+	if (fetch.retries >= policy_.retries || !takeBudget())
+	{
+		if (fetch.retries < policy_.retries)
+			++throttled_;
+
+		finish(fetch, std::move(fetch.last_failure));
+		return;
+	}
+
+	// Exponential backoff with jitter, so retries of a burst don't arrive together
+	const Timespan::TimeDiff backoff = policy_.retry_backoff.totalMicroseconds() << fetch.retries;
+	const Timestamp retryAt = Timestamp() + std::uniform_int_distribution<Timespan::TimeDiff>(
+		backoff / 2, backoff)(random_);
+
+	if (retryAt >= fetch.deadline)
+	{
+		finish(fetch, std::move(fetch.last_failure));
+		return;
+	}
+
+	if (logger.debug())
+		logger.debug("Retrying %s (%s)", fetch.uri.toString(), fetch.last_failure.error.empty()
+			                                                        ? std::to_string(fetch.last_failure.status)
+			                                                        : fetch.last_failure.error);
+
+	++fetch.retries;
+	++retries_;
+	fetch.retry_at = retryAt;
+}
+
+void UpstreamClient::release(Attempt& attempt)
+{
+	waiting_.erase(attempt.socket);
+
+	try
+	{
+		if (attempt.registered)
+			poll_set_.remove(attempt.socket);
+
+		attempt.socket.close();
+	}
+	catch (Poco::Exception&)
+	{
+		// Never connected
+	}
+}
+
+void UpstreamClient::finish(Fetch& fetch, Result result)
+{
+	fetch.done = true;
+	fetch.hedge_at.reset();
+	fetch.retry_at.reset();
+
+	// Whatever is still running lost, it's woken by the next loop iteration
+	for (const auto& attempt : fetch.attempts)
+		attempt->cancelled = true;
+
+	result.attempts = static_cast<int>(fetch.attempts.size());
+	result.hedged = fetch.hedged;
+
+	--in_flight_;
+
+	try
+	{
+		fetch.callback(std::move(result));
+	}
+	catch (Poco::Exception& ex)
+	{
+		Logger::get("Network").error("Upstream fetch callback failed for %s (%s)", fetch.uri.toString(),
+		                             ex.displayText());
+	}
+	catch (std::exception& ex)
+	{
+		Logger::get("Network").error("Upstream fetch callback failed for %s (%s)", fetch.uri.toString(),
+		                             std::string(ex.what()));
+	}
+}
+
+bool UpstreamClient::takeBudget()
+{
+	if (budget_ < 1)
+		return false;
+
+	budget_ -= 1;
+	return true;
+}
+
+std::optional<Timespan> UpstreamClient::hedgeDelay()
+{
+	if (!policy_.hedging || latency_count_ < MIN_HEDGE_SAMPLES)
+		return std::nullopt;
+
+	const std::size_t samples = std::min(latency_count_, LATENCY_SAMPLES);
+	std::array<Clock::ClockDiff, LATENCY_SAMPLES> latencies = header_latencies_;
+	const auto p95 = latencies.begin() + static_cast<std::ptrdiff_t>(samples * 95 / 100);
+	std::nth_element(latencies.begin(), p95, latencies.begin() + static_cast<std::ptrdiff_t>(samples));
+
+	// Hedging past the header timeout is pointless, the attempt is retried then anyway
+	const Timespan delay(std::clamp<Timespan::TimeDiff>(*p95, policy_.hedge_min_delay.totalMicroseconds(),
+	                                                     policy_.header_timeout.totalMicroseconds()));
+	hedge_delay_.store(delay.totalMicroseconds(), std::memory_order_relaxed);
+	return delay;
+}
+
+SocketAddress UpstreamClient::resolve(const std::string& host, const unsigned short port)
+{
+	const std::string key = std::format("{}:{}", host, port);
+
+	{
+		std::lock_guard lock(resolve_mutex_);
+
+		if (const auto it = resolved_.find(key); it != resolved_.end() && !it->second.second.isElapsed(RESOLVE_CACHE_TIME))
+			return it->second.first;
+	}
+
+	SocketAddress address(host, port);
+
+	std::lock_guard lock(resolve_mutex_);
+	resolved_[key] = {address, Timestamp()};
+	return address;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "../coroutine_task.hpp"
+
+#include <array>
+#include <optional>
+#include <random>
+
+#include <Poco/Net/NameValueCollection.h>
+#include <Poco/Net/PollSet.h>
+#include <Poco/Net/StreamSocket.h>
+
+// Fetches manifests and fragments from the CDN over non-blocking sockets. Every transfer is a coroutine on a single
+// event-loop thread, so a slow upstream costs a socket and a coroutine frame instead of a request thread.
+// A request that hasn't got response headers after the recent p95 is hedged with a second one, failed ones are
+// retried with backoff; both draw from one budget so a struggling CDN doesn't get twice the load.
+class UpstreamClient final : public Poco::Util::Subsystem
+{
+public:
+	struct Result
+	{
+		enum class Outcome
+		{
+			OK, // a complete response was received, whatever its status
+			TIMEOUT,
+			CANCELLED,
+			FAILED
+		};
+
+		Outcome outcome = Outcome::FAILED;
+		Poco::Net::HTTPResponse::HTTPStatus status = Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR;
+		Poco::Net::NameValueCollection headers; // without hop-by-hop headers, the body is already de-chunked
+		std::string body;
+		std::string error;
+
+		// For request tracing, of the attempt that produced the result
+		Poco::Clock::ClockVal begin = 0;
+		Poco::Clock::ClockDiff connect_duration = 0;
+		Poco::Clock::ClockDiff transfer_duration = 0;
+		int attempts = 0; // including hedges and retries
+		bool hedged = false;
+	};
+
+	struct Policy
+	{
+		bool hedging = true;
+		Poco::Timespan hedge_min_delay = Poco::Timespan(100 * Poco::Timespan::MILLISECONDS);
+		double budget = 0.1; // extra attempts (hedges and retries) earned per fetch
+		int retries = 2;
+		Poco::Timespan retry_backoff = Poco::Timespan(250 * Poco::Timespan::MILLISECONDS); // doubled per retry
+		Poco::Timespan header_timeout = Poco::Timespan(5, 0); // an attempt without headers by then is retried
+	};
+
+	struct Statistics
+	{
+		unsigned long long fetches = 0;
+		unsigned long long hedges = 0;
+		unsigned long long hedge_wins = 0; // the hedge answered first
+		unsigned long long retries = 0;
+		unsigned long long throttled = 0; // hedges and retries skipped for lack of budget
+		Poco::Timespan hedge_delay; // 0 until there are enough samples
+	};
+
+	using Callback = std::function<void(Result result)>;
+
+	struct Fetch;
+	using FetchPtr = std::shared_ptr<Fetch>;
+
+	UpstreamClient();
+
+	[[nodiscard]] const char* name() const override;
+
+	// Subsystem initialization calls these, standalone users (load test) call them directly
+	void start();
+	void stop();
+
+	// Before start()
+	void setPolicy(const Policy& policy) { policy_ = policy; }
+
+	// GET uri with the given request headers. The callback is called exactly once on the client's thread, so it must
+	// not block; only once the client is stopped it runs on the calling thread, before this returns.
+	FetchPtr fetch(const Poco::URI& uri, const Poco::Net::NameValueCollection& headers, Poco::Timespan timeout,
+	               Callback callback);
+
+	// Waits for the result, for callers that can't continue asynchronously
+	Result fetch(const Poco::URI& uri, const Poco::Net::NameValueCollection& headers, Poco::Timespan timeout);
+
+	// Completes the fetch with Outcome::CANCELLED unless it's already done
+	void cancel(const FetchPtr& fetch);
+
+	[[nodiscard]] std::size_t inFlight() const { return in_flight_.load(std::memory_order_relaxed); }
+	[[nodiscard]] Statistics statistics() const;
+
+protected:
+	~UpstreamClient() override;
+
+	void initialize(Poco::Util::Application& app) override;
+	void uninitialize() override;
+
+private:
+	enum class Wake
+	{
+		READY,
+		TIMEOUT,
+		CANCELLED
+	};
+
+	struct Attempt;
+	using AttemptPtr = std::shared_ptr<Attempt>;
+	class SocketWait;
+
+	static constexpr std::size_t LATENCY_SAMPLES = 128;
+
+	Policy policy_;
+	Poco::Net::PollSet poll_set_;
+	std::thread thread_;
+	std::atomic<bool> running_ = false;
+	std::atomic<std::size_t> in_flight_ = 0;
+
+	std::mutex pending_mutex_;
+	std::vector<FetchPtr> pending_;
+
+	// Event-loop thread only
+	std::map<Poco::Net::Socket, Attempt*> waiting_;
+	std::vector<FetchPtr> active_;
+	std::array<Poco::Clock::ClockDiff, LATENCY_SAMPLES> header_latencies_{};
+	std::size_t latency_count_ = 0;
+	double budget_ = 0;
+	std::minstd_rand random_;
+
+	std::atomic<unsigned long long> fetches_ = 0;
+	std::atomic<unsigned long long> hedges_ = 0;
+	std::atomic<unsigned long long> hedge_wins_ = 0;
+	std::atomic<unsigned long long> retries_ = 0;
+	std::atomic<unsigned long long> throttled_ = 0;
+	std::atomic<Poco::Timespan::TimeDiff> hedge_delay_ = 0;
+
+	std::mutex resolve_mutex_;
+	std::map<std::string, std::pair<Poco::Net::SocketAddress, Poco::Timestamp>> resolved_;
+
+	void run();
+	void wakeExpired();
+	void schedule();
+	Poco::Timespan nextDeadline() const;
+
+	void launch(const FetchPtr& fetch, bool hedge = false);
+	Task<> transfer(FetchPtr fetch, AttemptPtr attempt);
+	Task<Result> exchange(Attempt& attempt);
+	SocketWait wait(Attempt& attempt, int mode);
+	void headersReceived(Attempt& attempt);
+	void attemptFinished(Fetch& fetch, const Attempt& attempt, Result result);
+	void release(Attempt& attempt);
+	void finish(Fetch& fetch, Result result);
+
+	bool takeBudget();
+	std::optional<Poco::Timespan> hedgeDelay();
+
+	Poco::Net::SocketAddress resolve(const std::string& host, unsigned short port);
+};
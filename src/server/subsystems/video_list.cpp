@@ -1,6 +1,8 @@
 #include "pch.hpp"
 #include "video_list.hpp"
 
+#include "../handler_factory.hpp"
+
 using Poco::File;
 using Poco::Logger;
 using Poco::Dynamic::Var;
@@ -28,6 +30,7 @@ void VideoList::initialize(Application& app)
 	}
 
 	video_list_ = loadVideoList(videoListPath);
+	indexEpisodes();
 
 	logger.information("Successfully loaded videos list! (Videos count: %d)", static_cast<int>(video_list_->size()));
 }
@@ -35,28 +38,36 @@ void VideoList::initialize(Application& app)
 void VideoList::uninitialize()
 {
 	video_list_->clear();
+	manifest_urls_.clear();
 }
 
 std::string VideoList::getManifestUrl(const std::string& episode_id)
 {
-	if (!video_list_->has(episode_id))
-		return {};
+	return getManifestUrl(SymbolTable::episodes().find(episode_id));
+}
 
-	return video_list_->getValue<std::string>(episode_id);
+std::string VideoList::getManifestUrl(const SymbolTable::Symbol episode)
+{
+	return symbolAt(manifest_urls_, episode);
 }
 
 std::string VideoList::getFragmentUrl(const std::string& episode_id, const std::string& bitrate,
                                       const std::string& type, const std::string& start_time)
 {
-	if (!video_list_->has(episode_id))
-		return {};
+	return getFragmentUrl(RequestTarget::fragment(episode_id, bitrate, type, start_time));
+}
 
-	const auto manifestUrl = video_list_->getValue<std::string>(episode_id);
+std::string VideoList::getFragmentUrl(const RequestTarget& target)
+{
+	const std::string& manifestUrl = symbolAt(manifest_urls_, target.episode_symbol);
+	if (manifestUrl.empty())
+		return {};
 
 	// Replace "manifest" with QualityLevels({bitrate})/Fragments({type}={startTime})
 	std::string fragmentUrl = manifestUrl;
 	if (const size_t pos = fragmentUrl.find("manifest"); pos != std::string::npos)
-		fragmentUrl.replace(pos, 8, "QualityLevels(" + bitrate + ")/Fragments(" + type + "=" + start_time + ")");
+		fragmentUrl.replace(pos, 8, "QualityLevels(" + target.bitrate + ")/Fragments(" + target.type + "=" +
+		                    target.start_time + ")");
 	else
 	{
 		Logger& logger = Logger::get("Server");
@@ -74,6 +85,21 @@ std::vector<std::string> VideoList::getEpisodeList()
 	return episodes;
 }
 
+void VideoList::indexEpisodes()
+{
+	manifest_urls_.clear();
+
+	for (const auto& episodeId : getEpisodeList())
+		symbolSlot(manifest_urls_, SymbolTable::episodes().intern(episodeId)) =
+			video_list_->getValue<std::string>(episodeId);
+}
+
+void VideoList::applyCipher(char* data, const std::size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] ^= static_cast<char>(RMDJ_ENCRYPTION_KEY[i % 32]);
+}
+
 Object::Ptr VideoList::loadVideoList(const std::string& path) const
 {
 	Logger& logger = Logger::get(name());
@@ -92,8 +118,7 @@ Object::Ptr VideoList::loadVideoList(const std::string& path) const
 	videoListStream.close();
 
 	// Decrypt the video list data
-	for (size_t i = 0; i < videoListData.size(); ++i)
-		videoListData[i] ^= RMDJ_ENCRYPTION_KEY[i % 32];
+	applyCipher(videoListData.data(), videoListData.size());
 
 	const auto tempVideoListStr = std::string(videoListData.begin(), videoListData.end());
 
@@ -128,6 +153,7 @@ void VideoList::patch(unsigned short port)
 	}
 
 	video_list_ = loadVideoList(videoListPath);
+	indexEpisodes();
 
 	// Build the patched video list
 	// Each episode id is a key, and the value is in format:
@@ -149,8 +175,7 @@ void VideoList::patch(unsigned short port)
 	std::string patchedVideoListStr = oss.str();
 
 	// Encrypt the patched video list
-	for (size_t i = 0; i < patchedVideoListStr.size(); ++i)
-		patchedVideoListStr[i] ^= RMDJ_ENCRYPTION_KEY[i % 32];
+	applyCipher(patchedVideoListStr.data(), patchedVideoListStr.size());
 
 	std::ofstream outFile(gameVideoListPath, std::ios::binary | std::ios::trunc);
 	logger.debug("Writing patched video list to %s...", gameVideoListPath);
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "../symbol_table.hpp"
+
+struct RequestTarget;
+
 static constexpr unsigned char RMDJ_ENCRYPTION_KEY[] =
 {
 	0xba, 0x7a, 0xbb, 0x27, 0x03, 0x9b, 0x72, 0xfd, 0x13, 0xeb, 0x70, 0x38, 0x7e, 0x0f, 0xcb, 0x41,
@@ -12,18 +16,26 @@ public:
 	[[nodiscard]] const char* name() const override;
 
 	std::string getManifestUrl(const std::string& episode_id);
+	std::string getManifestUrl(SymbolTable::Symbol episode);
+	[[nodiscard]] bool hasEpisode(SymbolTable::Symbol episode) const { return !symbolAt(manifest_urls_, episode).empty(); }
 	std::string getFragmentUrl(const std::string& episode_id, const std::string& bitrate, const std::string& type,
 	                           const std::string& start_time);
+	std::string getFragmentUrl(const RequestTarget& target);
 
 	std::vector<std::string> getEpisodeList();
 	void patch(unsigned short port);
 
+	// RMDJ is XORed with a fixed key, same operation encrypts and decrypts
+	static void applyCipher(char* data, std::size_t size);
+
 protected:
 	void initialize(Poco::Util::Application& app) override;
 	void uninitialize() override;
 
 private:
 	Poco::JSON::Object::Ptr video_list_;
+	std::vector<std::string> manifest_urls_; // by episode symbol, empty for episodes not on the list
 
 	Poco::JSON::Object::Ptr loadVideoList(const std::string& path) const;
+	void indexEpisodes();
 };
@@ -0,0 +1,58 @@
+#include "pch.hpp"
+#include "symbol_table.hpp"
+
+SymbolTable::Symbol SymbolTable::intern(const std::string_view name)
+{
+	if (const Symbol symbol = find(name); symbol != NONE)
+		return symbol;
+
+	std::unique_lock lock(mutex_);
+
+	// Someone else may have interned it in the meantime
+	const auto [it, inserted] = symbols_.try_emplace(std::string(name), static_cast<Symbol>(names_.size()));
+
+	if (inserted)
+		names_.emplace_back(name);
+
+	return it->second;
+}
+
+SymbolTable::Symbol SymbolTable::find(const std::string_view name) const
+{
+	std::shared_lock lock(mutex_);
+
+	const auto it = symbols_.find(name);
+	return it != symbols_.end() ? it->second : NONE;
+}
+
+const std::string& SymbolTable::name(const Symbol symbol) const
+{
+	static const std::string empty;
+
+	std::shared_lock lock(mutex_);
+	return symbol < names_.size() ? names_[symbol] : empty;
+}
+
+std::size_t SymbolTable::size() const
+{
+	std::shared_lock lock(mutex_);
+	return names_.size();
+}
+
+SymbolTable& SymbolTable::episodes()
+{
+	static SymbolTable table;
+	return table;
+}
+
+SymbolTable& SymbolTable::tracks()
+{
+	static SymbolTable table;
+	return table;
+}
+
+SymbolTable& SymbolTable::bitrates()
+{
+	static SymbolTable table;
+	return table;
+}
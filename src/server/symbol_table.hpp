@@ -0,0 +1,58 @@
+#pragma once
+
+#include <deque>
+#include <limits>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+
+// Dense integer handles for the strings that key lookups on the request path: episode ids, track names and
+// bitrates. Indexing interns them, requests only resolve them, so subsystems can keep their per-episode and
+// per-track data in vectors indexed by symbol and an arbitrary URI can't grow the tables.
+class SymbolTable
+{
+public:
+	using Symbol = std::uint32_t;
+	static constexpr Symbol NONE = std::numeric_limits<Symbol>::max();
+
+	Symbol intern(std::string_view name);
+
+	// NONE if the name was never interned
+	[[nodiscard]] Symbol find(std::string_view name) const;
+	[[nodiscard]] const std::string& name(Symbol symbol) const;
+	[[nodiscard]] std::size_t size() const;
+
+	static SymbolTable& episodes();
+	static SymbolTable& tracks();
+	static SymbolTable& bitrates();
+
+private:
+	struct Hash
+	{
+		using is_transparent = void;
+
+		std::size_t operator()(const std::string_view value) const { return std::hash<std::string_view>()(value); }
+	};
+
+	mutable std::shared_mutex mutex_;
+	std::unordered_map<std::string, Symbol, Hash, std::equal_to<>> symbols_;
+	std::deque<std::string> names_; // by symbol, a deque never moves its elements
+};
+
+// Grows a vector indexed by symbol so that symbol is a valid index
+template <typename T>
+T& symbolSlot(std::vector<T>& slots, const SymbolTable::Symbol symbol)
+{
+	if (slots.size() <= symbol)
+		slots.resize(static_cast<std::size_t>(symbol) + 1);
+
+	return slots[symbol];
+}
+
+// Element of a vector indexed by symbol, a default value for symbols past its end (or NONE)
+template <typename T>
+const T& symbolAt(const std::vector<T>& slots, const SymbolTable::Symbol symbol)
+{
+	static const T none{};
+	return symbol < slots.size() ? slots[symbol] : none;
+}
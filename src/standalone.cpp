@@ -0,0 +1,6 @@
+// standalone.cpp : Hosts the server as a regular process (or daemon/service), without the game.
+#include "pch.hpp"
+
+#include "server/main.hpp"
+
+POCO_SERVER_MAIN(QuantumStreamer)
@@ -0,0 +1,101 @@
+// Packs episode directories into single-file archives (<episode>.qsp) that OfflineStreaming maps directly.
+//
+// Usage: quantumstreamer-pack --episodes=<dir> [--output=<dir>] [episode ...]
+#include "pch.hpp"
+
+#include "server/episode_archive.hpp"
+#include "server/subsystems/offline_streaming.hpp"
+
+using Poco::AutoPtr;
+using Poco::ConsoleChannel;
+using Poco::DirectoryIterator;
+using Poco::File;
+using Poco::FormattingChannel;
+using Poco::Logger;
+using Poco::Message;
+using Poco::Path;
+using Poco::PatternFormatter;
+
+namespace
+{
+	constexpr auto USAGE =
+		"Usage: quantumstreamer-pack --episodes=<dir> [--output=<dir>] [episode ...]\n"
+		"\n"
+		"  --episodes=<dir>   Directory with one sub-directory per episode (Server.EpisodesPath)\n"
+		"  --output=<dir>     Where to write <episode>.qsp (default: the episodes directory, where the server looks)\n"
+		"  episode ...        Episodes to pack (default: every sub-directory)\n"
+		"\n"
+		"The episode directories are left in place, SRT caption overrides are still read from them.\n";
+}
+
+int main(const int argc, char** argv)
+{
+	std::string episodesDir;
+	std::string outputDir;
+	std::vector<std::string> episodes;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+
+		if (arg.starts_with("--episodes="))
+			episodesDir = arg.substr(11);
+		else if (arg.starts_with("--output="))
+			outputDir = arg.substr(9);
+		else if (!arg.starts_with("--"))
+			episodes.push_back(arg);
+		else
+		{
+			std::cerr << USAGE;
+			return 1;
+		}
+	}
+
+	if (episodesDir.empty())
+	{
+		std::cerr << USAGE;
+		return 1;
+	}
+
+	const AutoPtr pChannel = new FormattingChannel(new PatternFormatter("[%p] %t"), new ConsoleChannel);
+	Logger::create("OfflineStreaming", pChannel, Message::PRIO_INFORMATION);
+
+	const Path episodesPath = Path(episodesDir).makeDirectory();
+	const Path outputPath = outputDir.empty() ? episodesPath : Path(outputDir).makeDirectory();
+
+	try
+	{
+		File(outputPath).createDirectories();
+
+		if (episodes.empty())
+		{
+			for (DirectoryIterator it(episodesPath), end; it != end; ++it)
+			{
+				if (it->isDirectory())
+					episodes.push_back(it.name());
+			}
+		}
+
+		const AutoPtr offlineStreaming = new OfflineStreaming;
+		int failed = 0;
+
+		for (const auto& episode : episodes)
+		{
+			Path episodePath(episodesPath);
+			episodePath.pushDirectory(episode);
+
+			Path archivePath(outputPath);
+			archivePath.setFileName(episode + "." + EpisodeArchive::EXTENSION);
+
+			if (!offlineStreaming->packEpisode(episode, episodePath, archivePath))
+				++failed;
+		}
+
+		return failed == 0 ? 0 : 1;
+	}
+	catch (const Poco::Exception& ex)
+	{
+		std::cerr << "Error: " << ex.displayText() << "\n";
+		return 1;
+	}
+}
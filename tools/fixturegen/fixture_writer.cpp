@@ -0,0 +1,305 @@
+#include "fixture_writer.hpp"
+
+#include <cstdio>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+	void putUInt32(std::string& out, const unsigned int value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<char>((value >> shift) & 0xFF));
+	}
+
+	void putUInt(std::string& out, const unsigned long long value, const int size)
+	{
+		for (int shift = (size - 1) * 8; shift >= 0; shift -= 8)
+			out.push_back(static_cast<char>((value >> shift) & 0xFF));
+	}
+
+	void putBoxHeader(std::string& out, const unsigned int size, const char* type)
+	{
+		putUInt32(out, size);
+		out.append(type, 4);
+	}
+
+	std::string formatTime(const unsigned long long ticks, const char fraction_separator)
+	{
+		const unsigned long long totalMs = ticks / 10000;
+
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%02llu:%02llu:%02llu%c%03llu", totalMs / 3600000, totalMs / 60000 % 60,
+		         totalMs / 1000 % 60, fraction_separator, totalMs % 1000);
+		return buffer;
+	}
+
+	void writeFile(const std::filesystem::path& path, const std::string& content)
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write(content.data(), static_cast<std::streamsize>(content.size()));
+	}
+
+	void writeChunks(std::ostringstream& out, const std::size_t fragment_count,
+	                 const unsigned long long fragment_duration)
+	{
+		for (std::size_t i = 0; i < fragment_count; ++i)
+		{
+			if (i == 0)
+				out << "    <c t=\"0\" d=\"" << fragment_duration << "\" />\n";
+			else
+				out << "    <c d=\"" << fragment_duration << "\" />\n";
+		}
+	}
+}
+
+namespace fixtures
+{
+	std::vector<unsigned long long> writeTrack(const std::filesystem::path& path, const unsigned int track_id,
+	                                           const std::size_t fragment_count,
+	                                           const unsigned long long fragment_duration,
+	                                           const std::size_t payload_size, const TrackLayout& layout,
+	                                           const std::size_t cues_per_fragment)
+	{
+		const auto validSize = [](const int size) { return size >= 1 && size <= 4; };
+
+		if ((layout.tfra_version != 0 && layout.tfra_version != 1) || !validSize(layout.traf_number_size) ||
+			!validSize(layout.trun_number_size) || !validSize(layout.sample_number_size))
+			throw std::invalid_argument("Unsupported tfra layout");
+
+		std::string data;
+		std::vector<unsigned long long> startTimes;
+		std::vector<unsigned long long> moofOffsets;
+
+		putBoxHeader(data, 24, "ftyp");
+		data.append("isml");
+		putUInt32(data, 1);
+		data.append("piffiso2");
+
+		const std::string captionDocument = cues_per_fragment > 0
+			                                    ? makeCaptionDocument(cues_per_fragment, fragment_duration)
+			                                    : "";
+
+		for (std::size_t i = 0; i < fragment_count; ++i)
+		{
+			startTimes.push_back(i * fragment_duration);
+			moofOffsets.push_back(data.size());
+
+			if (cues_per_fragment > 0)
+				data.append(makeFragment(i + 1, captionDocument, track_id));
+			else
+				data.append(makeFragment(i + 1, std::string(payload_size, static_cast<char>(i & 0xFF)), track_id));
+		}
+
+		const int timeSize = layout.tfra_version == 1 ? 8 : 4;
+
+		if (timeSize == 4 && (data.size() > 0xFFFFFFFF || fragment_count * fragment_duration > 0xFFFFFFFF))
+			throw std::invalid_argument("Track too large for a version 0 tfra, use version 1");
+
+		const int entrySize = timeSize * 2 + layout.traf_number_size + layout.trun_number_size +
+			layout.sample_number_size;
+		const auto tfraSize = static_cast<unsigned int>(24 + fragment_count * entrySize);
+		const unsigned int mfraSize = 8 + tfraSize + 16;
+
+		putBoxHeader(data, mfraSize, "mfra");
+		putBoxHeader(data, tfraSize, "tfra");
+		putUInt32(data, static_cast<unsigned int>(layout.tfra_version) << 24);
+		putUInt32(data, track_id);
+		putUInt32(data, static_cast<unsigned int>((layout.traf_number_size - 1) << 4 |
+			(layout.trun_number_size - 1) << 2 | (layout.sample_number_size - 1)));
+		putUInt32(data, static_cast<unsigned int>(fragment_count));
+
+		for (std::size_t i = 0; i < fragment_count; ++i)
+		{
+			putUInt(data, startTimes[i], timeSize);
+			putUInt(data, moofOffsets[i], timeSize);
+			putUInt(data, 1, layout.traf_number_size);
+			putUInt(data, 1, layout.trun_number_size);
+			putUInt(data, 1, layout.sample_number_size);
+		}
+
+		putBoxHeader(data, 16, "mfro");
+		putUInt32(data, 0);
+		putUInt32(data, mfraSize);
+
+		writeFile(path, data);
+		return startTimes;
+	}
+
+	std::string makeFragment(const std::size_t sequence_number, const std::string& payload,
+	                         const unsigned int track_id)
+	{
+		std::string data;
+		data.reserve(payload.size() + 56);
+
+		// moof with a mfhd and a traf holding just its tfhd, only synthesized captions look inside (for the track ID)
+		putBoxHeader(data, 48, "moof");
+		putBoxHeader(data, 16, "mfhd");
+		putUInt32(data, 0);
+		putUInt32(data, static_cast<unsigned int>(sequence_number));
+		putBoxHeader(data, 24, "traf");
+		putBoxHeader(data, 16, "tfhd");
+		putUInt32(data, 0);
+		putUInt32(data, track_id);
+
+		putBoxHeader(data, static_cast<unsigned int>(payload.size() + 8), "mdat");
+		data.append(payload);
+		return data;
+	}
+
+	std::size_t payloadSize(const unsigned int bitrate, const unsigned long long fragment_duration,
+	                        const double payload_scale)
+	{
+		const double seconds = static_cast<double>(fragment_duration) / TIME_SCALE;
+		return static_cast<std::size_t>(bitrate / 8.0 * seconds * payload_scale);
+	}
+
+	std::string makeCaptionDocument(const std::size_t cue_count, const unsigned long long fragment_duration)
+	{
+		std::ostringstream out;
+		out << R"(<?xml version="1.0" encoding="utf-8"?>)"
+			<< R"(<tt xmlns="http://www.w3.org/ns/ttml" xml:lang="en-US"><body><div>)";
+
+		const unsigned long long cueDuration = fragment_duration / (cue_count + 1);
+
+		for (std::size_t i = 0; i < cue_count; ++i)
+		{
+			out << R"(<p xml:id="p)" << i + 1 << R"(" begin=")" << formatTime(i * cueDuration, '.')
+				<< R"(" end=")" << formatTime((i + 1) * cueDuration, '.')
+				<< R"(" region="speaker"><span style="textStyle">Original caption line )" << i + 1
+				<< "</span></p>";
+		}
+
+		out << "</div></body></tt>";
+		return out.str();
+	}
+
+	void writeSrt(const std::filesystem::path& path, const std::size_t fragment_count,
+	              const std::size_t cues_per_fragment, const unsigned long long fragment_duration)
+	{
+		std::ostringstream out;
+
+		const std::size_t cueCount = fragment_count * cues_per_fragment;
+		const unsigned long long cueDuration = fragment_duration / cues_per_fragment;
+
+		for (std::size_t i = 0; i < cueCount; ++i)
+		{
+			out << i + 1 << "\n"
+				<< formatTime(i * cueDuration, ',') << " --> " << formatTime((i + 1) * cueDuration - 10000, ',')
+				<< "\n"
+				<< "Override line " << i + 1 << "\n"
+				<< (i % 4 == 0 ? "[ MUSIC ] \xE2\x99\xAA\xE2\x99\xAA\n" : "")
+				<< "\n";
+		}
+
+		writeFile(path, out.str());
+	}
+
+	void writeEpisode(const std::filesystem::path& root, const EpisodeSpec& spec)
+	{
+		const std::filesystem::path episodeDir = root / spec.id;
+		std::filesystem::create_directories(episodeDir);
+
+		unsigned int trackId = 1;
+		std::ostringstream serverManifest;
+		std::ostringstream clientManifest;
+
+		serverManifest << R"(<?xml version="1.0" encoding="utf-8"?>)" << "\n"
+			<< R"(<smil xmlns="http://www.w3.org/2001/SMIL20/Language">)" << "\n"
+			<< "  <head>\n"
+			<< R"(    <meta name="clientManifestRelativePath" content=")" << spec.id << R"(.ismc" />)" << "\n"
+			<< "  </head>\n"
+			<< "  <body>\n"
+			<< "    <switch>\n";
+
+		clientManifest << R"(<?xml version="1.0" encoding="utf-8"?>)" << "\n"
+			<< R"(<SmoothStreamingMedia MajorVersion="2" MinorVersion="2" TimeScale="10000000" Duration=")"
+			<< spec.fragment_count * spec.fragment_duration << "\">\n";
+
+		// Video, one file per quality level
+		clientManifest << R"(  <StreamIndex Type="video" Name="video" Chunks=")" << spec.fragment_count
+			<< R"(" QualityLevels=")" << spec.video_bitrates.size()
+			<< R"x(" Url="QualityLevels({bitrate})/Fragments(video={start time})">)x" << "\n";
+
+		for (std::size_t i = 0; i < spec.video_bitrates.size(); ++i)
+		{
+			const unsigned int bitrate = spec.video_bitrates[i];
+			const std::string fileName = "video_" + std::to_string(bitrate) + ".ismv";
+
+			writeTrack(episodeDir / fileName, trackId, spec.fragment_count, spec.fragment_duration,
+			           payloadSize(bitrate, spec.fragment_duration, spec.payload_scale), spec.layout);
+
+			serverManifest << R"(      <video src=")" << fileName << R"(" systemBitrate=")" << bitrate << "\">\n"
+				<< R"(        <param name="trackID" value=")" << trackId++ << R"(" valuetype="data" />)" << "\n"
+				<< "      </video>\n";
+
+			clientManifest << R"(    <QualityLevel Index=")" << i << R"(" Bitrate=")" << bitrate
+				<< R"(" FourCC="H264" MaxWidth="1280" MaxHeight="720" CodecPrivateData="" />)" << "\n";
+		}
+
+		writeChunks(clientManifest, spec.fragment_count, spec.fragment_duration);
+		clientManifest << "  </StreamIndex>\n";
+
+		// Audio, one file per language
+		for (const auto& [trackName, bitrate] : spec.audio_tracks)
+		{
+			const std::string fileName = trackName + ".isma";
+
+			writeTrack(episodeDir / fileName, trackId, spec.fragment_count, spec.fragment_duration,
+			           payloadSize(bitrate, spec.fragment_duration, spec.payload_scale), spec.layout);
+
+			serverManifest << R"(      <audio src=")" << fileName << R"(" systemBitrate=")" << bitrate << "\">\n"
+				<< R"(        <param name="trackID" value=")" << trackId++ << R"(" valuetype="data" />)" << "\n"
+				<< R"(        <param name="trackName" value=")" << trackName << R"(" valuetype="data" />)" << "\n"
+				<< "      </audio>\n";
+
+			clientManifest << R"(  <StreamIndex Type="audio" Name=")" << trackName
+				<< R"(" Chunks=")" << spec.fragment_count
+				<< R"x(" QualityLevels="1" Url="QualityLevels({bitrate})/Fragments()x" << trackName
+				<< R"x(={start time})">)x" << "\n"
+				<< R"(    <QualityLevel Index="0" Bitrate=")" << bitrate
+				<< R"(" FourCC="AACL" SamplingRate="48000" Channels="2" BitsPerSample="16" PacketSize="4" AudioTag="255" CodecPrivateData="" />)"
+				<< "\n";
+
+			writeChunks(clientManifest, spec.fragment_count, spec.fragment_duration);
+			clientManifest << "  </StreamIndex>\n";
+		}
+
+		// Captions, with a matching SRT override for each track
+		for (const auto& captionTrack : spec.caption_tracks)
+		{
+			const std::string fileName = captionTrack + ".ismt";
+
+			writeTrack(episodeDir / fileName, trackId, spec.fragment_count, spec.fragment_duration, 0, spec.layout,
+			           spec.cues_per_fragment);
+
+			if (spec.srt_overrides)
+				writeSrt(episodeDir / (captionTrack + ".srt"), spec.fragment_count, spec.cues_per_fragment,
+				         spec.fragment_duration);
+
+			serverManifest << R"(      <textstream src=")" << fileName << R"(" systemBitrate="1000">)" << "\n"
+				<< R"(        <param name="trackID" value=")" << trackId++ << R"(" valuetype="data" />)" << "\n"
+				<< R"(        <param name="trackName" value=")" << captionTrack << R"(" valuetype="data" />)" << "\n"
+				<< "      </textstream>\n";
+
+			clientManifest << R"(  <StreamIndex Type="text" Name=")" << captionTrack
+				<< R"(" Subtype="CAPT" Chunks=")" << spec.fragment_count
+				<< R"(" QualityLevels="1" Url="QualityLevels({bitrate})/Fragments()" << captionTrack
+				<< R"x(={start time})">)x" << "\n"
+				<< R"(    <QualityLevel Index="0" Bitrate="1000" FourCC="TTML" CodecPrivateData="" />)" << "\n";
+
+			writeChunks(clientManifest, spec.fragment_count, spec.fragment_duration);
+			clientManifest << "  </StreamIndex>\n";
+		}
+
+		serverManifest << "    </switch>\n"
+			<< "  </body>\n"
+			<< "</smil>\n";
+
+		clientManifest << "</SmoothStreamingMedia>\n";
+
+		writeFile(episodeDir / (spec.id + ".ism"), serverManifest.str());
+		writeFile(episodeDir / (spec.id + ".ismc"), clientManifest.str());
+	}
+}
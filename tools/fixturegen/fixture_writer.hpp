@@ -0,0 +1,65 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Generates Smooth Streaming episodes laid out like the ones QuantumFetcher produces, without any game assets
+namespace fixtures
+{
+	constexpr unsigned long long TIME_SCALE = 10000000; // 100ns ticks
+
+	// How the mfra/tfra trailer of a track is encoded
+	struct TrackLayout
+	{
+		int tfra_version = 1; // 0 = 32-bit time and moof offset, 1 = 64-bit
+		int traf_number_size = 1; // 1-4 bytes
+		int trun_number_size = 1; // 1-4 bytes
+		int sample_number_size = 1; // 1-4 bytes
+	};
+
+	struct AudioTrackSpec
+	{
+		std::string name;
+		unsigned int bitrate;
+	};
+
+	struct EpisodeSpec
+	{
+		std::string id;
+		std::size_t fragment_count = 300;
+		unsigned long long fragment_duration = 2 * TIME_SCALE;
+		std::vector<unsigned int> video_bitrates = {230000, 1200000, 3500000};
+		std::vector<AudioTrackSpec> audio_tracks = {{"audio_eng", 128000}};
+		std::vector<std::string> caption_tracks = {"enus_captions"};
+		std::size_t cues_per_fragment = 2;
+		bool srt_overrides = true;
+
+		// Media payload is bitrate * fragment duration * payload_scale, 1.0 gives realistic fragment sizes
+		double payload_scale = 1.0;
+		TrackLayout layout;
+	};
+
+	// Writes a fragmented MP4 track (moof+mdat per fragment) with a mfra/tfra/mfro trailer,
+	// returns the start time of every fragment
+	std::vector<unsigned long long> writeTrack(const std::filesystem::path& path, unsigned int track_id,
+	                                           std::size_t fragment_count, unsigned long long fragment_duration,
+	                                           std::size_t payload_size, const TrackLayout& layout = {},
+	                                           std::size_t cues_per_fragment = 0);
+
+	// Single moof+mdat pair as served for one fragment request
+	std::string makeFragment(std::size_t sequence_number, const std::string& payload, unsigned int track_id = 1);
+
+	// Media payload size of one fragment at the given bitrate
+	std::size_t payloadSize(unsigned int bitrate, unsigned long long fragment_duration, double payload_scale = 1.0);
+
+	// TTML document as stored in a caption fragment mdat, times are relative to the fragment start
+	std::string makeCaptionDocument(std::size_t cue_count, unsigned long long fragment_duration = 2 * TIME_SCALE);
+
+	// SubRip override covering fragment_count fragments
+	void writeSrt(const std::filesystem::path& path, std::size_t fragment_count, std::size_t cues_per_fragment,
+	              unsigned long long fragment_duration = 2 * TIME_SCALE);
+
+	// Writes .ism, .ismc, all tracks and SRT overrides into root/spec.id
+	void writeEpisode(const std::filesystem::path& root, const EpisodeSpec& spec);
+}
@@ -0,0 +1,185 @@
+// Generates synthetic Smooth Streaming episode directories for benchmarks, load tests and correctness checks.
+//
+// Usage: quantumstreamer-fixturegen --output=<dir> [options]
+#include "fixture_writer.hpp"
+
+#include <charconv>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+namespace
+{
+	constexpr auto USAGE =
+		"Usage: quantumstreamer-fixturegen --output=<dir> [options]\n"
+		"\n"
+		"  --episodes=<n>              Number of episodes to generate (default: 1)\n"
+		"  --episode-prefix=<id>       Episode id prefix, ids are <prefix>-001, <prefix>-002... (default: SYN)\n"
+		"  --fragments=<n>             Fragments per track (default: 300)\n"
+		"  --fragment-duration=<sec>   Fragment duration in seconds (default: 2)\n"
+		"  --video-bitrates=<list>     Comma separated video quality levels (default: 230000,1200000,3500000)\n"
+		"  --audio-tracks=<list>       Comma separated name:bitrate pairs (default: audio_eng:128000)\n"
+		"  --captions=<list>           Comma separated caption track names, empty for none (default: enus_captions)\n"
+		"  --cues-per-fragment=<n>     Caption cues per fragment (default: 2)\n"
+		"  --no-srt                    Don't write SRT overrides for caption tracks\n"
+		"  --payload-scale=<x>         Scale media payload relative to the bitrate (default: 1.0)\n"
+		"  --tfra-version=<0|1>        tfra box version, 0 = 32-bit times and offsets (default: 1)\n"
+		"  --traf-size=<1-4>           Width of tfra traf_number in bytes (default: 1)\n"
+		"  --trun-size=<1-4>           Width of tfra trun_number in bytes (default: 1)\n"
+		"  --sample-size=<1-4>         Width of tfra sample_number in bytes (default: 1)\n";
+
+	std::vector<std::string> splitList(const std::string& value)
+	{
+		std::vector<std::string> items;
+		std::istringstream stream(value);
+
+		for (std::string item; std::getline(stream, item, ',');)
+		{
+			if (!item.empty())
+				items.push_back(item);
+		}
+
+		return items;
+	}
+
+	template <typename T>
+	T parseNumber(const std::string& option, const std::string& value)
+	{
+		T result{};
+		const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+
+		if (ec != std::errc() || end != value.data() + value.size())
+			throw std::invalid_argument("Invalid value for --" + option + ": " + value);
+
+		return result;
+	}
+
+	double parseDouble(const std::string& option, const std::string& value)
+	{
+		try
+		{
+			return std::stod(value);
+		}
+		catch (const std::exception&)
+		{
+			throw std::invalid_argument("Invalid value for --" + option + ": " + value);
+		}
+	}
+}
+
+int main(const int argc, char** argv)
+{
+	std::map<std::string, std::string> options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--help" || arg == "-h")
+		{
+			std::cout << USAGE;
+			return 0;
+		}
+
+		if (!arg.starts_with("--"))
+		{
+			std::cerr << "Unexpected argument: " << arg << "\n\n" << USAGE;
+			return 1;
+		}
+
+		const auto separator = arg.find('=');
+		options[arg.substr(2, separator - 2)] = separator == std::string::npos ? "" : arg.substr(separator + 1);
+	}
+
+	if (!options.contains("output"))
+	{
+		std::cerr << USAGE;
+		return 1;
+	}
+
+	try
+	{
+		fixtures::EpisodeSpec spec;
+		std::size_t episodeCount = 1;
+		std::string episodePrefix = "SYN";
+
+		for (const auto& [option, value] : options)
+		{
+			if (option == "output")
+				continue;
+
+			if (option == "episodes")
+				episodeCount = parseNumber<std::size_t>(option, value);
+			else if (option == "episode-prefix")
+				episodePrefix = value;
+			else if (option == "fragments")
+				spec.fragment_count = parseNumber<std::size_t>(option, value);
+			else if (option == "fragment-duration")
+				spec.fragment_duration = static_cast<unsigned long long>(parseDouble(option, value) *
+					fixtures::TIME_SCALE);
+			else if (option == "video-bitrates")
+			{
+				spec.video_bitrates.clear();
+
+				for (const auto& bitrate : splitList(value))
+					spec.video_bitrates.push_back(parseNumber<unsigned int>(option, bitrate));
+			}
+			else if (option == "audio-tracks")
+			{
+				spec.audio_tracks.clear();
+
+				for (const auto& track : splitList(value))
+				{
+					const auto colon = track.find(':');
+					if (colon == std::string::npos)
+						throw std::invalid_argument("Audio tracks are expected as name:bitrate, got: " + track);
+
+					spec.audio_tracks.push_back({
+						track.substr(0, colon), parseNumber<unsigned int>(option, track.substr(colon + 1))
+					});
+				}
+			}
+			else if (option == "captions")
+				spec.caption_tracks = splitList(value);
+			else if (option == "cues-per-fragment")
+				spec.cues_per_fragment = parseNumber<std::size_t>(option, value);
+			else if (option == "no-srt")
+				spec.srt_overrides = false;
+			else if (option == "payload-scale")
+				spec.payload_scale = parseDouble(option, value);
+			else if (option == "tfra-version")
+				spec.layout.tfra_version = parseNumber<int>(option, value);
+			else if (option == "traf-size")
+				spec.layout.traf_number_size = parseNumber<int>(option, value);
+			else if (option == "trun-size")
+				spec.layout.trun_number_size = parseNumber<int>(option, value);
+			else if (option == "sample-size")
+				spec.layout.sample_number_size = parseNumber<int>(option, value);
+			else
+				throw std::invalid_argument("Unknown option: --" + option);
+		}
+
+		if (spec.cues_per_fragment == 0 && !spec.caption_tracks.empty())
+			throw std::invalid_argument("--cues-per-fragment must be at least 1 when caption tracks are generated");
+
+		const std::filesystem::path output = options["output"];
+
+		for (std::size_t i = 1; i <= episodeCount; ++i)
+		{
+			char episodeId[64];
+			snprintf(episodeId, sizeof(episodeId), "%s-%03zu", episodePrefix.c_str(), i);
+			spec.id = episodeId;
+
+			fixtures::writeEpisode(output, spec);
+			std::cout << "Generated " << (output / spec.id).string() << "\n";
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Error: " << ex.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,311 @@
+#include "pch.hpp"
+#include "load_generator.hpp"
+
+#include <Poco/NullStream.h>
+#include <Poco/String.h>
+
+using Poco::AutoPtr;
+using Poco::Clock;
+using Poco::NullOutputStream;
+using Poco::StreamCopier;
+using Poco::Timespan;
+using Poco::JSON::Array;
+using Poco::JSON::Object;
+using Poco::Net::HTTPClientSession;
+using Poco::Net::HTTPMessage;
+using Poco::Net::HTTPRequest;
+using Poco::Net::HTTPResponse;
+using Poco::XML::DOMParser;
+using Poco::XML::Document;
+using Poco::XML::Element;
+using Poco::XML::InputSource;
+using Poco::XML::NodeList;
+
+namespace
+{
+	double percentile(const std::vector<double>& sorted, const double fraction)
+	{
+		if (sorted.empty())
+			return 0;
+
+		const auto index = static_cast<std::size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+		return sorted[std::min(index, sorted.size() - 1)];
+	}
+}
+
+LoadGenerator::LoadGenerator(LoadOptions options) : options_(std::move(options))
+{
+}
+
+const char* LoadGenerator::className(const RequestClass request_class)
+{
+	switch (request_class)
+	{
+	case MANIFEST:
+		return "manifest";
+	case LOCAL_HIT:
+		return "local";
+	case UPSTREAM_MISS:
+		return "upstream";
+	default:
+		return "unknown";
+	}
+}
+
+void LoadGenerator::run()
+{
+	const Clock start;
+
+	std::vector<std::thread> players;
+	players.reserve(options_.players);
+
+	for (unsigned int i = 0; i < options_.players; ++i)
+		players.emplace_back(&LoadGenerator::player, this, i);
+
+	for (auto& player : players)
+		player.join();
+
+	elapsed_sec_ = static_cast<double>(start.elapsed()) / 1e6;
+}
+
+bool LoadGenerator::fetch(std::unique_ptr<HTTPClientSession>& session, const std::string& path, Samples& samples,
+                          std::string* body) const
+{
+	const Clock start;
+
+	try
+	{
+		// Without keep-alive every request pays for a new connection, like the game does
+		if (!session || !options_.keep_alive)
+		{
+			session = std::make_unique<HTTPClientSession>(options_.host, options_.port);
+			session->setKeepAlive(options_.keep_alive);
+			session->setTimeout(Timespan(options_.timeout_sec, 0));
+		}
+
+		HTTPRequest request(HTTPRequest::HTTP_GET, path, HTTPMessage::HTTP_1_1);
+		request.setKeepAlive(options_.keep_alive);
+		session->sendRequest(request);
+
+		HTTPResponse response;
+		std::istream& responseStream = session->receiveResponse(response);
+
+		std::streamsize received;
+
+		if (body)
+		{
+			received = StreamCopier::copyToString(responseStream, *body);
+		}
+		else
+		{
+			NullOutputStream discard;
+			received = StreamCopier::copyStream(responseStream, discard);
+		}
+
+		samples.latencies_ms.push_back(static_cast<double>(start.elapsed()) / 1000.0);
+		samples.bytes += static_cast<unsigned long long>(received);
+
+		if (response.getStatus() != HTTPResponse::HTTP_OK)
+		{
+			++samples.errors;
+			return false;
+		}
+
+		return true;
+	}
+	catch (const Poco::Exception&)
+	{
+		samples.latencies_ms.push_back(static_cast<double>(start.elapsed()) / 1000.0);
+		++samples.errors;
+		session.reset();
+		return false;
+	}
+}
+
+std::vector<LoadGenerator::Stream> LoadGenerator::parseManifest(const std::string& manifest,
+                                                               const unsigned int player_index) const
+{
+	std::vector<Stream> streams;
+
+	std::istringstream manifestStream(manifest);
+	InputSource manifestSource(manifestStream);
+	DOMParser parser;
+	const AutoPtr<Document> doc = parser.parse(&manifestSource);
+
+	const AutoPtr<NodeList> streamIndexes = doc->getElementsByTagName("StreamIndex");
+
+	for (unsigned long i = 0; i < streamIndexes->length(); ++i)
+	{
+		const auto* streamIndex = dynamic_cast<Element*>(streamIndexes->item(i));
+
+		if (streamIndex->getAttribute("Type") == "text" && !options_.captions)
+			continue;
+
+		Stream stream;
+		stream.url_template = streamIndex->getAttribute("Url");
+
+		// Spread players over the available quality levels, like players with different bandwidth would
+		const AutoPtr<NodeList> qualityLevels = streamIndex->getElementsByTagName("QualityLevel");
+		if (qualityLevels->length() == 0)
+			continue;
+
+		const auto* qualityLevel = dynamic_cast<Element*>(qualityLevels->item(player_index % qualityLevels->length()));
+		stream.bitrate = qualityLevel->getAttribute("Bitrate");
+
+		const AutoPtr<NodeList> chunks = streamIndex->getElementsByTagName("c");
+		unsigned long long time = 0;
+
+		for (unsigned long j = 0; j < chunks->length(); ++j)
+		{
+			const auto* chunk = dynamic_cast<Element*>(chunks->item(j));
+
+			if (chunk->hasAttribute("t"))
+				time = std::stoull(chunk->getAttribute("t"));
+
+			stream.start_times.push_back(time);
+			time += std::stoull(chunk->getAttribute("d"));
+		}
+
+		streams.push_back(std::move(stream));
+	}
+
+	return streams;
+}
+
+void LoadGenerator::player(const unsigned int index)
+{
+	std::array<Samples, REQUEST_CLASS_COUNT> samples;
+
+	const Clock start;
+	const auto deadline = static_cast<Clock::ClockDiff>(options_.duration_sec * 1e6);
+
+	const std::string& episodeId = options_.episodes[index % options_.episodes.size()];
+	const RequestClass fragmentClass = options_.local_episodes.contains(episodeId) ? LOCAL_HIT : UPSTREAM_MISS;
+
+	std::unique_ptr<HTTPClientSession> session;
+
+	while (start.elapsed() < deadline)
+	{
+		std::string manifest;
+
+		if (!fetch(session, std::format("/{}/manifest", episodeId), samples[MANIFEST], &manifest))
+			continue;
+
+		std::vector<Stream> streams;
+
+		try
+		{
+			streams = parseManifest(manifest, index);
+		}
+		catch (const Poco::Exception&)
+		{
+			++samples[MANIFEST].errors;
+			continue;
+		}
+
+		std::size_t chunkCount = 0;
+		for (const auto& stream : streams)
+			chunkCount = std::max(chunkCount, stream.start_times.size());
+
+		if (chunkCount == 0)
+			break;
+
+		// Play the episode through, one fragment per stream per chunk
+		for (std::size_t chunk = 0; chunk < chunkCount && start.elapsed() < deadline; ++chunk)
+		{
+			for (const auto& [urlTemplate, bitrate, startTimes] : streams)
+			{
+				if (chunk >= startTimes.size())
+					continue;
+
+				std::string path = urlTemplate;
+				Poco::replaceInPlace(path, std::string("{bitrate}"), bitrate);
+				Poco::replaceInPlace(path, std::string("{start time}"), std::to_string(startTimes[chunk]));
+
+				fetch(session, std::format("/{}/{}", episodeId, path), samples[fragmentClass]);
+			}
+		}
+	}
+
+	std::lock_guard lock(samples_mutex_);
+
+	for (int i = 0; i < REQUEST_CLASS_COUNT; ++i)
+	{
+		auto& target = samples_[i];
+		target.latencies_ms.insert(target.latencies_ms.end(), samples[i].latencies_ms.begin(),
+		                           samples[i].latencies_ms.end());
+		target.errors += samples[i].errors;
+		target.bytes += samples[i].bytes;
+	}
+}
+
+LoadGenerator::Summary LoadGenerator::summarize(const RequestClass request_class) const
+{
+	std::vector<double> latencies = samples_[request_class].latencies_ms;
+	std::ranges::sort(latencies);
+
+	Summary summary;
+	summary.requests = latencies.size();
+	summary.errors = samples_[request_class].errors;
+	summary.bytes = samples_[request_class].bytes;
+	summary.p50_ms = percentile(latencies, 0.50);
+	summary.p99_ms = percentile(latencies, 0.99);
+	summary.p999_ms = percentile(latencies, 0.999);
+	summary.max_ms = latencies.empty() ? 0 : latencies.back();
+
+	return summary;
+}
+
+void LoadGenerator::report(std::ostream& out) const
+{
+	out << std::format("{} players, {:.1f} s\n\n", options_.players, elapsed_sec_);
+	out << std::format("{:<10}{:>10}{:>8}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}\n", "class", "requests", "errors",
+	                   "req/s", "MB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+	for (int i = 0; i < REQUEST_CLASS_COUNT; ++i)
+	{
+		const auto requestClass = static_cast<RequestClass>(i);
+		const Summary summary = summarize(requestClass);
+
+		if (summary.requests == 0)
+			continue;
+
+		out << std::format("{:<10}{:>10}{:>8}{:>10.1f}{:>10.2f}{:>10.2f}{:>10.2f}{:>10.2f}{:>10.2f}\n",
+		                   className(requestClass), summary.requests, summary.errors,
+		                   static_cast<double>(summary.requests) / elapsed_sec_,
+		                   static_cast<double>(summary.bytes) / elapsed_sec_ / 1e6,
+		                   summary.p50_ms, summary.p99_ms, summary.p999_ms, summary.max_ms);
+	}
+}
+
+void LoadGenerator::writeJson(const std::string& path) const
+{
+	Object::Ptr result = new Object;
+	result->set("players", options_.players);
+	result->set("elapsed_sec", elapsed_sec_);
+
+	Array::Ptr classes = new Array;
+
+	for (int i = 0; i < REQUEST_CLASS_COUNT; ++i)
+	{
+		const auto requestClass = static_cast<RequestClass>(i);
+		const Summary summary = summarize(requestClass);
+
+		Object::Ptr entry = new Object;
+		entry->set("class", std::string(className(requestClass)));
+		entry->set("requests", summary.requests);
+		entry->set("errors", summary.errors);
+		entry->set("bytes", summary.bytes);
+		entry->set("throughput_rps", elapsed_sec_ > 0 ? static_cast<double>(summary.requests) / elapsed_sec_ : 0.0);
+		entry->set("p50_ms", summary.p50_ms);
+		entry->set("p99_ms", summary.p99_ms);
+		entry->set("p999_ms", summary.p999_ms);
+		entry->set("max_ms", summary.max_ms);
+		classes->add(entry);
+	}
+
+	result->set("classes", classes);
+
+	std::ofstream out(path, std::ios::trunc);
+	Poco::JSON::Stringifier::stringify(result, out, 2);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <set>
+
+struct LoadOptions
+{
+	std::string host = "127.0.0.1";
+	unsigned short port = 0;
+	std::vector<std::string> episodes;
+	std::set<std::string> local_episodes; // requests for other episodes are counted as upstream misses
+	unsigned int players = 8;
+	double duration_sec = 30;
+	bool captions = true;
+	bool keep_alive = false; // reuse one connection per player
+	int timeout_sec = 30;
+};
+
+// Closed-loop replay of the game's request pattern: every player fetches a manifest, then requests
+// video, audio and caption fragments in order, issuing the next request as soon as the previous one completed.
+class LoadGenerator
+{
+public:
+	enum RequestClass
+	{
+		MANIFEST,
+		LOCAL_HIT,
+		UPSTREAM_MISS,
+		REQUEST_CLASS_COUNT
+	};
+
+	struct Summary
+	{
+		std::size_t requests = 0;
+		std::size_t errors = 0;
+		unsigned long long bytes = 0;
+		double p50_ms = 0;
+		double p99_ms = 0;
+		double p999_ms = 0;
+		double max_ms = 0;
+	};
+
+	explicit LoadGenerator(LoadOptions options);
+
+	void run();
+
+	[[nodiscard]] Summary summarize(RequestClass request_class) const;
+	void report(std::ostream& out) const;
+	void writeJson(const std::string& path) const;
+
+	static const char* className(RequestClass request_class);
+
+private:
+	struct Stream
+	{
+		std::string url_template;
+		std::string bitrate;
+		std::vector<unsigned long long> start_times;
+	};
+
+	struct Samples
+	{
+		std::vector<double> latencies_ms;
+		std::size_t errors = 0;
+		unsigned long long bytes = 0;
+	};
+
+	LoadOptions options_;
+	double elapsed_sec_ = 0;
+
+	std::mutex samples_mutex_;
+	std::array<Samples, REQUEST_CLASS_COUNT> samples_;
+
+	void player(unsigned int index);
+	bool fetch(std::unique_ptr<Poco::Net::HTTPClientSession>& session, const std::string& path, Samples& samples,
+	           std::string* body = nullptr) const;
+	std::vector<Stream> parseManifest(const std::string& manifest, unsigned int player_index) const;
+};
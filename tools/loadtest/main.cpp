@@ -0,0 +1,499 @@
+// Load test harness for the serving core.
+//
+//   quantumstreamer-loadtest prepare --output=<dir> [--local-episodes=2] [--remote-episodes=2] [fixture options]
+//   quantumstreamer-loadtest cdn --plan=<dir>/loadtest.json [--latency-ms=..] [--jitter-ms=..] [--spike-rate=..]
+//   quantumstreamer-loadtest run --plan=<dir>/loadtest.json [--players=8] [--duration=30] [--json=<file>]
+//   quantumstreamer-loadtest upstream --plan=<dir>/loadtest.json [--requests=256] [--latency-ms=200]
+//
+// `prepare` writes a fixture library for the server, the same episodes plus upstream-only ones for the stand-in CDN,
+// a videoList_original.rmdj pointing at the stand-in and a QuantumStreamer.properties for quantumstreamer-server.
+#include "pch.hpp"
+#include "load_generator.hpp"
+#include "standin_cdn.hpp"
+
+#include "server/subsystems/upstream_client.hpp"
+#include "server/subsystems/video_list.hpp"
+
+#include <algorithm>
+
+using Poco::JSON::Array;
+using Poco::JSON::Object;
+using Poco::JSON::Parser;
+
+namespace
+{
+	constexpr auto USAGE =
+		"Usage: quantumstreamer-loadtest <prepare|cdn|run|upstream> [options]\n"
+		"\n"
+		"prepare --output=<dir>         Generate a test library, video list and server config\n"
+		"  --local-episodes=<n>         Episodes stored locally and on the stand-in CDN (default: 2)\n"
+		"  --remote-episodes=<n>        Episodes only available on the stand-in CDN (default: 2)\n"
+		"  --server-port=<port>         Port the server will listen on (default: 8880)\n"
+		"  --cdn-port=<port>            Port the stand-in CDN will listen on (default: 8881)\n"
+		"  --fragments=<n>              Fragments per track (default: 150)\n"
+		"  --payload-scale=<x>          Media payload relative to the bitrate (default: 1.0)\n"
+		"\n"
+		"cdn --plan=<file>              Run the stand-in CDN until interrupted\n"
+		"  --latency-ms=<ms>            Time to first byte added to every response (default: 0)\n"
+		"  --jitter-ms=<ms>             Uniform random latency on top of --latency-ms (default: 0)\n"
+		"  --spike-rate=<x>             Fraction of responses delayed by another --spike-ms (default: 0)\n"
+		"  --spike-ms=<ms>              Latency spike (default: 2000)\n"
+		"  --error-rate=<x>             Fraction of responses answered with 503 (default: 0)\n"
+		"  --bandwidth-kbps=<kbps>      Per-response bandwidth limit, 0 = unlimited (default: 0)\n"
+		"  --max-threads=<n>            Concurrent responses (default: 64)\n"
+		"\n"
+		"run --plan=<file>              Replay the game's request pattern against the server\n"
+		"  --players=<n>                Concurrent players (default: 8)\n"
+		"  --duration=<sec>             Test duration (default: 30)\n"
+		"  --no-captions                Don't request caption fragments\n"
+		"  --keep-alive                 Reuse one connection per player (Server.Engine=event)\n"
+		"  --json=<file>                Also write the results as JSON\n"
+		"\n"
+		"upstream --plan=<file>         Check the server's upstream client against an in-process stand-in CDN\n"
+		"  --requests=<n>               Fragments fetched concurrently (default: 256)\n"
+		"  --latency-ms=<ms>            Stand-in latency, at least 20 (default: 200)\n"
+		"  --spike-ms=<ms>              Latency spike the hedging check has to hide (default: 2000)\n";
+
+	using Options = std::map<std::string, std::string>;
+
+	Options parseOptions(const int argc, char** argv)
+	{
+		Options options;
+
+		for (int i = 2; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+
+			if (!arg.starts_with("--"))
+				throw std::invalid_argument("Unexpected argument: " + arg);
+
+			const auto separator = arg.find('=');
+			options[arg.substr(2, separator - 2)] = separator == std::string::npos ? "" : arg.substr(separator + 1);
+		}
+
+		return options;
+	}
+
+	template <typename T>
+	T option(const Options& options, const std::string& name, const T defaultValue)
+	{
+		const auto it = options.find(name);
+		if (it == options.end())
+			return defaultValue;
+
+		if constexpr (std::is_floating_point_v<T>)
+			return static_cast<T>(std::stod(it->second));
+		else
+			return static_cast<T>(std::stoull(it->second));
+	}
+
+	Object::Ptr loadPlan(const Options& options)
+	{
+		if (!options.contains("plan"))
+			throw std::invalid_argument("--plan is required");
+
+		std::ifstream planStream(options.at("plan"));
+		if (!planStream)
+			throw std::invalid_argument("Cannot open plan " + options.at("plan"));
+
+		Parser parser;
+		return parser.parse(planStream).extract<Object::Ptr>();
+	}
+
+	std::vector<std::string> toStrings(const Array::Ptr& array)
+	{
+		std::vector<std::string> values;
+
+		for (std::size_t i = 0; i < array->size(); ++i)
+			values.push_back(array->getElement<std::string>(static_cast<unsigned int>(i)));
+
+		return values;
+	}
+
+	int prepare(const Options& options)
+	{
+		if (!options.contains("output"))
+			throw std::invalid_argument("--output is required");
+
+		const std::filesystem::path output = std::filesystem::absolute(options.at("output"));
+		const auto localEpisodes = option<std::size_t>(options, "local-episodes", 2);
+		const auto remoteEpisodes = option<std::size_t>(options, "remote-episodes", 2);
+		const auto serverPort = option<unsigned short>(options, "server-port", 8880);
+		const auto cdnPort = option<unsigned short>(options, "cdn-port", 8881);
+
+		fixtures::EpisodeSpec spec;
+		spec.fragment_count = option<std::size_t>(options, "fragments", 150);
+		spec.payload_scale = option<double>(options, "payload-scale", 1.0);
+
+		Object::Ptr videoList = new Object;
+		Array::Ptr local = new Array;
+		Array::Ptr remote = new Array;
+
+		for (std::size_t i = 1; i <= localEpisodes + remoteEpisodes; ++i)
+		{
+			const bool isLocal = i <= localEpisodes;
+			spec.id = std::format("LT-{:03}", i);
+
+			// The stand-in only serves client manifests from its copy, fragments are synthesized on request
+			fixtures::writeEpisode(output / "cdn", spec);
+
+			if (isLocal)
+			{
+				fixtures::writeEpisode(output / "episodes", spec);
+				local->add(spec.id);
+			}
+			else
+				remote->add(spec.id);
+
+			videoList->set(spec.id, std::format("http://127.0.0.1:{}/{}/manifest", cdnPort, spec.id));
+		}
+
+		std::filesystem::create_directories(output / "episodes");
+
+		std::ostringstream videoListStream;
+		Poco::JSON::Stringifier::stringify(videoList, videoListStream, 4);
+		std::string videoListStr = videoListStream.str();
+		VideoList::applyCipher(videoListStr.data(), videoListStr.size());
+
+		std::ofstream(output / "videoList_original.rmdj", std::ios::binary | std::ios::trunc)
+			.write(videoListStr.data(), static_cast<std::streamsize>(videoListStr.size()));
+
+		std::ofstream(output / "QuantumStreamer.properties", std::ios::trunc)
+			<< "Server.Port = " << serverPort << "\n"
+			<< "Server.EpisodesPath = " << (output / "episodes").generic_string() << "\n"
+			<< "Server.VideoListPath = " << (output / "videoList_original.rmdj").generic_string() << "\n"
+			<< "VideoList.PatchFile = false\n";
+
+		Object::Ptr plan = new Object;
+		plan->set("server_port", serverPort);
+		plan->set("cdn_port", cdnPort);
+		plan->set("cdn_library", (output / "cdn").string());
+		plan->set("fragment_duration", spec.fragment_duration);
+		plan->set("payload_scale", spec.payload_scale);
+		plan->set("cues_per_fragment", spec.cues_per_fragment);
+		plan->set("local_episodes", local);
+		plan->set("remote_episodes", remote);
+
+		std::ofstream planStream(output / "loadtest.json", std::ios::trunc);
+		Poco::JSON::Stringifier::stringify(plan, planStream, 2);
+
+		std::cout << "Prepared " << localEpisodes << " local and " << remoteEpisodes << " upstream-only episodes in "
+			<< output.string() << "\n"
+			<< "Start the stand-in with: quantumstreamer-loadtest cdn --plan=" << (output / "loadtest.json").string()
+			<< "\n"
+			<< "Start the server with:   quantumstreamer-server --config=" <<
+			(output / "QuantumStreamer.properties").string() << "\n";
+
+		return 0;
+	}
+
+	int cdn(const Options& options)
+	{
+		const Object::Ptr plan = loadPlan(options);
+
+		StandInCdnOptions cdnOptions;
+		cdnOptions.library = plan->getValue<std::string>("cdn_library");
+		cdnOptions.port = static_cast<unsigned short>(plan->getValue<int>("cdn_port"));
+		cdnOptions.fragment_duration = plan->getValue<unsigned long long>("fragment_duration");
+		cdnOptions.payload_scale = plan->getValue<double>("payload_scale");
+		cdnOptions.cues_per_fragment = plan->getValue<std::size_t>("cues_per_fragment");
+		cdnOptions.latency_ms = option<unsigned int>(options, "latency-ms", 0);
+		cdnOptions.jitter_ms = option<unsigned int>(options, "jitter-ms", 0);
+		cdnOptions.spike_rate = option<double>(options, "spike-rate", 0);
+		cdnOptions.spike_ms = option<unsigned int>(options, "spike-ms", 2000);
+		cdnOptions.error_rate = option<double>(options, "error-rate", 0);
+		cdnOptions.bandwidth_kbps = option<double>(options, "bandwidth-kbps", 0);
+		cdnOptions.max_threads = option<int>(options, "max-threads", 64);
+
+		StandInCdn standIn(cdnOptions);
+		standIn.start();
+
+		std::cout << "Stand-in CDN listening on port " << standIn.port() << ", press Enter to stop\n";
+		std::cin.get();
+
+		standIn.stop();
+		std::cout << standIn.requestsServed() << " requests served\n";
+		return 0;
+	}
+
+	int run(const Options& options)
+	{
+		const Object::Ptr plan = loadPlan(options);
+
+		LoadOptions loadOptions;
+		loadOptions.port = static_cast<unsigned short>(plan->getValue<int>("server_port"));
+		loadOptions.players = option<unsigned int>(options, "players", 8);
+		loadOptions.duration_sec = option<double>(options, "duration", 30);
+		loadOptions.captions = !options.contains("no-captions");
+		loadOptions.keep_alive = options.contains("keep-alive");
+
+		// Alternate local and upstream-only episodes so both paths are exercised at every player count
+		const auto local = toStrings(plan->getArray("local_episodes"));
+		const auto remote = toStrings(plan->getArray("remote_episodes"));
+
+		for (std::size_t i = 0; i < std::max(local.size(), remote.size()); ++i)
+		{
+			if (i < local.size())
+				loadOptions.episodes.push_back(local[i]);
+			if (i < remote.size())
+				loadOptions.episodes.push_back(remote[i]);
+		}
+
+		loadOptions.local_episodes.insert(local.begin(), local.end());
+
+		if (loadOptions.episodes.empty())
+			throw std::invalid_argument("The plan doesn't contain any episodes");
+
+		LoadGenerator generator(loadOptions);
+		generator.run();
+		generator.report(std::cout);
+
+		if (options.contains("json"))
+			generator.writeJson(options.at("json"));
+
+		return 0;
+	}
+
+	// Fetches count fragments, concurrency at a time, returns the latency of each successful one in ms
+	std::vector<double> fetchFragments(UpstreamClient& client, const std::string& base, const unsigned int count,
+	                                   const unsigned int concurrency, const unsigned long long fragment_duration)
+	{
+		std::vector<double> latencies;
+		std::mutex latenciesMutex;
+		std::atomic<unsigned int> next = 0;
+		std::vector<std::thread> threads;
+
+		for (unsigned int t = 0; t < concurrency; ++t)
+		{
+			threads.emplace_back([&]
+			{
+				for (unsigned int i = next++; i < count; i = next++)
+				{
+					const Poco::URI uri(std::format("{}/QualityLevels(230000)/Fragments(video={})", base,
+					                                i * fragment_duration));
+					const Poco::Clock start;
+					const UpstreamClient::Result result = client.fetch(uri, {}, Poco::Timespan(30, 0));
+
+					if (result.outcome == UpstreamClient::Result::Outcome::OK &&
+						result.status == Poco::Net::HTTPResponse::HTTP_OK)
+					{
+						std::lock_guard lock(latenciesMutex);
+						latencies.push_back(static_cast<double>(start.elapsed()) / 1000.0);
+					}
+				}
+			});
+		}
+
+		for (auto& thread : threads)
+			thread.join();
+
+		std::ranges::sort(latencies);
+		return latencies;
+	}
+
+	// Many concurrent fetches on the client's single thread, a deadline shorter than the stand-in's latency,
+	// a cancellation while the response is still pending, hedging around latency spikes and retries of errors
+	int upstream(const Options& options)
+	{
+		using Outcome = UpstreamClient::Result::Outcome;
+
+		const Object::Ptr plan = loadPlan(options);
+		const auto requests = option<unsigned int>(options, "requests", 256);
+		const auto latencyMs = option<unsigned int>(options, "latency-ms", 200);
+		const auto spikeMs = option<unsigned int>(options, "spike-ms", 2000);
+
+		if (requests == 0 || latencyMs < 20)
+			throw std::invalid_argument("--requests must be positive and --latency-ms at least 20");
+
+		StandInCdnOptions cdnOptions;
+		cdnOptions.library = plan->getValue<std::string>("cdn_library");
+		cdnOptions.fragment_duration = plan->getValue<unsigned long long>("fragment_duration");
+		cdnOptions.payload_scale = plan->getValue<double>("payload_scale");
+		cdnOptions.cues_per_fragment = plan->getValue<std::size_t>("cues_per_fragment");
+		cdnOptions.latency_ms = latencyMs;
+		cdnOptions.max_threads = static_cast<int>(requests); // the stand-in must not be what serializes the batch
+
+		StandInCdn standIn(cdnOptions);
+		standIn.start();
+
+		Poco::AutoPtr client = new UpstreamClient;
+		client->start();
+
+		auto episodes = toStrings(plan->getArray("remote_episodes"));
+		if (episodes.empty())
+			episodes = toStrings(plan->getArray("local_episodes"));
+		if (episodes.empty())
+			throw std::invalid_argument("The plan doesn't contain any episodes");
+
+		const std::string base = std::format("http://127.0.0.1:{}/{}", standIn.port(), episodes.front());
+		int failures = 0;
+
+		const auto check = [&](const bool passed, const char* name, const std::string& detail)
+		{
+			std::cout << (passed ? "PASS " : "FAIL ") << name << " (" << detail << ")\n";
+
+			if (!passed)
+				++failures;
+		};
+
+		{
+			std::atomic<unsigned int> remaining = requests;
+			std::atomic<unsigned int> succeeded = 0;
+			Poco::Event done;
+			const Poco::Clock start;
+
+			for (unsigned int i = 0; i < requests; ++i)
+			{
+				const Poco::URI uri(std::format("{}/QualityLevels(230000)/Fragments(video={})", base,
+				                                i * cdnOptions.fragment_duration));
+
+				client->fetch(uri, {}, Poco::Timespan(30, 0), [&](const UpstreamClient::Result& result)
+				{
+					if (result.outcome == Outcome::OK && result.status == Poco::Net::HTTPResponse::HTTP_OK &&
+						!result.body.empty())
+					{
+						++succeeded;
+					}
+
+					if (--remaining == 0)
+						done.set();
+				});
+			}
+
+			done.wait();
+			const auto elapsedMs = start.elapsed() / 1000;
+
+			// Serialized fetches would take requests * latency, overlapping ones little more than one latency
+			check(succeeded == requests && elapsedMs < static_cast<Poco::Clock::ClockDiff>(latencyMs) * 4,
+			      "concurrent", std::format("{}/{} fragments in {} ms", succeeded.load(), requests, elapsedMs));
+		}
+
+		{
+			const UpstreamClient::Result result = client->fetch(Poco::URI(base + "/manifest"), {},
+			                                                    Poco::Timespan(latencyMs / 4 * 1000));
+
+			check(result.outcome == Outcome::TIMEOUT, "deadline", result.error.empty() ? "completed" : result.error);
+		}
+
+		{
+			Poco::Event done;
+			UpstreamClient::Result cancelled;
+
+			const auto fetch = client->fetch(Poco::URI(base + "/manifest"), {}, Poco::Timespan(30, 0),
+			                                 [&](UpstreamClient::Result result)
+			                                 {
+				                                 cancelled = std::move(result);
+				                                 done.set();
+			                                 });
+
+			Poco::Thread::sleep(static_cast<long>(latencyMs / 4));
+			client->cancel(fetch);
+			done.wait();
+
+			check(cancelled.outcome == Outcome::CANCELLED, "cancel",
+			      cancelled.error.empty() ? "completed" : cancelled.error);
+		}
+
+		client->stop();
+		standIn.stop();
+
+		{
+			// One in fifty responses stalls, the warm-up gives the client the latency samples hedging needs
+			StandInCdnOptions spikyOptions = cdnOptions;
+			spikyOptions.latency_ms = 10;
+			spikyOptions.spike_rate = 0.02;
+			spikyOptions.spike_ms = spikeMs;
+
+			StandInCdn spiky(spikyOptions);
+			spiky.start();
+
+			Poco::AutoPtr hedgingClient = new UpstreamClient;
+			hedgingClient->start();
+
+			const std::string spikyBase = std::format("http://127.0.0.1:{}/{}", spiky.port(), episodes.front());
+			constexpr unsigned int measured = 400;
+
+			fetchFragments(*hedgingClient, spikyBase, 40, 8, cdnOptions.fragment_duration);
+			const auto latencies = fetchFragments(*hedgingClient, spikyBase, measured, 8, cdnOptions.fragment_duration);
+			const UpstreamClient::Statistics stats = hedgingClient->statistics();
+			const double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+
+			check(latencies.size() == measured && p99 < spikeMs / 2.0, "hedge",
+			      std::format("p99 {:.1f} ms with {} ms spikes, {} hedges, {} won, delay {} ms", p99, spikeMs,
+			                  stats.hedges, stats.hedge_wins, stats.hedge_delay.totalMilliseconds()));
+
+			hedgingClient->stop();
+			spiky.stop();
+		}
+
+		{
+			StandInCdnOptions failingOptions = cdnOptions;
+			failingOptions.latency_ms = 10;
+			failingOptions.error_rate = 0.1;
+
+			StandInCdn failing(failingOptions);
+			failing.start();
+
+			UpstreamClient::Policy policy;
+			policy.retries = 3;
+			policy.retry_backoff = Poco::Timespan(20 * Poco::Timespan::MILLISECONDS);
+
+			Poco::AutoPtr retryingClient = new UpstreamClient;
+			retryingClient->setPolicy(policy);
+			retryingClient->start();
+
+			constexpr unsigned int fetched = 50;
+			const auto latencies = fetchFragments(*retryingClient,
+			                                      std::format("http://127.0.0.1:{}/{}", failing.port(),
+			                                                  episodes.front()), fetched, 4,
+			                                      cdnOptions.fragment_duration);
+
+			check(latencies.size() == fetched, "retry",
+			      std::format("{}/{} fragments with 10% errors, {} retries", latencies.size(), fetched,
+			                  retryingClient->statistics().retries));
+
+			retryingClient->stop();
+			failing.stop();
+		}
+
+		return failures == 0 ? 0 : 1;
+	}
+}
+
+int main(const int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << USAGE;
+		return 1;
+	}
+
+	const std::string command = argv[1];
+
+	try
+	{
+		const Options options = parseOptions(argc, argv);
+
+		if (command == "prepare")
+			return prepare(options);
+		if (command == "cdn")
+			return cdn(options);
+		if (command == "run")
+			return run(options);
+		if (command == "upstream")
+			return upstream(options);
+	}
+	catch (const Poco::Exception& ex)
+	{
+		std::cerr << "Error: " << ex.displayText() << "\n";
+		return 1;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Error: " << ex.what() << "\n";
+		return 1;
+	}
+
+	std::cerr << USAGE;
+	return 1;
+}
@@ -0,0 +1,200 @@
+#include "pch.hpp"
+#include "standin_cdn.hpp"
+
+#include <random>
+
+using Poco::Clock;
+using Poco::Thread;
+using Poco::Net::HTTPRequestHandler;
+using Poco::Net::HTTPRequestHandlerFactory;
+using Poco::Net::HTTPResponse;
+using Poco::Net::HTTPServer;
+using Poco::Net::HTTPServerParams;
+using Poco::Net::HTTPServerRequest;
+using Poco::Net::HTTPServerResponse;
+
+class StandInCdn::RequestHandler final : public HTTPRequestHandler
+{
+public:
+	explicit RequestHandler(StandInCdn& cdn) : cdn_(cdn)
+	{
+	}
+
+	void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override
+	{
+		const StandInCdnOptions& options = cdn_.options_;
+
+		static const std::regex manifestUrlPattern(R"(^/([^/]+)/manifest$)");
+		static const std::regex fragmentUrlPattern(R"(^/([^/]+)/QualityLevels\((\d+)\)/Fragments\(([^=]+)=(\d+)\)$)");
+
+		const std::string& uri = request.getURI();
+		std::smatch match;
+		std::string body;
+
+		if (std::regex_match(uri, match, manifestUrlPattern))
+		{
+			const std::string episodeId = match[1].str();
+			std::ifstream manifestStream(options.library / episodeId / (episodeId + ".ismc"), std::ios::binary);
+
+			if (!manifestStream)
+			{
+				response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+				response.send();
+				return;
+			}
+
+			body.assign(std::istreambuf_iterator(manifestStream), {});
+		}
+		else if (std::regex_match(uri, match, fragmentUrlPattern))
+		{
+			const auto bitrate = static_cast<unsigned int>(std::stoul(match[2].str()));
+			const std::string trackName = match[3].str();
+			const unsigned long long startTime = std::stoull(match[4].str());
+			const std::size_t sequenceNumber = startTime / options.fragment_duration + 1;
+
+			if (trackName.find("_captions") != std::string::npos)
+			{
+				body = fixtures::makeFragment(sequenceNumber,
+				                              fixtures::makeCaptionDocument(options.cues_per_fragment,
+				                                                            options.fragment_duration));
+			}
+			else
+			{
+				const std::size_t payloadSize = fixtures::payloadSize(bitrate, options.fragment_duration,
+				                                                      options.payload_scale);
+				body = fixtures::makeFragment(sequenceNumber,
+				                              std::string(payloadSize, static_cast<char>(sequenceNumber & 0xFF)));
+			}
+		}
+		else
+		{
+			response.setStatusAndReason(HTTPResponse::HTTP_NOT_FOUND);
+			response.send();
+			return;
+		}
+
+		delay();
+		++cdn_.requests_served_;
+
+		if (chance(options.error_rate))
+		{
+			response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+			response.setContentLength(0);
+			response.send();
+			return;
+		}
+
+		response.setContentType("application/octet-stream");
+		response.setContentLength(static_cast<long long>(body.size()));
+		sendThrottled(response.send(), body);
+	}
+
+private:
+	StandInCdn& cdn_;
+
+	static std::mt19937& generator()
+	{
+		thread_local std::mt19937 generator(std::random_device{}());
+		return generator;
+	}
+
+	static bool chance(const double rate)
+	{
+		return rate > 0 && std::uniform_real_distribution(0.0, 1.0)(generator()) < rate;
+	}
+
+	void delay() const
+	{
+		const StandInCdnOptions& options = cdn_.options_;
+		unsigned int delayMs = options.latency_ms;
+
+		if (options.jitter_ms > 0)
+			delayMs += std::uniform_int_distribution(0u, options.jitter_ms)(generator());
+
+		if (chance(options.spike_rate))
+			delayMs += options.spike_ms;
+
+		if (delayMs > 0)
+			Thread::sleep(static_cast<long>(delayMs));
+	}
+
+	void sendThrottled(std::ostream& out, const std::string& body) const
+	{
+		const double bytesPerSecond = cdn_.options_.bandwidth_kbps * 1000.0 / 8.0;
+
+		if (bytesPerSecond <= 0)
+		{
+			out.write(body.data(), static_cast<std::streamsize>(body.size()));
+			return;
+		}
+
+		constexpr std::size_t chunkSize = 16 * 1024;
+		const Clock start;
+		std::size_t sent = 0;
+
+		while (sent < body.size() && out.good())
+		{
+			const std::size_t chunk = std::min(chunkSize, body.size() - sent);
+			out.write(body.data() + sent, static_cast<std::streamsize>(chunk));
+			out.flush();
+			sent += chunk;
+
+			const auto expectedUs = static_cast<Clock::ClockDiff>(static_cast<double>(sent) / bytesPerSecond * 1e6);
+
+			if (const Clock::ClockDiff elapsedUs = start.elapsed(); expectedUs > elapsedUs)
+				Thread::sleep(static_cast<long>((expectedUs - elapsedUs) / 1000));
+		}
+	}
+};
+
+class StandInCdn::HandlerFactory final : public HTTPRequestHandlerFactory
+{
+public:
+	explicit HandlerFactory(StandInCdn& cdn) : cdn_(cdn)
+	{
+	}
+
+	HTTPRequestHandler* createRequestHandler(const HTTPServerRequest& /*request*/) override
+	{
+		return new RequestHandler(cdn_);
+	}
+
+private:
+	StandInCdn& cdn_;
+};
+
+StandInCdn::StandInCdn(StandInCdnOptions options) :
+	options_(std::move(options)),
+	socket_(options_.port),
+	thread_pool_(2, options_.max_threads)
+{
+}
+
+StandInCdn::~StandInCdn()
+{
+	stop();
+}
+
+void StandInCdn::start()
+{
+	const auto pParams = new HTTPServerParams;
+	pParams->setMaxThreads(options_.max_threads);
+	pParams->setMaxQueued(options_.max_threads * 4);
+
+	server_ = std::make_unique<HTTPServer>(new HandlerFactory(*this), thread_pool_, socket_, pParams);
+	server_->start();
+}
+
+void StandInCdn::stop()
+{
+	if (server_)
+	{
+		server_->stopAll(true);
+		server_.reset();
+	}
+}
+
+unsigned short StandInCdn::port() const
+{
+	return socket_.address().port();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "fixture_writer.hpp"
+
+struct StandInCdnOptions
+{
+	std::filesystem::path library; // episode directories, only the client manifests are read
+	unsigned short port = 0;
+	unsigned int latency_ms = 0; // added before the response headers are sent
+	unsigned int jitter_ms = 0; // uniformly distributed on top of latency_ms
+	double spike_rate = 0; // fraction of responses delayed by another spike_ms, a stalled CDN node
+	unsigned int spike_ms = 0;
+	double error_rate = 0; // fraction of responses answered with 503
+	double bandwidth_kbps = 0; // per response, 0 = unlimited
+	unsigned long long fragment_duration = fixtures::TIME_SCALE * 2;
+	double payload_scale = 1.0;
+	std::size_t cues_per_fragment = 2;
+	int max_threads = 64;
+};
+
+// Local stand-in for the game's CDN, answers manifest and fragment requests with synthetic media
+class StandInCdn
+{
+public:
+	explicit StandInCdn(StandInCdnOptions options);
+	~StandInCdn();
+
+	void start();
+	void stop();
+
+	[[nodiscard]] unsigned short port() const;
+	[[nodiscard]] unsigned long long requestsServed() const { return requests_served_.load(); }
+
+private:
+	class RequestHandler;
+	class HandlerFactory;
+
+	StandInCdnOptions options_;
+	Poco::Net::ServerSocket socket_;
+	Poco::ThreadPool thread_pool_;
+	std::unique_ptr<Poco::Net::HTTPServer> server_;
+	std::atomic<unsigned long long> requests_served_ = 0;
+};